@@ -38,6 +38,32 @@ extern "C" {
     - Unicode just add a #define CPATH_UNICODE or UNICODE or _UNICODE
     - Custom Allocators just #define:
         - CPATH_MALLOC and CPATH_FREE (make sure to define both)
+    - Multithreaded traversal (cpath_traverse_parallel) just #define
+        CPATH_PARALLEL, this requires pthreads so you may need to link
+        with -pthread
+    - To read directories on linux using getdents64 directly (rather than
+        readdir) just #define CPATH_USE_GETDENTS, you can change the size
+        of the buffer through CPATH_GETDENTS_BUF_SIZE or pass your own
+        buffer to cpathOpenDirBuf
+    - To batch stat calls through io_uring (IORING_OP_STATX) on linux
+        just #define CPATH_USE_IO_URING, this is used by cpathStatBatch
+        (and so cpathLoadAllFilesStat and cpath_traverse_stat) it'll fallback
+        to calling stat sequentially if io_uring isn't available.
+    - Separators are normalised using SSE2/AVX2/NEON when the compiler
+        targets them (i.e. -mavx2) if you don't want that #define
+        CPATH_NO_SIMD
+    - To count (or trace) the filesystem calls we make just #define
+        CPATH_SYSCALL_HOOK(kind) it is called just before every open, read,
+        rewind, stat and readlink of a directory or file with kind being
+        one of "open", "read", "rewind", "stat" or "link".
+    - cpathSnapshotScan only trusts directory mtimes that are more than
+        CPATH_SNAPSHOT_MTIME_SLACK (2) seconds older than the snapshot, you
+        can #define it to something else if your filesystem is coarser
+    - cpathWatchUpdate reads inotify events CPATH_WATCH_BUF_SIZE (64 KiB)
+        bytes at a time, #define it to change that
+    - cpathDupesFind reads files CPATH_DUPES_BUF_SIZE (1 MiB) bytes at a
+        time (one buffer per thread), if you #define it keep it a multiple
+        of 64 and atleast 8 KiB
 */
 
 /*
@@ -84,6 +110,11 @@ extern "C" {
 #error "Can't define only free or only malloc have to define both or neither"
 #endif
 
+// by default we don't trace anything
+#ifndef CPATH_SYSCALL_HOOK
+#define CPATH_SYSCALL_HOOK(kind)
+#endif
+
 // Support unicode
 #if defined CPATH_UNICODE || (!defined UNICODE && defined _UNICODE)
 #define UNICODE
@@ -147,6 +178,55 @@ extern "C" {
 #include <stdarg.h>
 #include <errno.h>
 #include <stdint.h>
+#include <time.h>
+
+#if defined CPATH_PARALLEL && !defined _MSC_VER
+#include <pthread.h>
+#endif
+
+// SIMD is only used for narrow strings, chosen at compile time
+#if !defined CPATH_NO_SIMD && \
+        !((defined _MSC_VER || defined __MINGW32__) && defined CPATH_UNICODE)
+#if defined __AVX2__
+#define CPATH_SIMD_AVX2
+#include <immintrin.h>
+#elif defined __SSE2__ || defined _M_X64 || \
+        (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#define CPATH_SIMD_SSE2
+#include <emmintrin.h>
+#elif defined __ARM_NEON && defined __aarch64__
+#define CPATH_SIMD_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
+#if defined CPATH_USE_GETDENTS && defined __linux__
+#define CPATH_GETDENTS
+#include <fcntl.h>
+#include <sys/syscall.h>
+
+// 64 KiB lets a typical directory be read in a single syscall
+#ifndef CPATH_GETDENTS_BUF_SIZE
+#define CPATH_GETDENTS_BUF_SIZE (64 * 1024)
+#endif
+#endif
+
+#if defined CPATH_USE_IO_URING && defined __linux__
+#include <sys/syscall.h>
+#if defined __NR_io_uring_setup && defined __NR_io_uring_enter
+#define CPATH_IO_URING
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+
+// How many statx requests we have in flight at once
+#ifndef CPATH_IO_URING_ENTRIES
+#define CPATH_IO_URING_ENTRIES (256)
+#endif
+#endif
+#endif
 
 // Linux has a max of 255 (+1 for \0) I couldn't find a max on windows
 // But since 260 > 256 it is a reasonable value that should be crossplatform
@@ -253,10 +333,33 @@ extern "C" {
 #define _cpath_opendir _wopendir
 #define _cpath_readdir _wreaddir
 #define _cpath_closedir _wclosedir
+#define _cpath_rewinddir _wrewinddir
 #else
 #define _cpath_opendir opendir
 #define _cpath_readdir readdir
 #define _cpath_closedir closedir
+#define _cpath_rewinddir rewinddir
+#endif
+#endif
+
+// openat/fstatat style functions (relative to a directory descriptor)
+#if !defined _MSC_VER && !defined __MINGW32__
+#define CPATH_HAS_OPENAT
+#include <fcntl.h>
+#include <sys/mman.h>
+// for the device numbers in /proc/self/mountinfo
+#if defined __linux__
+#include <sys/sysmacros.h>
+#endif
+#endif
+
+// cpath_watch keeps a tree up to date through inotify
+#if defined __linux__
+#define CPATH_HAS_INOTIFY
+#include <poll.h>
+#include <sys/inotify.h>
+#ifndef CPATH_WATCH_BUF_SIZE
+#define CPATH_WATCH_BUF_SIZE (64 * 1024)
 #endif
 #endif
 
@@ -299,6 +402,16 @@ typedef time_t cpath_time_t;
 #if defined __MINGW32__ && defined _UNICODE
 typedef _WDIR cpath_dirdata_t;
 typedef struct _wdirent cpath_dirent_t;
+#elif defined CPATH_GETDENTS
+// This is the layout of `struct linux_dirent64` which glibc doesn't expose
+// like `struct dirent` the name is really only as long as d_reclen allows
+typedef struct cpath_dirent_t {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[256];
+} cpath_dirent_t;
 #else
 typedef DIR cpath_dirdata_t;
 typedef struct dirent cpath_dirent_t;
@@ -313,6 +426,42 @@ typedef struct cpath_t {
     size_t len;
 } cpath;
 
+/*
+    A variable length path, short paths are stored inline (no allocation)
+    and longer ones spill onto the heap, this is much smaller than a cpath
+    so is better suited for storing a lot of paths.
+    You can change the inline size through CPATH_VPATH_INLINE_LEN
+*/
+#ifndef CPATH_VPATH_INLINE_LEN
+#define CPATH_VPATH_INLINE_LEN (40)
+#endif
+
+typedef struct cpath_vpath_t {
+    // NULL when we are using the inline buffer
+    cpath_char_t *buf;
+    size_t len;
+    // capacity of buf (excluding the '\0')
+    size_t cap;
+    cpath_char_t small[CPATH_VPATH_INLINE_LEN];
+} cpath_vpath;
+
+/*
+    A view of a single component of a path (isn't null terminated)
+*/
+typedef struct cpath_component_t {
+    const cpath_char_t *str;
+    size_t len;
+} cpath_component;
+
+typedef struct cpath_component_it_t {
+    const cpath_char_t *buf;
+    // the components left are in [front, back)
+    size_t front;
+    size_t back;
+    // 1 if the path begins with a separator
+    size_t root;
+} cpath_component_it;
+
 typedef struct cpath_file_t {
     int isDir;
     int isReg;
@@ -340,6 +489,17 @@ typedef struct cpath_dir_t {
 #ifdef _MSC_VER
     HANDLE_ handle;
     WIN32_FIND_DATA findData;
+#elif defined CPATH_GETDENTS
+    int fd;
+    // records from getdents64 are read straight out of here
+    char *buf;
+    size_t bufSize;
+    size_t bufPos;
+    size_t bufLen;
+    int ownsBuf;
+    // length of dirent->d_name (so we don't have to strlen)
+    size_t direntLen;
+    cpath_dirent_t *dirent;
 #else
     cpath_dirdata_t *dir;
     cpath_dirent_t *dirent;
@@ -348,6 +508,13 @@ typedef struct cpath_dir_t {
     // This is set whenever you do an emplace
     // This allows you to revert an emplace
     struct cpath_dir_t *parent;
+    // Frames of reverted emplaces kept for the next emplace to reuse
+    // (each links to the next through its own pool)
+    struct cpath_dir_t *pool;
+
+    // If set then entries with an unknown type won't be stat'd when read
+    // the caller is expected to stat them later (i.e. cpathStatBatch)
+    int deferStat;
 
     int hasNext;
 
@@ -373,6 +540,832 @@ typedef void(*cpath_traverse_it)(
     void *data
 );
 
+/*
+    Return true to skip the directory called name (inside of parent)
+    it won't be given to `it` and it is never opened.
+*/
+typedef int(*cpath_traverse_prune)(
+    const cpath_char_t *name, size_t len, cpath_dir *parent, int depth,
+    void *data
+);
+
+#if defined CPATH_HAS_OPENAT
+/*
+    A set of (st_dev, st_ino) pairs, used to visit each directory only once
+    when following symbolic links (or bind mounts) that could loop.
+*/
+typedef struct cpath_visited_key_t {
+    uint64_t dev;
+    uint64_t ino;
+} cpath_visited_key;
+
+typedef struct cpath_visited_t {
+    // a slot of (0, 0) is empty so that pair is tracked on its own
+    cpath_visited_key *keys;
+    size_t cap;
+    size_t count;
+    int hasZero;
+} cpath_visited;
+#endif
+
+#if defined CPATH_HAS_OPENAT
+/*
+    A single mount from /proc/self/mountinfo, the strings point into the
+    table's buffer.
+*/
+typedef struct cpath_mount_t {
+    uint64_t dev;
+    const char *mountPoint;
+    // i.e. "ext4", "nfs4", "fuse.sshfs" or "proc"
+    const char *fsType;
+    const char *source;
+} cpath_mount;
+
+typedef struct cpath_mounts_t {
+    cpath_mount *mounts;
+    size_t count;
+    char *buf;
+} cpath_mounts;
+#endif
+
+/*
+    Called when cpath_traverse_ex is about to enter a directory on a
+    different device to its parent (a mount point), return true to skip it.
+    mount is NULL if it isn't in the options' mounts.
+*/
+typedef int(*cpath_mount_policy)(
+    const cpath_file *dir, const struct cpath_mount_t *mount, void *data
+);
+
+/*
+    Options for cpath_traverse_ex, use cpathTraverseOptsInit for defaults.
+    Names and extensions are checked against the raw directory entry so
+    nothing is built for files that are filtered out.
+*/
+typedef struct cpath_traverse_opts_t {
+    // can be NULL
+    cpath_traverse_prune prune;
+    // directories are only opened while depth < maxDepth, < 0 is no limit
+    int maxDepth;
+    // stop once this many files have been given to `it`, 0 is no limit
+    size_t maxEntries;
+    // files and directories with any of these names are skipped entirely
+    // i.e. ".git" or "node_modules"
+    const cpath_char_t **skipNames;
+    size_t skipNamesCount;
+    // if given only files with one of these extensions (without the '.')
+    // are given to `it` (directories are still opened but not given)
+    const cpath_char_t **extensions;
+    size_t extensionsCount;
+    // follow symbolic links to directories (like find -L), every directory
+    // is only visited once so loops end, does nothing on Windows
+    int followLinks;
+    // never enter other devices (like find -xdev), does nothing on Windows
+    int sameDevice;
+    // for mounts that need their own rules (i.e. skipping nfs or fuse)
+    // mounts can be NULL (see cpathMountsLoad), does nothing on Windows
+    cpath_mount_policy mountPolicy;
+    const struct cpath_mounts_t *mounts;
+} cpath_traverse_opts;
+
+#if defined CPATH_HAS_OPENAT
+/*
+    A lightweight file used by cpath_traverse_at, it only refers to the name
+    inside of the directory so no paths are built unless you ask for one
+    through cpathEntryGetPath (or cpathEntryToFile).
+*/
+typedef struct cpath_entry_t {
+    const cpath_char_t *name;
+    size_t nameLen;
+
+    int isDir;
+    int isReg;
+    int isSym;
+
+    struct stat stat;
+    int statLoaded;
+
+    // the directory the entry was read from
+    cpath_dir *dir;
+    // the entry that `dir` was opened from, NULL if `dir` is the root
+    const struct cpath_entry_t *parent;
+} cpath_entry;
+
+typedef void(*cpath_traverse_at_it)(
+    cpath_entry *entry, int depth, void *data
+);
+
+typedef struct cpath_resolver_entry_t {
+    // 0 when the slot is empty
+    uint64_t hash;
+    // offsets into the resolver's names
+    size_t key;
+    size_t keyLen;
+    size_t value;
+    size_t valueLen;
+} cpath_resolver_entry;
+
+/*
+    Resolves paths (like realpath) remembering each resolved prefix
+    see cpathResolve.
+*/
+typedef struct cpath_resolver_t {
+    // open addressing (linear probing) and cap is a power of 2
+    cpath_resolver_entry *entries;
+    size_t size;
+    size_t cap;
+
+    // the keys and values of every entry
+    cpath_char_t *names;
+    size_t namesLen;
+    size_t namesCap;
+
+    // relative paths are resolved against this (empty until needed)
+    cpath cwd;
+} cpath_resolver;
+#endif
+
+/*
+    Used to stat a lot of files at once, on linux (with CPATH_USE_IO_URING)
+    this holds an io_uring which is kept around between batches.
+*/
+typedef struct cpath_stat_batch_t {
+    int useRing;
+#if defined CPATH_IO_URING
+    int fd;
+    unsigned entries;
+
+    void *sqRing;
+    size_t sqRingSize;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+
+    void *cqRing;
+    size_t cqRingSize;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+
+    struct statx *results;
+    size_t *indices;
+#endif
+} cpath_stat_batch;
+
+/*
+    A compact listing of a directory, unlike cpathLoadAllFiles it doesn't
+    store a cpath_file (~4.5k) per entry instead each entry is a few parallel
+    arrays with all the names packed into a single arena.
+    Use cpathListingGetFile to get a full file for an entry.
+*/
+enum CPathListingType_ {
+    CPATH_LISTING_DIR   = 1,
+    CPATH_LISTING_REG   = 2,
+    CPATH_LISTING_SYM   = 4,
+};
+
+typedef struct cpath_listing_t {
+    size_t size;
+    size_t cap;
+
+    // per entry (index into names and the length excluding the '\0')
+    size_t *nameOffsets;
+    unsigned short *nameLens;
+    // CPathListingType_ flags
+    unsigned char *types;
+    uint64_t *inodes;
+
+    // only allocated if the listing was loaded with stat
+    cpath_offset_t *sizes;
+    cpath_time_t *mtimes;
+    // the rest of the stat cpathListingGetFile fills in (mode is 0 for an
+    // entry we couldn't stat)
+    uint32_t *modes;
+    uint32_t *nlinks;
+    uint64_t *devs;
+
+    // how many entries we couldn't stat (they are still listed but with
+    // whatever type the directory gave us and a mode/size of 0)
+    size_t errors;
+
+    // all names (null terminated) one after the other
+    cpath_char_t *names;
+    size_t namesLen;
+    size_t namesCap;
+
+    // the directory the listing was loaded from
+    cpath path;
+} cpath_listing;
+
+#if defined CPATH_HAS_OPENAT
+/*
+    How close (in seconds) a directory's mtime can be to when a snapshot
+    was taken before we stop trusting it, some filesystems only keep
+    mtimes to the second (or two) so a change straight after we listed it
+    might not change its mtime at all.
+*/
+#ifndef CPATH_SNAPSHOT_MTIME_SLACK
+#define CPATH_SNAPSHOT_MTIME_SLACK (2)
+#endif
+
+#define CPATH_SNAPSHOT_NONE ((size_t)-1)
+
+/*
+    An entry of a snapshot, children of a directory are always one after
+    the other (see cpath_snapshot_dir).
+*/
+typedef struct cpath_snapshot_entry_t {
+    size_t name;
+    uint32_t nameLen;
+    // CPathListingType_ flags
+    uint32_t type;
+    size_t parent;
+    // index into the snapshot's dirs (CPATH_SNAPSHOT_NONE if it isn't one)
+    size_t dir;
+} cpath_snapshot_entry;
+
+typedef struct cpath_snapshot_dir_t {
+    size_t entry;
+    // children are entries [first, first + count)
+    size_t first;
+    size_t count;
+    // in nanoseconds
+    int64_t mtime;
+    int64_t ctime;
+} cpath_snapshot_dir;
+
+/*
+    Every name under a directory (like find) that can be rescanned cheaply
+    see cpathSnapshotScan.
+*/
+typedef struct cpath_snapshot_t {
+    cpath_snapshot_entry *entries;
+    size_t count;
+    size_t cap;
+
+    cpath_snapshot_dir *dirs;
+    size_t dirCount;
+    size_t dirCap;
+
+    // names aren't null terminated
+    cpath_char_t *names;
+    size_t namesLen;
+    size_t namesCap;
+
+    // when the scan began
+    cpath_time_t taken;
+    // how many directories were actually read (the rest were reused)
+    size_t listed;
+} cpath_snapshot;
+
+#define CPATH_SNAPSHOT_ADDED (0)
+#define CPATH_SNAPSHOT_REMOVED (1)
+
+typedef struct cpath_snapshot_change_t {
+    int kind;
+    // added entries are in the new snapshot, removed are in the old one
+    size_t entry;
+} cpath_snapshot_change;
+
+typedef struct cpath_snapshot_changes_t {
+    cpath_snapshot_change *items;
+    size_t count;
+    size_t cap;
+} cpath_snapshot_changes;
+#endif
+
+#if defined CPATH_HAS_OPENAT
+#define CPATH_INDEX_NONE ((uint64_t)-1)
+// how many names share a front coded block
+#define CPATH_INDEX_BLOCK (16)
+
+/*
+    An index file begins with this followed by each column (8 byte aligned)
+    everything is in native byte order so it can be used straight from mmap
+*/
+typedef struct cpath_index_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t charSize;
+    uint64_t count;
+
+    // byte offsets of each column from the start of the file
+    // uint64_t parents[count] (the root's is CPATH_INDEX_NONE)
+    uint64_t parents;
+    // uint64_t first[count] and counts[count], children of an entry are
+    // entries [first, first + counts) sorted by name
+    uint64_t first;
+    uint64_t counts;
+    // unsigned char types[count] (CPathListingType_ flags)
+    uint64_t types;
+    // uint64_t sizes[count] and int64_t mtimes[count] (seconds)
+    uint64_t sizes;
+    uint64_t mtimes;
+    // uint64_t blocks[(count + CPATH_INDEX_BLOCK - 1) / CPATH_INDEX_BLOCK]
+    // offsets into names of the start of each block
+    uint64_t blocks;
+    // each name is a varint of how much it shares with the one before it
+    // (0 at the start of a block), a varint of the length of the rest and
+    // then the rest of the characters
+    uint64_t names;
+    uint64_t namesLen;
+} cpath_index_header;
+
+typedef struct cpath_index_build_entry_t {
+    size_t parent;
+    size_t name;
+    size_t nameLen;
+    unsigned char type;
+    uint64_t size;
+    int64_t mtime;
+} cpath_index_build_entry;
+
+/*
+    Collects what a traversal finds so it can be written as an index
+    see cpathIndexBuilderVisit.
+*/
+typedef struct cpath_index_builder_t {
+    // in the order they were visited (the root is 0)
+    cpath_index_build_entry *entries;
+    size_t count;
+    size_t cap;
+
+    cpath_char_t *names;
+    size_t namesLen;
+    size_t namesCap;
+
+    // the last directory visited at each depth
+    size_t *dirs;
+    size_t dirsLen;
+    size_t dirsCap;
+
+    // set if we failed to add something (errno has why)
+    int failed;
+} cpath_index_builder;
+
+typedef struct cpath_index_t {
+    void *map;
+    size_t size;
+    uint64_t count;
+
+    const uint64_t *parents;
+    const uint64_t *first;
+    const uint64_t *counts;
+    const unsigned char *types;
+    const uint64_t *sizes;
+    const int64_t *mtimes;
+    const uint64_t *blocks;
+    const unsigned char *names;
+    uint64_t namesLen;
+} cpath_index;
+
+/*
+    Like a cpath_dir but reads from an index.
+*/
+typedef struct cpath_index_dir_t {
+    const cpath_index *index;
+    uint64_t next;
+    uint64_t end;
+    cpath path;
+} cpath_index_dir;
+#endif
+
+#if defined CPATH_HAS_INOTIFY
+#define CPATH_WATCH_NONE ((size_t)-1)
+
+typedef struct cpath_watch_node_t {
+    // indexes into the nodes, children aren't kept in any order
+    size_t parent;
+    size_t child;
+    size_t next;
+    size_t prev;
+    // next node in the same bucket of the (parent, name) table
+    size_t chain;
+    uint64_t hash;
+
+    // the root's name is the path it was opened with, NULL if it's free
+    cpath_char_t *name;
+    size_t nameLen;
+    // inotify watch descriptor (directories only) or -1
+    int wd;
+    // CPathListingType_ flags
+    unsigned char type;
+    unsigned char seen;
+    uint32_t mode;
+    uint64_t size;
+    int64_t mtime;
+} cpath_watch_node;
+
+/*
+    An in memory copy of a tree that is kept up to date through inotify
+    see cpathWatchOpen and cpathWatchUpdate.
+*/
+typedef struct cpath_watch_t {
+    int fd;
+    void *buf;
+
+    cpath_watch_node *nodes;
+    // live nodes, slots used and slots allocated
+    size_t count;
+    size_t used;
+    size_t cap;
+    size_t freeList;
+
+    size_t *buckets;
+    size_t bucketCount;
+
+    // the node of each watch descriptor
+    size_t *wds;
+    size_t wdsCap;
+
+    // the first half of a rename (IN_MOVED_FROM) waiting for the second
+    size_t moved;
+    uint32_t movedCookie;
+
+    // events applied, rescans (because the queue overflowed) and
+    // directories we couldn't watch (i.e. out of watches) which only a
+    // rescan will bring up to date
+    size_t events;
+    size_t rescans;
+    size_t unwatched;
+} cpath_watch;
+
+typedef struct cpath_watch_dir_t {
+    const cpath_watch *watch;
+    size_t next;
+    cpath path;
+} cpath_watch_dir;
+#endif
+
+#if defined CPATH_PARALLEL && defined CPATH_HAS_OPENAT
+#define CPATH_DU_NONE ((size_t)-1)
+// the hardlink set is split into this many separately locked sets
+#ifndef CPATH_DU_LINK_STRIPES
+#define CPATH_DU_LINK_STRIPES (64)
+#endif
+
+/*
+    The totals of one directory, sizes are st_size and blocks are
+    st_blocks (512 byte units).
+*/
+typedef struct cpath_du_node_t {
+    size_t parent;
+    // offset into the names
+    size_t name;
+    size_t nameLen;
+    int depth;
+
+    // the directory itself and the files directly inside of it
+    uint64_t size;
+    uint64_t blocks;
+    uint64_t files;
+    // including every directory under it
+    uint64_t totalSize;
+    uint64_t totalBlocks;
+    uint64_t totalFiles;
+} cpath_du_node;
+
+typedef struct cpath_du_t {
+    // a parent always comes before its children (the root is 0)
+    cpath_du_node *nodes;
+    size_t count;
+    size_t cap;
+
+    // the root's name is the path it was scanned from
+    cpath_char_t *names;
+    size_t namesLen;
+    size_t namesCap;
+
+    // files we didn't count since another link to them was counted
+    size_t hardlinks;
+    // directories or files we couldn't read
+    size_t errors;
+} cpath_du;
+#endif
+
+/*
+    The state of a content hash (see cpathContentHash) which is fed 64
+    byte stripes at a time.
+*/
+typedef struct cpath_content_hash_t {
+    uint64_t acc[8];
+    uint64_t stripes;
+} cpath_content_hash;
+
+#if defined CPATH_HAS_OPENAT
+// how much of each end of a file is hashed before all of it is
+#define CPATH_DUPES_PARTIAL (4096)
+// how many files a job hashes
+#define CPATH_DUPES_CHUNK (16)
+#ifndef CPATH_DUPES_BUF_SIZE
+#define CPATH_DUPES_BUF_SIZE (1024 * 1024)
+#endif
+
+typedef struct cpath_dupes_file_t {
+    // offset into the paths
+    size_t path;
+    size_t len;
+    uint64_t size;
+    uint64_t partial;
+    uint64_t full;
+    // the first file of its group with the same bytes (once verified)
+    size_t match;
+    int unreadable;
+} cpath_dupes_file;
+
+/*
+    Collects files (see cpathDupesVisit) and then finds which ones have
+    the same contents with cpathDupesFind.
+*/
+typedef struct cpath_dupes_t {
+    cpath_dupes_file *files;
+    size_t count;
+    size_t cap;
+
+    cpath_char_t *paths;
+    size_t pathsLen;
+    size_t pathsCap;
+
+    // only the first link to a file is kept
+    cpath_visited links;
+
+    // after cpathDupesFind group i is files [groups[i], groups[i + 1])
+    size_t *groups;
+    size_t groupCount;
+
+    // compare every group byte for byte before reporting it (on by default)
+    // so a hash collision can never pass as a duplicate
+    int verify;
+
+    // bytes read for the partial and full hashes and to verify groups
+    uint64_t partialBytes;
+    uint64_t fullBytes;
+    uint64_t verifyBytes;
+    // files that couldn't be read (or changed size while we read them)
+    size_t errors;
+    size_t hardlinks;
+    int failed;
+} cpath_dupes;
+#endif
+
+/*
+    A stack of open directories for iterative (depth first) traversals
+    the frames are kept around and reused so pushing a directory doesn't
+    allocate (other than the first time we reach that depth) and all frames
+    share a single path that is just extended/truncated by each name.
+    NOTE: the readdir backend still has to fdopendir (which allocates) for
+          every push, use CPATH_USE_GETDENTS to avoid that.
+*/
+typedef struct cpath_dir_frame_t {
+    // NOTE: dir.path isn't used (where openat is supported)
+    cpath_dir dir;
+    // the length of the stack's path before this directory was pushed
+    size_t pathLen;
+#if defined CPATH_GETDENTS
+    // getdents buffer, kept when the frame is popped so it can be reused
+    char *buf;
+#endif
+} cpath_dir_frame;
+
+typedef struct cpath_dir_stack_t {
+    cpath_dir_frame *frames;
+    size_t depth;
+    size_t cap;
+
+    // path of the top directory
+    cpath path;
+} cpath_dir_stack;
+
+/*
+    A pending directory of a cpath_bfs, the path is in the list's names.
+*/
+typedef struct cpath_bfs_pending_t {
+    size_t name;
+    size_t len;
+    int depth;
+} cpath_bfs_pending;
+
+typedef struct cpath_bfs_list_t {
+    cpath_bfs_pending *items;
+    size_t head;
+    size_t count;
+    size_t cap;
+
+    cpath_char_t *names;
+    size_t namesLen;
+    size_t namesCap;
+} cpath_bfs_list;
+
+/*
+    A breadth first walk, only a single directory is open unless the
+    frontier is full.  see cpathBfsOpen.
+*/
+typedef struct cpath_bfs_t {
+    cpath_dir dir;
+    int dirOpen;
+    // depth of the directory the last file was in (the root is 0)
+    int depth;
+    // depth of dir
+    int dirDepth;
+
+    // directories waiting their turn (in order)
+    cpath_bfs_list queue;
+    // once the queue is full a new directory is walked depth first straight
+    // away (the directories it is in wait open) so nothing else is pending
+    cpath_dir_stack deep;
+    // depth of the bottom of deep
+    int deepDepth;
+    size_t maxFrontier;
+} cpath_bfs;
+
+typedef int(*cpath_listing_cmp)(
+    const cpath_listing *listing, size_t a, size_t b, void *data
+);
+
+#if defined CPATH_PARALLEL && !defined _MSC_VER
+/*
+    A pending directory for the parallel traversal.
+    The path is stored directly after the job (in the same allocation).
+*/
+typedef struct cpath_parallel_job_t {
+    int depth;
+    size_t tag;
+    size_t len;
+} cpath_parallel_job;
+
+/*
+    Each worker owns a deque, it pushes/pops its own work from the tail
+    (so it stays depth first and keeps the cache warm) and other workers
+    steal from the head (which tends to be the bigger subtrees).
+*/
+typedef struct cpath_parallel_deque_t {
+    pthread_mutex_t lock;
+    cpath_parallel_job **jobs;
+    size_t head;
+    size_t count;
+    size_t cap;
+} cpath_parallel_deque;
+
+struct cpath_parallel_t;
+typedef void(*cpath_parallel_fn)(
+    struct cpath_parallel_t *pool, int worker, cpath_parallel_job *job
+);
+
+typedef struct cpath_parallel_t {
+    cpath_parallel_deque *deques;
+    int threads;
+
+    // protects pending/pushes and is what idle workers sleep on
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t pending;
+    size_t pushes;
+
+    cpath_parallel_fn fn;
+    cpath_err_handler err;
+    void *data;
+} cpath_parallel;
+
+#ifndef CPATH_PARALLEL_MAX_THREADS
+#define CPATH_PARALLEL_MAX_THREADS (256)
+#endif
+#endif
+
+/*
+    A compiled glob pattern, every segment (between separators) is either
+    a literal, a pattern (using *, ? and [...]) or ** which matches any
+    number of directories.  Braces ({a,b}) are expanded inside of each
+    segment into alternatives.
+*/
+#define CPATH_GLOB_MAX_SEGMENTS (63)
+#define CPATH_GLOB_MAX_ALTERNATIVES (1024)
+
+#define CPATH_GLOB_LITERAL (0)
+#define CPATH_GLOB_PATTERN (1)
+#define CPATH_GLOB_ANY_DEPTH (2)
+
+typedef struct cpath_glob_segment_t {
+    int kind;
+    // the alternatives [alt, alt + altCount) of the pattern
+    size_t alt;
+    size_t altCount;
+} cpath_glob_segment;
+
+typedef struct cpath_glob_pattern_t {
+    cpath_glob_segment *segments;
+    size_t count;
+
+    // every alternative is stored in buf (not null terminated)
+    size_t *altOffsets;
+    size_t *altLens;
+    size_t alts;
+    size_t altsCap;
+    cpath_char_t *buf;
+    size_t bufLen;
+    size_t bufCap;
+
+    // the pattern begins with a separator
+    int absolute;
+} cpath_glob_pattern;
+
+typedef struct cpath_glob_frame_t {
+    // only opened if we have to read the directory
+    cpath_dir dir;
+    int opened;
+    // bit i is set if the next component could match segment i
+    uint64_t states;
+    // if every segment is a literal we just try each alternative
+    // rather than reading the directory, this is the next one to try
+    size_t next;
+    size_t pathLen;
+} cpath_glob_frame;
+
+/*
+    Iterates the files matching a glob (see cpathGlobOpen).
+*/
+typedef struct cpath_glob_t {
+    cpath_glob_pattern pattern;
+
+    cpath_glob_frame *frames;
+    size_t depth;
+    size_t cap;
+    // the directory of the top frame
+    cpath path;
+
+    // a directory we've just given back that we still have to go into
+    int hasPending;
+    uint64_t pendingStates;
+    cpath pending;
+} cpath_glob;
+
+/*
+    A rule from an ignore file (.gitignore/.ignore)
+    Literals (i.e. node_modules) are found through a hash set and suffixes
+    (i.e. *.o) are just compared, everything else is a glob.
+*/
+#define CPATH_IGNORE_LITERAL (0)
+#define CPATH_IGNORE_SUFFIX (1)
+#define CPATH_IGNORE_GLOB (2)
+
+typedef struct cpath_ignore_rule_t {
+    int kind;
+    int negate;
+    int dirOnly;
+    // has a separator so it's matched against the path relative to the
+    // ignore file rather than just the name
+    int anchored;
+    // literals and suffixes are stored in the level's names
+    size_t name;
+    size_t nameLen;
+    // the previous literal with the same name (index + 1, 0 if none)
+    size_t prev;
+    cpath_glob_pattern pattern;
+} cpath_ignore_rule;
+
+/*
+    The rules from the ignore files of a single directory.
+*/
+typedef struct cpath_ignore_level_t {
+    cpath_ignore_rule *rules;
+    size_t count;
+    size_t cap;
+
+    // the last literal rule for each name (index + 1, 0 if empty)
+    size_t *slots;
+    size_t slotsCap;
+    size_t literals;
+
+    cpath_char_t *names;
+    size_t namesLen;
+    size_t namesCap;
+
+    size_t anchored;
+    // where paths relative to this directory start (in the walk's path)
+    size_t relStart;
+} cpath_ignore_level;
+
+/*
+    Walks a tree skipping anything ignored by .gitignore/.ignore files
+    see cpathIgnoreWalkOpen.
+*/
+typedef struct cpath_ignore_walk_t {
+    cpath_dir_stack stack;
+    // levels[i] has the rules for stack.frames[i]
+    cpath_ignore_level *levels;
+    size_t levelsCap;
+    // rules that apply everywhere (lowest priority)
+    cpath_ignore_level global;
+    // how many levels have anchored rules (we only build paths if > 0)
+    size_t anchored;
+    // how many entries we couldn't load (they are skipped)
+    size_t errors;
+    cpath scratch;
+} cpath_ignore_walk;
+
 /* == Declarations == */
 
 /* == Path == */
@@ -398,6 +1391,13 @@ typedef void(*cpath_traverse_it)(
 _CPATH_FUNC_
 size_t cpathStrCpyConv(cpath_str dest, size_t len, const cpath_char_t *src);
 
+/*
+    The same as cpathStrCpyConv but never uses SIMD (mainly for comparison)
+*/
+_CPATH_FUNC_
+size_t cpathStrCpyConvScalar(cpath_str dest, size_t len,
+                             const cpath_char_t *src);
+
 /*
     Trim all trailing / or \ from a path
 */
@@ -491,6 +1491,15 @@ int cpathExists(const cpath *path);
 _CPATH_FUNC_
 int cpathCanonicaliseNoSysCall(cpath *out, cpath *path);
 
+/*
+    Canonicalises (without system calls) each path in place, paths that
+    can't be canonicalised are left as they are.
+    If ok isn't NULL ok[i] is set to whether paths[i] succeeded.
+    Returns how many succeeded.
+*/
+_CPATH_FUNC_
+size_t cpathCanonicaliseNoSysCallBatch(cpath *paths, size_t n, int *ok);
+
 /*
     Resolves the path.  Involves system calls.
 */
@@ -525,6 +1534,9 @@ void cpathClear(cpath *path);
                 out then.  It is hard to detect that though.
 
     You can strdup it yourself or do a memcpy if you care about editing it
+
+    If you don't need null terminated components prefer the read only
+    cpathComponentItInit/cpathComponentItNext below.
 */
 _CPATH_FUNC_
 const cpath_char_t *cpathItRef(cpath *path, int *index);
@@ -544,101 +1556,324 @@ _CPATH_FUNC_
 void cpathItRefRestore(cpath *path, int *index);
 
 /*
-    Go up a directory effectively going back by one /
-    i.e. C:/D/E/F/g.c => C:/D/E/F and so on...
-    Returns true if it succeeded
-    Could possibly involve a canonicalise if the path is a symlink
-    i.e. ./ has to be resolved and so does ~/
+    Begins a read only iteration over the components of str (of length len)
+    this never writes to the path so it is safe on const/shared paths.
+
+    Components are given as (pointer, length) views into the path, a leading
+    separator is given as a root component (of just the separator) and empty
+    components (i.e. from '//') are skipped.
+    i.e. /usr/local//bin/ will be '/' 'usr' 'local' 'bin'
+
+    You can iterate from the front (cpathComponentItNext) and/or the back
+    (cpathComponentItPrev), each component is only returned once.
 */
 _CPATH_FUNC_
-int cpathUpDir(cpath *path);
+void cpathComponentItInitStrn(cpath_component_it *it, const cpath_char_t *str,
+                              size_t len);
 
 /*
-    Converts all separators to the given separator
-    Note: will only convert / and \
+    Same as above but for a path.
+    NOTE: The path has to outlive the iterator and any components.
 */
 _CPATH_FUNC_
-void cpathConvertSepCustom(cpath *path, cpath_char_t sep);
+void cpathComponentItInit(cpath_component_it *it, const cpath *path);
 
 /*
-    Converts all seperators to the default one.
+    Gets the next component from the front.
+    Returns false if there are no more components.
 */
 _CPATH_FUNC_
-void cpathConvertSep(cpath *path) { cpathConvertSepCustom(path, CPATH_SEP); }
+int cpathComponentItNext(cpath_component_it *it, cpath_component *out);
 
-/* == File System == */
+/*
+    Gets the next component from the back.
+    Returns false if there are no more components.
+*/
+_CPATH_FUNC_
+int cpathComponentItPrev(cpath_component_it *it, cpath_component *out);
 
 /*
-    Get the current working directory allocating the space
+    Returns true if the two components are the same.
 */
 _CPATH_FUNC_
-cpath_char_t *cpathGetCwdAlloc();
+int cpathComponentEq(const cpath_component *a, const cpath_component *b);
 
 /*
-    Get the current working directory passing in a buffer
+    Returns true if the components of prefix are the first components of path
+    i.e. /a/b/c starts with /a/b and /a/b/ but not with /a/bc
 */
 _CPATH_FUNC_
-cpath_char_t *cpathGetCwdBuf(cpath_char_t *buf, size_t size);
+int cpathStartsWith(const cpath *path, const cpath *prefix);
 
+#if defined CPATH_HAS_OPENAT
 /*
-    Write the cwd to a path buffer.
+    Initialise an empty resolver (doesn't allocate).
 */
 _CPATH_FUNC_
-void cpathWriteCwd(cpath *path);
+void cpathResolverInit(cpath_resolver *resolver);
 
 /*
-    Get the cwd as a path.
+    Frees all the memory of a resolver, it is reinitialised so can be reused.
 */
 _CPATH_FUNC_
-cpath cpathGetCwd();
+void cpathResolverFree(cpath_resolver *resolver);
 
 /*
-    Opens a directory placing information into the given directory buffer.
+    Forgets everything that has been resolved (and the cwd) but keeps
+    the memory around.
 */
 _CPATH_FUNC_
-int cpathOpenDir(cpath_dir *dir, const cpath *path);
+void cpathResolverClear(cpath_resolver *resolver);
 
 /*
-    Restarts the given directory iterator.
+    Resolves path like cpathCanonicalise (realpath) does but in userspace
+    with one readlinkat per component that isn't already known.
+    Every prefix resolved along the way is remembered so resolving
+    /a/b/c/d after /a/b/c/e only has to look at 'd'.
+
+    Relative paths are resolved against the cwd at the time of the first
+    call (or the first after cpathResolverClear).
+    NOTE: out can be the same as path.
 */
 _CPATH_FUNC_
-int cpathRestartDir(cpath_dir *dir);
+int cpathResolve(cpath_resolver *resolver, cpath *out, const cpath *path);
 
 /*
-    Clear directory data.
-    If closing parents then will recurse through all previous emplaces.
+    Forgets every remembered prefix that either goes through prefix or
+    resolved to somewhere under it, call this when something under
+    prefix has been moved/removed or a symlink has changed.
+    Returns how many prefixes were forgotten.
 */
 _CPATH_FUNC_
-void cpathCloseDir(cpath_dir *dir);
+size_t cpathResolverInvalidate(cpath_resolver *resolver, const cpath *prefix);
+#endif
 
 /*
-    Move to the next file in the iterator.
+    Go up a directory effectively going back by one /
+    i.e. C:/D/E/F/g.c => C:/D/E/F and so on...
+    Returns true if it succeeded
+    Could possibly involve a canonicalise if the path is a symlink
+    i.e. ./ has to be resolved and so does ~/
 */
 _CPATH_FUNC_
-int cpathMoveNextFile(cpath_dir *dir);
+int cpathUpDir(cpath *path);
 
 /*
-    Load stat.  Sets statLoaded.
+    Converts all separators to the given separator
+    Note: will only convert / and \
 */
 _CPATH_FUNC_
-int cpathGetFileInfo(cpath_file *file);
+void cpathConvertSepCustom(cpath *path, cpath_char_t sep);
 
 /*
-    Load file flags such as isDir, isReg, isSym
-    Attempts to not use stat since that is slow
+    Converts all seperators to the default one.
 */
 _CPATH_FUNC_
-int cpathLoadFlags(cpath_dir *dir, cpath_file *file, void *data);
+void cpathConvertSep(cpath *path) { cpathConvertSepCustom(path, CPATH_SEP); }
+
+/* == Variable Length Path == */
 
 /*
-    Peeks the next file but doesn't move the iterator along.
+    Initialise an empty variable length path (doesn't allocate).
 */
 _CPATH_FUNC_
-int cpathPeekNextFile(cpath_dir *dir, cpath_file *file);
+void cpathVPathInit(cpath_vpath *path);
 
 /*
-    Get the next file inside the directory, acts like an iterator.
-    i.e. while (cpathGetNextFile(...)) can use dir->hasNext to verify
+    Frees the path (if it spilt onto the heap) it is left empty.
+*/
+_CPATH_FUNC_
+void cpathVPathFree(cpath_vpath *path);
+
+/*
+    The null terminated string of the path.
+*/
+_CPATH_FUNC_
+const cpath_char_t *cpathVPathStr(const cpath_vpath *path);
+
+/*
+    Construct a path from a system typed string (like cpathFromStr)
+    The path has to be initialised.
+*/
+_CPATH_FUNC_
+int cpathVPathFromStr(cpath_vpath *out, const cpath_char_t *str);
+
+/*
+    Construct from a fixed path.
+*/
+_CPATH_FUNC_
+int cpathVPathFromPath(cpath_vpath *out, const cpath *path);
+
+/*
+    Copy into a fixed path, fails with ENAMETOOLONG if it doesn't fit.
+*/
+_CPATH_FUNC_
+int cpathVPathToPath(const cpath_vpath *path, cpath *out);
+
+/*
+    Copy a path.
+*/
+_CPATH_FUNC_
+int cpathVPathCopy(cpath_vpath *out, const cpath_vpath *in);
+
+/*
+    Appends to the path (not adding /)
+*/
+_CPATH_FUNC_
+int cpathVPathAppendStrn(cpath_vpath *out, const cpath_char_t *other,
+                         size_t len);
+
+/*
+    Appends to the path (not adding /)
+*/
+_CPATH_FUNC_
+int cpathVPathAppend(cpath_vpath *out, const cpath_vpath *other);
+
+/*
+    Concatenate a path (adds / for you) from a system typed string
+*/
+_CPATH_FUNC_
+int cpathVPathConcatStrn(cpath_vpath *out, const cpath_char_t *other,
+                         size_t len);
+
+/*
+    Concatenate a path (adds / for you) from a system typed string
+*/
+_CPATH_FUNC_
+int cpathVPathConcatStr(cpath_vpath *out, const cpath_char_t *other);
+
+/*
+    Concat a path with another.
+*/
+_CPATH_FUNC_
+int cpathVPathConcat(cpath_vpath *out, const cpath_vpath *other);
+
+/*
+    Attempts to canonicalise without system calls (like
+    cpathCanonicaliseNoSysCall) out can be the same as path.
+*/
+_CPATH_FUNC_
+int cpathVPathCanonicaliseNoSysCall(cpath_vpath *out, const cpath_vpath *path);
+
+/*
+    Go up a directory, unlike cpathUpDir this never makes a system call
+    if there is no directory to strip it'll just add a ..
+*/
+_CPATH_FUNC_
+int cpathVPathUpDir(cpath_vpath *path);
+
+/* == File System == */
+
+/*
+    Get the current working directory allocating the space
+*/
+_CPATH_FUNC_
+cpath_char_t *cpathGetCwdAlloc();
+
+/*
+    Get the current working directory passing in a buffer
+*/
+_CPATH_FUNC_
+cpath_char_t *cpathGetCwdBuf(cpath_char_t *buf, size_t size);
+
+/*
+    Write the cwd to a path buffer.
+*/
+_CPATH_FUNC_
+void cpathWriteCwd(cpath *path);
+
+/*
+    Get the cwd as a path.
+*/
+_CPATH_FUNC_
+cpath cpathGetCwd();
+
+/*
+    Opens a directory placing information into the given directory buffer.
+*/
+_CPATH_FUNC_
+int cpathOpenDir(cpath_dir *dir, const cpath *path);
+
+#if defined CPATH_GETDENTS
+/*
+    Opens a directory using the given buffer for getdents64
+    (rather than allocating CPATH_GETDENTS_BUF_SIZE bytes)
+    The buffer has to outlive the directory and won't be freed.
+*/
+_CPATH_FUNC_
+int cpathOpenDirBuf(cpath_dir *dir, const cpath *path, void *buf, size_t size);
+#endif
+
+/*
+    Restarts the given directory iterator.
+*/
+_CPATH_FUNC_
+int cpathRestartDir(cpath_dir *dir);
+
+/*
+    Clear directory data.
+    If closing parents then will recurse through all previous emplaces.
+*/
+_CPATH_FUNC_
+void cpathCloseDir(cpath_dir *dir);
+
+/*
+    Move to the next file in the iterator.
+*/
+_CPATH_FUNC_
+int cpathMoveNextFile(cpath_dir *dir);
+
+/*
+    Load stat.  Sets statLoaded.
+*/
+_CPATH_FUNC_
+int cpathGetFileInfo(cpath_file *file);
+
+/*
+    Setup a stat batch, this will try to setup an io_uring (if enabled)
+    but will always succeed by falling back to sequential stats.
+*/
+_CPATH_FUNC_
+void cpathStatBatchInit(cpath_stat_batch *batch);
+
+/*
+    Free all data associated with the stat batch.
+*/
+_CPATH_FUNC_
+void cpathStatBatchFree(cpath_stat_batch *batch);
+
+/*
+    Load stat for every file that doesn't have it loaded (sets statLoaded)
+    Returns true if every stat succeeded, files that failed
+    will just have statLoaded == 0.
+*/
+_CPATH_FUNC_
+int cpathStatBatch(cpath_stat_batch *batch, cpath_file *files, size_t n);
+
+/*
+    Load file flags such as isDir, isReg, isSym
+    Attempts to not use stat since that is slow
+*/
+_CPATH_FUNC_
+int cpathLoadFlags(cpath_dir *dir, cpath_file *file, void *data);
+
+/*
+    Peeks the next file but doesn't move the iterator along.
+*/
+_CPATH_FUNC_
+int cpathPeekNextFile(cpath_dir *dir, cpath_file *file);
+
+/*
+    Peeks just the name of the next file (doesn't build a file or path)
+    Returns NULL if there is no next file, len can be NULL.
+    The name is only valid until you move the iterator.
+*/
+_CPATH_FUNC_
+const cpath_char_t *cpathPeekNextName(cpath_dir *dir, size_t *len);
+
+/*
+    Get the next file inside the directory, acts like an iterator.
+    i.e. while (cpathGetNextFile(...)) can use dir->hasNext to verify
     that there are indeed a file but it is safe!
 
     File may be null if you don't wish to actually get a copy
@@ -659,6 +1894,13 @@ int cpathFileIsSpecialHardLink(const cpath_file *file);
 _CPATH_FUNC_
 int cpathLoadAllFiles(cpath_dir *dir);
 
+/*
+    Preload all files in a directory and then load stat for all of them
+    using the given batch (can be NULL to use a temporary one).
+*/
+_CPATH_FUNC_
+int cpathLoadAllFilesStat(cpath_dir *dir, cpath_stat_batch *batch);
+
 /*
     More of a helper function, checks if we have space for n
     and will preload any files if required.
@@ -666,6 +1908,57 @@ int cpathLoadAllFiles(cpath_dir *dir);
 _CPATH_FUNC_
 int cpathCheckGetN(cpath_dir *dir, size_t n);
 
+/*
+    Initialise an empty listing (doesn't allocate).
+*/
+_CPATH_FUNC_
+void cpathListingInit(cpath_listing *listing);
+
+/*
+    Frees all the memory of a listing, it is reinitialised so can be reused.
+*/
+_CPATH_FUNC_
+void cpathListingFree(cpath_listing *listing);
+
+/*
+    Loads all files (from the current position) of the directory into the
+    listing, any previous contents are dropped but the memory is reused.
+    Entries that can't be stat'd are still listed and just counted in
+    errors so one bad entry doesn't lose the whole directory.
+    If loadStat is set then sizes, mtimes, modes, nlinks and devs will be
+    filled in too (and cpathListingGetFile won't have to stat again).
+*/
+_CPATH_FUNC_
+int cpathListingLoad(cpath_listing *listing, cpath_dir *dir, int loadStat);
+
+/*
+    The name of the nth entry, len can be NULL.
+*/
+_CPATH_FUNC_
+const cpath_char_t *cpathListingName(const cpath_listing *listing, size_t n,
+                                     size_t *len);
+
+/*
+    Builds a full file for the nth entry.
+*/
+_CPATH_FUNC_
+int cpathListingGetFile(const cpath_listing *listing, cpath_file *file,
+                        size_t n);
+
+/*
+    Compare names (can be given to cpathListingSort).
+*/
+_CPATH_FUNC_
+int cpathListingCompareName(const cpath_listing *listing, size_t a, size_t b,
+                            void *data);
+
+/*
+    Sorts the listing (stable), the arrays themselves are reordered so you
+    can just scan them in order afterwards.
+*/
+_CPATH_FUNC_
+int cpathListingSort(cpath_listing *listing, cpath_listing_cmp cmp, void *data);
+
 /*
     Get the nth file inside the directory, this is independent of the iterator
     above.
@@ -686,7 +1979,9 @@ int cpathGetFileConst(cpath_dir *dir, const cpath_file **file, size_t n);
 
 /*
     Opens the next sub directory into this
-    Saves the old directory into the parent if given saveDir
+    Saves the old directory into the parent if given saveDir, frames of
+    reverted emplaces are reused so this only allocates when it goes
+    deeper than it has been before.
 */
 _CPATH_FUNC_
 int cpathOpenSubFileEmplace(cpath_dir *dir, const cpath_file *file, int saveDir);
@@ -751,6 +2046,98 @@ int cpathRevertEmplace(cpath_dir **dir);
 _CPATH_FUNC_
 int cpathRevertEmplaceCopy(cpath_dir *dir);
 
+/*
+    Writes a checkpoint of an emplaced traversal (dir and all its parents)
+    that cpathCheckpointResume can pick up again later (even in another
+    process).  Each level is stored as its path and the name of the next
+    entry it would give back.
+
+    If buf is NULL (or cap is too small) only len is set to the size needed
+    (the latter fails with ERANGE).
+*/
+_CPATH_FUNC_
+int cpathCheckpointSave(cpath_dir *dir, void *buf, size_t cap, size_t *len);
+
+/*
+    Reopens every directory of a checkpoint as emplaces (like
+    cpathOpenSubFileEmplace with saveDir) so reverting goes back up the
+    same chain.  Entries before the saved ones are skipped without being
+    built so finished subtrees are never walked again.
+
+    If a saved entry has gone the directory is walked again from the
+    start (so nothing is missed) and if a directory has gone the
+    checkpoint just stops at its parent.
+*/
+_CPATH_FUNC_
+int cpathCheckpointResume(cpath_dir *dir, const void *buf, size_t len);
+
+/*
+    Opens the root directory of a directory stack.
+*/
+_CPATH_FUNC_
+int cpathDirStackOpen(cpath_dir_stack *stack, const cpath *path);
+
+/*
+    Closes every directory in the stack and frees the frames.
+*/
+_CPATH_FUNC_
+void cpathDirStackClose(cpath_dir_stack *stack);
+
+/*
+    The top (current) directory, NULL if the stack is empty.
+    NOTE: the frames are reallocated as the stack grows so the pointer is
+          invalidated by the next cpathDirStackPush.
+*/
+_CPATH_FUNC_
+cpath_dir *cpathDirStackTop(cpath_dir_stack *stack);
+
+/*
+    Gets the next file of the top directory (just like cpathGetNextFile)
+    Returns false when the top directory has no more files.
+*/
+_CPATH_FUNC_
+int cpathDirStackNext(cpath_dir_stack *stack, cpath_file *file);
+
+/*
+    Opens the given file (a sub directory of the top directory) as the new
+    top directory.
+*/
+_CPATH_FUNC_
+int cpathDirStackPush(cpath_dir_stack *stack, const cpath_file *file);
+
+/*
+    Closes the top directory and goes back to its parent.
+    Returns true if there is still a directory left on the stack.
+*/
+_CPATH_FUNC_
+int cpathDirStackPop(cpath_dir_stack *stack);
+
+/*
+    Begins a breadth first walk of path (shallow files come first).
+    Only one directory is open at a time, pending directories are kept as
+    paths so it never runs out of file descriptors however deep it goes.
+
+    maxFrontier caps how many directories can be waiting (0 is no cap),
+    once it is reached a new directory is walked depth first as soon as it
+    is found, the ones it is in are kept open until it is done so this
+    needs a file descriptor per level below it.
+*/
+_CPATH_FUNC_
+int cpathBfsOpen(cpath_bfs *bfs, const cpath *path, size_t maxFrontier);
+
+/*
+    Gets the next file, bfs->depth is the depth of the directory it is in.
+    Directories we can't open are skipped.
+*/
+_CPATH_FUNC_
+int cpathBfsNext(cpath_bfs *bfs, cpath_file *file);
+
+/*
+    Closes the current directory and frees the pending ones.
+*/
+_CPATH_FUNC_
+void cpathBfsClose(cpath_bfs *bfs);
+
 /*
     Opens the given path as a file.
 */
@@ -809,6 +2196,16 @@ double cpathGetFileSizeDec(cpath_file *file, int interval);
 _CPATH_FUNC_
 const cpath_char_t *cpathGetFileSizeSuffix(cpath_file *file, CPathByteRep rep);
 
+/*
+    Same as cpathGetFileSizeDec / cpathGetFileSizeSuffix but for any size
+    (i.e. a total)
+*/
+_CPATH_FUNC_
+double cpathGetSizeDec(cpath_offset_t size, int interval);
+
+_CPATH_FUNC_
+const cpath_char_t *cpathGetSizeSuffix(cpath_offset_t size, CPathByteRep rep);
+
 /*
     Create the given directory
 */
@@ -821,1192 +2218,8581 @@ int cpathMkdir(const cpath *path);
 _CPATH_FUNC_
 FILE *cpathOpen(const cpath *path, const cpath_char_t *mode);
 
-/* == Definitions == */
+#if defined CPATH_HAS_OPENAT
+/*
+    Opens the directory called `name` relative to the parent directory
+    (using openat) so the kernel doesn't have to walk the full path again.
+    NOTE: dir->path won't be filled in (it'll be empty) so paths of files
+          read through cpathGetNextFile will be relative to the parent,
+          use cpath_traverse_at if you want a full path for entries.
+          Entries of an unknown type are still stat'd through the
+          directory (fstatat) so they don't depend on the CWD.
+*/
+_CPATH_FUNC_
+int cpathOpenDirAt(cpath_dir *dir, cpath_dir *parent, const cpath_char_t *name);
 
-/* == Path == */
+#if defined CPATH_GETDENTS
+/*
+    cpathOpenDirAt using the given buffer for getdents64 (see cpathOpenDirBuf)
+    The buffer has to outlive the directory and won't be freed.
+*/
+_CPATH_FUNC_
+int cpathOpenDirAtBuf(cpath_dir *dir, cpath_dir *parent,
+                      const cpath_char_t *name, void *buf, size_t size);
+#endif
 
+/*
+    Load stat for an entry (relative to its directory using fstatat).
+    Sets statLoaded.
+*/
 _CPATH_FUNC_
-size_t cpathStrCpyConv(cpath_str dest, size_t len, const cpath_char_t *src) {
-    int lastWasSep = 0;
-    cpath_str startDest = dest;
-    for (size_t i = 0; i < len + 1; i++) {
-        int isSep = src[i] == CPATH_OTHER_SEP || src[i] == CPATH_SEP;
+int cpathEntryGetInfo(cpath_entry *entry);
 
-        if (isSep && !lastWasSep) {
-            *dest++ = CPATH_SEP;
-        } else if (!isSep || !lastWasSep) {
-            *dest++ = src[i];
-        }
-        lastWasSep = isSep;
-    }
-    return dest - startDest - 1;
-}
+/*
+    Build the full path for an entry.
+*/
+_CPATH_FUNC_
+int cpathEntryGetPath(const cpath_entry *entry, cpath *out);
 
+/*
+    Converts an entry into a full file (this builds the path).
+*/
 _CPATH_FUNC_
-void cpathTrim(cpath *path) {
+int cpathEntryToFile(const cpath_entry *entry, cpath_file *file);
+
+/*
+    Traverses like cpath_traverse but subdirectories are opened relative
+    to their parent's descriptor and files are given to you as entries
+    so the full path for each file is only built if you ask for it.
+*/
+_CPATH_FUNC_
+void cpath_traverse_at(
+    cpath_dir *dir, int depth, int visit_subdirs, cpath_err_handler err,
+    cpath_traverse_at_it it, void *data
+);
+#endif
+
+/*
+    Traverses just like cpath_traverse but every file will have its stat
+    loaded before `it` is called.  Each directory is loaded entirely and
+    then stat'd in one batch (see cpathStatBatch).
+*/
+_CPATH_FUNC_
+void cpath_traverse_stat(
+    cpath_dir *dir, int depth, int visit_subdirs, cpath_err_handler err,
+    cpath_traverse_it it, void *data
+);
+
+#if defined CPATH_HAS_OPENAT
+/*
+    Sets up an empty visited set.
+*/
+_CPATH_FUNC_
+void cpathVisitedInit(cpath_visited *set);
+
+/*
+    Frees the visited set.
+*/
+_CPATH_FUNC_
+void cpathVisitedFree(cpath_visited *set);
+
+/*
+    Adds the pair to the set, added is set to false if it was already there.
+    Returns false if it failed to grow the set.
+*/
+_CPATH_FUNC_
+int cpathVisitedAdd(cpath_visited *set, uint64_t dev, uint64_t ino, int *added);
+
+/*
+    Reads /proc/self/mountinfo into a table, do this once and share it.
+    Fails with ENOSYS on anything other than Linux.
+*/
+_CPATH_FUNC_
+int cpathMountsLoad(cpath_mounts *mounts);
+
+/*
+    Frees the mount table.
+*/
+_CPATH_FUNC_
+void cpathMountsFree(cpath_mounts *mounts);
+
+/*
+    Finds the mount for a device, NULL if there isn't one (or mounts is NULL)
+*/
+_CPATH_FUNC_
+const cpath_mount *cpathMountsFind(const cpath_mounts *mounts, uint64_t dev);
+#endif
+
+/*
+    Default options, that is no filters and no limits.
+*/
+_CPATH_FUNC_
+void cpathTraverseOptsInit(cpath_traverse_opts *opts);
+
+/*
+    Traverses just like cpath_traverse (always visiting subdirectories)
+    but with the given filters and limits (opts can be NULL).
+    Returns false if it stopped early because of maxEntries.
+*/
+_CPATH_FUNC_
+int cpath_traverse_ex(
+    cpath_dir *dir, int depth, const cpath_traverse_opts *opts,
+    cpath_err_handler err, cpath_traverse_it it, void *data
+);
+
+#if defined CPATH_PARALLEL && !defined _MSC_VER
+/*
+    Get the path of a parallel job.
+*/
+_CPATH_FUNC_
+cpath_char_t *cpathParallelJobPath(cpath_parallel_job *job);
+
+/*
+    Queue a directory onto the given worker's deque.
+    The tag is free for the caller to use (i.e. an index into their own data)
+*/
+_CPATH_FUNC_
+int cpathParallelPush(cpath_parallel *pool, int worker, const cpath_char_t *path,
+                      size_t len, int depth, size_t tag);
+
+/*
+    Setup a work stealing pool, threads <= 0 means use the number of online cpus
+    fn is called (from any worker) for every job that is pushed.
+*/
+_CPATH_FUNC_
+int cpathParallelInit(cpath_parallel *pool, int threads, cpath_parallel_fn fn,
+                      cpath_err_handler err, void *data);
+
+/*
+    Runs the pool until there is no more pending work.
+    You should have pushed atleast one job (typically onto worker 0)
+    before calling this.  The calling thread is used as worker 0.
+*/
+_CPATH_FUNC_
+void cpathParallelRun(cpath_parallel *pool);
+
+/*
+    Free all data associated with the pool.
+*/
+_CPATH_FUNC_
+void cpathParallelFree(cpath_parallel *pool);
+
+/*
+    Traverses just like cpath_traverse but spreads directories across
+    a pool of threads (threads <= 0 means use the number of online cpus).
+
+    NOTE: `it` is called concurrently from all the workers so it has to
+          be thread safe, and the order of files is no longer depth first.
+          The given directory is read by the calling thread.
+*/
+_CPATH_FUNC_
+void cpath_traverse_parallel(
+    cpath_dir *dir, int depth, int visit_subdirs, cpath_err_handler err,
+    cpath_traverse_it it, void *data, int threads
+);
+#endif
+
+/* == Glob == */
+
+/*
+    Initialise an empty pattern (doesn't allocate).
+*/
+_CPATH_FUNC_
+void cpathGlobPatternInit(cpath_glob_pattern *pattern);
+
+/*
+    Frees all the memory of a pattern.
+*/
+_CPATH_FUNC_
+void cpathGlobPatternFree(cpath_glob_pattern *pattern);
+
+/*
+    Compiles a glob i.e. src/{a,b}/[!_]?.c
+    Supports *, ?, [abc], [a-z], [!abc], {a,b} (inside a segment) and a
+    segment of just ** which matches any number of directories.
+    There are no escapes (since \ is a separator on windows).
+    * and ? don't match separators, nor do they treat hidden files specially.
+*/
+_CPATH_FUNC_
+int cpathGlobCompile(cpath_glob_pattern *pattern, const cpath_char_t *str);
+
+/*
+    Returns true if the path (of length len) matches the pattern
+    this is purely on the string and doesn't touch the filesystem.
+*/
+_CPATH_FUNC_
+int cpathGlobMatch(const cpath_glob_pattern *pattern, const cpath_char_t *path,
+                   size_t len);
+
+/*
+    Begins a glob of pattern under base (base can be NULL for the cwd and
+    is ignored if the pattern is absolute).
+
+    Directories are only opened if something under them could match and
+    literal segments are looked up directly (without reading the directory)
+    so A/B/?.c will only ever open A/B.
+*/
+_CPATH_FUNC_
+int cpathGlobOpen(cpath_glob *glob, const cpath *base,
+                  const cpath_char_t *pattern);
+
+/*
+    Gets the next file matching the glob, acts like cpathGetNextFile.
+    Directories that can't be opened are skipped.
+*/
+_CPATH_FUNC_
+int cpathGlobNext(cpath_glob *glob, cpath_file *file);
+
+/*
+    Closes every directory and frees the glob.
+*/
+_CPATH_FUNC_
+void cpathGlobClose(cpath_glob *glob);
+
+/* == Ignore Files == */
+
+/*
+    Begins a depth first walk of root that reads the .gitignore and .ignore
+    files of every directory as it goes.  Ignored files and directories are
+    skipped by name (before they are stat'd or opened) and rules of deeper
+    directories take precedence, just like git.
+    .git directories are always skipped.
+
+    NOTE: Braces in rules are expanded (git treats them literally) and
+          global excludes aren't read, use cpathIgnoreWalkAddRules for those.
+*/
+_CPATH_FUNC_
+int cpathIgnoreWalkOpen(cpath_ignore_walk *walk, const cpath *root);
+
+/*
+    Adds rules (in the format of a .gitignore) that apply to the whole walk
+    with a lower precedence than any ignore file.
+*/
+_CPATH_FUNC_
+int cpathIgnoreWalkAddRules(cpath_ignore_walk *walk, const char *rules,
+                            size_t len);
+
+/*
+    Gets the next file that isn't ignored, acts like cpathGetNextFile.
+    Directories are descended into straight after they are given back.
+    Entries that can't be loaded are skipped and counted in walk->errors.
+*/
+_CPATH_FUNC_
+int cpathIgnoreWalkNext(cpath_ignore_walk *walk, cpath_file *file);
+
+/*
+    Closes every directory and frees all the rules.
+*/
+_CPATH_FUNC_
+void cpathIgnoreWalkClose(cpath_ignore_walk *walk);
+
+/* == Snapshots == */
+
+#if defined CPATH_HAS_OPENAT
+/*
+    Empty snapshot/change set (scanning into them sets them up too).
+*/
+_CPATH_FUNC_
+void cpathSnapshotInit(cpath_snapshot *snapshot);
+
+_CPATH_FUNC_
+void cpathSnapshotFree(cpath_snapshot *snapshot);
+
+_CPATH_FUNC_
+void cpathSnapshotChangesInit(cpath_snapshot_changes *changes);
+
+_CPATH_FUNC_
+void cpathSnapshotChangesFree(cpath_snapshot_changes *changes);
+
+/*
+    Lists everything under root into out (entry 0 is root itself).
+
+    If prev is given (a previous snapshot of the same root) every
+    directory is still stat'd (with cpathGetFileInfo) but ones whose mtime
+    and ctime haven't changed reuse prev's children instead of being read.
+    Directories that changed within CPATH_SNAPSHOT_MTIME_SLACK seconds of
+    prev being taken are always read again.
+
+    Differences to prev are appended to changes (if not NULL), a removed
+    directory is a single change (its children aren't given).
+    NOTE: Only names are tracked, files that are just modified don't
+          change their directory so they aren't a change.
+*/
+_CPATH_FUNC_
+int cpathSnapshotScan(cpath_snapshot *out, const cpath *root,
+                      const cpath_snapshot *prev,
+                      cpath_snapshot_changes *changes);
+
+/*
+    The full path of an entry.
+*/
+_CPATH_FUNC_
+int cpathSnapshotPath(const cpath_snapshot *snapshot, size_t entry, cpath *out);
+#endif
+
+/* == Index Files == */
+
+#if defined CPATH_HAS_OPENAT
+/*
+    Sets up a builder with root as the first entry.
+*/
+_CPATH_FUNC_
+int cpathIndexBuilderInit(cpath_index_builder *builder, const cpath *root);
+
+_CPATH_FUNC_
+void cpathIndexBuilderFree(cpath_index_builder *builder);
+
+/*
+    A cpath_traverse_it that adds every file to the builder (data),
+    i.e. cpath_traverse(&dir, 0, 1, NULL, cpathIndexBuilderVisit, &builder)
+    the traversal has to start at depth 0 and can't be a parallel one.
+    Files are stat'd if they don't have it loaded (cpath_traverse_stat
+    batches them).
+*/
+_CPATH_FUNC_
+void cpathIndexBuilderVisit(cpath_file *file, cpath_dir *parent, int depth,
+                            void *data);
+
+/*
+    Writes everything the builder has to an index file, it's written to a
+    temporary file next to it and then renamed over path so an index that
+    is open (mapped) is never changed under anyone.
+*/
+_CPATH_FUNC_
+int cpathIndexBuilderWrite(cpath_index_builder *builder, const cpath *path);
+
+/*
+    Maps an index file, nothing is parsed so this is just as fast
+    however big the index is.
+*/
+_CPATH_FUNC_
+int cpathIndexOpen(cpath_index *index, const cpath *path);
+
+_CPATH_FUNC_
+void cpathIndexClose(cpath_index *index);
+
+/*
+    Gets the name of an entry (out has to fit CPATH_MAX_PATH_LEN since
+    the root's name is the path it was built from).
+    Returns the length of the name.
+*/
+_CPATH_FUNC_
+size_t cpathIndexName(const cpath_index *index, uint64_t entry,
+                      cpath_char_t *out);
+
+/*
+    Finds the entry for a path (it has to begin with the root's path)
+    CPATH_INDEX_NONE if it isn't in the index.
+*/
+_CPATH_FUNC_
+uint64_t cpathIndexFind(const cpath_index *index, const cpath *path);
+
+/*
+    Opens a directory of the index to be read like a normal directory.
+*/
+_CPATH_FUNC_
+int cpathIndexOpenDir(cpath_index_dir *dir, const cpath_index *index,
+                      const cpath *path);
+
+/*
+    Gets the next file (like cpathGetNextFile) the stat is loaded but only
+    st_mode, st_size and st_mtime are set.
+*/
+_CPATH_FUNC_
+int cpathIndexGetNextFile(cpath_index_dir *dir, cpath_file *file);
+#endif
+
+/* == Watching == */
+
+#if defined CPATH_HAS_INOTIFY
+/*
+    Loads everything under root and watches every directory in it.
+    Nothing changes until you call cpathWatchUpdate (poll watch->fd if you
+    want to know when there is something to do).
+*/
+_CPATH_FUNC_
+int cpathWatchOpen(cpath_watch *watch, const cpath *root);
+
+_CPATH_FUNC_
+void cpathWatchClose(cpath_watch *watch);
+
+/*
+    Waits up to timeout milliseconds (like poll, 0 doesn't wait and -1
+    waits forever) for events and then applies everything that is queued.
+    If the queue overflowed the root is rescanned.
+*/
+_CPATH_FUNC_
+int cpathWatchUpdate(cpath_watch *watch, int timeout);
+
+/*
+    Rescans everything under path (keeping what hasn't changed), for when
+    you know events were missed.
+*/
+_CPATH_FUNC_
+int cpathWatchRescan(cpath_watch *watch, const cpath *path);
+
+/*
+    Finds the node for a path (it has to begin with the root's path)
+    CPATH_WATCH_NONE if it isn't there.
+*/
+_CPATH_FUNC_
+size_t cpathWatchFind(const cpath_watch *watch, const cpath *path);
+
+/*
+    Gets the full path of a node.
+*/
+_CPATH_FUNC_
+int cpathWatchPath(const cpath_watch *watch, size_t node, cpath *out);
+
+/*
+    Like cpathOpenFile but from memory, the stat is loaded but only
+    st_mode, st_size and st_mtime are set.
+*/
+_CPATH_FUNC_
+int cpathWatchOpenFile(cpath_file *file, const cpath_watch *watch,
+                       const cpath *path);
+
+/*
+    Opens a directory to be read from memory, it is invalidated by the
+    next cpathWatchUpdate and files aren't in any particular order.
+*/
+_CPATH_FUNC_
+int cpathWatchOpenDir(cpath_watch_dir *dir, const cpath_watch *watch,
+                      const cpath *path);
+
+/*
+    Gets the next file (like cpathGetNextFile) with the same stat as
+    cpathWatchOpenFile.
+*/
+_CPATH_FUNC_
+int cpathWatchGetNextFile(cpath_watch_dir *dir, cpath_file *file);
+#endif
+
+/* == Disk Usage == */
+
+#if defined CPATH_PARALLEL && defined CPATH_HAS_OPENAT
+/*
+    Totals everything under root for each directory (like du) across a
+    pool of threads (threads <= 0 means use the number of online cpus).
+    Files with more than one link are only counted the first time they
+    are seen and symbolic links aren't followed.
+*/
+_CPATH_FUNC_
+int cpathDuScan(cpath_du *du, const cpath *root, int threads);
+
+_CPATH_FUNC_
+void cpathDuFree(cpath_du *du);
+
+/*
+    Gets the full path of a directory.
+*/
+_CPATH_FUNC_
+int cpathDuPath(const cpath_du *du, size_t node, cpath *out);
+#endif
+
+/* == Duplicates == */
+
+/*
+    A fast (non cryptographic) 64 bit hash of some data, it is vectorised
+    with SSE2/AVX2 when the compiler targets them.
+*/
+_CPATH_FUNC_
+uint64_t cpathContentHash(const void *data, size_t len);
+
+/*
+    The same as cpathContentHash but never uses SIMD (mainly for comparison)
+*/
+_CPATH_FUNC_
+uint64_t cpathContentHashScalar(const void *data, size_t len);
+
+#if defined CPATH_HAS_OPENAT
+_CPATH_FUNC_
+void cpathDupesInit(cpath_dupes *dupes);
+
+_CPATH_FUNC_
+void cpathDupesFree(cpath_dupes *dupes);
+
+/*
+    Adds a file to be checked, anything that isn't a regular file (or is
+    empty) is ignored as is any other link to a file we already have.
+*/
+_CPATH_FUNC_
+int cpathDupesAdd(cpath_dupes *dupes, cpath_file *file);
+
+/*
+    A cpath_traverse_it that adds every file to the dupes (data)
+    i.e. cpath_traverse(&dir, 0, 1, NULL, cpathDupesVisit, &dupes)
+    it isn't thread safe so it can't be used with cpath_traverse_parallel.
+*/
+_CPATH_FUNC_
+void cpathDupesVisit(cpath_file *file, cpath_dir *parent, int depth,
+                     void *data);
+
+/*
+    Finds the groups of files with the same contents.  Only files with
+    the same size are hashed, first just the first and last
+    CPATH_DUPES_PARTIAL bytes and then (if those match) all of it, then
+    (unless dupes->verify is cleared) each group is compared byte for byte.
+    Files are read CPATH_DUPES_BUF_SIZE bytes at a time with one buffer per
+    thread, threads is only used with CPATH_PARALLEL (<= 0 means use the
+    number of online cpus).
+*/
+_CPATH_FUNC_
+int cpathDupesFind(cpath_dupes *dupes, int threads);
+
+/*
+    Gets the path of a file.
+*/
+_CPATH_FUNC_
+int cpathDupesPath(const cpath_dupes *dupes, size_t file, cpath *out);
+#endif
+
+/* == Definitions == */
+
+/* == Path == */
+
+#if defined CPATH_SIMD_AVX2 || defined CPATH_SIMD_SSE2
+_CPATH_FUNC_
+unsigned _cpathCtz(uint32_t mask) {
+#if defined _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctz(mask);
+#endif
+}
+
+_CPATH_FUNC_
+unsigned _cpathClz(uint32_t mask) {
+#if defined _MSC_VER
+    unsigned long index;
+    _BitScanReverse(&index, mask);
+    return 31 - (unsigned)index;
+#else
+    return (unsigned)__builtin_clz(mask);
+#endif
+}
+#endif
+
+/*
+    Copies n characters (including the '\0') converting / and \ to sep and
+    collapsing runs of separators, returns how many characters were written.
+    dest can be the same as src.
+*/
+_CPATH_FUNC_
+size_t _cpathSepConvScalar(cpath_char_t *dest, const cpath_char_t *src,
+                           size_t n, cpath_char_t sep, int *lastWasSep) {
+    size_t out = 0;
+    int last = *lastWasSep;
+    for (size_t i = 0; i < n; i++) {
+        int isSep = src[i] == CPATH_OTHER_SEP || src[i] == CPATH_SEP;
+
+        if (isSep && !last) {
+            dest[out++] = sep;
+        } else if (!isSep) {
+            dest[out++] = src[i];
+        }
+        last = isSep;
+    }
+    *lastWasSep = last;
+    return out;
+}
+
+/*
+    Same as _cpathSepConvScalar but a block at a time, a block can just be
+    copied as is if it contains no separator that has to be converted and
+    no two separators in a row (which is the case for almost all paths)
+*/
+_CPATH_FUNC_
+size_t _cpathSepConv(cpath_char_t *dest, const cpath_char_t *src, size_t n,
+                     cpath_char_t sep) {
+    size_t i = 0;
+    size_t out = 0;
+    int last = 0;
+
+#if defined CPATH_SIMD_AVX2
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+        uint32_t s = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, slash));
+        uint32_t b = (uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, backslash));
+        uint32_t mask = s | b;
+        uint32_t bad = sep == '/' ? b : sep == '\\' ? s : mask;
+        if (bad == 0 && (mask & (mask >> 1)) == 0 && !(last && (mask & 1))) {
+            _mm256_storeu_si256((__m256i*)(dest + out), v);
+            out += 32;
+            last = (mask >> 31) & 1;
+        } else {
+            out += _cpathSepConvScalar(dest + out, src + i, 32, sep, &last);
+        }
+    }
+#elif defined CPATH_SIMD_SSE2
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        uint32_t s = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, slash));
+        uint32_t b = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, backslash));
+        uint32_t mask = s | b;
+        uint32_t bad = sep == '/' ? b : sep == '\\' ? s : mask;
+        if (bad == 0 && (mask & (mask >> 1)) == 0 && !(last && (mask & 1))) {
+            _mm_storeu_si128((__m128i*)(dest + out), v);
+            out += 16;
+            last = (mask >> 15) & 1;
+        } else {
+            out += _cpathSepConvScalar(dest + out, src + i, 16, sep, &last);
+        }
+    }
+#elif defined CPATH_SIMD_NEON
+    const uint8x16_t slash = vdupq_n_u8('/');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)(src + i));
+        uint8x16_t s = vceqq_u8(v, slash);
+        uint8x16_t b = vceqq_u8(v, backslash);
+        uint8x16_t mask = vorrq_u8(s, b);
+        uint8x16_t bad = sep == '/' ? b : sep == '\\' ? s : mask;
+        // each lane is whether the previous character was a separator
+        uint8x16_t prev = vextq_u8(vdupq_n_u8(last ? 0xFF : 0), mask, 15);
+        if (vmaxvq_u8(bad) == 0 && vmaxvq_u8(vandq_u8(mask, prev)) == 0) {
+            vst1q_u8((uint8_t*)(dest + out), v);
+            out += 16;
+            last = vgetq_lane_u8(mask, 15) != 0;
+        } else {
+            out += _cpathSepConvScalar(dest + out, src + i, 16, sep, &last);
+        }
+    }
+#endif
+
+    out += _cpathSepConvScalar(dest + out, src + i, n - i, sep, &last);
+    return out;
+}
+
+_CPATH_FUNC_
+size_t cpathStrCpyConv(cpath_str dest, size_t len, const cpath_char_t *src) {
+    return _cpathSepConv(dest, src, len + 1, CPATH_SEP) - 1;
+}
+
+_CPATH_FUNC_
+size_t cpathStrCpyConvScalar(cpath_str dest, size_t len,
+                             const cpath_char_t *src) {
+    int last = 0;
+    return _cpathSepConvScalar(dest, src, len + 1, CPATH_SEP, &last) - 1;
+}
+
+_CPATH_FUNC_
+size_t _cpathTrimBuf(cpath_char_t *buf, size_t len) {
     /* trim all the terminating / and \ */
     /* We don't want to trim // into empty string
          We will trim it to just /
      */
-    while (path->len > 1 && (path->buf[path->len - 1] == CPATH_SEP ||
-                 path->buf[path->len - 1] == CPATH_OTHER_SEP)) {
+    while (len > 1 && (buf[len - 1] == CPATH_SEP ||
+                 buf[len - 1] == CPATH_OTHER_SEP)) {
+        len--;
+    }
+    buf[len] = CPATH_STR('\0');
+    return len;
+}
+
+_CPATH_FUNC_
+void cpathTrim(cpath *path) {
+    path->len = _cpathTrimBuf(path->buf, path->len);
+}
+
+_CPATH_FUNC_
+cpath cpathFromUtf8(const char *str) {
+    cpath path;
+    if (str[0] == CPATH_STR('\0')) {
+        // empty string which is just '.'
+        path.len = 1;
+        path.buf[0] = CPATH_STR('.');
+        path.buf[1] = CPATH_STR('\0');
+        return path;
+    }
+
+    path.len = 0;
+    path.buf[0] = CPATH_STR('\0');
+    size_t len = cpath_str_length(str);
+    // NOTE: max path len includes the \0 where as str length doesn't!
+    if (len >= CPATH_MAX_PATH_LEN) {
+        errno = ENAMETOOLONG;
+        return path;
+    }
+#if defined CPATH_UNICODE && defined _MSC_VER
+    mbstowcs_s(&path.len, path.buf, len + 1, str, CPATH_MAX_PATH_LEN);
+    cpathConvertSep(&path);
+#else
+    path.len = cpathStrCpyConv(path.buf, len, str);
+#endif
+    cpathTrim(&path);
+    return path;
+}
+
+_CPATH_FUNC_
+void cpathCopy(cpath *out, const cpath *in) {
+    cpath_str_copy(out->buf, in->buf);
+    out->len = in->len;
+}
+
+_CPATH_FUNC_
+int cpathFromStr(cpath *out, const cpath_char_t *str) {
+    size_t len = cpath_str_length(str);
+    if (len >= CPATH_MAX_PATH_LEN) return 0;
+    if (len == 0) {
+        out->len = 1;
+        out->buf[0] = CPATH_STR('.');
+        out->buf[1] = CPATH_STR('\0');
+        return 1;
+    }
+
+    out->len = cpathStrCpyConv(out->buf, len, str);
+    cpathTrim(out);
+    return 1;
+}
+
+_CPATH_FUNC_
+void cpathAppendSprintf(cpath *out, const cpath_char_t *fmt, ...) {
+    va_list list;
+    va_start(list, fmt);
+    out->len += cpath_vsnprintf(out->buf + out->len,
+                                CPATH_MAX_PATH_LEN - out->len, fmt, list);
+    va_end(list);
+}
+
+_CPATH_FUNC_
+int cpathAppendStrn(cpath *out, const cpath_char_t *other, size_t len) {
+    if (len + out->len >= CPATH_MAX_PATH_LEN) {
+        // path too long, >= cause max path includes CPATH_STR('\0')
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+
+    // This is more efficient than a strcat since it doesn't have to get
+    // the length again it also handles all the conversions well and doesn't
+    // have to retraverse the out->buf which we know is fine.
+    out->len += cpathStrCpyConv(out->buf + out->len, len, other);
+    cpathTrim(out);
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathAppendStr(cpath *out, const cpath_char_t *other) {
+    return cpathAppendStrn(out, other, cpath_str_length(other));
+}
+
+_CPATH_FUNC_
+int cpathAppend(cpath *out, const cpath *other) {
+    return cpathAppendStrn(out, other->buf, other->len);
+}
+
+_CPATH_FUNC_
+int cpathConcatStrn(cpath *out, const cpath_char_t *str, size_t len) {
+    if (len + out->len >= CPATH_MAX_PATH_LEN) {
+        // path too long, >= cause max path includes CPATH_STR('\0')
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+
+    if (out->len > 0 && str[0] != CPATH_SEP &&
+            out->buf[out->len - 1] != CPATH_SEP && str[0] != CPATH_OTHER_SEP &&
+            out->buf[out->len - 1] != CPATH_OTHER_SEP) {
+        out->buf[out->len++] = CPATH_SEP;
+        out->buf[out->len] = CPATH_STR('\0');
+    }
+
+    // This is more efficient than a strcat since it doesn't have to get
+    // the length again it also handles all the conversions well and doesn't
+    // have to retraverse the out->buf which we know is fine.
+    out->len += cpathStrCpyConv(out->buf + out->len, len, str);
+    cpathTrim(out);
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathConcatStr(cpath *out, const cpath_char_t *other) {
+    return cpathConcatStrn(out, other, cpath_str_length(other));
+}
+
+_CPATH_FUNC_
+int cpathConcat(cpath *out, const cpath *other) {
+    return cpathConcatStrn(out, other->buf, other->len);
+}
+
+_CPATH_FUNC_
+int cpathExists(const cpath *path) {
+#if defined _MSC_VER || defined __MINGW32__
+    DWORD res = GetFileAttributes(path->buf);
+    return res != INVALID_FILE_ATTRIBUTES;
+#else
+    /*
+        We can either try to use stat or just access, access is more efficient
+        when not checking permissions.
+
+        struct stat tmp;
+        return stat(path->buf, &tmp) == 0;
+    */
+    return access(path->buf, F_OK) != -1;
+#endif
+}
+
+// Index of the first separator in s[0..n) (or n if there isn't one)
+_CPATH_FUNC_
+size_t _cpathFindSep(const cpath_char_t *s, size_t n) {
+    size_t i = 0;
+#if defined CPATH_SIMD_AVX2
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(s + i));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(v, slash), _mm256_cmpeq_epi8(v, backslash)));
+        if (mask != 0) return i + _cpathCtz(mask);
+    }
+#elif defined CPATH_SIMD_SSE2
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_or_si128(
+            _mm_cmpeq_epi8(v, slash), _mm_cmpeq_epi8(v, backslash)));
+        if (mask != 0) return i + _cpathCtz(mask);
+    }
+#elif defined CPATH_SIMD_NEON
+    const uint8x16_t slash = vdupq_n_u8('/');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)(s + i));
+        uint8x16_t mask = vorrq_u8(vceqq_u8(v, slash), vceqq_u8(v, backslash));
+        if (vmaxvq_u8(mask) != 0) break;
+    }
+#endif
+    for (; i < n; i++) {
+        if (s[i] == CPATH_SEP || s[i] == CPATH_OTHER_SEP) return i;
+    }
+    return n;
+}
+
+// Index of the last separator in s[0..n) (or n if there isn't one)
+_CPATH_FUNC_
+size_t _cpathFindSepRev(const cpath_char_t *s, size_t n) {
+    size_t i = n;
+#if defined CPATH_SIMD_AVX2
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    for (; i >= 32; i -= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(s + i - 32));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(v, slash), _mm256_cmpeq_epi8(v, backslash)));
+        if (mask != 0) return i - 1 - _cpathClz(mask);
+    }
+#elif defined CPATH_SIMD_SSE2
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    for (; i >= 16; i -= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i - 16));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_or_si128(
+            _mm_cmpeq_epi8(v, slash), _mm_cmpeq_epi8(v, backslash)));
+        // mask only has the low 16 bits set
+        if (mask != 0) return i - 1 - (_cpathClz(mask) - 16);
+    }
+#elif defined CPATH_SIMD_NEON
+    const uint8x16_t slash = vdupq_n_u8('/');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    for (; i >= 16; i -= 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)(s + i - 16));
+        uint8x16_t mask = vorrq_u8(vceqq_u8(v, slash), vceqq_u8(v, backslash));
+        if (vmaxvq_u8(mask) != 0) break;
+    }
+#endif
+    while (i > 0) {
+        i--;
+        if (s[i] == CPATH_SEP || s[i] == CPATH_OTHER_SEP) return i;
+    }
+    return n;
+}
+
+// Offsets of each component we've written so '..' can pop in O(1)
+typedef struct _cpath_components_t {
+    int *offsets;
+    size_t cap;
+    int small[64];
+} _cpath_components;
+
+_CPATH_FUNC_
+void _cpathComponentsInit(_cpath_components *stack) {
+    stack->offsets = stack->small;
+    stack->cap = sizeof(stack->small) / sizeof(stack->small[0]);
+}
+
+_CPATH_FUNC_
+void _cpathComponentsFree(_cpath_components *stack) {
+    if (stack->offsets != stack->small) CPATH_FREE(stack->offsets);
+    _cpathComponentsInit(stack);
+}
+
+/*
+    The buffer version of cpathCanonicaliseNoSysCall, out has to have room
+    for atleast len + 2 characters (it can be the same as path)
+    Returns the length or -1 on failure.
+
+    Each component is found with a (vectorised) search for the next
+    separator and copied as a whole, '.' is dropped and '..' pops the
+    last component.  Runs of separators are collapsed.
+*/
+_CPATH_FUNC_
+long _cpathCanonicaliseBuf(cpath_char_t *out, const cpath_char_t *path,
+                           size_t len, _cpath_components *stack) {
+    size_t i = 0;
+    size_t o = 0;
+    size_t depth = 0;
+
+    if (len > 0 && (path[0] == CPATH_SEP || path[0] == CPATH_OTHER_SEP)) {
+        // we keep the root
+        out[o++] = CPATH_SEP;
+    }
+    size_t root = o;
+
+    while (i < len) {
+        while (i < len && (path[i] == CPATH_SEP || path[i] == CPATH_OTHER_SEP)) {
+            i++;
+        }
+        if (i == len) break;
+
+        size_t n = _cpathFindSep(path + i, len - i);
+        if (n == 1 && path[i] == CPATH_STR('.')) {
+            // skip
+        } else if (n == 2 && path[i] == CPATH_STR('.') &&
+                   path[i + 1] == CPATH_STR('.')) {
+            if (depth == 0) {
+                // no directory to go back based on string alone
+                errno = ENOENT;
+                return -1;
+            }
+            o = stack->offsets[--depth];
+        } else {
+            if (depth == stack->cap) {
+                size_t cap = stack->cap * 2;
+                int *offsets = (int*)CPATH_MALLOC(sizeof(int) * cap);
+                if (offsets == NULL) {
+                    errno = ENOMEM;
+                    return -1;
+                }
+                memcpy(offsets, stack->offsets, sizeof(int) * depth);
+                if (stack->offsets != stack->small) CPATH_FREE(stack->offsets);
+                stack->offsets = offsets;
+                stack->cap = cap;
+            }
+            stack->offsets[depth++] = (int)o;
+
+            // NOTE: we never write past i so this works in place
+            if (o > root) out[o++] = CPATH_SEP;
+            memmove(out + o, path + i, sizeof(cpath_char_t) * n);
+            o += n;
+        }
+        i += n;
+    }
+
+    if (o == 0) {
+        out[o++] = CPATH_STR('.');
+    }
+    out[o] = CPATH_STR('\0');
+    return (long)o;
+}
+
+_CPATH_FUNC_
+int cpathCanonicaliseNoSysCall(cpath *out, cpath *path) {
+    /*
+        NOTE: This should work even if out == path
+                    It just has been written that way.
+    */
+    if (path == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    _cpath_components stack;
+    _cpathComponentsInit(&stack);
+    long len = _cpathCanonicaliseBuf(out->buf, path->buf, path->len, &stack);
+    _cpathComponentsFree(&stack);
+    if (len < 0) {
+        out->len = 0;
+        return 0;
+    }
+    out->len = (size_t)len;
+    return 1;
+}
+
+_CPATH_FUNC_
+size_t cpathCanonicaliseNoSysCallBatch(cpath *paths, size_t n, int *ok) {
+    if (paths == NULL && n > 0) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    // one scratch buffer and component stack for the whole batch
+    // the scratch means a path that fails is left untouched
+    cpath_char_t *tmp =
+        (cpath_char_t*)CPATH_MALLOC(sizeof(cpath_char_t) * CPATH_MAX_PATH_LEN);
+    if (tmp == NULL) {
+        errno = ENOMEM;
+        return 0;
+    }
+    _cpath_components stack;
+    _cpathComponentsInit(&stack);
+
+    size_t succeeded = 0;
+    for (size_t i = 0; i < n; i++) {
+        long len = -1;
+        if (paths[i].len + 1 < CPATH_MAX_PATH_LEN) {
+            len = _cpathCanonicaliseBuf(tmp, paths[i].buf, paths[i].len,
+                                        &stack);
+        }
+        if (len >= 0) {
+            memcpy(paths[i].buf, tmp, sizeof(cpath_char_t) * (len + 1));
+            paths[i].len = (size_t)len;
+            succeeded++;
+        }
+        if (ok != NULL) ok[i] = len >= 0;
+    }
+
+    _cpathComponentsFree(&stack);
+    CPATH_FREE(tmp);
+    return succeeded;
+}
+
+_CPATH_FUNC_
+int cpathCanonicalise(cpath *out, cpath *path) {
+    cpath tmp;
+    if (out == path) {
+        // support non-restrict method
+        cpathCopy(&tmp, path);
+        path = &tmp;
+    }
+
+#if defined _MSC_VER
+    DWORD size = GetFullPathName(path->buf, CPATH_MAX_PATH_LEN, out->buf, NULL);
+    if (size == 0) {
+        // figure out errno
+        return 0;
+    } else {
+        path->len = size;
+        return 1;
+    }
+#else
+    char *res = realpath(path->buf, out->buf);
+    if (res != NULL) {
+        out->len = cpath_str_length(out->buf);
+    }
+    return res != NULL;
+#endif
+}
+
+_CPATH_FUNC_
+int cpathCanonicaliseAvoidSysCall(cpath *out, cpath *path) {
+    if (!cpathCanonicaliseNoSysCall(out, path)) {
+        return cpathCanonicalise(out, path);
+    }
+    return 1;
+}
+
+_CPATH_FUNC_
+void cpathClear(cpath *path) {
+    path->buf[0] = CPATH_STR('.');
+    path->buf[1] = CPATH_STR('\0');
+    path->len = 1;
+}
+
+_CPATH_FUNC_
+const cpath_char_t *cpathItRef(cpath *path, int *index) {
+    if (path == NULL || index == NULL || *index >= path->len || *index < 0) {
+        return NULL;
+    }
+
+    if (path->buf[*index] == CPATH_STR('\0')) {
+        path->buf[*index] = CPATH_SEP;
+        (*index)++;
+    }
+    int old_pos = *index;
+
+    // find next '/'
+    while (*index < path->len && path->buf[*index] != CPATH_SEP &&
+                 path->buf[*index] != CPATH_OTHER_SEP) {
+        (*index)++;
+    }
+
+    path->buf[*index] = '\0';
+
+    return &path->buf[old_pos];
+}
+
+_CPATH_FUNC_
+void cpathItRefRestore(cpath *path, int *index) {
+    if (path == NULL) return;
+
+    if (index == NULL || *index < 0 || *index >= path->len ||
+            path->buf[*index] != CPATH_STR('\0')) {
+        // we have to loop
+        for (int i = 0; i < path->len; i++) {
+            if (path->buf[i] == CPATH_STR('\0')) path->buf[i] = CPATH_SEP;
+        }
+        // set index to the length since we have no real way to determine
+        // where abouts it its (that is if it isn't null)
+        if (index != NULL) *index = path->len;
+    } else {
+        path->buf[*index] = CPATH_SEP;
+        (*index)++;
+    }
+}
+
+_CPATH_FUNC_
+void cpathComponentItInitStrn(cpath_component_it *it, const cpath_char_t *str,
+                              size_t len) {
+    it->buf = str;
+    it->front = 0;
+    it->back = len;
+    it->root = len > 0 && (str[0] == CPATH_SEP || str[0] == CPATH_OTHER_SEP);
+}
+
+_CPATH_FUNC_
+void cpathComponentItInit(cpath_component_it *it, const cpath *path) {
+    cpathComponentItInitStrn(it, path->buf, path->len);
+}
+
+_CPATH_FUNC_
+int cpathComponentItNext(cpath_component_it *it, cpath_component *out) {
+    if (it->front == 0 && it->root && it->back > 0) {
+        out->str = it->buf;
+        out->len = 1;
+        it->front = 1;
+        return 1;
+    }
+
+    while (it->front < it->back && (it->buf[it->front] == CPATH_SEP ||
+                                    it->buf[it->front] == CPATH_OTHER_SEP)) {
+        it->front++;
+    }
+    if (it->front >= it->back) return 0;
+
+    size_t n = _cpathFindSep(it->buf + it->front, it->back - it->front);
+    out->str = it->buf + it->front;
+    out->len = n;
+    it->front += n;
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathComponentItPrev(cpath_component_it *it, cpath_component *out) {
+    // never treat the root as a trailing separator
+    size_t start = it->front > it->root ? it->front : it->root;
+    while (it->back > start && (it->buf[it->back - 1] == CPATH_SEP ||
+                                it->buf[it->back - 1] == CPATH_OTHER_SEP)) {
+        it->back--;
+    }
+    if (it->back <= it->front) return 0;
+
+    if (it->back == it->root) {
+        out->str = it->buf;
+        out->len = 1;
+        it->back = 0;
+        return 1;
+    }
+
+    size_t n = it->back - start;
+    size_t sep = _cpathFindSepRev(it->buf + start, n);
+    size_t begin = sep == n ? start : start + sep + 1;
+    out->str = it->buf + begin;
+    out->len = it->back - begin;
+    it->back = begin;
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathComponentEq(const cpath_component *a, const cpath_component *b) {
+    if (a->len != b->len) return 0;
+    // the root is any separator
+    if (a->len == 1 && (a->str[0] == CPATH_SEP || a->str[0] == CPATH_OTHER_SEP)) {
+        return b->str[0] == CPATH_SEP || b->str[0] == CPATH_OTHER_SEP;
+    }
+    return !cpath_str_compare_safe(a->str, b->str, a->len);
+}
+
+_CPATH_FUNC_
+int _cpathStartsWithStrn(const cpath_char_t *path, size_t pathLen,
+                         const cpath_char_t *prefix, size_t prefixLen) {
+    cpath_component_it pathIt, prefixIt;
+    cpath_component a, b;
+    cpathComponentItInitStrn(&pathIt, path, pathLen);
+    cpathComponentItInitStrn(&prefixIt, prefix, prefixLen);
+    while (cpathComponentItNext(&prefixIt, &b)) {
+        if (!cpathComponentItNext(&pathIt, &a) || !cpathComponentEq(&a, &b)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathStartsWith(const cpath *path, const cpath *prefix) {
+    if (path == NULL || prefix == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    return _cpathStartsWithStrn(path->buf, path->len, prefix->buf, prefix->len);
+}
+
+#define _CPATH_HASH_INIT (14695981039346656037ULL)
+
+// FNV-1a, can be done incrementally
+_CPATH_FUNC_
+uint64_t _cpathHashStep(uint64_t hash, const cpath_char_t *str, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint64_t)str[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+#if defined CPATH_HAS_OPENAT
+
+// how many symlinks we follow before giving up (same as linux)
+#define _CPATH_MAX_LINKS (40)
+
+// 0 marks an empty slot so a hash can't be 0
+#define _CPATH_RESOLVER_HASH(hash) ((hash) != 0 ? (hash) : 1)
+
+_CPATH_FUNC_
+void cpathResolverInit(cpath_resolver *resolver) {
+    resolver->entries = NULL;
+    resolver->size = 0;
+    resolver->cap = 0;
+    resolver->names = NULL;
+    resolver->namesLen = 0;
+    resolver->namesCap = 0;
+    resolver->cwd.len = 0;
+    resolver->cwd.buf[0] = CPATH_STR('\0');
+}
+
+_CPATH_FUNC_
+void cpathResolverFree(cpath_resolver *resolver) {
+    if (resolver->entries != NULL) CPATH_FREE(resolver->entries);
+    if (resolver->names != NULL) CPATH_FREE(resolver->names);
+    cpathResolverInit(resolver);
+}
+
+_CPATH_FUNC_
+void cpathResolverClear(cpath_resolver *resolver) {
+    if (resolver->entries != NULL) {
+        memset(resolver->entries, 0,
+               sizeof(cpath_resolver_entry) * resolver->cap);
+    }
+    resolver->size = 0;
+    resolver->namesLen = 0;
+    resolver->cwd.len = 0;
+}
+
+// Returns either the entry for key or the empty slot it would go in
+_CPATH_FUNC_
+cpath_resolver_entry *_cpathResolverFind(cpath_resolver *resolver,
+                                         uint64_t hash, const cpath_char_t *key,
+                                         size_t keyLen) {
+    if (resolver->cap == 0) return NULL;
+
+    size_t mask = resolver->cap - 1;
+    for (size_t i = (size_t)hash & mask;; i = (i + 1) & mask) {
+        cpath_resolver_entry *entry = &resolver->entries[i];
+        if (entry->hash == 0) return entry;
+        if (entry->hash == hash && entry->keyLen == keyLen &&
+                !memcmp(resolver->names + entry->key, key,
+                        sizeof(cpath_char_t) * keyLen)) {
+            return entry;
+        }
+    }
+}
+
+_CPATH_FUNC_
+int _cpathResolverAppend(cpath_resolver *resolver, const cpath_char_t *str,
+                         size_t len, size_t *offset) {
+    if (resolver->namesLen + len > resolver->namesCap) {
+        size_t cap = resolver->namesCap > 0 ? resolver->namesCap * 2 : 4096;
+        while (cap < resolver->namesLen + len) cap *= 2;
+
+        cpath_char_t *names =
+            (cpath_char_t*)CPATH_MALLOC(sizeof(cpath_char_t) * cap);
+        if (names == NULL) {
+            errno = ENOMEM;
+            return 0;
+        }
+        if (resolver->names != NULL) {
+            memcpy(names, resolver->names,
+                   sizeof(cpath_char_t) * resolver->namesLen);
+            CPATH_FREE(resolver->names);
+        }
+        resolver->names = names;
+        resolver->namesCap = cap;
+    }
+
+    memcpy(resolver->names + resolver->namesLen, str, sizeof(cpath_char_t) * len);
+    *offset = resolver->namesLen;
+    resolver->namesLen += len;
+    return 1;
+}
+
+_CPATH_FUNC_
+int _cpathResolverRehash(cpath_resolver *resolver, size_t cap) {
+    cpath_resolver_entry *entries = (cpath_resolver_entry*)CPATH_MALLOC(
+        sizeof(cpath_resolver_entry) * cap);
+    if (entries == NULL) {
+        errno = ENOMEM;
+        return 0;
+    }
+    memset(entries, 0, sizeof(cpath_resolver_entry) * cap);
+
+    for (size_t i = 0; i < resolver->cap; i++) {
+        cpath_resolver_entry *entry = &resolver->entries[i];
+        if (entry->hash == 0) continue;
+
+        size_t j = (size_t)entry->hash & (cap - 1);
+        while (entries[j].hash != 0) j = (j + 1) & (cap - 1);
+        entries[j] = *entry;
+    }
+
+    if (resolver->entries != NULL) CPATH_FREE(resolver->entries);
+    resolver->entries = entries;
+    resolver->cap = cap;
+    return 1;
+}
+
+_CPATH_FUNC_
+int _cpathResolverInsert(cpath_resolver *resolver, uint64_t hash,
+                         const cpath_char_t *key, size_t keyLen,
+                         const cpath_char_t *value, size_t valueLen) {
+    // keep the load factor under a half
+    if ((resolver->size + 1) * 2 > resolver->cap &&
+            !_cpathResolverRehash(resolver,
+                                  resolver->cap > 0 ? resolver->cap * 2 : 64)) {
+        return 0;
+    }
+
+    cpath_resolver_entry *entry =
+        _cpathResolverFind(resolver, hash, key, keyLen);
+    if (entry->hash == 0) {
+        if (!_cpathResolverAppend(resolver, key, keyLen, &entry->key)) {
+            return 0;
+        }
+        entry->keyLen = keyLen;
+        resolver->size++;
+    }
+    if (!_cpathResolverAppend(resolver, value, valueLen, &entry->value)) {
+        if (entry->hash == 0) resolver->size--;
+        return 0;
+    }
+    entry->valueLen = valueLen;
+    entry->hash = hash;
+    return 1;
+}
+
+// Appends the components of str onto the key (skipping empty and '.' ones)
+_CPATH_FUNC_
+long _cpathResolverKeyAppend(cpath_char_t *key, size_t len,
+                             const cpath_char_t *str, size_t strLen) {
+    cpath_component_it it;
+    cpath_component c;
+    cpathComponentItInitStrn(&it, str, strLen);
+    while (cpathComponentItNext(&it, &c)) {
+        if (c.str == str && it.root) continue;
+        if (c.len == 1 && c.str[0] == CPATH_STR('.')) continue;
+
+        if (len + 1 + c.len >= CPATH_MAX_PATH_LEN) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if (len > 1) key[len++] = CPATH_SEP;
+        memcpy(key + len, c.str, sizeof(cpath_char_t) * c.len);
+        len += c.len;
+    }
+    return (long)len;
+}
+
+/*
+    The key for a path is the absolute path with all the empty and '.'
+    components dropped, it isn't resolved at all.
+*/
+_CPATH_FUNC_
+long _cpathResolverKey(cpath_resolver *resolver, const cpath *path,
+                       cpath_char_t *key) {
+    long len = 1;
+    key[0] = CPATH_SEP;
+    if (path->len == 0 || (path->buf[0] != CPATH_SEP &&
+                           path->buf[0] != CPATH_OTHER_SEP)) {
+        if (resolver->cwd.len == 0) cpathWriteCwd(&resolver->cwd);
+        len = _cpathResolverKeyAppend(key, len, resolver->cwd.buf,
+                                      resolver->cwd.len);
+        if (len < 0) return -1;
+    }
+    len = _cpathResolverKeyAppend(key, len, path->buf, path->len);
+    if (len >= 0) key[len] = CPATH_STR('\0');
+    return len;
+}
+
+// Drops the last component of an absolute path
+_CPATH_FUNC_
+size_t _cpathResolverPop(const cpath_char_t *path, size_t len) {
+    while (len > 1 && path[len - 1] != CPATH_SEP) len--;
+    return len > 1 ? len - 1 : len;
+}
+
+_CPATH_FUNC_
+int cpathResolve(cpath_resolver *resolver, cpath *out, const cpath *path) {
+    if (resolver == NULL || out == NULL || path == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    cpath_char_t key[CPATH_MAX_PATH_LEN];
+    long keyLen = _cpathResolverKey(resolver, path, key);
+    if (keyLen < 0) return 0;
+
+    // find the longest prefix we've already resolved
+    cpath_char_t resolved[CPATH_MAX_PATH_LEN];
+    size_t resolvedLen = 1;
+    resolved[0] = CPATH_SEP;
+    size_t best = 1;
+    uint64_t hash = _cpathHashStep(_CPATH_HASH_INIT, key, 1);
+    uint64_t bestHash = hash;
+    for (size_t i = 1; i <= (size_t)keyLen; i++) {
+        if (i == (size_t)keyLen || key[i] == CPATH_SEP) {
+            cpath_resolver_entry *entry = _cpathResolverFind(
+                resolver, _CPATH_RESOLVER_HASH(hash), key, i);
+            if (entry != NULL && entry->hash != 0) {
+                best = i;
+                bestHash = hash;
+                resolvedLen = entry->valueLen;
+                memcpy(resolved, resolver->names + entry->value,
+                       sizeof(cpath_char_t) * resolvedLen);
+            }
+        }
+        if (i < (size_t)keyLen) hash = _cpathHashStep(hash, key + i, 1);
+    }
+
+    /*
+        The rest of the key goes at the end of the work buffer so symlink
+        targets can be put in front of it as we hit them, `untouched` is
+        where the original rest of the key starts (so we know when we are
+        back to resolving a prefix of the key).
+    */
+    cpath_char_t work[CPATH_MAX_PATH_LEN * 2];
+    cpath_char_t link[CPATH_MAX_PATH_LEN];
+    const size_t workLen = sizeof(work) / sizeof(work[0]);
+    size_t cursor = workLen - ((size_t)keyLen - best);
+    size_t untouched = cursor;
+    memcpy(work + cursor, key + best, sizeof(cpath_char_t) * (keyLen - best));
+
+    size_t hashed = best;
+    hash = bestHash;
+    int links = 0;
+    while (cursor < workLen) {
+        while (cursor < workLen && (work[cursor] == CPATH_SEP ||
+                                    work[cursor] == CPATH_OTHER_SEP)) {
+            cursor++;
+        }
+        if (cursor == workLen) break;
+
+        const cpath_char_t *name = work + cursor;
+        size_t n = _cpathFindSep(name, workLen - cursor);
+        cursor += n;
+
+        if (n == 1 && name[0] == CPATH_STR('.')) {
+            continue;
+        } else if (n == 2 && name[0] == CPATH_STR('.') &&
+                   name[1] == CPATH_STR('.')) {
+            // resolved never has symlinks so this is safe
+            resolvedLen = _cpathResolverPop(resolved, resolvedLen);
+        } else {
+            if (resolvedLen + 1 + n >= CPATH_MAX_PATH_LEN) {
+                errno = ENAMETOOLONG;
+                return 0;
+            }
+            if (resolvedLen > 1) resolved[resolvedLen++] = CPATH_SEP;
+            memcpy(resolved + resolvedLen, name, sizeof(cpath_char_t) * n);
+            resolvedLen += n;
+            resolved[resolvedLen] = CPATH_STR('\0');
+
+            CPATH_SYSCALL_HOOK("link");
+            ssize_t linkLen = readlinkat(AT_FDCWD, resolved, link,
+                                         sizeof(link) / sizeof(link[0]));
+            if (linkLen < 0) {
+                // EINVAL just means it isn't a symlink
+                if (errno != EINVAL) return 0;
+            } else {
+                if (++links > _CPATH_MAX_LINKS) {
+                    errno = ELOOP;
+                    return 0;
+                }
+                if ((size_t)linkLen >= sizeof(link) / sizeof(link[0]) ||
+                        (size_t)linkLen > cursor) {
+                    errno = ENAMETOOLONG;
+                    return 0;
+                }
+
+                resolvedLen = _cpathResolverPop(resolved, resolvedLen);
+                if (link[0] == CPATH_SEP) resolvedLen = 1;
+
+                // everything from cursor onwards is still original
+                if (cursor > untouched) untouched = cursor;
+                cursor -= (size_t)linkLen;
+                memcpy(work + cursor, link, sizeof(cpath_char_t) * linkLen);
+                continue;
+            }
+        }
+
+        if (cursor >= untouched) {
+            // we've resolved another prefix of the key so remember it
+            // NOTE: the cache is best effort so we don't care if it fails
+            size_t end = (size_t)keyLen - (workLen - cursor);
+            hash = _cpathHashStep(hash, key + hashed, end - hashed);
+            hashed = end;
+            _cpathResolverInsert(resolver, _CPATH_RESOLVER_HASH(hash), key,
+                                 end, resolved, resolvedLen);
+        }
+    }
+
+    memcpy(out->buf, resolved, sizeof(cpath_char_t) * resolvedLen);
+    out->buf[resolvedLen] = CPATH_STR('\0');
+    out->len = resolvedLen;
+    return 1;
+}
+
+_CPATH_FUNC_
+size_t cpathResolverInvalidate(cpath_resolver *resolver, const cpath *prefix) {
+    if (resolver == NULL || prefix == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    cpath_char_t key[CPATH_MAX_PATH_LEN];
+    long keyLen = _cpathResolverKey(resolver, prefix, key);
+    if (keyLen < 0) return 0;
+
+    // rebuild the table which also compacts the names
+    cpath_resolver old = *resolver;
+    resolver->entries = NULL;
+    resolver->size = 0;
+    resolver->cap = 0;
+    resolver->names = NULL;
+    resolver->namesLen = 0;
+    resolver->namesCap = 0;
+
+    size_t removed = 0;
+    for (size_t i = 0; i < old.cap; i++) {
+        cpath_resolver_entry *entry = &old.entries[i];
+        if (entry->hash == 0) continue;
+
+        // either the key went through the prefix or it resolved under it
+        if (_cpathStartsWithStrn(old.names + entry->key, entry->keyLen,
+                                 key, (size_t)keyLen) ||
+                _cpathStartsWithStrn(old.names + entry->value,
+                                     entry->valueLen, key, (size_t)keyLen)) {
+            removed++;
+            continue;
+        }
+        _cpathResolverInsert(resolver, entry->hash,
+                             old.names + entry->key, entry->keyLen,
+                             old.names + entry->value, entry->valueLen);
+    }
+
+    if (old.entries != NULL) CPATH_FREE(old.entries);
+    if (old.names != NULL) CPATH_FREE(old.names);
+    return removed;
+}
+#endif
+
+_CPATH_FUNC_
+int cpathUpDir(cpath *path) {
+    if (path->len == 0) {
+        // shouldn't have a path with this length
+        errno = EINVAL;
+        return 0;
+    }
+
+    // We have to find the last component and strip it
+    int oldLen = path->len;
+    while (path->len > 1 && path->buf[path->len - 1] != CPATH_SEP &&
+                 path->buf[path->len - 1] != CPATH_SEP) {
         path->len--;
     }
-    path->buf[path->len] = CPATH_STR('\0');
+    if (path->len == 1) {
+        // we failed to quickly go up a dir
+        // so we will have to restore len and try another method
+        // this is better than the avoid method because
+        // this will allow you to go up a directory if the path == PATH_MAX
+        path->len = oldLen;
+        if (!CPATH_CONCAT_LIT(path, "..")) {
+            return 0;
+        }
+        return cpathCanonicalise(path, path);
+    }
+
+    // we have found a '/' so we just set it to '\0'
+    path->buf[path->len - 1] = '\0';
+    path->len--;
+    return 1;
+}
+
+_CPATH_FUNC_
+void cpathConvertSepCustom(cpath *path, cpath_char_t sep) {
+    path->len = _cpathSepConv(path->buf, path->buf, path->len + 1, sep) - 1;
+}
+
+/* == Variable Length Path == */
+
+_CPATH_FUNC_
+void cpathVPathInit(cpath_vpath *path) {
+    path->buf = NULL;
+    path->len = 0;
+    path->cap = 0;
+    path->small[0] = CPATH_STR('\0');
+}
+
+_CPATH_FUNC_
+void cpathVPathFree(cpath_vpath *path) {
+    if (path == NULL) return;
+    if (path->buf != NULL) CPATH_FREE(path->buf);
+    cpathVPathInit(path);
+}
+
+_CPATH_FUNC_
+const cpath_char_t *cpathVPathStr(const cpath_vpath *path) {
+    return path->buf != NULL ? path->buf : path->small;
+}
+
+_CPATH_FUNC_
+cpath_char_t *_cpathVPathBuf(cpath_vpath *path) {
+    return path->buf != NULL ? path->buf : path->small;
+}
+
+// make sure there is room for len characters (and the '\0')
+_CPATH_FUNC_
+int _cpathVPathReserve(cpath_vpath *path, size_t len) {
+    if (path->buf == NULL && len < CPATH_VPATH_INLINE_LEN) return 1;
+    if (path->buf != NULL && len <= path->cap) return 1;
+
+    size_t cap = path->buf == NULL ? CPATH_VPATH_INLINE_LEN * 2 : path->cap * 2;
+    if (cap < len) cap = len;
+    cpath_char_t *buf =
+        (cpath_char_t*)CPATH_MALLOC(sizeof(cpath_char_t) * (cap + 1));
+    if (buf == NULL) {
+        errno = ENOMEM;
+        return 0;
+    }
+    memcpy(buf, cpathVPathStr(path), sizeof(cpath_char_t) * (path->len + 1));
+    if (path->buf != NULL) CPATH_FREE(path->buf);
+    path->buf = buf;
+    path->cap = cap;
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathVPathFromStr(cpath_vpath *out, const cpath_char_t *str) {
+    out->len = 0;
+    _cpathVPathBuf(out)[0] = CPATH_STR('\0');
+    if (str[0] == CPATH_STR('\0')) {
+        return cpathVPathAppendStrn(out, CPATH_STR("."), 1);
+    }
+    return cpathVPathAppendStrn(out, str, cpath_str_length(str));
+}
+
+_CPATH_FUNC_
+int cpathVPathFromPath(cpath_vpath *out, const cpath *path) {
+    if (!_cpathVPathReserve(out, path->len)) return 0;
+    memcpy(_cpathVPathBuf(out), path->buf,
+           sizeof(cpath_char_t) * (path->len + 1));
+    out->len = path->len;
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathVPathToPath(const cpath_vpath *path, cpath *out) {
+    if (path->len >= CPATH_MAX_PATH_LEN) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    memcpy(out->buf, cpathVPathStr(path),
+           sizeof(cpath_char_t) * (path->len + 1));
+    out->len = path->len;
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathVPathCopy(cpath_vpath *out, const cpath_vpath *in) {
+    if (out == in) return 1;
+    if (!_cpathVPathReserve(out, in->len)) return 0;
+    memcpy(_cpathVPathBuf(out), cpathVPathStr(in),
+           sizeof(cpath_char_t) * (in->len + 1));
+    out->len = in->len;
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathVPathAppendStrn(cpath_vpath *out, const cpath_char_t *other,
+                         size_t len) {
+    if (!_cpathVPathReserve(out, out->len + len)) return 0;
+    cpath_char_t *buf = _cpathVPathBuf(out);
+    out->len += cpathStrCpyConv(buf + out->len, len, other);
+    out->len = _cpathTrimBuf(buf, out->len);
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathVPathAppend(cpath_vpath *out, const cpath_vpath *other) {
+    return cpathVPathAppendStrn(out, cpathVPathStr(other), other->len);
+}
+
+_CPATH_FUNC_
+int cpathVPathConcatStrn(cpath_vpath *out, const cpath_char_t *str,
+                         size_t len) {
+    if (!_cpathVPathReserve(out, out->len + len + 1)) return 0;
+    cpath_char_t *buf = _cpathVPathBuf(out);
+    if (out->len > 0 && str[0] != CPATH_SEP &&
+            buf[out->len - 1] != CPATH_SEP && str[0] != CPATH_OTHER_SEP &&
+            buf[out->len - 1] != CPATH_OTHER_SEP) {
+        buf[out->len++] = CPATH_SEP;
+        buf[out->len] = CPATH_STR('\0');
+    }
+
+    out->len += cpathStrCpyConv(buf + out->len, len, str);
+    out->len = _cpathTrimBuf(buf, out->len);
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathVPathConcatStr(cpath_vpath *out, const cpath_char_t *other) {
+    return cpathVPathConcatStrn(out, other, cpath_str_length(other));
+}
+
+_CPATH_FUNC_
+int cpathVPathConcat(cpath_vpath *out, const cpath_vpath *other) {
+    return cpathVPathConcatStrn(out, cpathVPathStr(other), other->len);
+}
+
+_CPATH_FUNC_
+int cpathVPathCanonicaliseNoSysCall(cpath_vpath *out, const cpath_vpath *path) {
+    // canonicalising never makes the path longer (other than the '.')
+    if (!_cpathVPathReserve(out, path->len + 1)) return 0;
+    _cpath_components stack;
+    _cpathComponentsInit(&stack);
+    long len = _cpathCanonicaliseBuf(_cpathVPathBuf(out), cpathVPathStr(path),
+                                     path->len, &stack);
+    _cpathComponentsFree(&stack);
+    if (len < 0) {
+        out->len = 0;
+        _cpathVPathBuf(out)[0] = CPATH_STR('\0');
+        return 0;
+    }
+    out->len = (size_t)len;
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathVPathUpDir(cpath_vpath *path) {
+    if (path->len == 0) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    cpath_char_t *buf = _cpathVPathBuf(path);
+    size_t len = path->len;
+    while (len > 1 && buf[len - 1] != CPATH_SEP &&
+                 buf[len - 1] != CPATH_OTHER_SEP) {
+        len--;
+    }
+    if (len > 1) {
+        // we have found a '/' so we just set it to '\0'
+        buf[len - 1] = CPATH_STR('\0');
+        path->len = len - 1;
+        return 1;
+    }
+
+    // nothing to strip (i.e. a, .. or /a) so resolve it by adding ..
+    if (!cpathVPathConcatStrn(path, CPATH_STR(".."), 2)) return 0;
+    cpath_vpath tmp;
+    cpathVPathInit(&tmp);
+    if (cpathVPathCanonicaliseNoSysCall(&tmp, path)) {
+        cpathVPathCopy(path, &tmp);
+    }
+    cpathVPathFree(&tmp);
+    return 1;
+}
+
+/* == File System == */
+
+/*
+    Get the current working directory allocating the space
+*/
+_CPATH_FUNC_
+cpath_char_t *cpathGetCwdAlloc() {
+    cpath_char_t *buf;
+    buf = (cpath_char_t*)CPATH_MALLOC(sizeof(cpath_char_t) * CPATH_MAX_PATH_LEN);
+    return cpathGetCwdBuf(buf, CPATH_MAX_PATH_LEN);
+}
+
+_CPATH_FUNC_
+cpath_char_t *cpathGetCwdBuf(cpath_char_t *buf, size_t size) {
+    return _cpath_getcwd(buf, size);
+}
+
+_CPATH_FUNC_
+void cpathWriteCwd(cpath *path) {
+    cpathGetCwdBuf(path->buf, CPATH_MAX_PATH_LEN);
+    path->len = cpath_str_length(path->buf);
+    cpathTrim(path);
+}
+
+_CPATH_FUNC_
+cpath cpathGetCwd() {
+    cpath path;
+    cpathWriteCwd(&path);
+    cpathTrim(&path);
+    return path;
+}
+
+#if defined CPATH_GETDENTS
+_CPATH_FUNC_
+cpath_dirent_t *_cpathGetdentsNext(cpath_dir *dir) {
+    if (dir->bufPos >= dir->bufLen) {
+        CPATH_SYSCALL_HOOK("read");
+        long read = syscall(SYS_getdents64, dir->fd, dir->buf, dir->bufSize);
+        if (read <= 0) {
+            // 0 is the end of the directory, < 0 is an error (errno is set)
+            dir->bufPos = 0;
+            dir->bufLen = 0;
+            return NULL;
+        }
+        dir->bufPos = 0;
+        dir->bufLen = (size_t)read;
+    }
+
+    cpath_dirent_t *dirent = (cpath_dirent_t*)(dir->buf + dir->bufPos);
+    dir->bufPos += dirent->d_reclen;
+
+    // The name is \0 terminated and then padded to 8 bytes but the kernel
+    // doesn't clear the padding, so the terminator has to be in the last
+    // 8 bytes of the record, this lets us avoid a strlen.
+    size_t nameOffset = offsetof(cpath_dirent_t, d_name);
+    size_t start = dirent->d_reclen > nameOffset + 8
+                 ? dirent->d_reclen - nameOffset - 8 : 0;
+    const char *end = (const char*)memchr(dirent->d_name + start, '\0',
+                                          dirent->d_reclen - nameOffset - start);
+    dir->direntLen = end != NULL ? (size_t)(end - dirent->d_name)
+                                 : strlen(dirent->d_name);
+    return dirent;
+}
+#endif
+
+#if defined CPATH_HAS_OPENAT
+_CPATH_FUNC_
+int _cpathDirFd(cpath_dir *dir) {
+#if defined CPATH_GETDENTS
+    return dir->fd;
+#else
+    return dirfd(dir->dir);
+#endif
+}
+#endif
+
+_CPATH_FUNC_
+int cpathOpenDir(cpath_dir *dir, const cpath *path) {
+    if (dir == NULL || path == NULL || path->len == 0) {
+        // empty strings are invalid arguments
+        errno = EINVAL;
+        return 0;
+    }
+
+    if (path->len + CPATH_PATH_EXTRA_CHARS >= CPATH_MAX_PATH_LEN) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+
+    dir->files = NULL;
+
+#if defined _MSC_VER
+    dir->handle = INVALID_HANDLE_VALUE;
+#elif defined CPATH_GETDENTS
+    dir->fd = -1;
+    dir->buf = NULL;
+    dir->bufSize = 0;
+    dir->ownsBuf = 0;
+#else
+    dir->dir = NULL;
+#endif
+    dir->path.buf[path->len] = CPATH_STR('\0');
+    dir->parent = NULL;
+    dir->pool = NULL;
+    dir->deferStat = 0;
+    dir->files = NULL;
+#if defined _MSC_VER
+    dir->handle = INVALID_HANDLE_VALUE;
+#else
+#if !defined CPATH_GETDENTS
+    dir->dir = NULL;
+#endif
+    dir->dirent = NULL;
+#endif
+
+    cpathCopy(&dir->path, path);
+    return cpathRestartDir(dir);
+}
+
+#if defined CPATH_GETDENTS
+_CPATH_FUNC_
+int cpathOpenDirBuf(cpath_dir *dir, const cpath *path, void *buf, size_t size) {
+    if (dir == NULL || path == NULL || path->len == 0 || buf == NULL ||
+            size < sizeof(cpath_dirent_t)) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    if (path->len + CPATH_PATH_EXTRA_CHARS >= CPATH_MAX_PATH_LEN) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+
+    dir->files = NULL;
+    dir->parent = NULL;
+    dir->pool = NULL;
+    dir->deferStat = 0;
+    dir->fd = -1;
+    dir->buf = (char*)buf;
+    dir->bufSize = size;
+    dir->ownsBuf = 0;
+    dir->dirent = NULL;
+
+    cpathCopy(&dir->path, path);
+    return cpathRestartDir(dir);
+}
+#endif
+
+_CPATH_FUNC_
+int cpathRestartDir(cpath_dir *dir) {
+    if (dir == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    dir->hasNext = 1;
+    dir->size = -1;
+    if (dir->files != NULL) CPATH_FREE(dir->files);
+    dir->files = NULL;
+
+#if defined _MSC_VER
+    if (dir->handle != INVALID_HANDLE_VALUE) FindClose(dir->handle);
+    dir->handle = INVALID_HANDLE_VALUE;
+#elif defined CPATH_GETDENTS
+    // no need to reopen we can just rewind the descriptor
+    dir->dirent = NULL;
+    dir->bufPos = 0;
+    dir->bufLen = 0;
+#else
+    // no need to reopen we can just rewind the handle
+    dir->dirent = NULL;
+#endif
+
+    // Ignore parent, just restart this dir
+
+#if defined _MSC_VER
+    cpath_char_t pathBuf[CPATH_MAX_PATH_LEN];
+    cpath_str_copy(pathBuf, dir->path);
+    cpath_str_cat(pathBuf, CPATH_STR("\\*"));
+
+    CPATH_SYSCALL_HOOK("open");
+#if (defined WINAPI_FAMILY) && (WINAPI_FAMILY != WINAPI_FAMILY_DESKTOP_APP)
+    dir->handle = FindFirstFileEx(path_buf, FindExInfoStandard, &dir->findData,
+                                                                FindExSearchNameMatch, NULL, 0);
+#else
+    dir->handle = FindFirstFile(path_buf, &dir->findData);
+#endif
+
+    if (dir->handle == INVALID_HANDLE_VALUE) {
+        errno = ENOENT;
+        // free associate memory and exit
+        cpathCloseDir(dir);
+        return 0;
+    }
+
+#elif defined CPATH_GETDENTS
+
+    if (dir->fd >= 0) {
+        CPATH_SYSCALL_HOOK("rewind");
+        if (lseek(dir->fd, 0, SEEK_SET) == -1) {
+            cpathCloseDir(dir);
+            return 0;
+        }
+    } else {
+        CPATH_SYSCALL_HOOK("open");
+        dir->fd = open(dir->path.buf, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir->fd == -1) {
+            cpathCloseDir(dir);
+            return 0;
+        }
+    }
+
+    if (dir->buf == NULL) {
+        dir->buf = (char*)CPATH_MALLOC(CPATH_GETDENTS_BUF_SIZE);
+        if (dir->buf == NULL) {
+            cpathCloseDir(dir);
+            errno = ENOMEM;
+            return 0;
+        }
+        dir->bufSize = CPATH_GETDENTS_BUF_SIZE;
+        dir->ownsBuf = 1;
+    }
+
+    dir->dirent = _cpathGetdentsNext(dir);
+    // empty directory
+    if (dir->dirent == NULL) dir->hasNext = 0;
+
+#else
+
+    if (dir->dir != NULL) {
+        CPATH_SYSCALL_HOOK("rewind");
+        _cpath_rewinddir(dir->dir);
+    } else {
+        CPATH_SYSCALL_HOOK("open");
+        dir->dir = _cpath_opendir(dir->path.buf);
+        if (dir->dir == NULL) {
+            cpathCloseDir(dir);
+            return 0;
+        }
+    }
+    CPATH_SYSCALL_HOOK("read");
+    dir->dirent = _cpath_readdir(dir->dir);
+    // empty directory
+    if (dir->dirent == NULL) dir->hasNext = 0;
+
+#endif
+
+    return 1;
+}
+
+_CPATH_FUNC_
+void cpathCloseDir(cpath_dir *dir) {
+    if (dir == NULL) return;
+
+    dir->hasNext = 1;
+    dir->size = -1;
+    if (dir->files != NULL) CPATH_FREE(dir->files);
+    dir->files = NULL;
+
+#if defined _MSC_VER
+    if (dir->handle != INVALID_HANDLE_VALUE) FindClose(dir->handle);
+    dir->handle = INVALID_HANDLE_VALUE;
+#elif defined CPATH_GETDENTS
+    if (dir->fd >= 0) close(dir->fd);
+    dir->fd = -1;
+    if (dir->ownsBuf && dir->buf != NULL) CPATH_FREE(dir->buf);
+    dir->buf = NULL;
+    dir->ownsBuf = 0;
+    dir->bufPos = 0;
+    dir->bufLen = 0;
+    dir->dirent = NULL;
+#else
+    if (dir->dir != NULL) _cpath_closedir(dir->dir);
+    dir->dir = NULL;
+    dir->dirent = NULL;
+#endif
+
+    cpathClear(&dir->path);
+    if (dir->parent != NULL) {
+        cpathCloseDir(dir->parent);
+        CPATH_FREE(dir->parent);
+        dir->parent = NULL;
+    }
+    while (dir->pool != NULL) {
+        cpath_dir *next = dir->pool->pool;
+        CPATH_FREE(dir->pool);
+        dir->pool = next;
+    }
+}
+
+_CPATH_FUNC_
+int cpathMoveNextFile(cpath_dir *dir) {
+    if (dir == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (!dir->hasNext) {
+        return 0;
+    }
+
+#if defined _MSC_VER
+    CPATH_SYSCALL_HOOK("read");
+    if (FindNextFile(dir->handle, &dir->findData) == 0) {
+        dir->hasNext = 0;
+        if (GetLastError() != ERROR_SUCCESS &&
+                GetLastError() != ERROR_NO_MORE_FILES) {
+            cpathCloseDir(dir);
+            errno = EIO;
+            return 0;
+        }
+    }
+#elif defined CPATH_GETDENTS
+    dir->dirent = _cpathGetdentsNext(dir);
+    if (dir->dirent == NULL) {
+        dir->hasNext = 0;
+    }
+#else
+    CPATH_SYSCALL_HOOK("read");
+    dir->dirent = _cpath_readdir(dir->dir);
+    if (dir->dirent == NULL) {
+        dir->hasNext = 0;
+    }
+#endif
+
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathGetFileInfo(cpath_file *file) {
+    if (file->statLoaded) {
+        return 1;
+    }
+#if !defined _MSC_VER
+    CPATH_SYSCALL_HOOK("stat");
+#if defined __MINGW32__
+    if (_tstat(file->path.buf, &file->stat) == -1) {
+        return 0;
+    }
+#elif defined _BSD_SOURCE || defined _DEFAULT_SOURCE	\
+            || (defined _XOPEN_SOURCE && _XOPEN_SOURCE >= 500)	\
+            || (defined _POSIX_C_SOURCE && _POSIX_C_SOURCE >= 200112L)
+    if (lstat(file->path.buf, &file->stat) == -1) {
+        return 0;
+    }
+#else
+    if (stat(file->path.buf, &file->stat) == -1) {
+        return 0;
+    }
+#endif
+#endif
+    file->statLoaded = 1;
+    return 1;
+}
+
+#if defined CPATH_IO_URING
+_CPATH_FUNC_
+int _cpathStatBatchSetup(cpath_stat_batch *batch) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    batch->fd = (int)syscall(__NR_io_uring_setup, CPATH_IO_URING_ENTRIES,
+                             &params);
+    if (batch->fd < 0) return 0;
+
+    batch->entries = params.sq_entries;
+    batch->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    batch->cqRingSize = params.cq_off.cqes +
+                        params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (batch->cqRingSize > batch->sqRingSize) {
+            batch->sqRingSize = batch->cqRingSize;
+        }
+        batch->cqRingSize = batch->sqRingSize;
+    }
+
+    batch->sqRing = mmap(NULL, batch->sqRingSize, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, batch->fd,
+                         IORING_OFF_SQ_RING);
+    if (batch->sqRing == MAP_FAILED) {
+        batch->sqRing = NULL;
+        return 0;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        batch->cqRing = batch->sqRing;
+    } else {
+        batch->cqRing = mmap(NULL, batch->cqRingSize, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, batch->fd,
+                             IORING_OFF_CQ_RING);
+        if (batch->cqRing == MAP_FAILED) {
+            batch->cqRing = NULL;
+            return 0;
+        }
+    }
+
+    batch->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    batch->sqes = (struct io_uring_sqe*)mmap(NULL, batch->sqesSize,
+                                             PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE,
+                                             batch->fd, IORING_OFF_SQES);
+    if (batch->sqes == MAP_FAILED) {
+        batch->sqes = NULL;
+        return 0;
+    }
+
+    char *sq = (char*)batch->sqRing;
+    char *cq = (char*)batch->cqRing;
+    batch->sqHead = (unsigned*)(sq + params.sq_off.head);
+    batch->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    batch->sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    batch->sqArray = (unsigned*)(sq + params.sq_off.array);
+    batch->cqHead = (unsigned*)(cq + params.cq_off.head);
+    batch->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    batch->cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    batch->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    batch->results = (struct statx*)
+        CPATH_MALLOC(sizeof(struct statx) * batch->entries);
+    batch->indices = (size_t*)CPATH_MALLOC(sizeof(size_t) * batch->entries);
+    return batch->results != NULL && batch->indices != NULL;
+}
+
+_CPATH_FUNC_
+void _cpathStatxToStat(const struct statx *in, cpath_file *file) {
+    struct stat *out = &file->stat;
+    memset(out, 0, sizeof(struct stat));
+    out->st_dev = makedev(in->stx_dev_major, in->stx_dev_minor);
+    out->st_ino = in->stx_ino;
+    out->st_mode = in->stx_mode;
+    out->st_nlink = in->stx_nlink;
+    out->st_uid = in->stx_uid;
+    out->st_gid = in->stx_gid;
+    out->st_rdev = makedev(in->stx_rdev_major, in->stx_rdev_minor);
+    out->st_size = in->stx_size;
+    out->st_blksize = in->stx_blksize;
+    out->st_blocks = in->stx_blocks;
+    out->st_atim.tv_sec = in->stx_atime.tv_sec;
+    out->st_atim.tv_nsec = in->stx_atime.tv_nsec;
+    out->st_mtim.tv_sec = in->stx_mtime.tv_sec;
+    out->st_mtim.tv_nsec = in->stx_mtime.tv_nsec;
+    out->st_ctim.tv_sec = in->stx_ctime.tv_sec;
+    out->st_ctim.tv_nsec = in->stx_ctime.tv_nsec;
+    file->statLoaded = 1;
+}
+
+/*
+    Returns how many files it got through, anything after that
+    has to be done sequentially (i.e. the kernel doesn't support statx)
+*/
+_CPATH_FUNC_
+size_t _cpathStatBatchRing(cpath_stat_batch *batch, cpath_file *files,
+                           size_t n, int *failed) {
+    size_t i = 0;
+    while (i < n) {
+        unsigned tail = *batch->sqTail;
+        unsigned count = 0;
+        for (; i < n && count < batch->entries; i++) {
+            if (files[i].statLoaded) continue;
+            unsigned idx = tail & *batch->sqMask;
+            struct io_uring_sqe *sqe = &batch->sqes[idx];
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t)(uintptr_t)files[i].path.buf;
+            sqe->len = STATX_BASIC_STATS;
+            sqe->off = (uint64_t)(uintptr_t)&batch->results[count];
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+            sqe->user_data = count;
+            batch->sqArray[idx] = idx;
+            batch->indices[count] = i;
+            tail++;
+            count++;
+        }
+        if (count == 0) break;
+        __atomic_store_n(batch->sqTail, tail, __ATOMIC_RELEASE);
+
+        unsigned submitted = 0;
+        unsigned reaped = 0;
+        int unsupported = 0;
+        while (reaped < count) {
+            long res = syscall(__NR_io_uring_enter, batch->fd, count - submitted,
+                               1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (res < 0) {
+                if (errno == EINTR || errno == EAGAIN) continue;
+                // the ring is in an unknown state so just stop using it
+                // the files we couldn't get to will be done sequentially
+                batch->useRing = 0;
+                return batch->indices[0];
+            }
+            submitted += (unsigned)res;
+
+            unsigned head = *batch->cqHead;
+            unsigned cqTail = __atomic_load_n(batch->cqTail, __ATOMIC_ACQUIRE);
+            for (; head != cqTail; head++, reaped++) {
+                struct io_uring_cqe *cqe = &batch->cqes[head & *batch->cqMask];
+                unsigned slot = (unsigned)cqe->user_data;
+                if (cqe->res == 0) {
+                    _cpathStatxToStat(&batch->results[slot],
+                                      &files[batch->indices[slot]]);
+                } else if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+                    // kernel doesn't support IORING_OP_STATX
+                    unsupported = 1;
+                } else {
+                    errno = -cqe->res;
+                    *failed = 1;
+                }
+            }
+            __atomic_store_n(batch->cqHead, head, __ATOMIC_RELEASE);
+        }
+
+        if (unsupported) {
+            // anything that did succeed already has statLoaded set
+            // so it'll be skipped when we go sequential
+            batch->useRing = 0;
+            return batch->indices[0];
+        }
+    }
+    return n;
+}
+#endif
+
+_CPATH_FUNC_
+void cpathStatBatchInit(cpath_stat_batch *batch) {
+    batch->useRing = 0;
+#if defined CPATH_IO_URING
+    batch->fd = -1;
+    batch->sqRing = NULL;
+    batch->cqRing = NULL;
+    batch->sqes = NULL;
+    batch->results = NULL;
+    batch->indices = NULL;
+    if (_cpathStatBatchSetup(batch)) {
+        batch->useRing = 1;
+    } else {
+        // io_uring is unavailable (old kernel/disabled) so go sequential
+        cpathStatBatchFree(batch);
+    }
+#endif
+}
+
+_CPATH_FUNC_
+void cpathStatBatchFree(cpath_stat_batch *batch) {
+    if (batch == NULL) return;
+#if defined CPATH_IO_URING
+    if (batch->sqes != NULL) munmap(batch->sqes, batch->sqesSize);
+    if (batch->cqRing != NULL && batch->cqRing != batch->sqRing) {
+        munmap(batch->cqRing, batch->cqRingSize);
+    }
+    if (batch->sqRing != NULL) munmap(batch->sqRing, batch->sqRingSize);
+    if (batch->fd >= 0) close(batch->fd);
+    if (batch->results != NULL) CPATH_FREE(batch->results);
+    if (batch->indices != NULL) CPATH_FREE(batch->indices);
+    batch->fd = -1;
+    batch->sqRing = NULL;
+    batch->cqRing = NULL;
+    batch->sqes = NULL;
+    batch->results = NULL;
+    batch->indices = NULL;
+#endif
+    batch->useRing = 0;
+}
+
+_CPATH_FUNC_
+int cpathStatBatch(cpath_stat_batch *batch, cpath_file *files, size_t n) {
+    if (batch == NULL || (files == NULL && n > 0)) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    int failed = 0;
+    size_t i = 0;
+#if defined CPATH_IO_URING
+    if (batch->useRing) {
+        i = _cpathStatBatchRing(batch, files, n, &failed);
+    }
+#endif
+
+    for (; i < n; i++) {
+        if (!cpathGetFileInfo(&files[i])) failed = 1;
+    }
+
+    // any files we deferred will need their flags loaded
+    for (i = 0; i < n; i++) {
+        if (!files[i].statLoaded) continue;
+#if !defined _MSC_VER
+        files[i].isDir = S_ISDIR(files[i].stat.st_mode);
+        files[i].isReg = S_ISREG(files[i].stat.st_mode);
+        files[i].isSym = S_ISLNK(files[i].stat.st_mode);
+#endif
+    }
+
+    return !failed;
+}
+
+// Stats the file dir is on, a directory opened with cpathOpenDirAt has no
+// path so the file's path is relative to it (rather than to the CWD)
+_CPATH_FUNC_
+int _cpathDirGetFileInfo(cpath_dir *dir, cpath_file *file) {
+#if defined CPATH_HAS_OPENAT
+    if (dir->path.len == 0 && dir->dirent != NULL && !file->statLoaded) {
+        CPATH_SYSCALL_HOOK("stat");
+        if (fstatat(_cpathDirFd(dir), file->name, &file->stat,
+                    AT_SYMLINK_NOFOLLOW) == -1) {
+            return 0;
+        }
+        file->statLoaded = 1;
+        return 1;
+    }
+#endif
+    return cpathGetFileInfo(file);
+}
+
+_CPATH_FUNC_
+int cpathLoadFlags(cpath_dir *dir, cpath_file *file, void *data) {
+#if defined _MSC_VER
+    WIN32_FIND_DATA *find = (WIN32_FIND_DATA*) data;
+    file->isDir = FILE_IS(find, DIRECTORY);
+    if (FILE_IS(find, NORMAL)) {
+        file->isReg = 1;
+    } else if (FILE_IS_NOT(find, DEVICE) && FILE_IS_NOT(find, DIRECTORY) &&
+                         FILE_IS_NOT(find, ENCRYPTED) && FILE_IS_NOT(find, OFFLINE) &&
+#ifdef FILE_ATTRIBUTE_INTEGRITY_STREAM
+                         FILE_IS_NOT(find, INTEGRITY_STREAM) &&
+#endif
+#ifdef FILE_ATTRIBUTE_NO_SCRUB_DATA
+                         FILE_IS_NOT(find, NO_SCRUB_DATA) &&
+#endif
+                         FILE_IS_NOT(find, TEMPORARY)) {
+        file->isReg = 1;
+    } else {
+        file->isReg = 0;
+    }
+    file->isSym = FILE_IS(find, REPARSE_POINT);
+#else
+    if (dir->dirent == NULL || dir->dirent->d_type == DT_UNKNOWN) {
+        if (dir->dirent != NULL && dir->deferStat) {
+            // the caller will stat it later on and fix up the flags
+            file->isDir = 0;
+            file->isReg = 0;
+            file->isSym = 0;
+            return 1;
+        }
+
+        if (!_cpathDirGetFileInfo(dir, file)) {
+            return 0;
+        }
+
+        file->isDir = S_ISDIR(file->stat.st_mode);
+        file->isReg = S_ISREG(file->stat.st_mode);
+        file->isSym = S_ISLNK(file->stat.st_mode);
+    } else {
+        file->isDir = dir->dirent->d_type == DT_DIR;
+        file->isReg = dir->dirent->d_type == DT_REG;
+        file->isSym = dir->dirent->d_type == DT_LNK;
+        file->statLoaded = 0;
+    }
+#endif
+    return 1;
+}
+
+_CPATH_FUNC_
+const cpath_char_t *cpathPeekNextName(cpath_dir *dir, size_t *len) {
+    if (dir == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    const cpath_char_t *name;
+#if defined _MSC_VER
+    if (dir->handle == INVALID_HANDLE_VALUE) return NULL;
+    name = dir->findData.cFileName;
+    if (len != NULL) *len = cpath_str_length(name);
+#else
+    if (dir->dirent == NULL) return NULL;
+    name = dir->dirent->d_name;
+    if (len != NULL) {
+#if defined CPATH_GETDENTS
+        *len = dir->direntLen;
+#else
+        *len = cpath_str_length(name);
+#endif
+    }
+#endif
+    return name;
+}
+
+// same as cpathPeekNextFile but the file's path is relative to base
+// rather than the directory's path
+_CPATH_FUNC_
+int _cpathPeekNextFileBase(cpath_dir *dir, cpath_file *file,
+                           const cpath *base) {
+    file->statLoaded = 0;
+    file->extension = NULL;
+    // load current file into file
+    const cpath_char_t *filename;
+    size_t filenameLen;
+#if defined _MSC_VER
+    if (dir->handle == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    filename = dir->findData.cFileName;
+    filenameLen = cpath_str_length(filename);
+#else
+    if (dir->dirent == NULL) {
+        return 0;
+    }
+    filename = dir->dirent->d_name;
+#if defined CPATH_GETDENTS
+    filenameLen = dir->direntLen;
+#else
+    // TODO: On MACOS there is a d_namlen but not on linux
+    filenameLen = strlen(dir->dirent->d_name);
+#endif
+#endif
+    size_t totalLen = base->len + filenameLen;
+    if (totalLen + 1 + CPATH_PATH_EXTRA_CHARS >= CPATH_MAX_PATH_LEN ||
+            filenameLen >= CPATH_MAX_FILENAME_LEN) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+
+    memcpy(file->name, filename, sizeof(cpath_char_t) * (filenameLen + 1));
+    cpathCopy(&file->path, base);
+    if (!cpathConcatStrn(&file->path, filename, filenameLen)) {
+        return 0;
+    }
+#ifndef CPATH_NO_AUTOLOAD_EXT
+    cpathGetExtension(file);
+#endif
+#if defined _MSC_VER
+    if (!cpathLoadFlags(dir, file, &dir->findData)) return 0;
+#else
+    if (!cpathLoadFlags(dir, file, NULL)) return 0;
+#endif
+#ifdef CPATH_AUTOLOAD_STAT
+    if (!_cpathDirGetFileInfo(dir, file)) return 0;
+#endif
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathPeekNextFile(cpath_dir *dir, cpath_file *file) {
+    if (file == NULL || dir == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    return _cpathPeekNextFileBase(dir, file, &dir->path);
+}
+
+_CPATH_FUNC_
+int cpathGetNextFile(cpath_dir *dir, cpath_file *file) {
+    if (file != NULL) {
+        if (!cpathPeekNextFile(dir, file)) {
+            return 0;
+        }
+    }
+
+    errno = 0;
+    // @TODO: Bug I think
+    //        I think we want to remove the condition that dir->hasNext
+    //        Sicne cpath checks that.
+    if (dir->hasNext && !cpathMoveNextFile(dir) && errno != 0) {
+        return 0;
+    }
+
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathFileIsSpecialHardLink(const cpath_file *file) {
+    return file->name[0] == CPATH_STR('.') && (file->name[1] == CPATH_STR('\0') ||
+                 (file->name[1] == CPATH_STR('.') && file->name[2] == CPATH_STR('\0')));
+}
+
+_CPATH_FUNC_
+int cpathLoadAllFilesStat(cpath_dir *dir, cpath_stat_batch *batch) {
+    if (dir == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    cpath_stat_batch tmp;
+    if (batch == NULL) {
+        cpathStatBatchInit(&tmp);
+        batch = &tmp;
+    }
+
+    dir->deferStat = 1;
+    int res = cpathLoadAllFiles(dir);
+    dir->deferStat = 0;
+    if (res) res = cpathStatBatch(batch, dir->files, dir->size);
+
+    if (batch == &tmp) cpathStatBatchFree(&tmp);
+    return res;
+}
+
+_CPATH_FUNC_
+void cpathListingInit(cpath_listing *listing) {
+    memset(listing, 0, sizeof(*listing) - sizeof(listing->path));
+    listing->path.buf[0] = CPATH_STR('\0');
+    listing->path.len = 0;
+}
+
+_CPATH_FUNC_
+void cpathListingFree(cpath_listing *listing) {
+    if (listing == NULL) return;
+    if (listing->nameOffsets != NULL) CPATH_FREE(listing->nameOffsets);
+    if (listing->nameLens != NULL) CPATH_FREE(listing->nameLens);
+    if (listing->types != NULL) CPATH_FREE(listing->types);
+    if (listing->inodes != NULL) CPATH_FREE(listing->inodes);
+    if (listing->sizes != NULL) CPATH_FREE(listing->sizes);
+    if (listing->mtimes != NULL) CPATH_FREE(listing->mtimes);
+    if (listing->modes != NULL) CPATH_FREE(listing->modes);
+    if (listing->nlinks != NULL) CPATH_FREE(listing->nlinks);
+    if (listing->devs != NULL) CPATH_FREE(listing->devs);
+    if (listing->names != NULL) CPATH_FREE(listing->names);
+    cpathListingInit(listing);
+}
+
+_CPATH_FUNC_
+int _cpathListingGrow(void **arr, size_t elem, size_t old, size_t cap) {
+    void *tmp = CPATH_MALLOC(elem * cap);
+    if (tmp == NULL) return 0;
+    if (*arr != NULL) {
+        memcpy(tmp, *arr, elem * old);
+        CPATH_FREE(*arr);
+    }
+    *arr = tmp;
+    return 1;
+}
+
+_CPATH_FUNC_
+int _cpathListingReserve(cpath_listing *listing, size_t cap, int withStat) {
+    if (cap <= listing->cap && (!withStat || listing->sizes != NULL)) {
+        return 1;
+    }
+    if (cap < listing->cap) cap = listing->cap;
+    // only what we've loaded so far has to be kept
+    size_t old = listing->size;
+    int grow = cap > listing->cap;
+    int stat = withStat || listing->sizes != NULL;
+
+    void **cols[] = {
+        (void**)&listing->nameOffsets, (void**)&listing->nameLens,
+        (void**)&listing->types, (void**)&listing->inodes,
+        (void**)&listing->sizes, (void**)&listing->mtimes,
+        (void**)&listing->modes, (void**)&listing->nlinks,
+        (void**)&listing->devs,
+    };
+    size_t elems[] = {
+        sizeof(size_t), sizeof(unsigned short),
+        sizeof(unsigned char), sizeof(uint64_t),
+        sizeof(cpath_offset_t), sizeof(cpath_time_t),
+        sizeof(uint32_t), sizeof(uint32_t),
+        sizeof(uint64_t),
+    };
+    int want[] = {
+        grow, grow, grow, grow,
+        stat && (grow || listing->sizes == NULL),
+        stat && (grow || listing->mtimes == NULL),
+        stat && (grow || listing->modes == NULL),
+        stat && (grow || listing->nlinks == NULL),
+        stat && (grow || listing->devs == NULL),
+    };
+    enum { count = sizeof(elems) / sizeof(elems[0]) };
+
+    // allocate everything first so running out of memory leaves the
+    // listing just as it was (rather than with only some columns grown)
+    void *fresh[count];
+    for (size_t i = 0; i < count; i++) {
+        fresh[i] = NULL;
+        if (!want[i]) continue;
+        fresh[i] = CPATH_MALLOC(elems[i] * cap);
+        if (fresh[i] == NULL) {
+            while (i-- > 0) {
+                if (fresh[i] != NULL) CPATH_FREE(fresh[i]);
+            }
+            errno = ENOMEM;
+            return 0;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!want[i]) continue;
+        if (*cols[i] != NULL) {
+            memcpy(fresh[i], *cols[i], elems[i] * old);
+            CPATH_FREE(*cols[i]);
+        }
+        *cols[i] = fresh[i];
+    }
+    listing->cap = cap;
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathListingLoad(cpath_listing *listing, cpath_dir *dir, int loadStat) {
+    if (listing == NULL || dir == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    listing->size = 0;
+    listing->namesLen = 0;
+    listing->errors = 0;
+    if (!loadStat && listing->sizes != NULL) {
+        // so people can check if stat was loaded
+        CPATH_FREE(listing->sizes);
+        CPATH_FREE(listing->mtimes);
+        CPATH_FREE(listing->modes);
+        CPATH_FREE(listing->nlinks);
+        CPATH_FREE(listing->devs);
+        listing->sizes = NULL;
+        listing->mtimes = NULL;
+        listing->modes = NULL;
+        listing->nlinks = NULL;
+        listing->devs = NULL;
+    }
+    cpathCopy(&listing->path, &dir->path);
+
+    const cpath_char_t *name;
+    size_t len;
+    while ((name = cpathPeekNextName(dir, &len)) != NULL) {
+        size_t i = listing->size;
+        if (i == listing->cap &&
+                !_cpathListingReserve(listing, i < 16 ? 16 : i * 2, loadStat)) {
+            return 0;
+        } else if (loadStat && listing->sizes == NULL &&
+                !_cpathListingReserve(listing, listing->cap, loadStat)) {
+            return 0;
+        }
+
+        if (listing->namesLen + len + 1 > listing->namesCap) {
+            size_t cap = listing->namesCap < 256 ? 256 : listing->namesCap * 2;
+            while (cap < listing->namesLen + len + 1) cap *= 2;
+            if (!_cpathListingGrow((void**)&listing->names, sizeof(cpath_char_t),
+                                   listing->namesLen, cap)) {
+                errno = ENOMEM;
+                return 0;
+            }
+            listing->namesCap = cap;
+        }
+
+        listing->nameOffsets[i] = listing->namesLen;
+        listing->nameLens[i] = (unsigned short)len;
+        memcpy(listing->names + listing->namesLen, name,
+               sizeof(cpath_char_t) * (len + 1));
+        listing->namesLen += len + 1;
+
+        unsigned char type = 0;
+        uint64_t ino = 0;
+#if defined _MSC_VER
+        if (FILE_IS(dir->findData, DIRECTORY)) type = CPATH_LISTING_DIR;
+        else if (FILE_IS(dir->findData, REPARSE_POINT)) type = CPATH_LISTING_SYM;
+        else type = CPATH_LISTING_REG;
+#else
+        ino = (uint64_t)dir->dirent->d_ino;
+        unsigned char dtype = dir->dirent->d_type;
+        if (dtype == DT_DIR) type = CPATH_LISTING_DIR;
+        else if (dtype == DT_REG) type = CPATH_LISTING_REG;
+        else if (dtype == DT_LNK) type = CPATH_LISTING_SYM;
+
+        if (loadStat || (dtype == DT_UNKNOWN && !dir->deferStat)) {
+            cpath_file file;
+            file.statLoaded = 0;
+            int ok;
+#if defined CPATH_HAS_OPENAT
+            if (dir->path.len == 0) {
+                CPATH_SYSCALL_HOOK("stat");
+                ok = fstatat(_cpathDirFd(dir), name, &file.stat,
+                             AT_SYMLINK_NOFOLLOW) != -1;
+            } else
+#endif
+            {
+                cpathCopy(&file.path, &dir->path);
+                ok = cpathConcatStrn(&file.path, name, len) &&
+                     cpathGetFileInfo(&file);
+            }
+            if (!ok) {
+                // it might have just been removed, that shouldn't cost us
+                // the rest of the directory
+                listing->errors++;
+                if (loadStat) {
+                    listing->sizes[i] = 0;
+                    listing->mtimes[i] = 0;
+                    listing->modes[i] = 0;
+                    listing->nlinks[i] = 0;
+                    listing->devs[i] = 0;
+                }
+            } else if (dtype == DT_UNKNOWN) {
+                if (S_ISDIR(file.stat.st_mode)) type = CPATH_LISTING_DIR;
+                else if (S_ISREG(file.stat.st_mode)) type = CPATH_LISTING_REG;
+                else if (S_ISLNK(file.stat.st_mode)) type = CPATH_LISTING_SYM;
+            }
+            if (ok && loadStat) {
+                // just what cpathListingGetFile needs to give back a stat
+                // so it doesn't have to stat again
+                listing->sizes[i] = file.stat.st_size;
+                listing->mtimes[i] = file.stat.st_mtime;
+                listing->modes[i] = (uint32_t)file.stat.st_mode;
+                listing->nlinks[i] = file.stat.st_nlink > UINT32_MAX ?
+                    UINT32_MAX : (uint32_t)file.stat.st_nlink;
+                listing->devs[i] = (uint64_t)file.stat.st_dev;
+            }
+        }
+#endif
+        listing->types[i] = type;
+        listing->inodes[i] = ino;
+        listing->size++;
+
+        // readdir only tells us about an error through errno
+        errno = 0;
+        if (!cpathMoveNextFile(dir) || (!dir->hasNext && errno != 0)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+_CPATH_FUNC_
+const cpath_char_t *cpathListingName(const cpath_listing *listing, size_t n,
+                                     size_t *len) {
+    if (listing == NULL || n >= listing->size) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (len != NULL) *len = listing->nameLens[n];
+    return listing->names + listing->nameOffsets[n];
+}
+
+_CPATH_FUNC_
+int cpathListingGetFile(const cpath_listing *listing, cpath_file *file,
+                        size_t n) {
+    if (listing == NULL || file == NULL || n >= listing->size) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    size_t len = listing->nameLens[n];
+    const cpath_char_t *name = listing->names + listing->nameOffsets[n];
+    if (len >= CPATH_MAX_FILENAME_LEN) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    cpathCopy(&file->path, &listing->path);
+    if (!cpathConcatStrn(&file->path, name, len)) return 0;
+
+    memcpy(file->name, name, sizeof(cpath_char_t) * (len + 1));
+    file->isDir = !!(listing->types[n] & CPATH_LISTING_DIR);
+    file->isReg = !!(listing->types[n] & CPATH_LISTING_REG);
+    file->isSym = !!(listing->types[n] & CPATH_LISTING_SYM);
+    // unless it was loaded with stat we only have some of the stat fields
+    file->statLoaded = 0;
+#if !defined _MSC_VER
+    if (listing->modes != NULL && listing->modes[n] != 0) {
+        memset(&file->stat, 0, sizeof(file->stat));
+        file->stat.st_mode = (mode_t)listing->modes[n];
+        file->stat.st_nlink = (nlink_t)listing->nlinks[n];
+        file->stat.st_dev = (dev_t)listing->devs[n];
+        file->stat.st_ino = (ino_t)listing->inodes[n];
+        file->stat.st_size = (off_t)listing->sizes[n];
+        file->stat.st_mtime = (time_t)listing->mtimes[n];
+        file->statLoaded = 1;
+    }
+#endif
+    file->extension = NULL;
+#ifndef CPATH_NO_AUTOLOAD_EXT
+    cpathGetExtension(file);
+#endif
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathListingCompareName(const cpath_listing *listing, size_t a, size_t b,
+                            void *data) {
+    (void)data;
+    return cpath_str_compare(listing->names + listing->nameOffsets[a],
+                             listing->names + listing->nameOffsets[b]);
+}
+
+_CPATH_FUNC_
+int _cpathListingPermute(void **arr, size_t elem, const size_t *order,
+                         size_t n) {
+    if (*arr == NULL) return 1;
+    char *tmp = (char*)CPATH_MALLOC(elem * n);
+    if (tmp == NULL) return 0;
+    for (size_t i = 0; i < n; i++) {
+        memcpy(tmp + i * elem, (char*)*arr + order[i] * elem, elem);
+    }
+    memcpy(*arr, tmp, elem * n);
+    CPATH_FREE(tmp);
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathListingSort(cpath_listing *listing, cpath_listing_cmp cmp, void *data) {
+    if (listing == NULL || cmp == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    size_t n = listing->size;
+    if (n < 2) return 1;
+
+    // bottom up merge sort on indices then we reorder every array once
+    size_t *order = (size_t*)CPATH_MALLOC(sizeof(size_t) * n * 2);
+    if (order == NULL) {
+        errno = ENOMEM;
+        return 0;
+    }
+    size_t *src = order;
+    size_t *dst = order + n;
+    for (size_t i = 0; i < n; i++) src[i] = i;
+
+    for (size_t width = 1; width < n; width *= 2) {
+        for (size_t lo = 0; lo < n; lo += width * 2) {
+            size_t mid = lo + width < n ? lo + width : n;
+            size_t hi = lo + width * 2 < n ? lo + width * 2 : n;
+            size_t i = lo, j = mid, k = lo;
+            while (i < mid && j < hi) {
+                if (cmp(listing, src[j], src[i], data) < 0) dst[k++] = src[j++];
+                else dst[k++] = src[i++];
+            }
+            while (i < mid) dst[k++] = src[i++];
+            while (j < hi) dst[k++] = src[j++];
+        }
+        size_t *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    int res = _cpathListingPermute((void**)&listing->nameOffsets,
+                                   sizeof(size_t), src, n) &&
+              _cpathListingPermute((void**)&listing->nameLens,
+                                   sizeof(unsigned short), src, n) &&
+              _cpathListingPermute((void**)&listing->types,
+                                   sizeof(unsigned char), src, n) &&
+              _cpathListingPermute((void**)&listing->inodes,
+                                   sizeof(uint64_t), src, n) &&
+              _cpathListingPermute((void**)&listing->sizes,
+                                   sizeof(cpath_offset_t), src, n) &&
+              _cpathListingPermute((void**)&listing->mtimes,
+                                   sizeof(cpath_time_t), src, n) &&
+              _cpathListingPermute((void**)&listing->modes,
+                                   sizeof(uint32_t), src, n) &&
+              _cpathListingPermute((void**)&listing->nlinks,
+                                   sizeof(uint32_t), src, n) &&
+              _cpathListingPermute((void**)&listing->devs,
+                                   sizeof(uint64_t), src, n);
+    CPATH_FREE(order);
+    if (!res) errno = ENOMEM;
+    return res;
+}
+
+_CPATH_FUNC_
+size_t _cpathDirSizeHint(cpath_dir *dir) {
+#if defined CPATH_HAS_OPENAT
+    // Most filesystems give the size of a directory in bytes which is
+    // roughly proportional to the number of entries, it's only a hint
+    // so it doesn't matter if we are wrong
+    struct stat st;
+    CPATH_SYSCALL_HOOK("stat");
+    if (fstat(_cpathDirFd(dir), &st) == -1) return 0;
+    size_t hint = (size_t)st.st_size / 32;
+    if ((size_t)st.st_nlink > hint) hint = (size_t)st.st_nlink;
+    if (hint > 1 << 16) hint = 1 << 16;
+    return hint;
+#else
+    return 0;
+#endif
+}
+
+_CPATH_FUNC_
+int cpathLoadAllFiles(cpath_dir *dir) {
+    if (dir == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    if (dir->files != NULL) CPATH_FREE(dir->files);
+    dir->files = NULL;
+
+    /*
+        We read the names into a compact listing (which grows geometrically)
+        then allocate exactly as many files as we read, so we only go through
+        the directory once (no count then rewind) and growing only ever copies
+        the small listing entries rather than huge cpath_file's.
+    */
+    cpath_listing listing;
+    cpathListingInit(&listing);
+    size_t hint = _cpathDirSizeHint(dir);
+    if ((hint > 0 && !_cpathListingReserve(&listing, hint, 0)) ||
+            !cpathListingLoad(&listing, dir, 0)) {
+        // we won't close the directory though!
+        // we'll just pretend we have no files!
+        cpathListingFree(&listing);
+        dir->size = 0;
+        return 0;
+    }
+
+    // we can have 0 files
+    if (listing.size == 0) {
+        cpathListingFree(&listing);
+        dir->size = 0;
+        return 1;
+    }
+
+    dir->files = (cpath_file*) CPATH_MALLOC(sizeof(cpath_file) * listing.size);
+    if (dir->files == NULL) {
+        // we won't close the directory just error out
+        cpathListingFree(&listing);
+        dir->size = 0;
+        return 0;
+    }
+
+    size_t i;
+    for (i = 0; i < listing.size; i++) {
+        if (!cpathListingGetFile(&listing, &dir->files[i], i)) break;
+#ifdef CPATH_AUTOLOAD_STAT
+        cpathGetFileInfo(&dir->files[i]);
+#endif
+    }
+    // if a name was too long we just stop there
+    dir->size = i;
+
+    cpathListingFree(&listing);
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathCheckGetN(cpath_dir *dir, size_t n) {
+    if (dir == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    if (dir->size == -1) {
+        // we haven't loaded
+        cpathLoadAllFiles(dir);
+    }
+
+    if (n >= dir->size) {
+        errno = ENOENT;
+        return 0;
+    }
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathGetFile(cpath_dir *dir, cpath_file *file, size_t n) {
+    if (file == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (!cpathCheckGetN(dir, n)) return 0;
+
+    memcpy(file, &dir->files[n], sizeof(cpath_file));
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathGetFileConst(cpath_dir *dir, const cpath_file **file, size_t n) {
+    if (dir == NULL || file == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    if (dir->size == -1) {
+        // we haven't loaded
+        cpathLoadAllFiles(dir);
+    }
+
+    if (n >= dir->size) {
+        errno = ENOENT;
+        return 0;
+    }
+
+    *file = &dir->files[n];
+    return 1;
+}
+
+// copies a directory without copying the unused part of the path
+_CPATH_FUNC_
+void _cpathDirMove(cpath_dir *out, const cpath_dir *dir) {
+    memcpy(out, dir, offsetof(cpath_dir, path));
+    cpathCopy(&out->path, &dir->path);
+}
+
+// Moves dir into a frame from its pool (only allocating if it's empty)
+// the rest of the pool is left with dir
+_CPATH_FUNC_
+cpath_dir *_cpathDirSave(cpath_dir *dir) {
+    cpath_dir *saved = dir->pool;
+    if (saved != NULL) {
+        dir->pool = saved->pool;
+    } else {
+        saved = (cpath_dir*)CPATH_MALLOC(sizeof(cpath_dir));
+        if (saved == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    cpath_dir *pool = dir->pool;
+    _cpathDirMove(saved, dir);
+    saved->pool = NULL;
+    dir->pool = pool;
+    return saved;
+}
+
+// Moves a saved frame back into dir and gives the frame back to the pool
+_CPATH_FUNC_
+void _cpathDirRestore(cpath_dir *dir, cpath_dir *saved, cpath_dir *pool) {
+    _cpathDirMove(dir, saved);
+    saved->pool = pool;
+    dir->pool = saved;
+}
+
+_CPATH_FUNC_
+int cpathOpenSubFileEmplace(cpath_dir *dir, const cpath_file *file,
+                                                        int saveDir) {
+    cpath_dir *saved = NULL;
+    if (saveDir) {
+        // save the old one
+        saved = _cpathDirSave(dir);
+        if (saved == NULL) return 0;
+    }
+
+    cpath_dir *pool = dir->pool;
+    if (!cpathFileToDir(dir, file)) {
+        if (saved != NULL) _cpathDirRestore(dir, saved, pool);
+        else dir->pool = pool;
+        return 0;
+    }
+
+    dir->parent = saved;
+    dir->pool = pool;
+
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathOpenSubDirEmplace(cpath_dir *dir, size_t n, int saveDir) {
+    if (dir == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (!cpathCheckGetN(dir, n)) return 0;
+
+    const cpath_file *file;
+    if (!cpathGetFileConst(dir, &file, n) ||
+            !file->isDir || !cpathOpenSubFileEmplace(dir, file, saveDir)) {
+        if (!file->isDir) errno = EINVAL;
+        return 0;
+    }
+
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathOpenSubDir(cpath_dir *out, cpath_dir *dir, size_t n) {
+    if (dir == NULL || out == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (!cpathCheckGetN(dir, n)) return 0;
+
+    const cpath_file *file;
+    if (!cpathGetFileConst(dir, &file, n) ||
+            !file->isDir || !cpathFileToDir(out, file)) {
+        if (!file->isDir) errno = EINVAL;
+        return 0;
+    }
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathOpenNextSubDir(cpath_dir *out, cpath_dir *dir) {
+    if (dir == NULL || out == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    cpath_file file;
+    if (!cpathGetNextFile(dir, &file) ||
+            !file.isDir || !cpathFileToDir(out, &file)) {
+        if (!file.isDir) errno = EINVAL;
+        return 0;
+    }
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathOpenCurrentSubDir(cpath_dir *out, cpath_dir *dir) {
+    if (dir == NULL || out == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    cpath_file file;
+    if (!cpathPeekNextFile(dir, &file) ||
+            !file.isDir || !cpathFileToDir(out, &file)) {
+        if (!file.isDir) errno = EINVAL;
+        return 0;
+    }
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathOpenNextSubDirEmplace(cpath_dir *dir, int saveDir) {
+    if (dir == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    cpath_file file;
+    if (!cpathGetNextFile(dir, &file) ||
+            !file.isDir || !cpathOpenSubFileEmplace(dir, &file, saveDir)) {
+        if (!file.isDir) errno = EINVAL;
+        return 0;
+    }
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathOpenCurrentSubDirEmplace(cpath_dir *dir, int saveDir) {
+    if (dir == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    cpath_file file;
+    if (!cpathPeekNextFile(dir, &file) ||
+            !file.isDir || !cpathOpenSubFileEmplace(dir, &file, saveDir)) {
+        if (!file.isDir) errno = EINVAL;
+        return 0;
+    }
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathRevertEmplace(cpath_dir **dir) {
+    if (dir == NULL || *dir == NULL) return 0;
+    cpath_dir *tmp = (*dir)->parent;
+    (*dir)->parent = NULL;
+    if (tmp != NULL) {
+        // the pool goes up with us
+        tmp->pool = (*dir)->pool;
+        (*dir)->pool = NULL;
+    }
+    cpathCloseDir(*dir);
+    *dir = tmp;
+    return *dir != NULL;
+}
+
+_CPATH_FUNC_
+int cpathRevertEmplaceCopy(cpath_dir *dir) {
+    if (dir == NULL) return 0;
+    cpath_dir *tmp = dir->parent;
+    dir->parent = NULL;
+    if (tmp == NULL) {
+        cpathCloseDir(dir);
+        return 0;
+    }
+
+    // the frame is kept for the next emplace
+    cpath_dir *pool = dir->pool;
+    dir->pool = NULL;
+    cpathCloseDir(dir);
+    _cpathDirRestore(dir, tmp, pool);
+    return 1;
+}
+
+/*
+    Checkpoints are; "CPCK", version, sizeof(cpath_char_t), depth then
+    for each directory (from the root) the path and the next name
+    each as a length followed by the characters.
+*/
+#define _CPATH_CHECKPOINT_VERSION (1)
+#define _CPATH_CHECKPOINT_HEADER_LEN (4 + sizeof(uint32_t) * 3)
+
+_CPATH_FUNC_
+size_t _cpathCheckpointLevelLen(cpath_dir *dir, const cpath_char_t **name,
+                                size_t *nameLen) {
+    *name = cpathPeekNextName(dir, nameLen);
+    if (*name == NULL) *nameLen = 0;
+    return sizeof(uint32_t) * 2 + sizeof(cpath_char_t) *
+           (dir->path.len + *nameLen);
+}
+
+_CPATH_FUNC_
+unsigned char *_cpathCheckpointPut(unsigned char *out, const void *data,
+                                   size_t len) {
+    uint32_t n = (uint32_t)len;
+    memcpy(out, &n, sizeof(n));
+    memcpy(out + sizeof(n), data, sizeof(cpath_char_t) * len);
+    return out + sizeof(n) + sizeof(cpath_char_t) * len;
+}
+
+_CPATH_FUNC_
+int cpathCheckpointSave(cpath_dir *dir, void *buf, size_t cap, size_t *len) {
+    if (dir == NULL || len == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    const cpath_char_t *name;
+    size_t nameLen;
+    uint32_t depth = 0;
+    *len = _CPATH_CHECKPOINT_HEADER_LEN;
+    for (cpath_dir *it = dir; it != NULL; it = it->parent) {
+        *len += _cpathCheckpointLevelLen(it, &name, &nameLen);
+        depth++;
+    }
+    if (buf == NULL) return 1;
+    if (cap < *len) {
+        errno = ERANGE;
+        return 0;
+    }
+
+    unsigned char *out = (unsigned char*)buf;
+    uint32_t header[3] = {
+        _CPATH_CHECKPOINT_VERSION, (uint32_t)sizeof(cpath_char_t), depth
+    };
+    memcpy(out, "CPCK", 4);
+    memcpy(out + 4, header, sizeof(header));
+
+    // the chain goes from the leaf up so fill it in from the end
+    size_t pos = *len;
+    for (cpath_dir *it = dir; it != NULL; it = it->parent) {
+        pos -= _cpathCheckpointLevelLen(it, &name, &nameLen);
+        out = _cpathCheckpointPut((unsigned char*)buf + pos, it->path.buf,
+                                  it->path.len);
+        _cpathCheckpointPut(out, name, nameLen);
+    }
+    return 1;
+}
+
+_CPATH_FUNC_
+const unsigned char *_cpathCheckpointGet(const unsigned char *in,
+                                         const unsigned char *end,
+                                         const cpath_char_t **str,
+                                         size_t *len) {
+    uint32_t n;
+    if (in == NULL || (size_t)(end - in) < sizeof(n)) return NULL;
+    memcpy(&n, in, sizeof(n));
+    in += sizeof(n);
+    if (n >= CPATH_MAX_PATH_LEN ||
+            (size_t)(end - in) < sizeof(cpath_char_t) * n) {
+        return NULL;
+    }
+    *str = (const cpath_char_t*)in;
+    *len = n;
+    return in + sizeof(cpath_char_t) * n;
+}
+
+// Skips every entry before name (all of them if len is 0)
+_CPATH_FUNC_
+void _cpathCheckpointSkip(cpath_dir *dir, const cpath_char_t *name,
+                          size_t len) {
+    const cpath_char_t *next;
+    size_t nextLen;
+    while ((next = cpathPeekNextName(dir, &nextLen)) != NULL) {
+        if (len > 0 && nextLen == len &&
+                !memcmp(next, name, sizeof(cpath_char_t) * len)) {
+            return;
+        }
+        cpathMoveNextFile(dir);
+    }
+
+    // it's gone so better to give back some twice than miss them
+    if (len > 0) cpathRestartDir(dir);
+}
+
+_CPATH_FUNC_
+int cpathCheckpointResume(cpath_dir *dir, const void *buf, size_t len) {
+    const unsigned char *in = (const unsigned char*)buf;
+    const unsigned char *end = in + len;
+    uint32_t header[3];
+    if (dir == NULL || buf == NULL || len < _CPATH_CHECKPOINT_HEADER_LEN ||
+            memcmp(in, "CPCK", 4) != 0) {
+        errno = EINVAL;
+        return 0;
+    }
+    memcpy(header, in + 4, sizeof(header));
+    if (header[0] != _CPATH_CHECKPOINT_VERSION ||
+            header[1] != sizeof(cpath_char_t) || header[2] == 0) {
+        errno = EINVAL;
+        return 0;
+    }
+    in += _CPATH_CHECKPOINT_HEADER_LEN;
+
+    for (uint32_t i = 0; i < header[2]; i++) {
+        const cpath_char_t *str;
+        const cpath_char_t *name;
+        size_t strLen;
+        size_t nameLen;
+        in = _cpathCheckpointGet(in, end, &str, &strLen);
+        in = _cpathCheckpointGet(in, end, &name, &nameLen);
+        if (in == NULL) {
+            if (i > 0) break;
+            errno = EINVAL;
+            return 0;
+        }
+
+        cpath path;
+        memcpy(path.buf, str, sizeof(cpath_char_t) * strLen);
+        path.len = strLen;
+        path.buf[strLen] = CPATH_STR('\0');
+        if (i == 0) {
+            if (!cpathOpenDir(dir, &path)) return 0;
+        } else {
+            cpath_dir *saved = _cpathDirSave(dir);
+            if (saved == NULL) return 0;
+            cpath_dir *pool = dir->pool;
+            if (!cpathOpenDir(dir, &path)) {
+                _cpathDirRestore(dir, saved, pool);
+                break;
+            }
+            dir->parent = saved;
+            dir->pool = pool;
+        }
+        _cpathCheckpointSkip(dir, name, nameLen);
+    }
+    return 1;
+}
+
+_CPATH_FUNC_
+int _cpathDirStackReserve(cpath_dir_stack *stack) {
+    if (stack->depth < stack->cap) return 1;
+
+    size_t cap = stack->cap < 8 ? 8 : stack->cap * 2;
+    cpath_dir_frame *frames =
+        (cpath_dir_frame*)CPATH_MALLOC(sizeof(cpath_dir_frame) * cap);
+    if (frames == NULL) {
+        errno = ENOMEM;
+        return 0;
+    }
+    for (size_t i = 0; i < stack->depth; i++) {
+        // the directories have no pointers into themselves so can be moved
+        _cpathDirMove(&frames[i].dir, &stack->frames[i].dir);
+        frames[i].pathLen = stack->frames[i].pathLen;
+    }
+#if defined CPATH_GETDENTS
+    // popped frames still hold on to their buffers
+    for (size_t i = 0; i < cap; i++) {
+        frames[i].buf = i < stack->cap ? stack->frames[i].buf : NULL;
+    }
+#endif
+    if (stack->frames != NULL) CPATH_FREE(stack->frames);
+    stack->frames = frames;
+    stack->cap = cap;
+    return 1;
+}
+
+#if defined CPATH_GETDENTS
+_CPATH_FUNC_
+char *_cpathDirStackBuf(cpath_dir_stack *stack) {
+    cpath_dir_frame *frame = &stack->frames[stack->depth];
+    if (frame->buf == NULL) {
+        frame->buf = (char*)CPATH_MALLOC(CPATH_GETDENTS_BUF_SIZE);
+        if (frame->buf == NULL) errno = ENOMEM;
+    }
+    return frame->buf;
+}
+#endif
+
+_CPATH_FUNC_
+int cpathDirStackOpen(cpath_dir_stack *stack, const cpath *path) {
+    if (stack == NULL || path == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    stack->frames = NULL;
+    stack->depth = 0;
+    stack->cap = 0;
+    if (!_cpathDirStackReserve(stack)) return 0;
+
+    cpath_dir_frame *frame = &stack->frames[0];
+#if defined CPATH_GETDENTS
+    char *buf = _cpathDirStackBuf(stack);
+    if (buf == NULL ||
+            !cpathOpenDirBuf(&frame->dir, path, buf, CPATH_GETDENTS_BUF_SIZE)) {
+#else
+    if (!cpathOpenDir(&frame->dir, path)) {
+#endif
+        cpathDirStackClose(stack);
+        return 0;
+    }
+    cpathCopy(&stack->path, path);
+    frame->pathLen = path->len;
+    stack->depth = 1;
+    return 1;
+}
+
+_CPATH_FUNC_
+void cpathDirStackClose(cpath_dir_stack *stack) {
+    if (stack == NULL) return;
+    while (cpathDirStackPop(stack)) {}
+#if defined CPATH_GETDENTS
+    for (size_t i = 0; i < stack->cap; i++) {
+        if (stack->frames[i].buf != NULL) CPATH_FREE(stack->frames[i].buf);
+    }
+#endif
+    if (stack->frames != NULL) CPATH_FREE(stack->frames);
+    stack->frames = NULL;
+    stack->cap = 0;
+}
+
+_CPATH_FUNC_
+cpath_dir *cpathDirStackTop(cpath_dir_stack *stack) {
+    if (stack == NULL || stack->depth == 0) return NULL;
+    return &stack->frames[stack->depth - 1].dir;
+}
+
+_CPATH_FUNC_
+int cpathDirStackNext(cpath_dir_stack *stack, cpath_file *file) {
+    cpath_dir *dir = cpathDirStackTop(stack);
+    if (dir == NULL || file == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    if (!_cpathPeekNextFileBase(dir, file, &stack->path)) return 0;
+    errno = 0;
+    if (dir->hasNext && !cpathMoveNextFile(dir) && errno != 0) return 0;
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathDirStackPush(cpath_dir_stack *stack, const cpath_file *file) {
+    if (stack == NULL || file == NULL || stack->depth == 0) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (!_cpathDirStackReserve(stack)) return 0;
+
+    size_t len = stack->path.len;
+    if (!cpathConcatStr(&stack->path, file->name)) return 0;
+
+    cpath_dir_frame *frame = &stack->frames[stack->depth];
+#if defined CPATH_HAS_OPENAT && defined CPATH_GETDENTS
+    char *buf = _cpathDirStackBuf(stack);
+    int res = buf != NULL &&
+              cpathOpenDirAtBuf(&frame->dir,
+                                &stack->frames[stack->depth - 1].dir,
+                                file->name, buf, CPATH_GETDENTS_BUF_SIZE);
+#elif defined CPATH_HAS_OPENAT
+    int res = cpathOpenDirAt(&frame->dir, &stack->frames[stack->depth - 1].dir,
+                             file->name);
+#else
+    int res = cpathOpenDir(&frame->dir, &stack->path);
+#endif
+    if (!res) {
+        stack->path.len = len;
+        stack->path.buf[len] = CPATH_STR('\0');
+        return 0;
+    }
+
+    frame->pathLen = len;
+    stack->depth++;
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathDirStackPop(cpath_dir_stack *stack) {
+    if (stack == NULL || stack->depth == 0) return 0;
+
+    cpath_dir_frame *frame = &stack->frames[--stack->depth];
+    cpathCloseDir(&frame->dir);
+    stack->path.len = frame->pathLen;
+    stack->path.buf[frame->pathLen] = CPATH_STR('\0');
+    return stack->depth > 0;
+}
+
+_CPATH_FUNC_
+void _cpathBfsListInit(cpath_bfs_list *list) {
+    list->items = NULL;
+    list->head = 0;
+    list->count = 0;
+    list->cap = 0;
+    list->names = NULL;
+    list->namesLen = 0;
+    list->namesCap = 0;
+}
+
+_CPATH_FUNC_
+void _cpathBfsListFree(cpath_bfs_list *list) {
+    if (list->items != NULL) CPATH_FREE(list->items);
+    if (list->names != NULL) CPATH_FREE(list->names);
+    _cpathBfsListInit(list);
+}
+
+_CPATH_FUNC_
+int _cpathBfsListPush(cpath_bfs_list *list, const cpath *path, int depth) {
+    // reuse the space of everything we've already popped
+    if (list->head > 0 && (list->count == list->cap ||
+            list->namesLen + path->len > list->namesCap)) {
+        size_t offset = list->items[list->head].name;
+        list->count -= list->head;
+        memmove(list->items, list->items + list->head,
+                sizeof(cpath_bfs_pending) * list->count);
+        memmove(list->names, list->names + offset,
+                sizeof(cpath_char_t) * (list->namesLen - offset));
+        list->namesLen -= offset;
+        for (size_t i = 0; i < list->count; i++) list->items[i].name -= offset;
+        list->head = 0;
+    }
+
+    if (list->count == list->cap) {
+        size_t cap = list->cap > 0 ? list->cap * 2 : 64;
+        if (!_cpathListingGrow((void**)&list->items, sizeof(cpath_bfs_pending),
+                               list->count, cap)) {
+            errno = ENOMEM;
+            return 0;
+        }
+        list->cap = cap;
+    }
+    if (list->namesLen + path->len > list->namesCap) {
+        size_t cap = list->namesCap > 0 ? list->namesCap * 2 : 4096;
+        while (cap < list->namesLen + path->len) cap *= 2;
+        if (!_cpathListingGrow((void**)&list->names, sizeof(cpath_char_t),
+                               list->namesLen, cap)) {
+            errno = ENOMEM;
+            return 0;
+        }
+        list->namesCap = cap;
+    }
+
+    cpath_bfs_pending *item = &list->items[list->count++];
+    item->name = list->namesLen;
+    item->len = path->len;
+    item->depth = depth;
+    memcpy(list->names + list->namesLen, path->buf,
+           sizeof(cpath_char_t) * path->len);
+    list->namesLen += path->len;
+    return 1;
+}
+
+// Takes from the front
+_CPATH_FUNC_
+int _cpathBfsListPop(cpath_bfs_list *list, cpath *path, int *depth) {
+    if (list->head == list->count) return 0;
+
+    cpath_bfs_pending *item = &list->items[list->head++];
+    memcpy(path->buf, list->names + item->name,
+           sizeof(cpath_char_t) * item->len);
+    path->len = item->len;
+    path->buf[path->len] = CPATH_STR('\0');
+    *depth = item->depth;
+
+    if (list->head == list->count) {
+        list->head = list->count = 0;
+        list->namesLen = 0;
+    }
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathBfsOpen(cpath_bfs *bfs, const cpath *path, size_t maxFrontier) {
+    if (bfs == NULL || path == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    bfs->dirOpen = 0;
+    bfs->depth = 0;
+    bfs->dirDepth = 0;
+    bfs->maxFrontier = maxFrontier;
+    _cpathBfsListInit(&bfs->queue);
+    bfs->deep.frames = NULL;
+    bfs->deep.depth = 0;
+    bfs->deep.cap = 0;
+    bfs->deepDepth = 0;
+    if (!cpathOpenDir(&bfs->dir, path)) return 0;
+    bfs->dirOpen = 1;
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathBfsNext(cpath_bfs *bfs, cpath_file *file) {
+    if (bfs == NULL || file == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    for (;;) {
+        int deep = bfs->deep.depth > 0;
+        cpath_dir *dir = deep ? cpathDirStackTop(&bfs->deep)
+                              : bfs->dirOpen ? &bfs->dir : NULL;
+        if (dir == NULL) {
+            cpath path;
+            if (!_cpathBfsListPop(&bfs->queue, &path, &bfs->dirDepth)) {
+                return 0;
+            }
+            bfs->dirOpen = cpathOpenDir(&bfs->dir, &path);
+            continue;
+        }
+
+        if (!(deep ? cpathDirStackNext(&bfs->deep, file)
+                   : cpathGetNextFile(dir, file))) {
+            if (cpathPeekNextName(dir, NULL) != NULL) {
+                // we couldn't load it (it's gone or too long) so skip it
+                cpathMoveNextFile(dir);
+            } else if (deep) {
+                if (!cpathDirStackPop(&bfs->deep)) {
+                    cpathDirStackClose(&bfs->deep);
+                }
+            } else {
+                cpathCloseDir(&bfs->dir);
+                bfs->dirOpen = 0;
+            }
+            continue;
+        }
+        if (cpathFileIsSpecialHardLink(file)) continue;
+
+        bfs->depth = deep ? bfs->deepDepth + (int)bfs->deep.depth - 1
+                          : bfs->dirDepth;
+        if (!file->isDir) return 1;
+
+        if (bfs->maxFrontier == 0 ||
+                bfs->queue.count - bfs->queue.head < bfs->maxFrontier) {
+            if (!_cpathBfsListPush(&bfs->queue, &file->path, bfs->depth + 1)) {
+                return 0;
+            }
+        } else if (deep) {
+            // directories we can't open are skipped
+            cpathDirStackPush(&bfs->deep, file);
+        } else if (cpathDirStackOpen(&bfs->deep, &file->path)) {
+            bfs->deepDepth = bfs->depth + 1;
+        }
+        return 1;
+    }
+}
+
+_CPATH_FUNC_
+void cpathBfsClose(cpath_bfs *bfs) {
+    if (bfs == NULL) return;
+
+    if (bfs->dirOpen) cpathCloseDir(&bfs->dir);
+    bfs->dirOpen = 0;
+    _cpathBfsListFree(&bfs->queue);
+    cpathDirStackClose(&bfs->deep);
+}
+
+_CPATH_FUNC_
+int cpathOpenFile(cpath_file *file, const cpath *path) {
+    // We want to efficiently open this file so unlike most libraries
+    // we won't use a directory search we will just find the given file
+    // or directly use stuff like dirname/basename!
+    cpath_dir dir;
+    int found = 0;
+
+    if (file == NULL || path == NULL || path->len == 0) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (path->len >= CPATH_MAX_PATH_LEN) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+
+    void *data = NULL;
+    void *handle = NULL;
+
+    cpathCopy(&file->path, path);
+
+#if defined _MSC_VER
+    WIN32_FIND_DATA findData;
+
+#if (defined WINAPI_FAMILY) && (WINAPI_FAMILY != WINAPI_FAMILY_DESKTOP_APP)
+    handle = FindFirstFileEx(path->buf, FindExInfoStandard, &findData,
+                                                                FindExSearchNameMatch, NULL, 0);
+#else
+    handle = FindFirstFile(path->buf, &findData);
+#endif
+
+    if (handle == INVALID_HANDLE_VALUE) {
+        errno = ENOENT;
+        return 0;
+    }
+
+    data = &findData;
+    cpath_str_copy(file->name, findData.cFileName);
+#else
+    // the name is just everything after the last separator
+    // (basename() can modify/return static storage so we do it ourselves)
+    const cpath_char_t *name = path->buf + path->len;
+    while (name > path->buf && name[-1] != CPATH_SEP &&
+            name[-1] != CPATH_OTHER_SEP) {
+        name--;
+    }
+    size_t nameLen = path->buf + path->len - name;
+    if (nameLen == 0) {
+        // i.e. '/'
+        name = path->buf;
+        nameLen = path->len;
+    }
+    if (nameLen >= CPATH_MAX_FILENAME_LEN) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    memcpy(file->name, name, sizeof(cpath_char_t) * nameLen);
+    file->name[nameLen] = CPATH_STR('\0');
+#endif
+    file->extension = NULL;
+    dir.dirent = NULL;
+    file->statLoaded = 0;
+    int res = cpathLoadFlags(&dir, file, data);
+#if defined _MSC_VER
+    FindClose((HANDLE)handle);
+#endif
+
+    return res;
+}
+
+_CPATH_FUNC_
+int cpathFileToDir(cpath_dir *dir, const cpath_file *file) {
+    if (dir == NULL || file == NULL || !file->isDir) {
+        errno = EINVAL;
+        return 0;
+    }
+    return cpathOpenDir(dir, &file->path);
+}
+
+_CPATH_FUNC_
+cpath_str cpathGetExtension(cpath_file *file) {
+    if (file->extension != NULL) return file->extension;
+
+    cpath_char_t *dot = cpath_str_find_last_char(file->name, CPATH_STR('.'));
+    if (dot != NULL) {
+        // extension
+        file->extension = dot + 1;
+    } else {
+        // no extension so set to CPATH_STR('\0')
+        file->extension = &file->name[cpath_str_length(file->name)];
+    }
+    return file->extension;
+}
+
+_CPATH_FUNC_
+cpath_time_t cpathGetLastAccess(cpath_file *file) {
+    if (!file->statLoaded) cpathGetFileInfo(file);
+
+#if defined _MSC_VER || defined __MINGW32__
+    // Idk todo
+#else
+    return file->stat.st_atime;
+#endif
+}
+
+_CPATH_FUNC_
+cpath_time_t cpathGetLastModification(cpath_file *file) {
+    if (!file->statLoaded) cpathGetFileInfo(file);
+
+#if defined _MSC_VER || defined __MINGW32__
+    // Idk todo
+#else
+    return file->stat.st_mtime;
+#endif
+}
+
+_CPATH_FUNC_
+cpath_offset_t cpathGetFileSize(cpath_file *file) {
+    if (!file->statLoaded) cpathGetFileInfo(file);
+
+#if defined _MSC_VER || defined __MINGW32__
+    // Idk todo
+#else
+    return file->stat.st_size;
+#endif
+}
+
+_CPATH_FUNC_
+void cpathSort(cpath_dir *dir, cpath_cmp cmp) {
+    if (dir->files == NULL) {
+        if (dir->size == -1) {
+            // bad, this means you try to sorted a directory before you preloaded
+            // in this case we'll just preload the files.  This is just to be nice
+            cpathLoadAllFiles(dir);
+        }
+
+        // this is fine just means no files in directory
+        if (dir->size == 0) {
+            return;
+        }
+    }
+    qsort(dir->files, dir->size, sizeof(struct cpath_dir_t), cmp);
+}
+
+static const cpath_char_t *prefixTableDecimal[] = {
+    CPATH_STR("kB"), CPATH_STR("MB"), CPATH_STR("GB"), CPATH_STR("TB"),
+    CPATH_STR("PB"), CPATH_STR("EB"), CPATH_STR("ZB"), CPATH_STR("YB"),
+};
+static const cpath_char_t *prefixTableDecimalUpper[] = {
+    CPATH_STR("KB"), CPATH_STR("MB"), CPATH_STR("GB"), CPATH_STR("TB"),
+    CPATH_STR("PB"), CPATH_STR("EB"), CPATH_STR("ZB"), CPATH_STR("YB"),
+};
+static const cpath_char_t *prefixTableDecimalLower[] = {
+    CPATH_STR("kb"), CPATH_STR("mb"), CPATH_STR("gb"), CPATH_STR("tb"),
+    CPATH_STR("pb"), CPATH_STR("eb"), CPATH_STR("zb"), CPATH_STR("yb"),
+};
+static const cpath_char_t *prefixTableIEC[] = {
+    CPATH_STR("KiB"), CPATH_STR("MiB"), CPATH_STR("GiB"), CPATH_STR("TiB"),
+    CPATH_STR("PiB"), CPATH_STR("EiB"), CPATH_STR("ZiB"), CPATH_STR("YiB"),
+};
+// identical to decimal upper but kept separate for the sake of readability
+static const cpath_char_t *prefixTableJEDEC[] = {
+    CPATH_STR("KB"), CPATH_STR("MB"), CPATH_STR("GB"), CPATH_STR("TB"),
+    CPATH_STR("PB"), CPATH_STR("EB"), CPATH_STR("ZB"), CPATH_STR("YB"),
+};
+
+_CPATH_FUNC_
+double cpathGetFileSizeDec(cpath_file *file, int intervalSize) {
+    return cpathGetSizeDec(cpathGetFileSize(file), intervalSize);
+}
+
+_CPATH_FUNC_
+const cpath_char_t *cpathGetFileSizeSuffix(cpath_file *file, CPathByteRep rep) {
+    return cpathGetSizeSuffix(cpathGetFileSize(file), rep);
+}
+
+_CPATH_FUNC_
+double cpathGetSizeDec(cpath_offset_t bytes, int intervalSize) {
+    double size = bytes;
+    int steps = 0;
+    while (size >= intervalSize / 2 && steps < 8) {
+        size /= intervalSize;
+        steps++;
+    }
+    return size;
+}
+
+_CPATH_FUNC_
+const cpath_char_t *cpathGetSizeSuffix(cpath_offset_t size, CPathByteRep rep) {
+    int word = (rep & BYTE_REP_LONG) == BYTE_REP_LONG;
+    int byte_word = (rep & BYTE_REP_BYTE_WORD) == BYTE_REP_BYTE_WORD;
+    // disable both them to make comparing easier
+    rep &= ~BYTE_REP_LONG;
+    rep &= ~BYTE_REP_BYTE_WORD;
+    int interval = rep == BYTE_REP_IEC || rep == BYTE_REP_JEDEC ? 1024 : 1000;
+
+    if (size < interval / 2) {
+        // then we just have a byte case
+        if (word || byte_word) {
+            return rep != BYTE_REP_DECIMAL_LOWER ? CPATH_STR("Bytes")
+                                                                                     : CPATH_STR("bytes");
+        } else {
+            return rep != BYTE_REP_DECIMAL_LOWER ? CPATH_STR("B")
+                                                                                     : CPATH_STR("b");
+        }
+    }
+
+    int steps = 0;
+    double size_flt = size;
+    while (size_flt >= interval / 2 && steps < 8) {
+        size_flt /= (double)interval;
+        steps++;
+    }
+
+    switch (rep) {
+        case BYTE_REP_IEC:            return prefixTableIEC[steps - 1];
+        case BYTE_REP_JEDEC:          return prefixTableJEDEC[steps - 1];
+        case BYTE_REP_DECIMAL:        return prefixTableDecimal[steps - 1];
+        case BYTE_REP_DECIMAL_LOWER:  return prefixTableDecimalLower[steps - 1];
+        case BYTE_REP_DECIMAL_UPPER:  return prefixTableDecimalUpper[steps - 1];
+        default: return NULL;
+    }
+}
+
+_CPATH_FUNC_
+void cpath_traverse(
+    cpath_dir *dir, int depth, int visit_subdirs, cpath_err_handler err,
+    cpath_traverse_it it, void *data
+) {
+    // currently implemented recursively
+    if (dir == NULL) {
+        errno = EINVAL;
+        if (err != NULL) err();
+        return;
+    }
+    cpath_file file;
+    while (cpathGetNextFile(dir, &file)) {
+        if (it != NULL) {
+            it(&file, dir, depth, data);
+        }
+        if (file.isDir && visit_subdirs && !cpathFileIsSpecialHardLink(&file)) {
+            cpath_dir tmp;
+            if (!cpathFileToDir(&tmp, &file)) {
+                if (err) err();
+                continue;
+            }
+            cpath_traverse(&tmp, depth + 1, visit_subdirs, err, it, data);
+            cpathCloseDir(&tmp);
+        }
+    }
+}
+
+_CPATH_FUNC_
+void cpathTraverseOptsInit(cpath_traverse_opts *opts) {
+    opts->prune = NULL;
+    opts->maxDepth = -1;
+    opts->maxEntries = 0;
+    opts->skipNames = NULL;
+    opts->skipNamesCount = 0;
+    opts->extensions = NULL;
+    opts->extensionsCount = 0;
+    opts->followLinks = 0;
+    opts->sameDevice = 0;
+    opts->mountPolicy = NULL;
+    opts->mounts = NULL;
+}
+
+#if defined CPATH_HAS_OPENAT
+_CPATH_FUNC_
+void cpathVisitedInit(cpath_visited *set) {
+    set->keys = NULL;
+    set->cap = 0;
+    set->count = 0;
+    set->hasZero = 0;
+}
+
+_CPATH_FUNC_
+void cpathVisitedFree(cpath_visited *set) {
+    if (set->keys != NULL) CPATH_FREE(set->keys);
+    cpathVisitedInit(set);
+}
+
+_CPATH_FUNC_
+cpath_visited_key *_cpathVisitedFind(cpath_visited_key *keys, size_t cap,
+                                     uint64_t dev, uint64_t ino) {
+    // inodes are mostly sequential so they need mixing
+    uint64_t h = (ino ^ (dev << 32 | dev >> 32)) * 0x9E3779B97F4A7C15ULL;
+    size_t mask = cap - 1;
+    for (size_t i = (size_t)(h >> 32) & mask;; i = (i + 1) & mask) {
+        cpath_visited_key *key = &keys[i];
+        if ((key->dev == dev && key->ino == ino) ||
+                (key->dev == 0 && key->ino == 0)) {
+            return key;
+        }
+    }
+}
+
+_CPATH_FUNC_
+int cpathVisitedAdd(cpath_visited *set, uint64_t dev, uint64_t ino, int *added) {
+    if (set == NULL || added == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    if (dev == 0 && ino == 0) {
+        *added = !set->hasZero;
+        set->hasZero = 1;
+        return 1;
+    }
+
+    // keep the load factor under a half
+    if ((set->count + 1) * 2 > set->cap) {
+        size_t cap = set->cap > 0 ? set->cap * 2 : 64;
+        cpath_visited_key *keys =
+            (cpath_visited_key*)CPATH_MALLOC(sizeof(cpath_visited_key) * cap);
+        if (keys == NULL) {
+            errno = ENOMEM;
+            return 0;
+        }
+        memset(keys, 0, sizeof(cpath_visited_key) * cap);
+        for (size_t i = 0; i < set->cap; i++) {
+            cpath_visited_key *key = &set->keys[i];
+            if (key->dev == 0 && key->ino == 0) continue;
+            *_cpathVisitedFind(keys, cap, key->dev, key->ino) = *key;
+        }
+        if (set->keys != NULL) CPATH_FREE(set->keys);
+        set->keys = keys;
+        set->cap = cap;
+    }
+
+    cpath_visited_key *key = _cpathVisitedFind(set->keys, set->cap, dev, ino);
+    *added = key->dev == 0 && key->ino == 0;
+    if (*added) {
+        key->dev = dev;
+        key->ino = ino;
+        set->count++;
+    }
+    return 1;
+}
+
+// Unescapes the octal escapes (i.e. \040 for a space) of mountinfo in place
+_CPATH_FUNC_
+void _cpathMountsUnescape(char *str) {
+    char *out = str;
+    for (; *str != '\0'; str++) {
+        if (str[0] == '\\' && str[1] >= '0' && str[1] <= '3' &&
+                str[2] >= '0' && str[2] <= '7' &&
+                str[3] >= '0' && str[3] <= '7') {
+            *out++ = (char)((str[1] - '0') * 64 + (str[2] - '0') * 8 +
+                            (str[3] - '0'));
+            str += 3;
+        } else {
+            *out++ = *str;
+        }
+    }
+    *out = '\0';
+}
+
+// Splits off the next space separated field (NULL if there isn't one)
+_CPATH_FUNC_
+char *_cpathMountsField(char **cursor) {
+    char *start = *cursor;
+    if (*start == '\0') return NULL;
+
+    char *end = strchr(start, ' ');
+    if (end != NULL) {
+        *end = '\0';
+        *cursor = end + 1;
+    } else {
+        *cursor = start + strlen(start);
+    }
+    return start;
+}
+
+_CPATH_FUNC_
+int cpathMountsLoad(cpath_mounts *mounts) {
+    if (mounts == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    mounts->mounts = NULL;
+    mounts->count = 0;
+    mounts->buf = NULL;
+
+#if !defined __linux__
+    errno = ENOSYS;
+    return 0;
+#else
+    CPATH_SYSCALL_HOOK("open");
+    int fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+
+    // proc files don't have a size so just keep reading
+    size_t cap = 16 * 1024;
+    size_t len = 0;
+    char *buf = (char*)CPATH_MALLOC(cap);
+    for (;;) {
+        if (buf != NULL && len + 1 == cap) {
+            cap *= 2;
+            if (!_cpathListingGrow((void**)&buf, 1, len, cap)) buf = NULL;
+        }
+        if (buf == NULL) {
+            close(fd);
+            errno = ENOMEM;
+            return 0;
+        }
+        CPATH_SYSCALL_HOOK("read");
+        ssize_t n = read(fd, buf + len, cap - len - 1);
+        if (n <= 0) break;
+        len += (size_t)n;
+    }
+    close(fd);
+    buf[len] = '\0';
+
+    size_t lines = 0;
+    for (size_t i = 0; i < len; i++) lines += buf[i] == '\n';
+    mounts->mounts = (cpath_mount*)CPATH_MALLOC(sizeof(cpath_mount) *
+                                                (lines + 1));
+    if (mounts->mounts == NULL) {
+        CPATH_FREE(buf);
+        errno = ENOMEM;
+        return 0;
+    }
+    mounts->buf = buf;
+
+    // id parent major:minor root mountPoint options [optional...] - type
+    // source superOptions
+    char *line = buf;
+    while (*line != '\0') {
+        char *next = strchr(line, '\n');
+        if (next != NULL) {
+            *next++ = '\0';
+        } else {
+            next = line + strlen(line);
+        }
+
+        char *cursor = line;
+        char *fields[5];
+        size_t found = 0;
+        while (found < 5 && (fields[found] = _cpathMountsField(&cursor)) != NULL) {
+            found++;
+        }
+
+        char *field = NULL;
+        while (found == 5 && (field = _cpathMountsField(&cursor)) != NULL &&
+               strcmp(field, "-") != 0) {
+        }
+        char *type = field != NULL ? _cpathMountsField(&cursor) : NULL;
+        char *source = type != NULL ? _cpathMountsField(&cursor) : NULL;
+        char *minor = found == 5 ? strchr(fields[2], ':') : NULL;
+        if (source != NULL && minor != NULL) {
+            cpath_mount *mount = &mounts->mounts[mounts->count++];
+            mount->dev = (uint64_t)makedev(strtoul(fields[2], NULL, 10),
+                                           strtoul(minor + 1, NULL, 10));
+            _cpathMountsUnescape(fields[4]);
+            _cpathMountsUnescape(source);
+            mount->mountPoint = fields[4];
+            mount->fsType = type;
+            mount->source = source;
+        }
+        line = next;
+    }
+    return 1;
+#endif
+}
+
+_CPATH_FUNC_
+void cpathMountsFree(cpath_mounts *mounts) {
+    if (mounts == NULL) return;
+    if (mounts->mounts != NULL) CPATH_FREE(mounts->mounts);
+    if (mounts->buf != NULL) CPATH_FREE(mounts->buf);
+    mounts->mounts = NULL;
+    mounts->count = 0;
+    mounts->buf = NULL;
+}
+
+_CPATH_FUNC_
+const cpath_mount *cpathMountsFind(const cpath_mounts *mounts, uint64_t dev) {
+    if (mounts == NULL) return NULL;
+    // there are only ever a few of them and we only look when we cross one
+    for (size_t i = 0; i < mounts->count; i++) {
+        if (mounts->mounts[i].dev == dev) return &mounts->mounts[i];
+    }
+    return NULL;
+}
+#endif
+
+// 1 if the next entry is a directory, 0 if it isn't and -1 if we don't know
+_CPATH_FUNC_
+int _cpathPeekNextIsDir(cpath_dir *dir) {
+#if defined _MSC_VER
+    return FILE_IS(dir->findData, DIRECTORY);
+#else
+    if (dir->dirent == NULL || dir->dirent->d_type == DT_UNKNOWN) return -1;
+    return dir->dirent->d_type == DT_DIR;
+#endif
+}
+
+_CPATH_FUNC_
+int _cpathTraverseNameIn(const cpath_char_t *name, size_t len,
+                         const cpath_char_t **names, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (!cpath_str_compare_safe(names[i], name, len) &&
+                names[i][len] == CPATH_STR('\0')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Same as cpathGetExtension (everything after the last '.')
+_CPATH_FUNC_
+int _cpathTraverseHasExtension(const cpath_char_t *name, size_t len,
+                               const cpath_traverse_opts *opts) {
+    size_t dot = len;
+    while (dot > 0 && name[dot - 1] != CPATH_STR('.')) dot--;
+    if (dot == 0) return 0;
+    return _cpathTraverseNameIn(name + dot, len - dot, opts->extensions,
+                                opts->extensionsCount);
+}
+
+typedef struct _cpath_traverse_state_t {
+    size_t visited;
+#if defined CPATH_HAS_OPENAT
+    // only when following links
+    cpath_visited *seen;
+    // if we need to know the device (and inode) of directories
+    int needStat;
+#endif
+} _cpath_traverse_state;
+
+_CPATH_FUNC_
+int _cpathTraverseEx(
+    cpath_dir *dir, int depth, const cpath_traverse_opts *opts,
+    cpath_err_handler err, cpath_traverse_it it, void *data, uint64_t dev,
+    _cpath_traverse_state *state
+) {
+    const cpath_char_t *name;
+    size_t len;
+    cpath_file file;
+#if defined CPATH_HAS_OPENAT
+    struct stat target;
+#endif
+    while ((name = cpathPeekNextName(dir, &len)) != NULL) {
+        int special = name[0] == CPATH_STR('.') &&
+                      (len == 1 || (len == 2 && name[1] == CPATH_STR('.')));
+        if (_cpathTraverseNameIn(name, len, opts->skipNames,
+                                 opts->skipNamesCount)) {
+            cpathMoveNextFile(dir);
+            continue;
+        }
+
+        // try to decide everything before we build the file
+        int isDir = _cpathPeekNextIsDir(dir);
+#if defined CPATH_HAS_OPENAT
+        int followed = 0;
+        // links could be directories
+        if (state->seen != NULL && isDir == 0 &&
+                dir->dirent->d_type == DT_LNK) {
+            isDir = -1;
+        }
+#endif
+        if (isDir == 0 && opts->extensionsCount > 0 &&
+                !_cpathTraverseHasExtension(name, len, opts)) {
+            cpathMoveNextFile(dir);
+            continue;
+        }
+        if (isDir == 1 && !special && opts->prune != NULL &&
+                opts->prune(name, len, dir, depth, data)) {
+            cpathMoveNextFile(dir);
+            continue;
+        }
+
+        if (!cpathGetNextFile(dir, &file)) {
+            if (err) err();
+            // a failed peek doesn't move along so skip it ourselves
+            cpathMoveNextFile(dir);
+            continue;
+        }
+        if (isDir == -1) {
+            // we had to build the file to find out what it is
+            // NOTE: name isn't valid anymore since we moved along
+            len = cpath_str_length(file.name);
+#if defined CPATH_HAS_OPENAT
+            if (state->seen != NULL && file.isSym) {
+                // broken links are just given back as is
+                CPATH_SYSCALL_HOOK("stat");
+                if (stat(file.path.buf, &target) == 0) {
+                    followed = 1;
+                    file.isDir = S_ISDIR(target.st_mode);
+                    file.isReg = S_ISREG(target.st_mode);
+                }
+            }
+#endif
+            if (!file.isDir && opts->extensionsCount > 0 &&
+                    !_cpathTraverseHasExtension(file.name, len, opts)) {
+                continue;
+            }
+            if (file.isDir && !special && opts->prune != NULL &&
+                    opts->prune(file.name, len, dir, depth, data)) {
+                continue;
+            }
+        }
+
+        int enter = file.isDir && !special &&
+                    (opts->maxDepth < 0 || depth < opts->maxDepth);
+#if defined CPATH_HAS_OPENAT
+        // only directories are stat'd and `it` gets to use it too
+        if (enter && state->needStat && !followed) {
+            if (cpathGetFileInfo(&file)) {
+                target = file.stat;
+            } else {
+                if (err) err();
+                enter = 0;
+            }
+        }
+#endif
+
+        if (it != NULL && (!file.isDir || opts->extensionsCount == 0)) {
+            it(&file, dir, depth, data);
+            if (++state->visited == opts->maxEntries) return 0;
+        }
+        if (!enter) continue;
+
+        uint64_t childDev = dev;
+#if defined CPATH_HAS_OPENAT
+        if (state->needStat) {
+            childDev = (uint64_t)target.st_dev;
+            if (childDev != dev) {
+                if (opts->sameDevice) continue;
+                if (opts->mountPolicy != NULL &&
+                        opts->mountPolicy(&file,
+                                          cpathMountsFind(opts->mounts, childDev),
+                                          data)) {
+                    continue;
+                }
+            }
+        }
+
+        // check before opening it (bind mounts can loop too)
+        int added = 1;
+        if (state->seen != NULL &&
+                !cpathVisitedAdd(state->seen, childDev,
+                                 (uint64_t)target.st_ino, &added)) {
+            if (err) err();
+            continue;
+        }
+        if (!added) continue;
+#endif
+
+        cpath_dir tmp;
+        if (!cpathFileToDir(&tmp, &file)) {
+            if (err) err();
+            continue;
+        }
+        int res = _cpathTraverseEx(&tmp, depth + 1, opts, err, it, data,
+                                   childDev, state);
+        cpathCloseDir(&tmp);
+        if (!res) return 0;
+    }
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpath_traverse_ex(
+    cpath_dir *dir, int depth, const cpath_traverse_opts *opts,
+    cpath_err_handler err, cpath_traverse_it it, void *data
+) {
+    if (dir == NULL) {
+        errno = EINVAL;
+        if (err != NULL) err();
+        return 0;
+    }
+
+    cpath_traverse_opts defaults;
+    if (opts == NULL) {
+        cpathTraverseOptsInit(&defaults);
+        opts = &defaults;
+    }
+
+    _cpath_traverse_state state;
+    uint64_t dev = 0;
+    state.visited = 0;
+#if defined CPATH_HAS_OPENAT
+    cpath_visited seen;
+    struct stat st;
+    state.seen = opts->followLinks ? &seen : NULL;
+    state.needStat = opts->followLinks || opts->sameDevice ||
+                     opts->mountPolicy != NULL;
+    if (state.needStat) {
+        CPATH_SYSCALL_HOOK("stat");
+        if (fstat(_cpathDirFd(dir), &st) == -1) {
+            if (err != NULL) err();
+            return 0;
+        }
+        dev = (uint64_t)st.st_dev;
+    }
+    if (state.seen != NULL) {
+        int added;
+        cpathVisitedInit(&seen);
+        cpathVisitedAdd(&seen, dev, (uint64_t)st.st_ino, &added);
+    }
+#endif
+
+    int res = _cpathTraverseEx(dir, depth, opts, err, it, data, dev, &state);
+#if defined CPATH_HAS_OPENAT
+    if (state.seen != NULL) cpathVisitedFree(&seen);
+#endif
+    return res;
+}
+
+#if defined CPATH_HAS_OPENAT
+/*
+    buf == NULL means allocate one (only used for getdents).
+*/
+_CPATH_FUNC_
+int _cpathOpenDirAt(cpath_dir *dir, cpath_dir *parent, const cpath_char_t *name,
+                    void *buf, size_t size) {
+#if !defined CPATH_GETDENTS
+    (void)buf;
+    (void)size;
+#endif
+
+    CPATH_SYSCALL_HOOK("open");
+    int fd = openat(_cpathDirFd(parent), name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return 0;
+
+    dir->files = NULL;
+    dir->size = -1;
+    dir->parent = NULL;
+    dir->pool = NULL;
+    dir->deferStat = 0;
+    dir->hasNext = 1;
+    dir->path.buf[0] = CPATH_STR('\0');
+    dir->path.len = 0;
+    dir->dirent = NULL;
+
+#if defined CPATH_GETDENTS
+    dir->fd = fd;
+    dir->bufPos = 0;
+    dir->bufLen = 0;
+    if (buf != NULL) {
+        dir->buf = (char*)buf;
+        dir->bufSize = size;
+        dir->ownsBuf = 0;
+    } else {
+        dir->buf = (char*)CPATH_MALLOC(CPATH_GETDENTS_BUF_SIZE);
+        dir->bufSize = CPATH_GETDENTS_BUF_SIZE;
+        dir->ownsBuf = 1;
+        if (dir->buf == NULL) {
+            cpathCloseDir(dir);
+            errno = ENOMEM;
+            return 0;
+        }
+    }
+    dir->dirent = _cpathGetdentsNext(dir);
+#else
+    dir->dir = fdopendir(fd);
+    if (dir->dir == NULL) {
+        close(fd);
+        return 0;
+    }
+    CPATH_SYSCALL_HOOK("read");
+    dir->dirent = _cpath_readdir(dir->dir);
+#endif
+    // empty directory
+    if (dir->dirent == NULL) dir->hasNext = 0;
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathOpenDirAt(cpath_dir *dir, cpath_dir *parent, const cpath_char_t *name) {
+    if (dir == NULL || parent == NULL || name == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    return _cpathOpenDirAt(dir, parent, name, NULL, 0);
+}
+
+#if defined CPATH_GETDENTS
+_CPATH_FUNC_
+int cpathOpenDirAtBuf(cpath_dir *dir, cpath_dir *parent,
+                      const cpath_char_t *name, void *buf, size_t size) {
+    if (dir == NULL || parent == NULL || name == NULL || buf == NULL ||
+            size < sizeof(cpath_dirent_t)) {
+        errno = EINVAL;
+        return 0;
+    }
+    return _cpathOpenDirAt(dir, parent, name, buf, size);
+}
+#endif
+
+_CPATH_FUNC_
+int cpathEntryGetInfo(cpath_entry *entry) {
+    if (entry->statLoaded) {
+        return 1;
+    }
+    CPATH_SYSCALL_HOOK("stat");
+    if (fstatat(_cpathDirFd(entry->dir), entry->name, &entry->stat, AT_SYMLINK_NOFOLLOW) == -1) {
+        return 0;
+    }
+    entry->statLoaded = 1;
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathEntryGetPath(const cpath_entry *entry, cpath *out) {
+    if (entry == NULL || out == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    if (entry->parent == NULL) {
+        cpathCopy(out, &entry->dir->path);
+    } else if (!cpathEntryGetPath(entry->parent, out)) {
+        return 0;
+    }
+    return cpathConcatStrn(out, entry->name, entry->nameLen);
+}
+
+_CPATH_FUNC_
+int cpathEntryToFile(const cpath_entry *entry, cpath_file *file) {
+    if (entry == NULL || file == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (entry->nameLen >= CPATH_MAX_FILENAME_LEN) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    if (!cpathEntryGetPath(entry, &file->path)) return 0;
+
+    memcpy(file->name, entry->name, sizeof(cpath_char_t) * (entry->nameLen + 1));
+    file->isDir = entry->isDir;
+    file->isReg = entry->isReg;
+    file->isSym = entry->isSym;
+    file->statLoaded = entry->statLoaded;
+    if (entry->statLoaded) file->stat = entry->stat;
+    file->extension = NULL;
+#ifndef CPATH_NO_AUTOLOAD_EXT
+    cpathGetExtension(file);
+#endif
+    return 1;
+}
+
+_CPATH_FUNC_
+void _cpathTraverseAt(
+    cpath_dir *dir, const cpath_entry *parent, int depth, int visit_subdirs,
+    cpath_err_handler err, cpath_traverse_at_it it, void *data
+) {
+    cpath_entry entry;
+    entry.dir = dir;
+    entry.parent = parent;
+
+    // NOTE: the name points into the directory's buffer which we don't
+    //       touch until we move along, so it's fine for children to use it
+    while ((entry.name = cpathPeekNextName(dir, &entry.nameLen)) != NULL) {
+        entry.statLoaded = 0;
+        if (dir->dirent->d_type == DT_UNKNOWN) {
+            if (!cpathEntryGetInfo(&entry)) {
+                if (err) err();
+                cpathMoveNextFile(dir);
+                continue;
+            }
+            entry.isDir = S_ISDIR(entry.stat.st_mode);
+            entry.isReg = S_ISREG(entry.stat.st_mode);
+            entry.isSym = S_ISLNK(entry.stat.st_mode);
+        } else {
+            entry.isDir = dir->dirent->d_type == DT_DIR;
+            entry.isReg = dir->dirent->d_type == DT_REG;
+            entry.isSym = dir->dirent->d_type == DT_LNK;
+        }
+#ifdef CPATH_AUTOLOAD_STAT
+        if (!cpathEntryGetInfo(&entry) && err) err();
+#endif
+
+        if (it != NULL) {
+            it(&entry, depth, data);
+        }
+
+        int special = entry.name[0] == CPATH_STR('.') && (entry.nameLen == 1 ||
+                      (entry.nameLen == 2 && entry.name[1] == CPATH_STR('.')));
+        if (entry.isDir && visit_subdirs && !special) {
+            cpath_dir tmp;
+            if (!cpathOpenDirAt(&tmp, dir, entry.name)) {
+                if (err) err();
+            } else {
+                _cpathTraverseAt(&tmp, &entry, depth + 1, visit_subdirs, err,
+                                 it, data);
+                cpathCloseDir(&tmp);
+            }
+        }
+
+        cpathMoveNextFile(dir);
+    }
+}
+
+_CPATH_FUNC_
+void cpath_traverse_at(
+    cpath_dir *dir, int depth, int visit_subdirs, cpath_err_handler err,
+    cpath_traverse_at_it it, void *data
+) {
+    if (dir == NULL) {
+        errno = EINVAL;
+        if (err != NULL) err();
+        return;
+    }
+    _cpathTraverseAt(dir, NULL, depth, visit_subdirs, err, it, data);
+}
+#endif
+
+_CPATH_FUNC_
+void _cpathTraverseStat(
+    cpath_dir *dir, int depth, int visit_subdirs, cpath_err_handler err,
+    cpath_traverse_it it, void *data, cpath_stat_batch *batch
+) {
+    if (!cpathLoadAllFilesStat(dir, batch) && err != NULL) err();
+
+    for (size_t i = 0; i < dir->size; i++) {
+        cpath_file *file = &dir->files[i];
+        if (it != NULL) {
+            it(file, dir, depth, data);
+        }
+        if (file->isDir && visit_subdirs && !cpathFileIsSpecialHardLink(file)) {
+            cpath_dir tmp;
+            if (!cpathFileToDir(&tmp, file)) {
+                if (err) err();
+                continue;
+            }
+            _cpathTraverseStat(&tmp, depth + 1, visit_subdirs, err, it, data,
+                               batch);
+            cpathCloseDir(&tmp);
+        }
+    }
+}
+
+_CPATH_FUNC_
+void cpath_traverse_stat(
+    cpath_dir *dir, int depth, int visit_subdirs, cpath_err_handler err,
+    cpath_traverse_it it, void *data
+) {
+    if (dir == NULL) {
+        errno = EINVAL;
+        if (err != NULL) err();
+        return;
+    }
+    // one batch (and so one ring) is shared for the whole traversal
+    cpath_stat_batch batch;
+    cpathStatBatchInit(&batch);
+    _cpathTraverseStat(dir, depth, visit_subdirs, err, it, data, &batch);
+    cpathStatBatchFree(&batch);
+}
+
+#if defined CPATH_PARALLEL && !defined _MSC_VER
+typedef struct _cpath_parallel_thread_t {
+    cpath_parallel *pool;
+    int worker;
+} _cpath_parallel_thread;
+
+typedef struct _cpath_parallel_traverse_t {
+    cpath_traverse_it it;
+    void *data;
+} _cpath_parallel_traverse;
+
+_CPATH_FUNC_
+cpath_char_t *cpathParallelJobPath(cpath_parallel_job *job) {
+    return (cpath_char_t*)(job + 1);
+}
+
+_CPATH_FUNC_
+int cpathParallelInit(cpath_parallel *pool, int threads, cpath_parallel_fn fn,
+                      cpath_err_handler err, void *data) {
+    if (pool == NULL || fn == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+    if (threads > CPATH_PARALLEL_MAX_THREADS) {
+        threads = CPATH_PARALLEL_MAX_THREADS;
+    }
+
+    pool->deques = (cpath_parallel_deque*)
+        CPATH_MALLOC(sizeof(cpath_parallel_deque) * threads);
+    if (pool->deques == NULL) {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->deques[i].jobs = NULL;
+        pool->deques[i].head = 0;
+        pool->deques[i].count = 0;
+        pool->deques[i].cap = 0;
+    }
+
+    pool->threads = threads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->pending = 0;
+    pool->pushes = 0;
+    pool->fn = fn;
+    pool->err = err;
+    pool->data = data;
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathParallelPush(cpath_parallel *pool, int worker, const cpath_char_t *path,
+                      size_t len, int depth, size_t tag) {
+    if (pool == NULL || path == NULL || worker < 0 || worker >= pool->threads) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    cpath_parallel_job *job = (cpath_parallel_job*)CPATH_MALLOC(
+        sizeof(cpath_parallel_job) + sizeof(cpath_char_t) * (len + 1));
+    if (job == NULL) {
+        errno = ENOMEM;
+        return 0;
+    }
+    job->depth = depth;
+    job->tag = tag;
+    job->len = len;
+    memcpy(cpathParallelJobPath(job), path, sizeof(cpath_char_t) * len);
+    cpathParallelJobPath(job)[len] = CPATH_STR('\0');
+
+    cpath_parallel_deque *deque = &pool->deques[worker];
+    // we hold the pool lock while pushing so that a sleeping worker
+    // can never miss a push (and pending never hits 0 early)
+    pthread_mutex_lock(&pool->lock);
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->cap) {
+        size_t cap = deque->cap == 0 ? 64 : deque->cap * 2;
+        cpath_parallel_job **jobs = (cpath_parallel_job**)
+            CPATH_MALLOC(sizeof(cpath_parallel_job*) * cap);
+        if (jobs == NULL) {
+            pthread_mutex_unlock(&deque->lock);
+            pthread_mutex_unlock(&pool->lock);
+            CPATH_FREE(job);
+            errno = ENOMEM;
+            return 0;
+        }
+        for (size_t i = 0; i < deque->count; i++) {
+            jobs[i] = deque->jobs[(deque->head + i) % deque->cap];
+        }
+        if (deque->jobs != NULL) CPATH_FREE(deque->jobs);
+        deque->jobs = jobs;
+        deque->head = 0;
+        deque->cap = cap;
+    }
+    deque->jobs[(deque->head + deque->count) % deque->cap] = job;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+
+    pool->pending++;
+    pool->pushes++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return 1;
+}
+
+_CPATH_FUNC_
+cpath_parallel_job *_cpathParallelTake(cpath_parallel *pool, int worker) {
+    cpath_parallel_job *job = NULL;
+    cpath_parallel_deque *own = &pool->deques[worker];
+
+    // our own work is taken from the tail
+    pthread_mutex_lock(&own->lock);
+    if (own->count > 0) {
+        own->count--;
+        job = own->jobs[(own->head + own->count) % own->cap];
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    // then we try to steal from the head of everyone else
+    for (int i = 1; i < pool->threads && job == NULL; i++) {
+        cpath_parallel_deque *victim = &pool->deques[(worker + i) % pool->threads];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->count > 0) {
+            job = victim->jobs[victim->head];
+            victim->head = (victim->head + 1) % victim->cap;
+            victim->count--;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    return job;
+}
+
+_CPATH_FUNC_
+void _cpathParallelWork(cpath_parallel *pool, int worker) {
+    for (;;) {
+        cpath_parallel_job *job = _cpathParallelTake(pool, worker);
+        if (job == NULL) {
+            // remember how many pushes we have seen so if anything is pushed
+            // between us looking and us sleeping we won't sleep through it
+            pthread_mutex_lock(&pool->lock);
+            size_t seen = pool->pushes;
+            pthread_mutex_unlock(&pool->lock);
+
+            job = _cpathParallelTake(pool, worker);
+            if (job == NULL) {
+                int finished;
+                pthread_mutex_lock(&pool->lock);
+                while (pool->pending > 0 && pool->pushes == seen) {
+                    pthread_cond_wait(&pool->cond, &pool->lock);
+                }
+                finished = pool->pending == 0;
+                pthread_mutex_unlock(&pool->lock);
+                if (finished) return;
+                continue;
+            }
+        }
+
+        pool->fn(pool, worker, job);
+        CPATH_FREE(job);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->pending--;
+        if (pool->pending == 0) pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+_CPATH_FUNC_
+void *_cpathParallelThread(void *arg) {
+    _cpath_parallel_thread *thread = (_cpath_parallel_thread*)arg;
+    _cpathParallelWork(thread->pool, thread->worker);
+    return NULL;
+}
+
+_CPATH_FUNC_
+void cpathParallelRun(cpath_parallel *pool) {
+    pthread_t handles[CPATH_PARALLEL_MAX_THREADS];
+    _cpath_parallel_thread args[CPATH_PARALLEL_MAX_THREADS];
+    int started = 1;
+
+    for (int i = 1; i < pool->threads; i++) {
+        args[i].pool = pool;
+        args[i].worker = i;
+        // if we can't make any more threads we'll just continue with less
+        // no work is lost since only the owner pushes onto its deque
+        if (pthread_create(&handles[i], NULL, _cpathParallelThread, &args[i])) {
+            break;
+        }
+        started++;
+    }
+
+    _cpathParallelWork(pool, 0);
+    for (int i = 1; i < started; i++) {
+        pthread_join(handles[i], NULL);
+    }
+}
+
+_CPATH_FUNC_
+void cpathParallelFree(cpath_parallel *pool) {
+    if (pool == NULL || pool->deques == NULL) return;
+
+    for (int i = 0; i < pool->threads; i++) {
+        cpath_parallel_deque *deque = &pool->deques[i];
+        for (size_t j = 0; j < deque->count; j++) {
+            CPATH_FREE(deque->jobs[(deque->head + j) % deque->cap]);
+        }
+        if (deque->jobs != NULL) CPATH_FREE(deque->jobs);
+        pthread_mutex_destroy(&deque->lock);
+    }
+    CPATH_FREE(pool->deques);
+    pool->deques = NULL;
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+}
+
+_CPATH_FUNC_
+void _cpathParallelVisit(cpath_parallel *pool, int worker, cpath_dir *dir,
+                         int depth) {
+    _cpath_parallel_traverse *ctx = (_cpath_parallel_traverse*)pool->data;
+    cpath_file file;
+    while (cpathGetNextFile(dir, &file)) {
+        if (ctx->it != NULL) {
+            ctx->it(&file, dir, depth, ctx->data);
+        }
+        if (file.isDir && !cpathFileIsSpecialHardLink(&file) &&
+                !cpathParallelPush(pool, worker, file.path.buf, file.path.len,
+                                   depth + 1, 0)) {
+            if (pool->err) pool->err();
+        }
+    }
+}
+
+_CPATH_FUNC_
+void _cpathParallelTraverseJob(cpath_parallel *pool, int worker,
+                               cpath_parallel_job *job) {
+    cpath path;
+    cpath_dir dir;
+    memcpy(path.buf, cpathParallelJobPath(job), sizeof(cpath_char_t) * (job->len + 1));
+    path.len = job->len;
+    if (!cpathOpenDir(&dir, &path)) {
+        if (pool->err) pool->err();
+        return;
+    }
+    _cpathParallelVisit(pool, worker, &dir, job->depth);
+    cpathCloseDir(&dir);
+}
+
+_CPATH_FUNC_
+void cpath_traverse_parallel(
+    cpath_dir *dir, int depth, int visit_subdirs, cpath_err_handler err,
+    cpath_traverse_it it, void *data, int threads
+) {
+    if (dir == NULL) {
+        errno = EINVAL;
+        if (err != NULL) err();
+        return;
+    }
+    if (!visit_subdirs || threads == 1) {
+        cpath_traverse(dir, depth, visit_subdirs, err, it, data);
+        return;
+    }
+
+    _cpath_parallel_traverse ctx;
+    ctx.it = it;
+    ctx.data = data;
+    cpath_parallel pool;
+    if (!cpathParallelInit(&pool, threads, _cpathParallelTraverseJob, err, &ctx)) {
+        if (err != NULL) err();
+        return;
+    }
+
+    // the root is read on this thread which seeds worker 0's deque
+    // and then everyone else will steal from there.
+    _cpathParallelVisit(&pool, 0, dir, depth);
+    cpathParallelRun(&pool);
+    cpathParallelFree(&pool);
+}
+#endif
+
+_CPATH_FUNC_
+int cpathMkdir(const cpath *path) {
+#if defined _MSC_VER || __MINGW32__
+    return CreateDirectory(path->buf, NULL);
+#else
+    return mkdir(path->buf, 0700) == 0;
+#endif
+}
+
+_CPATH_FUNC_
+FILE *cpathOpen(const cpath *path, const cpath_char_t *mode) {
+    return cpath_fopen(path->buf, mode);
+}
+
+/* == Glob == */
+
+// Length of the [...] class at p (0 if it is never closed)
+_CPATH_FUNC_
+size_t _cpathGlobClassLen(const cpath_char_t *p, size_t n) {
+    size_t i = 1;
+    if (i < n && (p[i] == CPATH_STR('!') || p[i] == CPATH_STR('^'))) i++;
+    // a leading ']' is part of the class
+    if (i < n && p[i] == CPATH_STR(']')) i++;
+    while (i < n && p[i] != CPATH_STR(']')) i++;
+    return i < n ? i + 1 : 0;
+}
+
+_CPATH_FUNC_
+int _cpathGlobClassMatch(const cpath_char_t *p, size_t len, cpath_char_t c) {
+    size_t i = 1;
+    int negate = 0;
+    if (p[i] == CPATH_STR('!') || p[i] == CPATH_STR('^')) {
+        negate = 1;
+        i++;
+    }
+
+    int match = 0;
+    for (size_t end = len - 1; i < end; i++) {
+        if (i + 2 < end && p[i + 1] == CPATH_STR('-')) {
+            if (c >= p[i] && c <= p[i + 2]) match = 1;
+            i += 2;
+        } else if (p[i] == c) {
+            match = 1;
+        }
+    }
+    return match != negate;
+}
+
+/*
+    Matches a single (brace free) alternative against a name, on a mismatch
+    we only ever go back to the last star so this is linear for most
+    patterns and O(n * m) at worst.
+*/
+_CPATH_FUNC_
+int _cpathGlobMatchStrn(const cpath_char_t *p, size_t pn,
+                        const cpath_char_t *s, size_t sn) {
+    size_t pi = 0;
+    size_t si = 0;
+    size_t starP = 0;
+    size_t starS = 0;
+    int star = 0;
+
+    while (si < sn) {
+        if (pi < pn) {
+            cpath_char_t c = p[pi];
+            if (c == CPATH_STR('*')) {
+                star = 1;
+                starP = ++pi;
+                starS = si;
+                continue;
+            } else if (c == CPATH_STR('?')) {
+                pi++;
+                si++;
+                continue;
+            } else if (c == CPATH_STR('[')) {
+                size_t len = _cpathGlobClassLen(p + pi, pn - pi);
+                if (len > 0 ? _cpathGlobClassMatch(p + pi, len, s[si])
+                            : s[si] == c) {
+                    pi += len > 0 ? len : 1;
+                    si++;
+                    continue;
+                }
+            } else if (s[si] == c) {
+                pi++;
+                si++;
+                continue;
+            }
+        }
+
+        if (!star) return 0;
+        // let the last star eat one more character
+        pi = starP;
+        si = ++starS;
+    }
+
+    while (pi < pn && p[pi] == CPATH_STR('*')) pi++;
+    return pi == pn;
+}
+
+_CPATH_FUNC_
+void cpathGlobPatternInit(cpath_glob_pattern *pattern) {
+    pattern->segments = NULL;
+    pattern->count = 0;
+    pattern->altOffsets = NULL;
+    pattern->altLens = NULL;
+    pattern->alts = 0;
+    pattern->altsCap = 0;
+    pattern->buf = NULL;
+    pattern->bufLen = 0;
+    pattern->bufCap = 0;
+    pattern->absolute = 0;
+}
+
+_CPATH_FUNC_
+void cpathGlobPatternFree(cpath_glob_pattern *pattern) {
+    if (pattern->segments != NULL) CPATH_FREE(pattern->segments);
+    if (pattern->altOffsets != NULL) CPATH_FREE(pattern->altOffsets);
+    if (pattern->altLens != NULL) CPATH_FREE(pattern->altLens);
+    if (pattern->buf != NULL) CPATH_FREE(pattern->buf);
+    cpathGlobPatternInit(pattern);
+}
+
+_CPATH_FUNC_
+int _cpathGlobPushAlt(cpath_glob_pattern *pattern, const cpath_char_t *str,
+                      size_t len) {
+    if (pattern->alts == CPATH_GLOB_MAX_ALTERNATIVES) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (pattern->alts == pattern->altsCap) {
+        size_t cap = pattern->altsCap > 0 ? pattern->altsCap * 2 : 16;
+        if (!_cpathListingGrow((void**)&pattern->altOffsets, sizeof(size_t),
+                               pattern->alts, cap) ||
+                !_cpathListingGrow((void**)&pattern->altLens, sizeof(size_t),
+                                   pattern->alts, cap)) {
+            errno = ENOMEM;
+            return 0;
+        }
+        pattern->altsCap = cap;
+    }
+    if (pattern->bufLen + len > pattern->bufCap) {
+        size_t cap = pattern->bufCap > 0 ? pattern->bufCap * 2 : 256;
+        while (cap < pattern->bufLen + len) cap *= 2;
+        if (!_cpathListingGrow((void**)&pattern->buf, sizeof(cpath_char_t),
+                               pattern->bufLen, cap)) {
+            errno = ENOMEM;
+            return 0;
+        }
+        pattern->bufCap = cap;
+    }
+
+    memcpy(pattern->buf + pattern->bufLen, str, sizeof(cpath_char_t) * len);
+    pattern->altOffsets[pattern->alts] = pattern->bufLen;
+    pattern->altLens[pattern->alts] = len;
+    pattern->bufLen += len;
+    pattern->alts++;
+    return 1;
+}
+
+// Expands the first brace of str (recursively) pushing every alternative
+_CPATH_FUNC_
+int _cpathGlobExpand(cpath_glob_pattern *pattern, const cpath_char_t *str,
+                     size_t len) {
+    size_t open = len;
+    size_t close = len;
+    int level = 0;
+    for (size_t i = 0; i < len && close == len; i++) {
+        if (str[i] == CPATH_STR('[')) {
+            size_t classLen = _cpathGlobClassLen(str + i, len - i);
+            if (classLen > 0) i += classLen - 1;
+        } else if (str[i] == CPATH_STR('{')) {
+            if (level++ == 0) open = i;
+        } else if (str[i] == CPATH_STR('}') && level > 0) {
+            if (--level == 0) close = i;
+        }
+    }
+    if (close == len) return _cpathGlobPushAlt(pattern, str, len);
+
+    // prefix + alternative + suffix is never longer than str
+    cpath_char_t *tmp =
+        (cpath_char_t*)CPATH_MALLOC(sizeof(cpath_char_t) * (len + 1));
+    if (tmp == NULL) {
+        errno = ENOMEM;
+        return 0;
+    }
+    memcpy(tmp, str, sizeof(cpath_char_t) * open);
+
+    size_t start = open + 1;
+    level = 0;
+    for (size_t i = open + 1; i <= close; i++) {
+        if (i < close && str[i] == CPATH_STR('{')) {
+            level++;
+        } else if (i < close && str[i] == CPATH_STR('}')) {
+            level--;
+        } else if (i == close || (level == 0 && str[i] == CPATH_STR(','))) {
+            size_t n = open;
+            memcpy(tmp + n, str + start, sizeof(cpath_char_t) * (i - start));
+            n += i - start;
+            memcpy(tmp + n, str + close + 1,
+                   sizeof(cpath_char_t) * (len - close - 1));
+            n += len - close - 1;
+            if (!_cpathGlobExpand(pattern, tmp, n)) {
+                CPATH_FREE(tmp);
+                return 0;
+            }
+            start = i + 1;
+        }
+    }
+
+    CPATH_FREE(tmp);
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathGlobCompile(cpath_glob_pattern *pattern, const cpath_char_t *str) {
+    if (pattern == NULL || str == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    cpathGlobPatternInit(pattern);
+
+    size_t len = cpath_str_length(str);
+    pattern->absolute = len > 0 && (str[0] == CPATH_SEP ||
+                                    str[0] == CPATH_OTHER_SEP);
+
+    // every component is atmost one segment
+    cpath_component_it it;
+    cpath_component c;
+    size_t count = 0;
+    cpathComponentItInitStrn(&it, str, len);
+    while (cpathComponentItNext(&it, &c)) count++;
+    if (count > CPATH_GLOB_MAX_SEGMENTS) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (count > 0) {
+        pattern->segments = (cpath_glob_segment*)CPATH_MALLOC(
+            sizeof(cpath_glob_segment) * count);
+        if (pattern->segments == NULL) {
+            errno = ENOMEM;
+            return 0;
+        }
+    }
+
+    cpathComponentItInitStrn(&it, str, len);
+    while (cpathComponentItNext(&it, &c)) {
+        if (c.str == str && pattern->absolute) continue;
+        if (c.len == 1 && c.str[0] == CPATH_STR('.')) continue;
+
+        cpath_glob_segment *seg = &pattern->segments[pattern->count];
+        seg->alt = pattern->alts;
+        seg->altCount = 0;
+        if (c.len == 2 && c.str[0] == CPATH_STR('*') &&
+                c.str[1] == CPATH_STR('*')) {
+            // '**' '**' is the same as just one
+            if (pattern->count > 0 &&
+                    seg[-1].kind == CPATH_GLOB_ANY_DEPTH) {
+                continue;
+            }
+            seg->kind = CPATH_GLOB_ANY_DEPTH;
+            pattern->count++;
+            continue;
+        }
+
+        if (!_cpathGlobExpand(pattern, c.str, c.len)) {
+            cpathGlobPatternFree(pattern);
+            return 0;
+        }
+        seg->altCount = pattern->alts - seg->alt;
+        seg->kind = CPATH_GLOB_LITERAL;
+        for (size_t i = 0; i < c.len; i++) {
+            if (c.str[i] == CPATH_STR('*') || c.str[i] == CPATH_STR('?') ||
+                    c.str[i] == CPATH_STR('[')) {
+                seg->kind = CPATH_GLOB_PATTERN;
+                break;
+            }
+        }
+        pattern->count++;
+    }
+
+    return 1;
+}
+
+// Adds the states we can reach without a component (** can match nothing)
+_CPATH_FUNC_
+uint64_t _cpathGlobClosure(const cpath_glob_pattern *pattern,
+                           uint64_t states) {
+    for (size_t i = 0; i < pattern->count; i++) {
+        if (((states >> i) & 1) &&
+                pattern->segments[i].kind == CPATH_GLOB_ANY_DEPTH) {
+            states |= (uint64_t)1 << (i + 1);
+        }
+    }
+    return states;
+}
+
+// The states after matching name (bit `count` is set if the glob matched)
+_CPATH_FUNC_
+uint64_t _cpathGlobStep(const cpath_glob_pattern *pattern, uint64_t states,
+                        const cpath_char_t *name, size_t len) {
+    uint64_t next = 0;
+    for (size_t i = 0; i < pattern->count; i++) {
+        if (!((states >> i) & 1)) continue;
+
+        const cpath_glob_segment *seg = &pattern->segments[i];
+        if (seg->kind == CPATH_GLOB_ANY_DEPTH) {
+            next |= (uint64_t)1 << i;
+            continue;
+        }
+
+        for (size_t a = seg->alt; a < seg->alt + seg->altCount; a++) {
+            const cpath_char_t *alt = pattern->buf + pattern->altOffsets[a];
+            size_t altLen = pattern->altLens[a];
+            int match = seg->kind == CPATH_GLOB_LITERAL
+                ? altLen == len &&
+                  !memcmp(alt, name, sizeof(cpath_char_t) * len)
+                : _cpathGlobMatchStrn(alt, altLen, name, len);
+            if (match) {
+                next |= (uint64_t)1 << (i + 1);
+                break;
+            }
+        }
+    }
+    return _cpathGlobClosure(pattern, next);
+}
+
+_CPATH_FUNC_
+int cpathGlobMatch(const cpath_glob_pattern *pattern, const cpath_char_t *path,
+                   size_t len) {
+    if (pattern == NULL || path == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    int absolute = len > 0 && (path[0] == CPATH_SEP ||
+                               path[0] == CPATH_OTHER_SEP);
+    if (absolute != pattern->absolute) return 0;
+
+    cpath_component_it it;
+    cpath_component c;
+    uint64_t states = _cpathGlobClosure(pattern, 1);
+    cpathComponentItInitStrn(&it, path, len);
+    while (cpathComponentItNext(&it, &c)) {
+        if (c.str == path && absolute) continue;
+        if (c.len == 1 && c.str[0] == CPATH_STR('.')) continue;
+
+        states = _cpathGlobStep(pattern, states, c.str, c.len);
+        if (states == 0) return 0;
+    }
+    return (states >> pattern->count) & 1;
+}
+
+// True if every segment we could be at is a literal
+_CPATH_FUNC_
+int _cpathGlobIsLiteral(const cpath_glob_pattern *pattern, uint64_t states) {
+    for (size_t i = 0; i < pattern->count; i++) {
+        if (((states >> i) & 1) &&
+                pattern->segments[i].kind != CPATH_GLOB_LITERAL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+_CPATH_FUNC_
+int _cpathGlobPush(cpath_glob *glob, const cpath *path, uint64_t states) {
+    if (glob->depth == glob->cap) {
+        size_t cap = glob->cap < 8 ? 8 : glob->cap * 2;
+        cpath_glob_frame *frames =
+            (cpath_glob_frame*)CPATH_MALLOC(sizeof(cpath_glob_frame) * cap);
+        if (frames == NULL) {
+            errno = ENOMEM;
+            return 0;
+        }
+        for (size_t i = 0; i < glob->depth; i++) {
+            frames[i] = glob->frames[i];
+            if (glob->frames[i].opened) {
+                _cpathDirMove(&frames[i].dir, &glob->frames[i].dir);
+            }
+        }
+        if (glob->frames != NULL) CPATH_FREE(glob->frames);
+        glob->frames = frames;
+        glob->cap = cap;
+    }
+
+    cpath_glob_frame *frame = &glob->frames[glob->depth];
+    frame->states = states;
+    frame->next = 0;
+    frame->opened = 0;
+    if (!_cpathGlobIsLiteral(&glob->pattern, states)) {
+        if (!cpathOpenDir(&frame->dir, path)) return 0;
+        frame->opened = 1;
+    }
+
+    cpathCopy(&glob->path, path);
+    frame->pathLen = path->len;
+    glob->depth++;
+    return 1;
+}
+
+_CPATH_FUNC_
+void _cpathGlobPop(cpath_glob *glob) {
+    cpath_glob_frame *frame = &glob->frames[--glob->depth];
+    if (frame->opened) cpathCloseDir(&frame->dir);
+    if (glob->depth > 0) {
+        glob->path.len = glob->frames[glob->depth - 1].pathLen;
+        glob->path.buf[glob->path.len] = CPATH_STR('\0');
+    }
+}
+
+// Tries the next alternative of a literal frame
+_CPATH_FUNC_
+int _cpathGlobNextLiteral(cpath_glob *glob, cpath_glob_frame *frame,
+                          cpath_file *file, uint64_t *next) {
+    const cpath_glob_pattern *pattern = &glob->pattern;
+    size_t seg = 0;
+    while (frame->next < pattern->alts) {
+        size_t a = frame->next++;
+        while (a >= pattern->segments[seg].alt + pattern->segments[seg].altCount) {
+            seg++;
+        }
+        if (!((frame->states >> seg) & 1)) continue;
+
+        const cpath_char_t *name = pattern->buf + pattern->altOffsets[a];
+        size_t len = pattern->altLens[a];
+
+        // the same name could have been an earlier alternative
+        int seen = 0;
+        for (size_t i = 0; i < seg && !seen; i++) {
+            if (!((frame->states >> i) & 1)) continue;
+            const cpath_glob_segment *other = &pattern->segments[i];
+            for (size_t b = other->alt; b < other->alt + other->altCount; b++) {
+                if (pattern->altLens[b] == len &&
+                        !memcmp(pattern->buf + pattern->altOffsets[b], name,
+                                sizeof(cpath_char_t) * len)) {
+                    seen = 1;
+                    break;
+                }
+            }
+        }
+        for (size_t b = pattern->segments[seg].alt; b < a && !seen; b++) {
+            seen = pattern->altLens[b] == len &&
+                   !memcmp(pattern->buf + pattern->altOffsets[b], name,
+                           sizeof(cpath_char_t) * len);
+        }
+        if (seen) continue;
+
+        // just look it up directly
+        size_t pathLen = glob->path.len;
+        int found = cpathConcatStrn(&glob->path, name, len) &&
+                    cpathOpenFile(file, &glob->path);
+        glob->path.len = pathLen;
+        glob->path.buf[pathLen] = CPATH_STR('\0');
+        if (!found) continue;
+
+        *next = _cpathGlobStep(pattern, frame->states, name, len);
+        return 1;
+    }
+    return 0;
+}
+
+_CPATH_FUNC_
+int cpathGlobOpen(cpath_glob *glob, const cpath *base,
+                  const cpath_char_t *pattern) {
+    if (glob == NULL || pattern == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    glob->frames = NULL;
+    glob->depth = 0;
+    glob->cap = 0;
+    glob->hasPending = 0;
+    if (!cpathGlobCompile(&glob->pattern, pattern)) return 0;
+
+    cpath root;
+    if (glob->pattern.absolute) {
+        cpathFromStr(&root, CPATH_STR("/"));
+    } else if (base == NULL) {
+        cpathFromStr(&root, CPATH_STR("."));
+    } else {
+        cpathCopy(&root, base);
+    }
+
+    // the base itself isn't given back even if it matches (i.e. **)
+    uint64_t complete = (uint64_t)1 << glob->pattern.count;
+    uint64_t states = _cpathGlobClosure(&glob->pattern, 1) & (complete - 1);
+    if (states != 0 && !_cpathGlobPush(glob, &root, states)) {
+        cpathGlobClose(glob);
+        return 0;
+    }
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathGlobNext(cpath_glob *glob, cpath_file *file) {
+    if (glob == NULL || file == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    uint64_t complete = (uint64_t)1 << glob->pattern.count;
+    for (;;) {
+        if (glob->hasPending) {
+            // directories we can't open are just skipped
+            glob->hasPending = 0;
+            _cpathGlobPush(glob, &glob->pending, glob->pendingStates);
+        }
+        if (glob->depth == 0) return 0;
+
+        cpath_glob_frame *frame = &glob->frames[glob->depth - 1];
+        uint64_t next;
+        if (!frame->opened) {
+            if (!_cpathGlobNextLiteral(glob, frame, file, &next)) {
+                _cpathGlobPop(glob);
+                continue;
+            }
+        } else {
+            if (!cpathGetNextFile(&frame->dir, file)) {
+                _cpathGlobPop(glob);
+                continue;
+            }
+            if (cpathFileIsSpecialHardLink(file)) continue;
+            next = _cpathGlobStep(&glob->pattern, frame->states, file->name,
+                                  cpath_str_length(file->name));
+        }
+
+        // only go into directories that something could still match under
+        if ((next & (complete - 1)) != 0 && file->isDir) {
+            glob->hasPending = 1;
+            glob->pendingStates = next & (complete - 1);
+            cpathCopy(&glob->pending, &file->path);
+        }
+        if (next & complete) return 1;
+    }
+}
+
+_CPATH_FUNC_
+void cpathGlobClose(cpath_glob *glob) {
+    if (glob == NULL) return;
+
+    while (glob->depth > 0) _cpathGlobPop(glob);
+    if (glob->frames != NULL) CPATH_FREE(glob->frames);
+    glob->frames = NULL;
+    glob->cap = 0;
+    glob->hasPending = 0;
+    cpathGlobPatternFree(&glob->pattern);
+}
+
+/* == Ignore Files == */
+
+_CPATH_FUNC_
+void _cpathIgnoreLevelInit(cpath_ignore_level *level) {
+    level->rules = NULL;
+    level->count = 0;
+    level->cap = 0;
+    level->slots = NULL;
+    level->slotsCap = 0;
+    level->literals = 0;
+    level->names = NULL;
+    level->namesLen = 0;
+    level->namesCap = 0;
+    level->anchored = 0;
+    level->relStart = 0;
 }
 
+// Drops all the rules but keeps the memory around
 _CPATH_FUNC_
-cpath cpathFromUtf8(const char *str) {
-    cpath path;
-    if (str[0] == CPATH_STR('\0')) {
-        // empty string which is just '.'
-        path.len = 1;
-        path.buf[0] = CPATH_STR('.');
-        path.buf[1] = CPATH_STR('\0');
-        return path;
+void _cpathIgnoreLevelClear(cpath_ignore_level *level) {
+    for (size_t i = 0; i < level->count; i++) {
+        if (level->rules[i].kind == CPATH_IGNORE_GLOB) {
+            cpathGlobPatternFree(&level->rules[i].pattern);
+        }
     }
-
-    path.len = 0;
-    path.buf[0] = CPATH_STR('\0');
-    size_t len = cpath_str_length(str);
-    // NOTE: max path len includes the \0 where as str length doesn't!
-    if (len >= CPATH_MAX_PATH_LEN) {
-        errno = ENAMETOOLONG;
-        return path;
+    if (level->slots != NULL) {
+        memset(level->slots, 0, sizeof(size_t) * level->slotsCap);
     }
-#if defined CPATH_UNICODE && defined _MSC_VER
-    mbstowcs_s(&path.len, path.buf, len + 1, str, CPATH_MAX_PATH_LEN);
-    cpathConvertSep(&path);
-#else
-    path.len = cpathStrCpyConv(path.buf, len, str);
-#endif
-    cpathTrim(&path);
-    return path;
+    level->count = 0;
+    level->literals = 0;
+    level->namesLen = 0;
+    level->anchored = 0;
 }
 
 _CPATH_FUNC_
-void cpathCopy(cpath *out, const cpath *in) {
-    cpath_str_copy(out->buf, in->buf);
-    out->len = in->len;
+void _cpathIgnoreLevelFree(cpath_ignore_level *level) {
+    _cpathIgnoreLevelClear(level);
+    if (level->rules != NULL) CPATH_FREE(level->rules);
+    if (level->slots != NULL) CPATH_FREE(level->slots);
+    if (level->names != NULL) CPATH_FREE(level->names);
+    _cpathIgnoreLevelInit(level);
 }
 
+// Returns the slot for name (either the one with the name or an empty one)
 _CPATH_FUNC_
-int cpathFromStr(cpath *out, const cpath_char_t *str) {
-    size_t len = cpath_str_length(str);
-    if (len >= CPATH_MAX_PATH_LEN) return 0;
-    if (len == 0) {
-        out->len = 1;
-        out->buf[0] = CPATH_STR('.');
-        out->buf[1] = CPATH_STR('\0');
-        return 1;
+size_t *_cpathIgnoreFindSlot(const cpath_ignore_level *level,
+                             const cpath_char_t *name, size_t len) {
+    size_t mask = level->slotsCap - 1;
+    size_t i = (size_t)_cpathHashStep(_CPATH_HASH_INIT, name, len) & mask;
+    for (;; i = (i + 1) & mask) {
+        size_t *slot = &level->slots[i];
+        if (*slot == 0) return slot;
+
+        const cpath_ignore_rule *rule = &level->rules[*slot - 1];
+        if (rule->nameLen == len &&
+                !memcmp(level->names + rule->name, name,
+                        sizeof(cpath_char_t) * len)) {
+            return slot;
+        }
     }
-
-    out->len = cpathStrCpyConv(out->buf, len, str);
-    cpathTrim(out);
-    return 1;
 }
 
 _CPATH_FUNC_
-void cpathAppendSprintf(cpath *out, const cpath_char_t *fmt, ...) {
-    va_list list;
-    va_start(list, fmt);
-    out->len += cpath_vsnprintf(out->buf + out->len,
-                                CPATH_MAX_PATH_LEN - out->len, fmt, list);
-    va_end(list);
+int _cpathIgnoreIndexLiteral(cpath_ignore_level *level, size_t index) {
+    // keep the load factor under a half
+    if ((level->literals + 1) * 2 > level->slotsCap) {
+        size_t cap = level->slotsCap > 0 ? level->slotsCap * 2 : 16;
+        size_t *slots = (size_t*)CPATH_MALLOC(sizeof(size_t) * cap);
+        if (slots == NULL) {
+            errno = ENOMEM;
+            return 0;
+        }
+        memset(slots, 0, sizeof(size_t) * cap);
+
+        size_t *old = level->slots;
+        size_t oldCap = level->slotsCap;
+        level->slots = slots;
+        level->slotsCap = cap;
+        for (size_t i = 0; i < oldCap; i++) {
+            if (old[i] == 0) continue;
+            const cpath_ignore_rule *rule = &level->rules[old[i] - 1];
+            *_cpathIgnoreFindSlot(level, level->names + rule->name,
+                                  rule->nameLen) = old[i];
+        }
+        if (old != NULL) CPATH_FREE(old);
+    }
+
+    cpath_ignore_rule *rule = &level->rules[index];
+    size_t *slot = _cpathIgnoreFindSlot(level, level->names + rule->name,
+                                        rule->nameLen);
+    if (*slot == 0) level->literals++;
+    rule->prev = *slot;
+    *slot = index + 1;
+    return 1;
 }
 
+/*
+    Adds a single line of an ignore file to the level.
+    Blank lines, comments and patterns too big to compile are fine
+    (they just don't add anything).
+*/
 _CPATH_FUNC_
-int cpathAppendStrn(cpath *out, const cpath_char_t *other, size_t len) {
-    if (len + out->len >= CPATH_MAX_PATH_LEN) {
-        // path too long, >= cause max path includes CPATH_STR('\0')
-        errno = ENAMETOOLONG;
+int _cpathIgnoreAddRule(cpath_ignore_level *level, const char *line,
+                        size_t len) {
+    // trailing spaces are ignored unless they are escaped
+    while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t') &&
+           !(len > 1 && line[len - 2] == '\\')) {
+        len--;
+    }
+    if (len == 0 || line[0] == '#') return 1;
+
+    cpath_ignore_rule rule;
+    rule.kind = CPATH_IGNORE_GLOB;
+    rule.negate = 0;
+    rule.dirOnly = 0;
+    rule.anchored = 0;
+    rule.name = 0;
+    rule.nameLen = 0;
+    rule.prev = 0;
+    cpathGlobPatternInit(&rule.pattern);
+
+    if (line[0] == '!') {
+        rule.negate = 1;
+        line++;
+        len--;
+    } else if (len > 1 && line[0] == '\\' && (line[1] == '#' || line[1] == '!')) {
+        line++;
+        len--;
+    }
+    if (len > 0 && line[len - 1] == '/') {
+        rule.dirOnly = 1;
+        len--;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (line[i] == '/') rule.anchored = 1;
+    }
+    if (len > 0 && line[0] == '/') {
+        line++;
+        len--;
+    }
+    if (len == 0 || len >= CPATH_MAX_PATH_LEN) return 1;
+
+    // the rules are stored as cpath characters
+    cpath_char_t str[CPATH_MAX_PATH_LEN];
+    int wildcard = 0;
+    int wildcardAfterFirst = 0;
+    for (size_t i = 0; i < len; i++) {
+        str[i] = (cpath_char_t)line[i];
+        if (line[i] == '*' || line[i] == '?' || line[i] == '[' ||
+                line[i] == '{') {
+            wildcard = 1;
+            if (i > 0) wildcardAfterFirst = 1;
+        }
+    }
+    str[len] = CPATH_STR('\0');
+
+    if (!rule.anchored && !wildcard) {
+        rule.kind = CPATH_IGNORE_LITERAL;
+    } else if (!rule.anchored && str[0] == CPATH_STR('*') &&
+               !wildcardAfterFirst) {
+        rule.kind = CPATH_IGNORE_SUFFIX;
+    } else if (!cpathGlobCompile(&rule.pattern, str)) {
+        // a pattern we can't handle (too many segments or alternatives) is
+        // just skipped like git does with bad lines, running out of memory
+        // is still an error
+        return errno == EINVAL;
+    }
+
+    if (rule.kind != CPATH_IGNORE_GLOB) {
+        const cpath_char_t *name = rule.kind == CPATH_IGNORE_SUFFIX ? str + 1
+                                                                    : str;
+        rule.nameLen = rule.kind == CPATH_IGNORE_SUFFIX ? len - 1 : len;
+        if (level->namesLen + rule.nameLen > level->namesCap) {
+            size_t cap = level->namesCap > 0 ? level->namesCap * 2 : 256;
+            while (cap < level->namesLen + rule.nameLen) cap *= 2;
+            if (!_cpathListingGrow((void**)&level->names, sizeof(cpath_char_t),
+                                   level->namesLen, cap)) {
+                errno = ENOMEM;
+                return 0;
+            }
+            level->namesCap = cap;
+        }
+        memcpy(level->names + level->namesLen, name,
+               sizeof(cpath_char_t) * rule.nameLen);
+        rule.name = level->namesLen;
+        level->namesLen += rule.nameLen;
+    }
+
+    if (level->count == level->cap) {
+        size_t cap = level->cap > 0 ? level->cap * 2 : 16;
+        if (!_cpathListingGrow((void**)&level->rules, sizeof(cpath_ignore_rule),
+                               level->count, cap)) {
+            cpathGlobPatternFree(&rule.pattern);
+            errno = ENOMEM;
+            return 0;
+        }
+        level->cap = cap;
+    }
+    level->rules[level->count] = rule;
+    if (rule.kind == CPATH_IGNORE_LITERAL &&
+            !_cpathIgnoreIndexLiteral(level, level->count)) {
         return 0;
     }
+    level->count++;
+    if (rule.anchored) level->anchored++;
+    return 1;
+}
 
-    // This is more efficient than a strcat since it doesn't have to get
-    // the length again it also handles all the conversions well and doesn't
-    // have to retraverse the out->buf which we know is fine.
-    out->len += cpathStrCpyConv(out->buf + out->len, len, other);
-    cpathTrim(out);
+_CPATH_FUNC_
+int _cpathIgnoreParse(cpath_ignore_level *level, const char *buf, size_t len) {
+    size_t start = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i < len && buf[i] != '\n') continue;
+
+        size_t n = i - start;
+        if (n > 0 && buf[start + n - 1] == '\r') n--;
+        if (!_cpathIgnoreAddRule(level, buf + start, n)) return 0;
+        start = i + 1;
+    }
     return 1;
 }
 
+/*
+    1 if the last rule that matches ignores the entry, 0 if it is negated
+    and -1 if nothing matches.
+*/
 _CPATH_FUNC_
-int cpathAppendStr(cpath *out, const cpath_char_t *other) {
-    return cpathAppendStrn(out, other, cpath_str_length(other));
+int _cpathIgnoreLevelMatch(const cpath_ignore_level *level,
+                           const cpath_char_t *name, size_t len,
+                           const cpath_char_t *rel, size_t relLen, int isDir) {
+    size_t best = 0;
+    if (level->literals > 0) {
+        best = *_cpathIgnoreFindSlot(level, name, len);
+        while (best != 0 && level->rules[best - 1].dirOnly && !isDir) {
+            best = level->rules[best - 1].prev;
+        }
+    }
+
+    // only rules after the best literal could override it
+    for (size_t i = level->count; i > best; i--) {
+        const cpath_ignore_rule *rule = &level->rules[i - 1];
+        if (rule->kind == CPATH_IGNORE_LITERAL || (rule->dirOnly && !isDir)) {
+            continue;
+        }
+
+        int match;
+        if (rule->kind == CPATH_IGNORE_SUFFIX) {
+            match = len >= rule->nameLen &&
+                    !memcmp(name + len - rule->nameLen,
+                            level->names + rule->name,
+                            sizeof(cpath_char_t) * rule->nameLen);
+        } else if (rule->anchored) {
+            match = cpathGlobMatch(&rule->pattern, rel, relLen);
+        } else {
+            match = cpathGlobMatch(&rule->pattern, name, len);
+        }
+        if (match) {
+            best = i;
+            break;
+        }
+    }
+
+    if (best == 0) return -1;
+    return !level->rules[best - 1].negate;
 }
 
 _CPATH_FUNC_
-int cpathAppend(cpath *out, const cpath *other) {
-    return cpathAppendStrn(out, other->buf, other->len);
+int _cpathIgnoreWalkIgnored(cpath_ignore_walk *walk, const cpath_char_t *name,
+                            size_t len, int isDir) {
+    // we only need the path if there are rules that look at it
+    cpath *path = &walk->scratch;
+    if (walk->anchored > 0 || walk->global.anchored > 0) {
+        cpathCopy(path, &walk->stack.path);
+        if (!cpathConcatStrn(path, name, len)) return 0;
+    } else {
+        path->len = 0;
+    }
+
+    for (size_t i = walk->stack.depth; i > 0; i--) {
+        const cpath_ignore_level *level = &walk->levels[i - 1];
+        if (level->count == 0) continue;
+
+        size_t start = path->len > level->relStart ? level->relStart : path->len;
+        int res = _cpathIgnoreLevelMatch(level, name, len, path->buf + start,
+                                         path->len - start, isDir);
+        if (res >= 0) return res;
+    }
+
+    const cpath_ignore_level *level = &walk->global;
+    if (level->count == 0) return 0;
+    size_t start = path->len > level->relStart ? level->relStart : path->len;
+    return _cpathIgnoreLevelMatch(level, name, len, path->buf + start,
+                                  path->len - start, isDir) == 1;
 }
 
+// Reads an ignore file from the top directory (if it exists)
 _CPATH_FUNC_
-int cpathConcatStrn(cpath *out, const cpath_char_t *str, size_t len) {
-    if (len + out->len >= CPATH_MAX_PATH_LEN) {
-        // path too long, >= cause max path includes CPATH_STR('\0')
-        errno = ENAMETOOLONG;
+int _cpathIgnoreLoad(cpath_ignore_walk *walk, cpath_ignore_level *level,
+                     const cpath_char_t *name) {
+    size_t cap = 4096;
+    size_t len = 0;
+    char *buf = (char*)CPATH_MALLOC(cap);
+    if (buf == NULL) {
+        errno = ENOMEM;
         return 0;
     }
 
-    if (str[0] != CPATH_SEP && out->buf[out->len - 1] != CPATH_SEP &&
-            str[0] != CPATH_OTHER_SEP && out->buf[out->len - 1] != CPATH_OTHER_SEP) {
-        out->buf[out->len++] = CPATH_SEP;
-        out->buf[out->len] = CPATH_STR('\0');
+#if defined CPATH_HAS_OPENAT
+    CPATH_SYSCALL_HOOK("open");
+    int fd = openat(_cpathDirFd(cpathDirStackTop(&walk->stack)), name,
+                    O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        // most directories won't have one
+        CPATH_FREE(buf);
+        return 1;
+    }
+    for (;;) {
+        if (len == cap) {
+            cap *= 2;
+            if (!_cpathListingGrow((void**)&buf, 1, len, cap)) {
+                close(fd);
+                CPATH_FREE(buf);
+                errno = ENOMEM;
+                return 0;
+            }
+        }
+        CPATH_SYSCALL_HOOK("read");
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n <= 0) break;
+        len += (size_t)n;
+    }
+    close(fd);
+#else
+    cpath path;
+    cpathCopy(&path, &walk->stack.path);
+    FILE *f = NULL;
+    if (cpathConcatStr(&path, name)) {
+        CPATH_SYSCALL_HOOK("open");
+        f = cpathOpen(&path, CPATH_STR("rb"));
+    }
+    if (f == NULL) {
+        CPATH_FREE(buf);
+        return 1;
+    }
+    for (;;) {
+        if (len == cap) {
+            cap *= 2;
+            if (!_cpathListingGrow((void**)&buf, 1, len, cap)) {
+                fclose(f);
+                CPATH_FREE(buf);
+                errno = ENOMEM;
+                return 0;
+            }
+        }
+        CPATH_SYSCALL_HOOK("read");
+        size_t n = fread(buf + len, 1, cap - len, f);
+        if (n == 0) break;
+        len += n;
     }
+    fclose(f);
+#endif
 
-    // This is more efficient than a strcat since it doesn't have to get
-    // the length again it also handles all the conversions well and doesn't
-    // have to retraverse the out->buf which we know is fine.
-    out->len += cpathStrCpyConv(out->buf + out->len, len, str);
-    cpathTrim(out);
-    return 1;
+    int res = _cpathIgnoreParse(level, buf, len);
+    CPATH_FREE(buf);
+    return res;
 }
 
+// Sets up the level for the directory that was just pushed
 _CPATH_FUNC_
-int cpathConcatStr(cpath *out, const cpath_char_t *other) {
-    return cpathConcatStrn(out, other, cpath_str_length(other));
+int _cpathIgnoreWalkEnter(cpath_ignore_walk *walk) {
+    size_t depth = walk->stack.depth;
+    if (depth > walk->levelsCap) {
+        size_t cap = walk->levelsCap < 8 ? 8 : walk->levelsCap * 2;
+        if (!_cpathListingGrow((void**)&walk->levels, sizeof(cpath_ignore_level),
+                               walk->levelsCap, cap)) {
+            errno = ENOMEM;
+            return 0;
+        }
+        for (size_t i = walk->levelsCap; i < cap; i++) {
+            _cpathIgnoreLevelInit(&walk->levels[i]);
+        }
+        walk->levelsCap = cap;
+    }
+
+    cpath_ignore_level *level = &walk->levels[depth - 1];
+    const cpath *path = &walk->stack.path;
+    _cpathIgnoreLevelClear(level);
+    level->relStart = path->len;
+    if (path->len > 0 && path->buf[path->len - 1] != CPATH_SEP &&
+            path->buf[path->len - 1] != CPATH_OTHER_SEP) {
+        level->relStart++;
+    }
+
+    int res = _cpathIgnoreLoad(walk, level, CPATH_STR(".gitignore")) &&
+              _cpathIgnoreLoad(walk, level, CPATH_STR(".ignore"));
+    if (level->anchored > 0) walk->anchored++;
+    return res;
 }
 
 _CPATH_FUNC_
-int cpathConcat(cpath *out, const cpath *other) {
-    return cpathConcatStrn(out, other->buf, other->len);
+void _cpathIgnoreWalkLeave(cpath_ignore_walk *walk) {
+    cpath_ignore_level *level = &walk->levels[walk->stack.depth - 1];
+    if (level->anchored > 0) walk->anchored--;
+    _cpathIgnoreLevelClear(level);
+    cpathDirStackPop(&walk->stack);
 }
 
 _CPATH_FUNC_
-int cpathExists(const cpath *path) {
-#if defined _MSC_VER || defined __MINGW32__
-    DWORD res = GetFileAttributes(path->buf);
-    return res != INVALID_FILE_ATTRIBUTES;
-#else
-    /*
-        We can either try to use stat or just access, access is more efficient
-        when not checking permissions.
+int cpathIgnoreWalkOpen(cpath_ignore_walk *walk, const cpath *root) {
+    if (walk == NULL || root == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
 
-        struct stat tmp;
-        return stat(path->buf, &tmp) == 0;
-    */
-    return access(path->buf, F_OK) != -1;
-#endif
+    walk->levels = NULL;
+    walk->levelsCap = 0;
+    walk->anchored = 0;
+    walk->errors = 0;
+    _cpathIgnoreLevelInit(&walk->global);
+    if (!cpathDirStackOpen(&walk->stack, root)) return 0;
+    if (!_cpathIgnoreWalkEnter(walk)) {
+        cpathIgnoreWalkClose(walk);
+        return 0;
+    }
+    walk->global.relStart = walk->levels[0].relStart;
+    return 1;
 }
 
 _CPATH_FUNC_
-int cpathCanonicaliseNoSysCall(cpath *out, cpath *path) {
-    /*
-        NOTE: This should work even if out == path
-                    It just has been written that way.
-    */
-    if (path == NULL) {
+int cpathIgnoreWalkAddRules(cpath_ignore_walk *walk, const char *rules,
+                            size_t len) {
+    if (walk == NULL || rules == NULL) {
         errno = EINVAL;
         return 0;
     }
+    return _cpathIgnoreParse(&walk->global, rules, len);
+}
 
-    out->len = 0;
-    cpath_char_t *chr = &path->buf[0];
-
-    while (*chr != CPATH_STR('\0')) {
-        if (*chr == CPATH_STR('.')) {
-            if (chr[1] == CPATH_STR('.')) {
-                if (out->len == 0 || (out->len == 1 && 
-                        (out->buf[0] == CPATH_SEP || out->buf[0] == CPATH_OTHER_SEP))) {
-                    // no directory to go back based on string alone
-                    errno = ENOENT;
-                    return 0;
-                }
-                // remove last directory ignoring the last / since that is part of ..
-                out->len--;
-                while (out->len > 0 && out->buf[out->len - 1] != CPATH_SEP &&
-                             out->buf[out->len - 1] != CPATH_OTHER_SEP) {
-                    out->len--;
-                }
-                // skip twice
-                chr++;
-                chr++;
-            } else if (chr[1] == CPATH_SEP || chr[1] == CPATH_STR('\0') ||
-                                 chr[1] == CPATH_OTHER_SEP) {
-                // skip
-                chr++;
-            } else {
-                out->buf[out->len++] = *chr;
-            }
-        } else {
-            out->buf[out->len++] = *chr;
-        }
-        chr++;
+_CPATH_FUNC_
+int cpathIgnoreWalkNext(cpath_ignore_walk *walk, cpath_file *file) {
+    if (walk == NULL || file == NULL) {
+        errno = EINVAL;
+        return 0;
     }
 
-    out->buf[out->len] = CPATH_STR('\0');
-    cpathTrim(out);
-    if (out->len == 0) {
-        out->buf[0] = CPATH_STR('.');
-        out->buf[1] = CPATH_STR('\0');
-        out->len = 1;
+    for (;;) {
+        cpath_dir *dir = cpathDirStackTop(&walk->stack);
+        if (dir == NULL) return 0;
+
+        size_t len;
+        const cpath_char_t *name = cpathPeekNextName(dir, &len);
+        if (name == NULL) {
+            _cpathIgnoreWalkLeave(walk);
+            continue;
+        }
+
+        int skip = name[0] == CPATH_STR('.') &&
+                   (len == 1 || (len == 2 && name[1] == CPATH_STR('.')) ||
+                    (len == 4 && name[1] == CPATH_STR('g') &&
+                     name[2] == CPATH_STR('i') && name[3] == CPATH_STR('t')));
+        // if we know what it is we can skip it before building the file
+        int isDir = skip ? 0 : _cpathPeekNextIsDir(dir);
+        if (skip || (isDir != -1 &&
+                     _cpathIgnoreWalkIgnored(walk, name, len, isDir))) {
+            cpathMoveNextFile(dir);
+            continue;
+        }
+
+        if (!cpathDirStackNext(&walk->stack, file)) {
+            // just this entry (the rest of the directory is still fine)
+            walk->errors++;
+            cpathMoveNextFile(dir);
+            continue;
+        }
+        if (isDir == -1 &&
+                _cpathIgnoreWalkIgnored(walk, file->name,
+                                        cpath_str_length(file->name),
+                                        file->isDir)) {
+            continue;
+        }
+
+        // directories we can't open are just skipped
+        if (file->isDir && cpathDirStackPush(&walk->stack, file) &&
+                !_cpathIgnoreWalkEnter(walk)) {
+            _cpathIgnoreWalkLeave(walk);
+        }
+        return 1;
     }
+}
 
-    return 1;
+_CPATH_FUNC_
+void cpathIgnoreWalkClose(cpath_ignore_walk *walk) {
+    if (walk == NULL) return;
+
+    for (size_t i = 0; i < walk->levelsCap; i++) {
+        _cpathIgnoreLevelFree(&walk->levels[i]);
+    }
+    if (walk->levels != NULL) CPATH_FREE(walk->levels);
+    walk->levels = NULL;
+    walk->levelsCap = 0;
+    walk->anchored = 0;
+    _cpathIgnoreLevelFree(&walk->global);
+    cpathDirStackClose(&walk->stack);
 }
 
+/* == Snapshots == */
+
+#if defined CPATH_HAS_OPENAT
 _CPATH_FUNC_
-int cpathCanonicalise(cpath *out, cpath *path) {
-    cpath tmp;
-    if (out == path) {
-        // support non-restrict method
-        cpathCopy(&tmp, path);
-        path = &tmp;
-    }
+void cpathSnapshotInit(cpath_snapshot *snapshot) {
+    snapshot->entries = NULL;
+    snapshot->count = 0;
+    snapshot->cap = 0;
+    snapshot->dirs = NULL;
+    snapshot->dirCount = 0;
+    snapshot->dirCap = 0;
+    snapshot->names = NULL;
+    snapshot->namesLen = 0;
+    snapshot->namesCap = 0;
+    snapshot->taken = 0;
+    snapshot->listed = 0;
+}
 
-#if defined _MSC_VER
-    DWORD size = GetFullPathName(path->buf, CPATH_MAX_PATH_LEN, out->buf, NULL);
-    if (size == 0) {
-        // figure out errno
-        return 0;
-    } else {
-        path->len = size;
-        return 1;
-    }
-#else
-    char *res = realpath(path->buf, out->buf);
-    if (res != NULL) {
-        out->len = cpath_str_length(out->buf);
-    }
-    return res != NULL;
-#endif
+_CPATH_FUNC_
+void cpathSnapshotFree(cpath_snapshot *snapshot) {
+    if (snapshot == NULL) return;
+    if (snapshot->entries != NULL) CPATH_FREE(snapshot->entries);
+    if (snapshot->dirs != NULL) CPATH_FREE(snapshot->dirs);
+    if (snapshot->names != NULL) CPATH_FREE(snapshot->names);
+    cpathSnapshotInit(snapshot);
 }
 
 _CPATH_FUNC_
-int cpathCanonicaliseAvoidSysCall(cpath *out, cpath *path) {
-    if (!cpathCanonicaliseNoSysCall(out, path)) {
-        return cpathCanonicalise(out, path);
-    }
-    return 1;
+void cpathSnapshotChangesInit(cpath_snapshot_changes *changes) {
+    changes->items = NULL;
+    changes->count = 0;
+    changes->cap = 0;
 }
 
 _CPATH_FUNC_
-void cpathClear(cpath *path) {
-    path->buf[0] = CPATH_STR('.');
-    path->buf[1] = CPATH_STR('\0');
-    path->len = 1;
+void cpathSnapshotChangesFree(cpath_snapshot_changes *changes) {
+    if (changes == NULL) return;
+    if (changes->items != NULL) CPATH_FREE(changes->items);
+    cpathSnapshotChangesInit(changes);
 }
 
 _CPATH_FUNC_
-const cpath_char_t *cpathItRef(cpath *path, int *index) {
-    if (path == NULL || index == NULL || *index >= path->len || *index < 0) {
-        return NULL;
+int _cpathSnapshotChange(cpath_snapshot_changes *changes, int kind,
+                         size_t entry) {
+    if (changes == NULL) return 1;
+    if (changes->count == changes->cap) {
+        size_t cap = changes->cap > 0 ? changes->cap * 2 : 64;
+        if (!_cpathListingGrow((void**)&changes->items,
+                               sizeof(cpath_snapshot_change), changes->count,
+                               cap)) {
+            errno = ENOMEM;
+            return 0;
+        }
+        changes->cap = cap;
     }
+    changes->items[changes->count].kind = kind;
+    changes->items[changes->count].entry = entry;
+    changes->count++;
+    return 1;
+}
 
-    if (path->buf[*index] == CPATH_STR('\0')) {
-        path->buf[*index] = CPATH_SEP;
-        (*index)++;
-    }
-    int old_pos = *index;
+// Returns the index of the new entry (CPATH_SNAPSHOT_NONE if we ran out)
+_CPATH_FUNC_
+size_t _cpathSnapshotAdd(cpath_snapshot *snapshot, const cpath_char_t *name,
+                         size_t len, uint32_t type, size_t parent) {
+    if (snapshot->count == snapshot->cap) {
+        size_t cap = snapshot->cap > 0 ? snapshot->cap * 2 : 256;
+        if (!_cpathListingGrow((void**)&snapshot->entries,
+                               sizeof(cpath_snapshot_entry), snapshot->count,
+                               cap)) {
+            errno = ENOMEM;
+            return CPATH_SNAPSHOT_NONE;
+        }
+        snapshot->cap = cap;
+    }
+    if (snapshot->namesLen + len > snapshot->namesCap) {
+        size_t cap = snapshot->namesCap > 0 ? snapshot->namesCap * 2 : 4096;
+        while (cap < snapshot->namesLen + len) cap *= 2;
+        if (!_cpathListingGrow((void**)&snapshot->names, sizeof(cpath_char_t),
+                               snapshot->namesLen, cap)) {
+            errno = ENOMEM;
+            return CPATH_SNAPSHOT_NONE;
+        }
+        snapshot->namesCap = cap;
+    }
+
+    cpath_snapshot_entry *entry = &snapshot->entries[snapshot->count];
+    entry->name = snapshot->namesLen;
+    entry->nameLen = (uint32_t)len;
+    entry->type = type;
+    entry->parent = parent;
+    entry->dir = CPATH_SNAPSHOT_NONE;
+    memcpy(snapshot->names + snapshot->namesLen, name,
+           sizeof(cpath_char_t) * len);
+    snapshot->namesLen += len;
+    return snapshot->count++;
+}
 
-    // find next '/'
-    while (*index < path->len && path->buf[*index] != CPATH_SEP &&
-                 path->buf[*index] != CPATH_OTHER_SEP) {
-        (*index)++;
+_CPATH_FUNC_
+size_t _cpathSnapshotAddDir(cpath_snapshot *snapshot, size_t entry) {
+    if (snapshot->dirCount == snapshot->dirCap) {
+        size_t cap = snapshot->dirCap > 0 ? snapshot->dirCap * 2 : 64;
+        if (!_cpathListingGrow((void**)&snapshot->dirs,
+                               sizeof(cpath_snapshot_dir), snapshot->dirCount,
+                               cap)) {
+            errno = ENOMEM;
+            return CPATH_SNAPSHOT_NONE;
+        }
+        snapshot->dirCap = cap;
     }
 
-    path->buf[*index] = '\0';
-
-    return &path->buf[old_pos];
+    cpath_snapshot_dir *dir = &snapshot->dirs[snapshot->dirCount];
+    dir->entry = entry;
+    dir->first = 0;
+    dir->count = 0;
+    dir->mtime = -1;
+    dir->ctime = -1;
+    snapshot->entries[entry].dir = snapshot->dirCount;
+    return snapshot->dirCount++;
 }
 
-_CPATH_FUNC_
-void cpathItRefRestore(cpath *path, int *index) {
-    if (path == NULL) return;
+// Reads the directory at path into the snapshot as children of parent
+_CPATH_FUNC_
+int _cpathSnapshotList(cpath_snapshot *snapshot, const cpath *path,
+                       size_t parent) {
+    cpath_dir dir;
+    // it may have gone since we stat'd it, then it's just empty
+    if (!cpathOpenDir(&dir, path)) return 1;
+    snapshot->listed++;
+
+    const cpath_char_t *name;
+    size_t len;
+    cpath_file file;
+    while ((name = cpathPeekNextName(&dir, &len)) != NULL) {
+        if (name[0] == CPATH_STR('.') &&
+                (len == 1 || (len == 2 && name[1] == CPATH_STR('.')))) {
+            cpathMoveNextFile(&dir);
+            continue;
+        }
+
+        uint32_t type = 0;
+        unsigned char dtype = dir.dirent->d_type;
+        if (dtype == DT_DIR) type = CPATH_LISTING_DIR;
+        else if (dtype == DT_REG) type = CPATH_LISTING_REG;
+        else if (dtype == DT_LNK) type = CPATH_LISTING_SYM;
+
+        if (dtype != DT_UNKNOWN) {
+            if (_cpathSnapshotAdd(snapshot, name, len, type, parent) ==
+                    CPATH_SNAPSHOT_NONE) {
+                cpathCloseDir(&dir);
+                return 0;
+            }
+            cpathMoveNextFile(&dir);
+            continue;
+        }
 
-    if (index == NULL || *index < 0 || *index >= path->len ||
-            path->buf[*index] != CPATH_STR('\0')) {
-        // we have to loop
-        for (int i = 0; i < path->len; i++) {
-            if (path->buf[i] == CPATH_STR('\0')) path->buf[i] = CPATH_SEP;
+        // we have to build it to find out what it is
+        if (!cpathGetNextFile(&dir, &file)) {
+            // a failed peek doesn't move along so skip it ourselves
+            cpathMoveNextFile(&dir);
+            continue;
+        }
+        if (file.isDir) type = CPATH_LISTING_DIR;
+        else if (file.isSym) type = CPATH_LISTING_SYM;
+        else if (file.isReg) type = CPATH_LISTING_REG;
+        if (_cpathSnapshotAdd(snapshot, file.name, cpath_str_length(file.name),
+                              type, parent) == CPATH_SNAPSHOT_NONE) {
+            cpathCloseDir(&dir);
+            return 0;
         }
-        // set index to the length since we have no real way to determine
-        // where abouts it its (that is if it isn't null)
-        if (index != NULL) *index = path->len;
-    } else {
-        path->buf[*index] = CPATH_SEP;
-        (*index)++;
     }
+    cpathCloseDir(&dir);
+    return 1;
 }
 
+/*
+    Matches the (freshly read) children of a directory with the ones in
+    the previous snapshot, map[i] is the old index of new child i.
+*/
 _CPATH_FUNC_
-int cpathUpDir(cpath *path) {
-    if (path->len == 0) {
-        // shouldn't have a path with this length
-        errno = EINVAL;
+int _cpathSnapshotMatch(const cpath_snapshot *out,
+                        const cpath_snapshot_dir *dir,
+                        const cpath_snapshot *prev,
+                        const cpath_snapshot_dir *old, size_t *map,
+                        cpath_snapshot_changes *changes) {
+    size_t cap = 16;
+    while (cap < old->count * 2) cap *= 2;
+    // slots are old index + 1 (0 is empty) and the rest are matched flags
+    size_t *slots = (size_t*)CPATH_MALLOC(sizeof(size_t) * cap +
+                                          old->count + 1);
+    if (slots == NULL) {
+        errno = ENOMEM;
         return 0;
     }
-
-    // We have to find the last component and strip it
-    int oldLen = path->len;
-    while (path->len > 1 && path->buf[path->len - 1] != CPATH_SEP &&
-                 path->buf[path->len - 1] != CPATH_SEP) {
-        path->len--;
+    unsigned char *matched = (unsigned char*)(slots + cap);
+    memset(slots, 0, sizeof(size_t) * cap + old->count);
+
+    size_t mask = cap - 1;
+    for (size_t i = old->first; i < old->first + old->count; i++) {
+        const cpath_snapshot_entry *entry = &prev->entries[i];
+        size_t h = (size_t)_cpathHashStep(_CPATH_HASH_INIT,
+                                          prev->names + entry->name,
+                                          entry->nameLen);
+        while (slots[h & mask] != 0) h++;
+        slots[h & mask] = i + 1;
+    }
+
+    int ok = 1;
+    for (size_t i = 0; i < dir->count && ok; i++) {
+        const cpath_snapshot_entry *entry = &out->entries[dir->first + i];
+        const cpath_char_t *name = out->names + entry->name;
+        size_t h = (size_t)_cpathHashStep(_CPATH_HASH_INIT, name,
+                                          entry->nameLen);
+        map[i] = CPATH_SNAPSHOT_NONE;
+        for (; slots[h & mask] != 0; h++) {
+            const cpath_snapshot_entry *other = &prev->entries[slots[h & mask] - 1];
+            if (other->nameLen == entry->nameLen &&
+                    !memcmp(prev->names + other->name, name,
+                            sizeof(cpath_char_t) * entry->nameLen)) {
+                // a different type is a different file
+                if (other->type == entry->type) {
+                    map[i] = slots[h & mask] - 1;
+                    matched[map[i] - old->first] = 1;
+                }
+                break;
+            }
+        }
+        if (map[i] == CPATH_SNAPSHOT_NONE) {
+            ok = _cpathSnapshotChange(changes, CPATH_SNAPSHOT_ADDED,
+                                      dir->first + i);
+        }
     }
-    if (path->len == 1) {
-        // we failed to quickly go up a dir
-        // so we will have to restore len and try another method
-        // this is better than the avoid method because
-        // this will allow you to go up a directory if the path == PATH_MAX
-        path->len = oldLen;
-        if (!CPATH_CONCAT_LIT(path, "..")) {
-            return 0;
+    for (size_t i = 0; i < old->count && ok; i++) {
+        if (!matched[i]) {
+            ok = _cpathSnapshotChange(changes, CPATH_SNAPSHOT_REMOVED,
+                                      old->first + i);
         }
-        return cpathCanonicalise(path, path);
     }
 
-    // we have found a '/' so we just set it to '\0'
-    path->buf[path->len - 1] = '\0';
-    path->len--;
-    return 1;
+    CPATH_FREE(slots);
+    return ok;
 }
 
 _CPATH_FUNC_
-void cpathConvertSepCustom(cpath *path, cpath_char_t sep) {
-    int lastSep = 0;
-    cpath_str cur = path->buf;
-    for (int i = 0; i < path->len + 1; i++) {
-        int isSep = path->buf[i] == CPATH_SEP || path->buf[i] == CPATH_OTHER_SEP;
-        if (isSep && !lastSep) {
-            *cur++ = CPATH_SEP;
-        } else if (!isSep || !lastSep) {
-            *cur++ = path->buf[i];
+int _cpathSnapshotScanDir(cpath_snapshot *out, cpath *path, size_t dir,
+                          const cpath_snapshot *prev, size_t prevDir,
+                          cpath_snapshot_changes *changes) {
+    cpath_file file;
+    cpathCopy(&file.path, path);
+    file.statLoaded = 0;
+    // it may have gone since we listed its parent, then it's just empty
+    if (!cpathGetFileInfo(&file)) return 1;
+
+#if defined __APPLE__
+    int64_t mtime = (int64_t)file.stat.st_mtimespec.tv_sec * 1000000000 +
+                    file.stat.st_mtimespec.tv_nsec;
+    int64_t ctime = (int64_t)file.stat.st_ctimespec.tv_sec * 1000000000 +
+                    file.stat.st_ctimespec.tv_nsec;
+#else
+    int64_t mtime = (int64_t)file.stat.st_mtim.tv_sec * 1000000000 +
+                    file.stat.st_mtim.tv_nsec;
+    int64_t ctime = (int64_t)file.stat.st_ctim.tv_sec * 1000000000 +
+                    file.stat.st_ctim.tv_nsec;
+#endif
+    out->dirs[dir].mtime = mtime;
+    out->dirs[dir].ctime = ctime;
+
+    const cpath_snapshot_dir *old = prevDir != CPATH_SNAPSHOT_NONE
+                                    ? &prev->dirs[prevDir] : NULL;
+    int reuse = old != NULL && old->mtime == mtime && old->ctime == ctime &&
+                mtime / 1000000000 + CPATH_SNAPSHOT_MTIME_SLACK <
+                    (int64_t)prev->taken;
+
+    size_t first = out->count;
+    size_t entry = out->dirs[dir].entry;
+    if (reuse) {
+        for (size_t i = old->first; i < old->first + old->count; i++) {
+            const cpath_snapshot_entry *child = &prev->entries[i];
+            if (_cpathSnapshotAdd(out, prev->names + child->name,
+                                  child->nameLen, child->type, entry) ==
+                    CPATH_SNAPSHOT_NONE) {
+                return 0;
+            }
         }
-        lastSep = isSep;
+    } else if (!_cpathSnapshotList(out, path, entry)) {
+        return 0;
     }
-}
+    out->dirs[dir].first = first;
+    out->dirs[dir].count = out->count - first;
 
-/* == File System == */
+    size_t count = out->count - first;
+    size_t *map = NULL;
+    if (!reuse && old != NULL) {
+        map = (size_t*)CPATH_MALLOC(sizeof(size_t) * (count + 1));
+        if (map == NULL) {
+            errno = ENOMEM;
+            return 0;
+        }
+        if (!_cpathSnapshotMatch(out, &out->dirs[dir], prev, old, map,
+                                 changes)) {
+            CPATH_FREE(map);
+            return 0;
+        }
+    } else if (old == NULL && prev != NULL) {
+        // everything in a new directory is new
+        for (size_t i = first; i < out->count; i++) {
+            if (!_cpathSnapshotChange(changes, CPATH_SNAPSHOT_ADDED, i)) {
+                return 0;
+            }
+        }
+    }
 
-/*
-    Get the current working directory allocating the space
-*/
-_CPATH_FUNC_
-cpath_char_t *cpathGetCwdAlloc() {
-    cpath_char_t *buf;
-    buf = (cpath_char_t*)CPATH_MALLOC(sizeof(cpath_char_t) * CPATH_MAX_PATH_LEN);
-    return cpathGetCwdBuf(buf, CPATH_MAX_PATH_LEN);
-}
+    int ok = 1;
+    size_t len = path->len;
+    for (size_t i = 0; i < count && ok; i++) {
+        size_t child = first + i;
+        if (!(out->entries[child].type & CPATH_LISTING_DIR)) continue;
 
-_CPATH_FUNC_
-cpath_char_t *cpathGetCwdBuf(cpath_char_t *buf, size_t size) {
-    return _cpath_getcwd(buf, size);
+        size_t prevChild = CPATH_SNAPSHOT_NONE;
+        if (reuse) prevChild = old->first + i;
+        else if (map != NULL) prevChild = map[i];
+        size_t prevChildDir = prevChild != CPATH_SNAPSHOT_NONE
+                              ? prev->entries[prevChild].dir
+                              : CPATH_SNAPSHOT_NONE;
+
+        size_t childDir = _cpathSnapshotAddDir(out, child);
+        ok = childDir != CPATH_SNAPSHOT_NONE &&
+             cpathConcatStrn(path, out->names + out->entries[child].name,
+                             out->entries[child].nameLen) &&
+             _cpathSnapshotScanDir(out, path, childDir, prev, prevChildDir,
+                                   changes);
+        path->len = len;
+        path->buf[len] = CPATH_STR('\0');
+    }
+
+    if (map != NULL) CPATH_FREE(map);
+    return ok;
 }
 
 _CPATH_FUNC_
-void cpathWriteCwd(cpath *path) {
-    cpathGetCwdBuf(path->buf, CPATH_MAX_PATH_LEN);
-    path->len = cpath_str_length(path->buf);
-    cpathTrim(path);
+int cpathSnapshotScan(cpath_snapshot *out, const cpath *root,
+                      const cpath_snapshot *prev,
+                      cpath_snapshot_changes *changes) {
+    if (out == NULL || root == NULL || out == prev) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    cpathSnapshotInit(out);
+    out->taken = time(NULL);
+    size_t entry = _cpathSnapshotAdd(out, root->buf, root->len,
+                                     CPATH_LISTING_DIR, CPATH_SNAPSHOT_NONE);
+    if (entry == CPATH_SNAPSHOT_NONE) return 0;
+    size_t dir = _cpathSnapshotAddDir(out, entry);
+    if (dir == CPATH_SNAPSHOT_NONE) return 0;
+
+    cpath path;
+    cpathCopy(&path, root);
+    size_t prevDir = prev != NULL && prev->dirCount > 0 ? 0
+                                                        : CPATH_SNAPSHOT_NONE;
+    return _cpathSnapshotScanDir(out, &path, dir, prev, prevDir, changes);
 }
 
+// If we need a separator between the entry and its parent
 _CPATH_FUNC_
-cpath cpathGetCwd() {
-    cpath path;
-    cpathWriteCwd(&path);
-    cpathTrim(&path);
-    return path;
+int _cpathSnapshotNeedsSep(const cpath_snapshot *snapshot, size_t entry) {
+    size_t parent = snapshot->entries[entry].parent;
+    if (parent == CPATH_SNAPSHOT_NONE) return 0;
+
+    const cpath_snapshot_entry *it = &snapshot->entries[parent];
+    if (it->nameLen == 0) return 1;
+    cpath_char_t last = snapshot->names[it->name + it->nameLen - 1];
+    return last != CPATH_SEP && last != CPATH_OTHER_SEP;
 }
 
 _CPATH_FUNC_
-int cpathOpenDir(cpath_dir *dir, const cpath *path) {
-    if (dir == NULL || path == NULL || path->len == 0) {
-        // empty strings are invalid arguments
+int cpathSnapshotPath(const cpath_snapshot *snapshot, size_t entry, cpath *out) {
+    if (snapshot == NULL || out == NULL || entry >= snapshot->count) {
         errno = EINVAL;
         return 0;
     }
 
-    if (path->len + CPATH_PATH_EXTRA_CHARS >= CPATH_MAX_PATH_LEN) {
+    // work out the length first so we can fill it in backwards
+    size_t len = 0;
+    for (size_t i = entry; i != CPATH_SNAPSHOT_NONE;
+            i = snapshot->entries[i].parent) {
+        len += snapshot->entries[i].nameLen +
+               _cpathSnapshotNeedsSep(snapshot, i);
+    }
+    if (len >= CPATH_MAX_PATH_LEN) {
         errno = ENAMETOOLONG;
         return 0;
     }
 
-    dir->files = NULL;
-
-#if defined _MSC_VER
-    dir->handle = INVALID_HANDLE_VALUE;
-#else
-    dir->dir = NULL;
-#endif
-    dir->path.buf[path->len] = CPATH_STR('\0');
-    dir->parent = NULL;
-    dir->files = NULL;
-#if defined _MSC_VER
-    dir->handle = INVALID_HANDLE_VALUE;
-#else
-    dir->dir = NULL;
-    dir->dirent = NULL;
+    size_t pos = len;
+    out->len = len;
+    out->buf[len] = CPATH_STR('\0');
+    for (size_t i = entry; i != CPATH_SNAPSHOT_NONE;
+            i = snapshot->entries[i].parent) {
+        const cpath_snapshot_entry *it = &snapshot->entries[i];
+        pos -= it->nameLen;
+        memcpy(out->buf + pos, snapshot->names + it->name,
+               sizeof(cpath_char_t) * it->nameLen);
+        if (_cpathSnapshotNeedsSep(snapshot, i)) out->buf[--pos] = CPATH_SEP;
+    }
+    return 1;
+}
 #endif
 
-    cpathCopy(&dir->path, path);
-    return cpathRestartDir(dir);
+/* == Index Files == */
+
+#if defined CPATH_HAS_OPENAT
+#define _CPATH_INDEX_VERSION (1)
+
+_CPATH_FUNC_
+size_t _cpathIndexBuilderAdd(cpath_index_builder *builder,
+                             const cpath_char_t *name, size_t len,
+                             size_t parent) {
+    if (builder->count == builder->cap) {
+        size_t cap = builder->cap > 0 ? builder->cap * 2 : 256;
+        if (!_cpathListingGrow((void**)&builder->entries,
+                               sizeof(cpath_index_build_entry), builder->count,
+                               cap)) {
+            errno = ENOMEM;
+            return CPATH_SNAPSHOT_NONE;
+        }
+        builder->cap = cap;
+    }
+    if (builder->namesLen + len > builder->namesCap) {
+        size_t cap = builder->namesCap > 0 ? builder->namesCap * 2 : 4096;
+        while (cap < builder->namesLen + len) cap *= 2;
+        if (!_cpathListingGrow((void**)&builder->names, sizeof(cpath_char_t),
+                               builder->namesLen, cap)) {
+            errno = ENOMEM;
+            return CPATH_SNAPSHOT_NONE;
+        }
+        builder->namesCap = cap;
+    }
+
+    cpath_index_build_entry *entry = &builder->entries[builder->count];
+    entry->parent = parent;
+    entry->name = builder->namesLen;
+    entry->nameLen = len;
+    entry->type = CPATH_LISTING_DIR;
+    entry->size = 0;
+    entry->mtime = 0;
+    memcpy(builder->names + builder->namesLen, name,
+           sizeof(cpath_char_t) * len);
+    builder->namesLen += len;
+    return builder->count++;
 }
 
+// Remembers that entry is the directory at depth (for its children)
 _CPATH_FUNC_
-int cpathRestartDir(cpath_dir *dir) {
-    // @TODO: I think there is a faster way if the handles exist
-    if (dir == NULL) {
+int _cpathIndexBuilderSetDir(cpath_index_builder *builder, size_t depth,
+                             size_t entry) {
+    if (depth >= builder->dirsCap) {
+        size_t cap = builder->dirsCap > 0 ? builder->dirsCap * 2 : 64;
+        while (cap <= depth) cap *= 2;
+        if (!_cpathListingGrow((void**)&builder->dirs, sizeof(size_t),
+                               builder->dirsLen, cap)) {
+            errno = ENOMEM;
+            return 0;
+        }
+        builder->dirsCap = cap;
+    }
+    builder->dirs[depth] = entry;
+    builder->dirsLen = depth + 1;
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathIndexBuilderInit(cpath_index_builder *builder, const cpath *root) {
+    if (builder == NULL || root == NULL) {
         errno = EINVAL;
         return 0;
     }
 
-    dir->hasNext = 1;
-    dir->size = -1;
-    if (dir->files != NULL) CPATH_FREE(dir->files);
-    dir->files = NULL;
-
-#if defined _MSC_VER
-    if (dir->handle != INVALID_HANDLE_VALUE) FindClose(dir->handle);
-    dir->handle = INVALID_HANDLE_VALUE;
-#else
-    if (dir->dir != NULL) _cpath_closedir(dir->dir);
-    dir->dir = NULL;
-    dir->dirent = NULL;
-#endif
-
-    // Ignore parent, just restart this dir
-
-#if defined _MSC_VER
-    cpath_char_t pathBuf[CPATH_MAX_PATH_LEN];
-    cpath_str_copy(pathBuf, dir->path);
-    cpath_str_cat(pathBuf, CPATH_STR("\\*"));
-
-#if (defined WINAPI_FAMILY) && (WINAPI_FAMILY != WINAPI_FAMILY_DESKTOP_APP)
-    dir->handle = FindFirstFileEx(path_buf, FindExInfoStandard, &dir->findData,
-                                                                FindExSearchNameMatch, NULL, 0);
-#else
-    dir->handle = FindFirstFile(path_buf, &dir->findData);
-#endif
-
-    if (dir->handle == INVALID_HANDLE_VALUE) {
-        errno = ENOENT;
-        // free associate memory and exit
-        cpathCloseDir(dir);
+    builder->entries = NULL;
+    builder->count = 0;
+    builder->cap = 0;
+    builder->names = NULL;
+    builder->namesLen = 0;
+    builder->namesCap = 0;
+    builder->dirs = NULL;
+    builder->dirsLen = 0;
+    builder->dirsCap = 0;
+    builder->failed = 0;
+    if (_cpathIndexBuilderAdd(builder, root->buf, root->len,
+                              CPATH_SNAPSHOT_NONE) == CPATH_SNAPSHOT_NONE ||
+            !_cpathIndexBuilderSetDir(builder, 0, 0)) {
+        cpathIndexBuilderFree(builder);
         return 0;
     }
+    return 1;
+}
 
-#else
+_CPATH_FUNC_
+void cpathIndexBuilderFree(cpath_index_builder *builder) {
+    if (builder == NULL) return;
+    if (builder->entries != NULL) CPATH_FREE(builder->entries);
+    if (builder->names != NULL) CPATH_FREE(builder->names);
+    if (builder->dirs != NULL) CPATH_FREE(builder->dirs);
+    builder->entries = NULL;
+    builder->names = NULL;
+    builder->dirs = NULL;
+    builder->count = builder->cap = 0;
+    builder->namesLen = builder->namesCap = 0;
+    builder->dirsLen = builder->dirsCap = 0;
+}
 
-    dir->dir = _cpath_opendir(dir->path.buf);
-    if (dir->dir == NULL) {
-        cpathCloseDir(dir);
-        return 0;
+_CPATH_FUNC_
+void cpathIndexBuilderVisit(cpath_file *file, cpath_dir *parent, int depth,
+                            void *data) {
+    (void)parent;
+    cpath_index_builder *builder = (cpath_index_builder*)data;
+    if (builder->failed || cpathFileIsSpecialHardLink(file)) return;
+
+    // a traversal is depth first so the last directory we saw one level
+    // up is always the parent
+    if (depth < 0 || (size_t)depth >= builder->dirsLen) {
+        builder->failed = 1;
+        errno = EINVAL;
+        return;
+    }
+    size_t entry = _cpathIndexBuilderAdd(builder, file->name,
+                                         cpath_str_length(file->name),
+                                         builder->dirs[depth]);
+    if (entry == CPATH_SNAPSHOT_NONE ||
+            (file->isDir && !_cpathIndexBuilderSetDir(builder, depth + 1,
+                                                      entry))) {
+        builder->failed = 1;
+        return;
     }
-    dir->dirent = _cpath_readdir(dir->dir);
-    // empty directory
-    if (dir->dirent == NULL) dir->hasNext = 0;
-
-#endif
 
-    return 1;
+    cpath_index_build_entry *it = &builder->entries[entry];
+    it->type = file->isDir ? CPATH_LISTING_DIR
+             : file->isSym ? CPATH_LISTING_SYM
+             : file->isReg ? CPATH_LISTING_REG : 0;
+    if (file->statLoaded || cpathGetFileInfo(file)) {
+        it->size = (uint64_t)file->stat.st_size;
+        it->mtime = (int64_t)file->stat.st_mtime;
+    }
 }
 
 _CPATH_FUNC_
-void cpathCloseDir(cpath_dir *dir) {
-    if (dir == NULL) return;
-
-    dir->hasNext = 1;
-    dir->size = -1;
-    if (dir->files != NULL) CPATH_FREE(dir->files);
-    dir->files = NULL;
+int _cpathIndexNameCmp(const cpath_char_t *a, size_t aLen,
+                       const cpath_char_t *b, size_t bLen) {
+    size_t len = aLen < bLen ? aLen : bLen;
+    for (size_t i = 0; i < len; i++) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    }
+    return aLen < bLen ? -1 : aLen > bLen;
+}
 
-#if defined _MSC_VER
-    if (dir->handle != INVALID_HANDLE_VALUE) FindClose(dir->handle);
-    dir->handle = INVALID_HANDLE_VALUE;
-#else
-    if (dir->dir != NULL) _cpath_closedir(dir->dir);
-    dir->dir = NULL;
-    dir->dirent = NULL;
-#endif
+// Merge sorts the entries in order[0..n) by name
+_CPATH_FUNC_
+void _cpathIndexSortNames(const cpath_index_builder *builder, size_t *order,
+                          size_t *tmp, size_t n) {
+    for (size_t width = 1; width < n; width *= 2) {
+        for (size_t lo = 0; lo < n; lo += width * 2) {
+            size_t mid = lo + width < n ? lo + width : n;
+            size_t hi = lo + width * 2 < n ? lo + width * 2 : n;
+            size_t a = lo;
+            size_t b = mid;
+            for (size_t k = lo; k < hi; k++) {
+                const cpath_index_build_entry *x = &builder->entries[order[a]];
+                const cpath_index_build_entry *y = &builder->entries[order[b < hi ? b : a]];
+                if (a < mid && (b >= hi ||
+                        _cpathIndexNameCmp(builder->names + x->name, x->nameLen,
+                                           builder->names + y->name,
+                                           y->nameLen) <= 0)) {
+                    tmp[k] = order[a++];
+                } else {
+                    tmp[k] = order[b++];
+                }
+            }
+        }
+        memcpy(order, tmp, sizeof(size_t) * n);
+    }
+}
 
-    cpathClear(&dir->path);
-    if (dir->parent != NULL) {
-        cpathCloseDir(dir->parent);
-        CPATH_FREE(dir->parent);
-        dir->parent = NULL;
+_CPATH_FUNC_
+unsigned char *_cpathIndexVarint(unsigned char *out, uint64_t n) {
+    while (n >= 0x80) {
+        *out++ = (unsigned char)(n | 0x80);
+        n >>= 7;
     }
+    *out++ = (unsigned char)n;
+    return out;
 }
 
 _CPATH_FUNC_
-int cpathMoveNextFile(cpath_dir *dir) {
-    if (dir == NULL) {
+const unsigned char *_cpathIndexReadVarint(const unsigned char *in,
+                                           const unsigned char *end,
+                                           uint64_t *n) {
+    *n = 0;
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+        unsigned char byte = *in++;
+        *n |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return in;
+    }
+    return NULL;
+}
+
+#define _CPATH_INDEX_ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+
+_CPATH_FUNC_
+int cpathIndexBuilderWrite(cpath_index_builder *builder, const cpath *path) {
+    if (builder == NULL || path == NULL || builder->failed) {
         errno = EINVAL;
         return 0;
     }
-    if (!dir->hasNext) {
+
+    size_t n = builder->count;
+    size_t blockCount = (n + CPATH_INDEX_BLOCK - 1) / CPATH_INDEX_BLOCK;
+    // start/byParent group the children of every entry, order is the
+    // final (breadth first) order and final maps an entry to it
+    size_t *start = (size_t*)CPATH_MALLOC(sizeof(size_t) * (n + 1) * 5);
+    // worst case every name is stored in full (with two 10 byte varints)
+    size_t namesCap = sizeof(cpath_char_t) * builder->namesLen + n * 20;
+    unsigned char *names = (unsigned char*)CPATH_MALLOC(namesCap + 1);
+    uint64_t *columns = (uint64_t*)CPATH_MALLOC(sizeof(uint64_t) *
+                                                (n * 5 + blockCount + 1));
+    if (start == NULL || names == NULL || columns == NULL) {
+        if (start != NULL) CPATH_FREE(start);
+        if (names != NULL) CPATH_FREE(names);
+        if (columns != NULL) CPATH_FREE(columns);
+        errno = ENOMEM;
         return 0;
     }
+    size_t *byParent = start + n + 1;
+    size_t *order = byParent + n + 1;
+    size_t *final = order + n + 1;
+    size_t *tmp = final + n + 1;
+
+    // group the children by their parent (keeping the visited order)
+    memset(start, 0, sizeof(size_t) * (n + 1));
+    for (size_t i = 1; i < n; i++) start[builder->entries[i].parent + 1]++;
+    for (size_t i = 0; i < n; i++) start[i + 1] += start[i];
+    memcpy(tmp, start, sizeof(size_t) * (n + 1));
+    for (size_t i = 1; i < n; i++) {
+        byParent[tmp[builder->entries[i].parent]++] = i;
+    }
+    for (size_t i = 0; i < n; i++) {
+        _cpathIndexSortNames(builder, byParent + start[i], tmp,
+                             start[i + 1] - start[i]);
+    }
+
+    // breadth first so all the children of a directory are together
+    uint64_t *parents = columns;
+    uint64_t *first = parents + n;
+    uint64_t *counts = first + n;
+    uint64_t *sizes = counts + n;
+    int64_t *mtimes = (int64_t*)(sizes + n);
+    uint64_t *blocks = (uint64_t*)(mtimes + n);
+    unsigned char *types = (unsigned char*)tmp;
+    size_t tail = 1;
+    order[0] = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t entry = order[i];
+        final[entry] = i;
+        first[i] = tail;
+        counts[i] = start[entry + 1] - start[entry];
+        for (size_t j = start[entry]; j < start[entry + 1]; j++) {
+            order[tail++] = byParent[j];
+        }
+    }
 
-#if defined _MSC_VER
-    if (FindNextFile(dir->handle, &dir->findData) == 0) {
-        dir->hasNext = 0;
-        if (GetLastError() != ERROR_SUCCESS &&
-                GetLastError() != ERROR_NO_MORE_FILES) {
-            cpathCloseDir(dir);
-            errno = EIO;
-            return 0;
+    size_t namesLen = 0;
+    const cpath_char_t *prev = NULL;
+    size_t prevLen = 0;
+    for (size_t i = 0; i < n; i++) {
+        const cpath_index_build_entry *entry = &builder->entries[order[i]];
+        const cpath_char_t *name = builder->names + entry->name;
+        parents[i] = entry->parent == CPATH_SNAPSHOT_NONE
+                     ? CPATH_INDEX_NONE : final[entry->parent];
+        sizes[i] = entry->size;
+        mtimes[i] = entry->mtime;
+        types[i] = entry->type;
+
+        size_t shared = 0;
+        if (i % CPATH_INDEX_BLOCK == 0) {
+            blocks[i / CPATH_INDEX_BLOCK] = namesLen;
+        } else {
+            while (shared < prevLen && shared < entry->nameLen &&
+                   prev[shared] == name[shared]) {
+                shared++;
+            }
+        }
+        unsigned char *out = _cpathIndexVarint(names + namesLen, shared);
+        out = _cpathIndexVarint(out, entry->nameLen - shared);
+        memcpy(out, name + shared,
+               sizeof(cpath_char_t) * (entry->nameLen - shared));
+        namesLen = out - names +
+                   sizeof(cpath_char_t) * (entry->nameLen - shared);
+        prev = name;
+        prevLen = entry->nameLen;
+    }
+
+    cpath_index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "CPATHIDX", 8);
+    header.version = _CPATH_INDEX_VERSION;
+    header.charSize = (uint32_t)sizeof(cpath_char_t);
+    header.count = n;
+    header.parents = _CPATH_INDEX_ALIGN(sizeof(header));
+    header.first = header.parents + sizeof(uint64_t) * n;
+    header.counts = header.first + sizeof(uint64_t) * n;
+    header.sizes = header.counts + sizeof(uint64_t) * n;
+    header.mtimes = header.sizes + sizeof(uint64_t) * n;
+    header.blocks = header.mtimes + sizeof(int64_t) * n;
+    header.types = header.blocks + sizeof(uint64_t) * blockCount;
+    header.names = _CPATH_INDEX_ALIGN(header.types + n);
+    header.namesLen = namesLen;
+
+    /*
+        It's written next to path and then renamed over it so anyone that
+        has the old one mapped keeps seeing the old one (rather than it
+        being truncated under them) and a crash never leaves half an index.
+    */
+    static const unsigned char padding[8] = {0};
+    int ok = 0;
+    cpath tmpPath;
+    cpathCopy(&tmpPath, path);
+    cpathAppendSprintf(&tmpPath, CPATH_STR(".%d.tmp"), (int)getpid());
+    FILE *f = NULL;
+    CPATH_SYSCALL_HOOK("open");
+    int fd = open(tmpPath.buf, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd != -1) {
+        f = fdopen(fd, "wb");
+        if (f == NULL) {
+            close(fd);
+            unlink(tmpPath.buf);
         }
     }
-#else
-    dir->dirent = _cpath_readdir(dir->dir);
-    if (dir->dirent == NULL) {
-        dir->hasNext = 0;
+    if (f != NULL) {
+        ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+             fwrite(padding, 1, header.parents - sizeof(header), f) ==
+                header.parents - sizeof(header) &&
+             fwrite(columns, sizeof(uint64_t), n * 5 + blockCount, f) ==
+                n * 5 + blockCount &&
+             fwrite(types, 1, n, f) == n &&
+             fwrite(padding, 1, header.names - header.types - n, f) ==
+                header.names - header.types - n &&
+             fwrite(names, 1, namesLen, f) == namesLen &&
+             fflush(f) == 0 && fsync(fd) == 0;
+        ok = fclose(f) == 0 && ok;
+        ok = ok && rename(tmpPath.buf, path->buf) == 0;
+        if (!ok) {
+            int err = errno;
+            unlink(tmpPath.buf);
+            errno = err;
+        }
     }
-#endif
 
-    return 1;
+    CPATH_FREE(start);
+    CPATH_FREE(names);
+    CPATH_FREE(columns);
+    return ok;
 }
 
+// Does [off, off + len) fit in size bytes (without overflowing)
 _CPATH_FUNC_
-int cpathGetFileInfo(cpath_file *file) {
-    if (file->statLoaded) {
-        return 1;
-    }
-#if !defined _MSC_VER
-#if defined __MINGW32__
-    if (_tstat(file->path.buf, &file->stat) == -1) {
+int _cpathIndexFits(uint64_t off, uint64_t len, uint64_t size) {
+    return off <= size && len <= size - off;
+}
+
+_CPATH_FUNC_
+int cpathIndexOpen(cpath_index *index, const cpath *path) {
+    if (index == NULL || path == NULL) {
+        errno = EINVAL;
         return 0;
     }
-#elif defined _BSD_SOURCE || defined _DEFAULT_SOURCE	\
-            || (defined _XOPEN_SOURCE && _XOPEN_SOURCE >= 500)	\
-            || (defined _POSIX_C_SOURCE && _POSIX_C_SOURCE >= 200112L)
-    if (lstat(file->path.buf, &file->stat) == -1) {
+    index->map = NULL;
+    index->size = 0;
+    index->count = 0;
+
+    CPATH_SYSCALL_HOOK("open");
+    int fd = open(path->buf, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+    struct stat st;
+    CPATH_SYSCALL_HOOK("stat");
+    if (fstat(fd, &st) == -1 ||
+            (size_t)st.st_size < sizeof(cpath_index_header)) {
+        close(fd);
+        errno = EINVAL;
         return 0;
     }
-#else
-    if (stat(file->path.buf, &file->stat) == -1) {
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    // make sure everything is where it says it is
+    const cpath_index_header *header = (const cpath_index_header*)map;
+    uint64_t size = (uint64_t)st.st_size;
+    uint64_t n = header->count;
+    uint64_t blockCount = (n + CPATH_INDEX_BLOCK - 1) / CPATH_INDEX_BLOCK;
+    if (memcmp(header->magic, "CPATHIDX", 8) != 0 ||
+            header->version != _CPATH_INDEX_VERSION ||
+            header->charSize != sizeof(cpath_char_t) || n == 0 ||
+            n > size / 8 || header->parents % 8 != 0 ||
+            // each offset is checked before it is added to
+            !_cpathIndexFits(header->parents, n * 8, size) ||
+            header->first != header->parents + n * 8 ||
+            !_cpathIndexFits(header->first, n * 8, size) ||
+            header->counts != header->first + n * 8 ||
+            !_cpathIndexFits(header->counts, n * 8, size) ||
+            header->sizes != header->counts + n * 8 ||
+            !_cpathIndexFits(header->sizes, n * 8, size) ||
+            header->mtimes != header->sizes + n * 8 ||
+            !_cpathIndexFits(header->mtimes, n * 8, size) ||
+            header->blocks != header->mtimes + n * 8 ||
+            !_cpathIndexFits(header->blocks, blockCount * 8, size) ||
+            header->types != header->blocks + blockCount * 8 ||
+            !_cpathIndexFits(header->types, n, size) ||
+            !_cpathIndexFits(header->names, header->namesLen, size)) {
+        munmap(map, (size_t)st.st_size);
+        errno = EINVAL;
         return 0;
     }
-#endif
-#endif
-    file->statLoaded = 1;
+
+    const unsigned char *base = (const unsigned char*)map;
+    index->map = map;
+    index->size = (size_t)st.st_size;
+    index->count = n;
+    index->parents = (const uint64_t*)(base + header->parents);
+    index->first = (const uint64_t*)(base + header->first);
+    index->counts = (const uint64_t*)(base + header->counts);
+    index->sizes = (const uint64_t*)(base + header->sizes);
+    index->mtimes = (const int64_t*)(base + header->mtimes);
+    index->blocks = (const uint64_t*)(base + header->blocks);
+    index->types = base + header->types;
+    index->names = base + header->names;
+    index->namesLen = header->namesLen;
     return 1;
 }
 
 _CPATH_FUNC_
-int cpathLoadFlags(cpath_dir *dir, cpath_file *file, void *data) {
-#if defined _MSC_VER
-    WIN32_FIND_DATA *find = (WIN32_FIND_DATA*) data;
-    file->isDir = FILE_IS(find, DIRECTORY);
-    if (FILE_IS(find, NORMAL)) {
-        file->isReg = 1;
-    } else if (FILE_IS_NOT(find, DEVICE) && FILE_IS_NOT(find, DIRECTORY) &&
-                         FILE_IS_NOT(find, ENCRYPTED) && FILE_IS_NOT(find, OFFLINE) &&
-#ifdef FILE_ATTRIBUTE_INTEGRITY_STREAM
-                         FILE_IS_NOT(find, INTEGRITY_STREAM) &&
-#endif
-#ifdef FILE_ATTRIBUTE_NO_SCRUB_DATA
-                         FILE_IS_NOT(find, NO_SCRUB_DATA) &&
-#endif
-                         FILE_IS_NOT(find, TEMPORARY)) {
-        file->isReg = 1;
-    } else {
-        file->isReg = 0;
-    }
-    file->isSym = FILE_IS(find, REPARSE_POINT);
-#else
-    if (dir->dirent == NULL || dir->dirent->d_type == DT_UNKNOWN) {
-        if (!cpathGetFileInfo(file)) {
+void cpathIndexClose(cpath_index *index) {
+    if (index == NULL || index->map == NULL) return;
+    munmap(index->map, index->size);
+    index->map = NULL;
+    index->size = 0;
+    index->count = 0;
+}
+
+_CPATH_FUNC_
+size_t cpathIndexName(const cpath_index *index, uint64_t entry,
+                      cpath_char_t *out) {
+    if (index == NULL || entry >= index->count) return 0;
+
+    // decode from the start of the block until we get to it
+    uint64_t block = entry / CPATH_INDEX_BLOCK;
+    const unsigned char *end = index->names + index->namesLen;
+    const unsigned char *in = index->blocks[block] < index->namesLen
+                              ? index->names + index->blocks[block] : end;
+    uint64_t len = 0;
+    for (uint64_t i = block * CPATH_INDEX_BLOCK; i <= entry; i++) {
+        uint64_t shared;
+        uint64_t rest;
+        in = _cpathIndexReadVarint(in, end, &shared);
+        if (in != NULL) in = _cpathIndexReadVarint(in, end, &rest);
+        if (in == NULL || shared > len ||
+                shared + rest >= CPATH_MAX_PATH_LEN ||
+                (uint64_t)(end - in) < sizeof(cpath_char_t) * rest) {
+            out[0] = CPATH_STR('\0');
             return 0;
         }
-
-        file->isDir = S_ISDIR(file->stat.st_mode);
-        file->isReg = S_ISREG(file->stat.st_mode);
-        file->isSym = S_ISLNK(file->stat.st_mode);
-    } else {
-        file->isDir = dir->dirent->d_type == DT_DIR;
-        file->isReg = dir->dirent->d_type == DT_REG;
-        file->isSym = dir->dirent->d_type == DT_LNK;
-        file->statLoaded = 0;
+        memcpy(out + shared, in, sizeof(cpath_char_t) * rest);
+        in += sizeof(cpath_char_t) * rest;
+        len = shared + rest;
     }
-#endif
-    return 1;
+    out[len] = CPATH_STR('\0');
+    return (size_t)len;
 }
 
+// Binary search of the (sorted) children of dir
 _CPATH_FUNC_
-int cpathPeekNextFile(cpath_dir *dir, cpath_file *file) {
-    if (file == NULL || dir == NULL) {
+uint64_t _cpathIndexFindChild(const cpath_index *index, uint64_t dir,
+                              const cpath_char_t *name, size_t len) {
+    cpath_char_t buf[CPATH_MAX_PATH_LEN];
+    uint64_t lo = index->first[dir];
+    uint64_t hi = lo + index->counts[dir];
+    if (hi > index->count || hi < lo) return CPATH_INDEX_NONE;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        size_t midLen = cpathIndexName(index, mid, buf);
+        int cmp = _cpathIndexNameCmp(buf, midLen, name, len);
+        if (cmp == 0) return mid;
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return CPATH_INDEX_NONE;
+}
+
+_CPATH_FUNC_
+uint64_t cpathIndexFind(const cpath_index *index, const cpath *path) {
+    if (index == NULL || path == NULL || index->count == 0) {
+        return CPATH_INDEX_NONE;
+    }
+
+    cpath_char_t root[CPATH_MAX_PATH_LEN];
+    size_t rootLen = cpathIndexName(index, 0, root);
+    if (path->len < rootLen || memcmp(path->buf, root,
+                                      sizeof(cpath_char_t) * rootLen) != 0 ||
+            (path->len > rootLen && rootLen > 0 &&
+             root[rootLen - 1] != CPATH_SEP &&
+             root[rootLen - 1] != CPATH_OTHER_SEP &&
+             path->buf[rootLen] != CPATH_SEP &&
+             path->buf[rootLen] != CPATH_OTHER_SEP)) {
+        return CPATH_INDEX_NONE;
+    }
+
+    // the rest is relative to the root
+    while (rootLen < path->len && (path->buf[rootLen] == CPATH_SEP ||
+                                   path->buf[rootLen] == CPATH_OTHER_SEP)) {
+        rootLen++;
+    }
+
+    cpath_component_it it;
+    cpath_component component;
+    uint64_t entry = 0;
+    cpathComponentItInitStrn(&it, path->buf + rootLen, path->len - rootLen);
+    while (entry != CPATH_INDEX_NONE && cpathComponentItNext(&it, &component)) {
+        entry = _cpathIndexFindChild(index, entry, component.str,
+                                     component.len);
+    }
+    return entry;
+}
+
+_CPATH_FUNC_
+int cpathIndexOpenDir(cpath_index_dir *dir, const cpath_index *index,
+                      const cpath *path) {
+    if (dir == NULL || index == NULL || path == NULL) {
         errno = EINVAL;
         return 0;
     }
 
-    file->statLoaded = 0;
-    // load current file into file
-    const cpath_char_t *filename;
-    size_t filenameLen;
-#if defined _MSC_VER
-    if (dir->handle == INVALID_HANDLE_VALUE) {
+    uint64_t entry = cpathIndexFind(index, path);
+    if (entry == CPATH_INDEX_NONE) {
+        errno = ENOENT;
         return 0;
     }
-    filename = dir->fileData.cFileName;
-    filenameLen = cpath_str_length(filename);
-#else
-    if (dir->dirent == NULL) {
+    if (!(index->types[entry] & CPATH_LISTING_DIR)) {
+        errno = ENOTDIR;
         return 0;
     }
-    filename = dir->dirent->d_name;
-    // TODO: On MACOS there is a d_namlen but not on linux
-    filenameLen = strlen(dir->dirent->d_name);
-#endif
-    size_t totalLen = dir->path.len + filenameLen;
-    if (totalLen + 1 + CPATH_PATH_EXTRA_CHARS >= CPATH_MAX_PATH_LEN ||
-            filenameLen >= CPATH_MAX_FILENAME_LEN) {
-        errno = ENAMETOOLONG;
+
+    dir->index = index;
+    dir->next = index->first[entry];
+    dir->end = dir->next + index->counts[entry];
+    if (dir->end > index->count || dir->end < dir->next) {
+        errno = EINVAL;
         return 0;
     }
+    cpathCopy(&dir->path, path);
+    return 1;
+}
 
-    cpath_str_copy(file->name, filename);
-    cpathCopy(&file->path, &dir->path);
-    if (!CPATH_CONCAT_LIT(&file->path, "/") ||
-            !cpathConcatStr(&file->path, filename)) {
+_CPATH_FUNC_
+int cpathIndexGetNextFile(cpath_index_dir *dir, cpath_file *file) {
+    if (dir == NULL || file == NULL || dir->next >= dir->end) return 0;
+
+    const cpath_index *index = dir->index;
+    uint64_t entry = dir->next++;
+    cpath_char_t name[CPATH_MAX_PATH_LEN];
+    size_t len = cpathIndexName(index, entry, name);
+    if (len == 0 || len >= CPATH_MAX_FILENAME_LEN) {
+        errno = EINVAL;
         return 0;
     }
+
+    cpathCopy(&file->path, &dir->path);
+    if (!cpathConcatStrn(&file->path, name, len)) return 0;
+    memcpy(file->name, name, sizeof(cpath_char_t) * (len + 1));
+
+    unsigned char type = index->types[entry];
+    file->isDir = !!(type & CPATH_LISTING_DIR);
+    file->isReg = !!(type & CPATH_LISTING_REG);
+    file->isSym = !!(type & CPATH_LISTING_SYM);
+    memset(&file->stat, 0, sizeof(file->stat));
+    file->stat.st_mode = file->isDir ? S_IFDIR
+                       : file->isSym ? S_IFLNK
+                       : file->isReg ? S_IFREG : 0;
+    file->stat.st_size = (off_t)index->sizes[entry];
+    file->stat.st_mtime = (time_t)index->mtimes[entry];
+    file->statLoaded = 1;
+    file->extension = NULL;
 #ifndef CPATH_NO_AUTOLOAD_EXT
     cpathGetExtension(file);
-#endif
-#if defined _MSC_VER
-    if (!cpathLoadFlags(dir, file, dir->fileData)) return 0;
-#else
-    if (!cpathLoadFlags(dir, file, NULL)) return 0;
-#endif
-#ifdef CPATH_AUTOLOAD_STAT
-    if (!cpathGetFileInfo(file)) return 0;
 #endif
     return 1;
 }
+#endif
+
+/* == Watching == */
+
+#if defined CPATH_HAS_INOTIFY
+#define _CPATH_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                           IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | \
+                           IN_CLOSE_WRITE | IN_ONLYDIR | IN_DONT_FOLLOW | \
+                           IN_EXCL_UNLINK)
 
 _CPATH_FUNC_
-int cpathGetNextFile(cpath_dir *dir, cpath_file *file) {
-    if (file != NULL) {
-        if (!cpathPeekNextFile(dir, file)) {
-            return 0;
+uint64_t _cpathWatchHash(size_t parent, const cpath_char_t *name,
+                         size_t len) {
+    uint64_t hash = _CPATH_HASH_INIT ^ ((uint64_t)parent * 0x9E3779B97F4A7C15ULL);
+    return _cpathHashStep(hash, name, len);
+}
+
+_CPATH_FUNC_
+size_t _cpathWatchChild(const cpath_watch *watch, size_t parent,
+                        const cpath_char_t *name, size_t len) {
+    if (watch->bucketCount == 0) return CPATH_WATCH_NONE;
+    uint64_t hash = _cpathWatchHash(parent, name, len);
+    size_t node = watch->buckets[hash & (watch->bucketCount - 1)];
+    while (node != CPATH_WATCH_NONE) {
+        const cpath_watch_node *it = &watch->nodes[node];
+        if (it->hash == hash && it->parent == parent && it->nameLen == len &&
+                memcmp(it->name, name, sizeof(cpath_char_t) * len) == 0) {
+            return node;
         }
+        node = it->chain;
     }
+    return CPATH_WATCH_NONE;
+}
 
-    errno = 0;
-    // @TODO: Bug I think
-    //        I think we want to remove the condition that dir->hasNext
-    //        Sicne cpath checks that.
-    if (dir->hasNext && !cpathMoveNextFile(dir) && errno != 0) {
-        return 0;
+_CPATH_FUNC_
+void _cpathWatchLink(cpath_watch *watch, size_t node) {
+    cpath_watch_node *it = &watch->nodes[node];
+    cpath_watch_node *parent = &watch->nodes[it->parent];
+    it->prev = CPATH_WATCH_NONE;
+    it->next = parent->child;
+    if (parent->child != CPATH_WATCH_NONE) {
+        watch->nodes[parent->child].prev = node;
+    }
+    parent->child = node;
+
+    size_t bucket = it->hash & (watch->bucketCount - 1);
+    it->chain = watch->buckets[bucket];
+    watch->buckets[bucket] = node;
+}
+
+_CPATH_FUNC_
+void _cpathWatchUnlink(cpath_watch *watch, size_t node) {
+    cpath_watch_node *it = &watch->nodes[node];
+    if (it->prev != CPATH_WATCH_NONE) {
+        watch->nodes[it->prev].next = it->next;
+    } else {
+        watch->nodes[it->parent].child = it->next;
     }
+    if (it->next != CPATH_WATCH_NONE) watch->nodes[it->next].prev = it->prev;
 
-    return 1;
+    size_t *chain = &watch->buckets[it->hash & (watch->bucketCount - 1)];
+    while (*chain != node) chain = &watch->nodes[*chain].chain;
+    *chain = it->chain;
 }
 
 _CPATH_FUNC_
-int cpathFileIsSpecialHardLink(const cpath_file *file) {
-    return file->name[0] == CPATH_STR('.') && (file->name[1] == CPATH_STR('\0') ||
-                 (file->name[1] == CPATH_STR('.') && file->name[2] == CPATH_STR('\0')));
+int _cpathWatchGrowBuckets(cpath_watch *watch) {
+    size_t count = watch->bucketCount > 0 ? watch->bucketCount * 2 : 256;
+    size_t *buckets = (size_t*)CPATH_MALLOC(sizeof(size_t) * count);
+    if (buckets == NULL) {
+        errno = ENOMEM;
+        return 0;
+    }
+    for (size_t i = 0; i < count; i++) buckets[i] = CPATH_WATCH_NONE;
+    // the root is never in the table
+    for (size_t i = 1; i < watch->used; i++) {
+        cpath_watch_node *it = &watch->nodes[i];
+        if (it->name == NULL) continue;
+        size_t bucket = it->hash & (count - 1);
+        it->chain = buckets[bucket];
+        buckets[bucket] = i;
+    }
+    if (watch->buckets != NULL) CPATH_FREE(watch->buckets);
+    watch->buckets = buckets;
+    watch->bucketCount = count;
+    return 1;
 }
 
 _CPATH_FUNC_
-int cpathLoadAllFiles(cpath_dir *dir) {
-    if (dir == NULL) {
-        errno = EINVAL;
-        return 0;
+size_t _cpathWatchAdd(cpath_watch *watch, size_t parent,
+                      const cpath_char_t *name, size_t len) {
+    if (watch->count >= watch->bucketCount && !_cpathWatchGrowBuckets(watch)) {
+        return CPATH_WATCH_NONE;
+    }
+    cpath_char_t *copy = (cpath_char_t*)CPATH_MALLOC(sizeof(cpath_char_t) *
+                                                     (len + 1));
+    if (copy == NULL) {
+        errno = ENOMEM;
+        return CPATH_WATCH_NONE;
     }
 
-    if (dir->files != NULL) CPATH_FREE(dir->files);
+    size_t node = watch->freeList;
+    if (node != CPATH_WATCH_NONE) {
+        watch->freeList = watch->nodes[node].next;
+    } else {
+        if (watch->used == watch->cap) {
+            size_t cap = watch->cap > 0 ? watch->cap * 2 : 256;
+            if (!_cpathListingGrow((void**)&watch->nodes,
+                                   sizeof(cpath_watch_node), watch->used,
+                                   cap)) {
+                CPATH_FREE(copy);
+                errno = ENOMEM;
+                return CPATH_WATCH_NONE;
+            }
+            watch->cap = cap;
+        }
+        node = watch->used++;
+    }
+
+    memcpy(copy, name, sizeof(cpath_char_t) * len);
+    copy[len] = CPATH_STR('\0');
+    cpath_watch_node *it = &watch->nodes[node];
+    it->parent = parent;
+    it->child = CPATH_WATCH_NONE;
+    it->next = CPATH_WATCH_NONE;
+    it->prev = CPATH_WATCH_NONE;
+    it->chain = CPATH_WATCH_NONE;
+    it->hash = _cpathWatchHash(parent, name, len);
+    it->name = copy;
+    it->nameLen = len;
+    it->wd = -1;
+    it->type = CPATH_LISTING_REG;
+    it->seen = 1;
+    it->mode = 0;
+    it->size = 0;
+    it->mtime = 0;
+    watch->count++;
+    if (parent != CPATH_WATCH_NONE) _cpathWatchLink(watch, node);
+    return node;
+}
 
-    // @Ugly:
-    /*
-        The problem is that we could go through all files to get a count
-        This is kinda ugly but is linear and ensures we don't make allocations
-        The other method is to use a 'vector' however the copies are really
-        expensive since we have huge objects which is why I chose the count method
-    */
-    size_t count = 0;
-    errno = 0;
-    while (cpathMoveNextFile(dir)) {
-        count++;
+// Removes node and everything under it
+_CPATH_FUNC_
+void _cpathWatchRemove(cpath_watch *watch, size_t node) {
+    cpath_watch_node *it = &watch->nodes[node];
+    while (it->child != CPATH_WATCH_NONE) {
+        _cpathWatchRemove(watch, it->child);
+    }
+
+    if (it->parent != CPATH_WATCH_NONE) _cpathWatchUnlink(watch, node);
+    if (it->wd >= 0) {
+        inotify_rm_watch(watch->fd, it->wd);
+        watch->wds[it->wd] = CPATH_WATCH_NONE;
+    }
+    if (watch->moved == node) watch->moved = CPATH_WATCH_NONE;
+    CPATH_FREE(it->name);
+    it->name = NULL;
+    it->next = watch->freeList;
+    watch->freeList = node;
+    watch->count--;
+}
+
+_CPATH_FUNC_
+void _cpathWatchSetInfo(cpath_watch_node *node, cpath_file *file) {
+    node->type = file->isDir ? CPATH_LISTING_DIR
+               : file->isSym ? CPATH_LISTING_SYM
+               : file->isReg ? CPATH_LISTING_REG : 0;
+    if (file->statLoaded || cpathGetFileInfo(file)) {
+        node->mode = (uint32_t)file->stat.st_mode;
+        node->size = (uint64_t)file->stat.st_size;
+        node->mtime = (int64_t)file->stat.st_mtime;
     }
+}
 
-    // we can have 0 files
-    if (count == 0) {
-        dir->size = 0;
+_CPATH_FUNC_
+int _cpathWatchAddWatch(cpath_watch *watch, size_t node, const cpath *path) {
+    int wd = inotify_add_watch(watch->fd, path->buf, _CPATH_WATCH_MASK);
+    if (wd < 0) {
+        watch->unwatched++;
         return 1;
     }
-
-    // loading failed for some reason or we failed to restart the dir iterator
-    if (errno != 0 || !cpathRestartDir(dir)) {
-        // we won't close the directory though!
-        // we'll just pretend we have no files!
-        dir->size = 0;
-        return 0;
+    if ((size_t)wd >= watch->wdsCap) {
+        size_t cap = watch->wdsCap > 0 ? watch->wdsCap * 2 : 256;
+        while (cap <= (size_t)wd) cap *= 2;
+        if (!_cpathListingGrow((void**)&watch->wds, sizeof(size_t),
+                               watch->wdsCap, cap)) {
+            inotify_rm_watch(watch->fd, wd);
+            errno = ENOMEM;
+            return 0;
+        }
+        for (size_t i = watch->wdsCap; i < cap; i++) {
+            watch->wds[i] = CPATH_WATCH_NONE;
+        }
+        watch->wdsCap = cap;
     }
+    // the same directory twice (i.e. a bind mount) only one gets events
+    size_t old = watch->wds[wd];
+    if (old != CPATH_WATCH_NONE && old != node) watch->nodes[old].wd = -1;
+    watch->wds[wd] = node;
+    watch->nodes[node].wd = wd;
+    return 1;
+}
 
-    dir->size = count;
-    dir->files = (cpath_file*) CPATH_MALLOC(sizeof(cpath_file) * count);
-    if (dir->files == NULL) {
-        // we won't close the directory just error out
-        dir->size = 0;
+// Brings the directory node (at path) up to date with what is on disk
+// keeping the nodes (and watches) of anything that is still there
+_CPATH_FUNC_
+int _cpathWatchScan(cpath_watch *watch, size_t node, const cpath *path) {
+    // watch first so nothing made while we are listing is missed
+    if (watch->nodes[node].wd < 0 && !_cpathWatchAddWatch(watch, node, path)) {
         return 0;
     }
 
-    errno = 0;
-    int i = 0;
-    // also make sure that we don't overflow the array
-    // because size requirements changed i.e. race condition
-    // we could fix this by resizing but that's super expensive
-    // maybe this is time for a linked list or just to dynamically allocate
-    // all file nodes and waste the extra 8 bytes per (and cache locality)
-    while (i < dir->size && cpathGetNextFile(dir, &dir->files[i])) {
-        i++;
+    cpath_dir dir;
+    if (!cpathOpenDir(&dir, path)) {
+        // it'll be removed by its parent's events
+        return errno != ENOMEM;
+    }
+    size_t child = watch->nodes[node].child;
+    for (; child != CPATH_WATCH_NONE; child = watch->nodes[child].next) {
+        watch->nodes[child].seen = 0;
     }
 
-    if (i < dir->size) {
-        // we stopped early due to error I'm still not going to crazily error out
-        // because it may just be race condition and I'll be a bit lazy
-        // @TODO: check if it was just race or if a read failed
-        dir->size = i;
+    cpath_file file;
+    const cpath_char_t *name;
+    size_t len;
+    int ok = 1;
+    while (ok && (name = cpathPeekNextName(&dir, &len)) != NULL) {
+        if (!cpathGetNextFile(&dir, &file)) {
+            // it went between the readdir and the stat (its events will
+            // follow) or the path is too long, either way keep what we
+            // have and move along
+            child = _cpathWatchChild(watch, node, name, len);
+            if (child != CPATH_WATCH_NONE) watch->nodes[child].seen = 1;
+            cpathMoveNextFile(&dir);
+            continue;
+        }
+        if (cpathFileIsSpecialHardLink(&file)) continue;
+        len = cpath_str_length(file.name);
+        child = _cpathWatchChild(watch, node, file.name, len);
+        if (child != CPATH_WATCH_NONE &&
+                !(watch->nodes[child].type & CPATH_LISTING_DIR) !=
+                !file.isDir) {
+            _cpathWatchRemove(watch, child);
+            child = CPATH_WATCH_NONE;
+        }
+        if (child == CPATH_WATCH_NONE) {
+            child = _cpathWatchAdd(watch, node, file.name, len);
+            if (child == CPATH_WATCH_NONE) {
+                ok = 0;
+                break;
+            }
+        }
+        _cpathWatchSetInfo(&watch->nodes[child], &file);
+        watch->nodes[child].seen = 1;
+        if (file.isDir) ok = _cpathWatchScan(watch, child, &file.path);
     }
+    cpathCloseDir(&dir);
+    // we only know what is gone if we got through the whole listing
+    if (!ok) return 0;
 
+    // anything we didn't see is gone
+    child = watch->nodes[node].child;
+    while (child != CPATH_WATCH_NONE) {
+        size_t next = watch->nodes[child].next;
+        if (!watch->nodes[child].seen) _cpathWatchRemove(watch, child);
+        child = next;
+    }
     return 1;
 }
 
 _CPATH_FUNC_
-int cpathCheckGetN(cpath_dir *dir, size_t n) {
-    if (dir == NULL) {
+int cpathWatchOpen(cpath_watch *watch, const cpath *root) {
+    if (watch == NULL || root == NULL) {
         errno = EINVAL;
         return 0;
     }
 
-    if (dir->size == -1) {
-        // we haven't loaded
-        cpathLoadAllFiles(dir);
-    }
+    watch->fd = -1;
+    watch->buf = NULL;
+    watch->nodes = NULL;
+    watch->count = 0;
+    watch->used = 0;
+    watch->cap = 0;
+    watch->freeList = CPATH_WATCH_NONE;
+    watch->buckets = NULL;
+    watch->bucketCount = 0;
+    watch->wds = NULL;
+    watch->wdsCap = 0;
+    watch->moved = CPATH_WATCH_NONE;
+    watch->movedCookie = 0;
+    watch->events = 0;
+    watch->rescans = 0;
+    watch->unwatched = 0;
 
-    if (n >= dir->size) {
-        errno = ENOENT;
+    cpath_file file;
+    if (!cpathOpenFile(&file, root)) return 0;
+    if (!file.isDir) {
+        errno = ENOTDIR;
+        return 0;
+    }
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd < 0) return 0;
+    watch->buf = CPATH_MALLOC(CPATH_WATCH_BUF_SIZE);
+    if (watch->buf == NULL ||
+            _cpathWatchAdd(watch, CPATH_WATCH_NONE, root->buf,
+                           root->len) == CPATH_WATCH_NONE) {
+        cpathWatchClose(watch);
+        errno = ENOMEM;
+        return 0;
+    }
+    _cpathWatchSetInfo(&watch->nodes[0], &file);
+    if (!_cpathWatchScan(watch, 0, root)) {
+        cpathWatchClose(watch);
         return 0;
     }
     return 1;
 }
 
 _CPATH_FUNC_
-int cpathGetFile(cpath_dir *dir, cpath_file *file, size_t n) {
-    if (file == NULL) {
-        errno = EINVAL;
+void cpathWatchClose(cpath_watch *watch) {
+    if (watch == NULL) return;
+    for (size_t i = 0; i < watch->used; i++) {
+        if (watch->nodes[i].name != NULL) CPATH_FREE(watch->nodes[i].name);
+    }
+    if (watch->fd >= 0) close(watch->fd);
+    if (watch->buf != NULL) CPATH_FREE(watch->buf);
+    if (watch->nodes != NULL) CPATH_FREE(watch->nodes);
+    if (watch->buckets != NULL) CPATH_FREE(watch->buckets);
+    if (watch->wds != NULL) CPATH_FREE(watch->wds);
+    watch->fd = -1;
+    watch->buf = NULL;
+    watch->nodes = NULL;
+    watch->buckets = NULL;
+    watch->wds = NULL;
+    watch->count = watch->used = watch->cap = 0;
+    watch->bucketCount = watch->wdsCap = 0;
+}
+
+// Picks up whatever is at name inside of dir (replacing what was there)
+_CPATH_FUNC_
+int _cpathWatchCreated(cpath_watch *watch, size_t dir,
+                       const cpath_char_t *name, size_t len) {
+    cpath path;
+    cpath_file file;
+    size_t node = _cpathWatchChild(watch, dir, name, len);
+    if (node != CPATH_WATCH_NONE) _cpathWatchRemove(watch, node);
+    if (!cpathWatchPath(watch, dir, &path) ||
+            !cpathConcatStrn(&path, name, len)) {
         return 0;
     }
-    if (!cpathCheckGetN(dir, n)) return 0;
+    // it could already be gone again
+    if (!cpathOpenFile(&file, &path)) return errno != ENOMEM;
 
-    memcpy(file, &dir->files[n], sizeof(cpath_file));
+    node = _cpathWatchAdd(watch, dir, name, len);
+    if (node == CPATH_WATCH_NONE) return 0;
+    _cpathWatchSetInfo(&watch->nodes[node], &file);
+    return !file.isDir || _cpathWatchScan(watch, node, &path);
+}
+
+// Reattaches the node we saw leave (IN_MOVED_FROM) as name inside of dir
+_CPATH_FUNC_
+int _cpathWatchMoved(cpath_watch *watch, size_t dir,
+                     const cpath_char_t *name, size_t len) {
+    size_t node = watch->moved;
+    size_t old = _cpathWatchChild(watch, dir, name, len);
+    watch->moved = CPATH_WATCH_NONE;
+    if (old == node) return 1;
+    if (old != CPATH_WATCH_NONE) _cpathWatchRemove(watch, old);
+
+    cpath_char_t *copy = (cpath_char_t*)CPATH_MALLOC(sizeof(cpath_char_t) *
+                                                     (len + 1));
+    if (copy == NULL) {
+        errno = ENOMEM;
+        return 0;
+    }
+    memcpy(copy, name, sizeof(cpath_char_t) * len);
+    copy[len] = CPATH_STR('\0');
+
+    // a directory keeps its watches since they follow the inode
+    cpath_watch_node *it = &watch->nodes[node];
+    _cpathWatchUnlink(watch, node);
+    CPATH_FREE(it->name);
+    it->name = copy;
+    it->nameLen = len;
+    it->parent = dir;
+    it->hash = _cpathWatchHash(dir, name, len);
+    _cpathWatchLink(watch, node);
     return 1;
 }
 
 _CPATH_FUNC_
-int cpathGetFileConst(cpath_dir *dir, const cpath_file **file, size_t n) {
-    if (dir == NULL || file == NULL) {
+int _cpathWatchApply(cpath_watch *watch, const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        cpath root;
+        watch->rescans++;
+        watch->moved = CPATH_WATCH_NONE;
+        return cpathWatchPath(watch, 0, &root) &&
+               _cpathWatchScan(watch, 0, &root);
+    }
+    if (event->wd < 0 || (size_t)event->wd >= watch->wdsCap ||
+            watch->wds[event->wd] == CPATH_WATCH_NONE) {
+        // for a directory we already removed
+        return 1;
+    }
+
+    size_t dir = watch->wds[event->wd];
+    if (event->mask & IN_IGNORED) {
+        watch->wds[event->wd] = CPATH_WATCH_NONE;
+        if (watch->nodes[dir].wd == event->wd) watch->nodes[dir].wd = -1;
+        return 1;
+    }
+    watch->events++;
+
+    const cpath_char_t *name = event->name;
+    size_t len = event->len > 0 ? cpath_str_length(event->name) : 0;
+    size_t node = len > 0 ? _cpathWatchChild(watch, dir, name, len) : dir;
+    if (event->mask & IN_MOVED_TO) {
+        if (watch->moved != CPATH_WATCH_NONE &&
+                watch->movedCookie == event->cookie) {
+            if (!_cpathWatchMoved(watch, dir, name, len)) return 0;
+            node = _cpathWatchChild(watch, dir, name, len);
+        } else {
+            return _cpathWatchCreated(watch, dir, name, len);
+        }
+    } else if (event->mask & IN_CREATE) {
+        return _cpathWatchCreated(watch, dir, name, len);
+    } else if (node == CPATH_WATCH_NONE) {
+        return 1;
+    } else if (event->mask & IN_MOVED_FROM) {
+        // we only know if it left the tree once we see (or don't see) the
+        // other half
+        if (watch->moved != CPATH_WATCH_NONE) {
+            _cpathWatchRemove(watch, watch->moved);
+        }
+        watch->moved = node;
+        watch->movedCookie = event->cookie;
+        return 1;
+    } else if (event->mask & IN_DELETE) {
+        _cpathWatchRemove(watch, node);
+        return 1;
+    }
+
+    // modified or moved, either way reload the stat
+    cpath path;
+    cpath_file file;
+    if (node != CPATH_WATCH_NONE && cpathWatchPath(watch, node, &path) &&
+            cpathOpenFile(&file, &path)) {
+        _cpathWatchSetInfo(&watch->nodes[node], &file);
+    }
+    return 1;
+}
+
+_CPATH_FUNC_
+int cpathWatchUpdate(cpath_watch *watch, int timeout) {
+    if (watch == NULL || watch->fd < 0) {
         errno = EINVAL;
         return 0;
     }
 
-    if (dir->size == -1) {
-        // we haven't loaded
-        cpathLoadAllFiles(dir);
+    struct pollfd poller;
+    poller.fd = watch->fd;
+    poller.events = POLLIN;
+    poller.revents = 0;
+    int ready = poll(&poller, 1, timeout);
+    if (ready <= 0) return ready == 0 || errno == EINTR;
+
+    int ok = 1;
+    for (;;) {
+        ssize_t len = read(watch->fd, watch->buf, CPATH_WATCH_BUF_SIZE);
+        if (len <= 0) {
+            if (len < 0 && errno != EAGAIN && errno != EINTR) ok = 0;
+            break;
+        }
+        const char *it = (const char*)watch->buf;
+        const char *end = it + len;
+        while (ok && it < end) {
+            const struct inotify_event *event =
+                (const struct inotify_event*)it;
+            ok = _cpathWatchApply(watch, event);
+            it += sizeof(struct inotify_event) + event->len;
+        }
+        if (!ok) break;
     }
 
-    if (n >= dir->size) {
+    // the other half of the rename never came so it left the tree
+    if (watch->moved != CPATH_WATCH_NONE) {
+        _cpathWatchRemove(watch, watch->moved);
+    }
+    return ok;
+}
+
+_CPATH_FUNC_
+int cpathWatchRescan(cpath_watch *watch, const cpath *path) {
+    size_t node = cpathWatchFind(watch, path);
+    if (node == CPATH_WATCH_NONE) {
         errno = ENOENT;
         return 0;
     }
 
-    *file = &dir->files[n];
-    return 1;
+    cpath full;
+    cpath_file file;
+    if (!cpathWatchPath(watch, node, &full)) return 0;
+    if (!cpathOpenFile(&file, &full)) {
+        if (node == 0) return 0;
+        _cpathWatchRemove(watch, node);
+        return 1;
+    }
+    _cpathWatchSetInfo(&watch->nodes[node], &file);
+    return !file.isDir || _cpathWatchScan(watch, node, &full);
 }
 
 _CPATH_FUNC_
-int cpathOpenSubFileEmplace(cpath_dir *dir, const cpath_file *file,
-                                                        int saveDir) {
-    cpath_dir *saved = NULL;
-    if (saveDir) {
-        // save the old one
-        saved = (cpath_dir*)CPATH_MALLOC(sizeof(cpath_dir));
-        if (saved != NULL) memcpy(saved, dir, sizeof(cpath_dir));
-    }
+size_t cpathWatchFind(const cpath_watch *watch, const cpath *path) {
+    if (watch == NULL || path == NULL || watch->count == 0) {
+        return CPATH_WATCH_NONE;
+    }
+
+    const cpath_watch_node *root = &watch->nodes[0];
+    size_t rootLen = root->nameLen;
+    if (path->len < rootLen || memcmp(path->buf, root->name,
+                                      sizeof(cpath_char_t) * rootLen) != 0 ||
+            (path->len > rootLen && rootLen > 0 &&
+             root->name[rootLen - 1] != CPATH_SEP &&
+             root->name[rootLen - 1] != CPATH_OTHER_SEP &&
+             path->buf[rootLen] != CPATH_SEP &&
+             path->buf[rootLen] != CPATH_OTHER_SEP)) {
+        return CPATH_WATCH_NONE;
+    }
+    // the rest is relative to the root
+    while (rootLen < path->len && (path->buf[rootLen] == CPATH_SEP ||
+                                   path->buf[rootLen] == CPATH_OTHER_SEP)) {
+        rootLen++;
+    }
+
+    cpath_component_it it;
+    cpath_component component;
+    size_t node = 0;
+    cpathComponentItInitStrn(&it, path->buf + rootLen, path->len - rootLen);
+    while (node != CPATH_WATCH_NONE && cpathComponentItNext(&it, &component)) {
+        node = _cpathWatchChild(watch, node, component.str, component.len);
+    }
+    return node;
+}
 
-    if (!cpathFileToDir(dir, file)) {
-        if (saved != NULL) CPATH_FREE(saved);
+_CPATH_FUNC_
+int cpathWatchPath(const cpath_watch *watch, size_t node, cpath *out) {
+    if (watch == NULL || out == NULL || node >= watch->used ||
+            watch->nodes[node].name == NULL) {
+        errno = EINVAL;
         return 0;
     }
 
-    dir->parent = saved;
+    const cpath_watch_node *it = &watch->nodes[node];
+    if (it->parent == CPATH_WATCH_NONE) {
+        memcpy(out->buf, it->name, sizeof(cpath_char_t) * (it->nameLen + 1));
+        out->len = it->nameLen;
+        return 1;
+    }
+    return cpathWatchPath(watch, it->parent, out) &&
+           cpathConcatStrn(out, it->name, it->nameLen);
+}
 
-    return 1;
+_CPATH_FUNC_
+void _cpathWatchFillFile(const cpath_watch_node *node, cpath_file *file) {
+    memcpy(file->name, node->name, sizeof(cpath_char_t) * (node->nameLen + 1));
+    file->isDir = !!(node->type & CPATH_LISTING_DIR);
+    file->isReg = !!(node->type & CPATH_LISTING_REG);
+    file->isSym = !!(node->type & CPATH_LISTING_SYM);
+    memset(&file->stat, 0, sizeof(file->stat));
+    file->stat.st_mode = (mode_t)node->mode;
+    file->stat.st_size = (off_t)node->size;
+    file->stat.st_mtime = (time_t)node->mtime;
+    file->statLoaded = 1;
+    file->extension = NULL;
+#ifndef CPATH_NO_AUTOLOAD_EXT
+    cpathGetExtension(file);
+#endif
 }
 
 _CPATH_FUNC_
-int cpathOpenSubDirEmplace(cpath_dir *dir, size_t n, int saveDir) {
-    if (dir == NULL) {
+int cpathWatchOpenFile(cpath_file *file, const cpath_watch *watch,
+                       const cpath *path) {
+    if (file == NULL || watch == NULL || path == NULL) {
         errno = EINVAL;
         return 0;
     }
-    if (!cpathCheckGetN(dir, n)) return 0;
 
-    const cpath_file *file;
-    if (!cpathGetFileConst(dir, &file, n) ||
-            !file->isDir || !cpathOpenSubFileEmplace(dir, file, saveDir)) {
-        if (!file->isDir) errno = EINVAL;
+    size_t node = cpathWatchFind(watch, path);
+    if (node == CPATH_WATCH_NONE) {
+        errno = ENOENT;
         return 0;
     }
-
+    if (node == 0 || watch->nodes[node].nameLen >= CPATH_MAX_FILENAME_LEN) {
+        // the root's name is a path so we just go through the kernel
+        return cpathOpenFile(file, path);
+    }
+    cpathCopy(&file->path, path);
+    _cpathWatchFillFile(&watch->nodes[node], file);
     return 1;
 }
 
 _CPATH_FUNC_
-int cpathOpenSubDir(cpath_dir *out, cpath_dir *dir, size_t n) {
-    if (dir == NULL || out == NULL) {
+int cpathWatchOpenDir(cpath_watch_dir *dir, const cpath_watch *watch,
+                      const cpath *path) {
+    if (dir == NULL || watch == NULL || path == NULL) {
         errno = EINVAL;
         return 0;
     }
-    if (!cpathCheckGetN(dir, n)) return 0;
 
-    const cpath_file *file;
-    if (!cpathGetFileConst(dir, &file, n) ||
-            !file->isDir || !cpathFileToDir(out, file)) {
-        if (!file->isDir) errno = EINVAL;
+    size_t node = cpathWatchFind(watch, path);
+    if (node == CPATH_WATCH_NONE) {
+        errno = ENOENT;
+        return 0;
+    }
+    if (!(watch->nodes[node].type & CPATH_LISTING_DIR)) {
+        errno = ENOTDIR;
         return 0;
     }
+    dir->watch = watch;
+    dir->next = watch->nodes[node].child;
+    cpathCopy(&dir->path, path);
     return 1;
 }
 
 _CPATH_FUNC_
-int cpathOpenNextSubDir(cpath_dir *out, cpath_dir *dir) {
-    if (dir == NULL || out == NULL) {
-        errno = EINVAL;
+int cpathWatchGetNextFile(cpath_watch_dir *dir, cpath_file *file) {
+    if (dir == NULL || file == NULL || dir->next == CPATH_WATCH_NONE) {
         return 0;
     }
 
-    cpath_file file;
-    if (!cpathGetNextFile(dir, &file) ||
-            !file.isDir || !cpathFileToDir(out, &file)) {
-        if (!file.isDir) errno = EINVAL;
+    const cpath_watch_node *node = &dir->watch->nodes[dir->next];
+    dir->next = node->next;
+    if (node->nameLen >= CPATH_MAX_FILENAME_LEN) {
+        errno = ENAMETOOLONG;
         return 0;
     }
+    cpathCopy(&file->path, &dir->path);
+    if (!cpathConcatStrn(&file->path, node->name, node->nameLen)) return 0;
+    _cpathWatchFillFile(node, file);
     return 1;
 }
+#endif
+
+/* == Disk Usage == */
+
+#if defined CPATH_PARALLEL && defined CPATH_HAS_OPENAT
+typedef struct _cpath_du_ctx_t {
+    cpath_du *du;
+    // protects everything in du
+    pthread_mutex_t lock;
+    pthread_mutex_t linkLocks[CPATH_DU_LINK_STRIPES];
+    cpath_visited links[CPATH_DU_LINK_STRIPES];
+    // one per worker
+    cpath_stat_batch *batches;
+} _cpath_du_ctx;
+
+// Adds a directory (with its own stat) has to hold the lock
+_CPATH_FUNC_
+size_t _cpathDuAdd(cpath_du *du, size_t parent, const cpath_char_t *name,
+                   size_t len, int depth, const struct stat *st) {
+    if (du->count == du->cap) {
+        size_t cap = du->cap > 0 ? du->cap * 2 : 256;
+        if (!_cpathListingGrow((void**)&du->nodes, sizeof(cpath_du_node),
+                               du->count, cap)) {
+            errno = ENOMEM;
+            return CPATH_DU_NONE;
+        }
+        du->cap = cap;
+    }
+    if (du->namesLen + len > du->namesCap) {
+        size_t cap = du->namesCap > 0 ? du->namesCap * 2 : 4096;
+        while (cap < du->namesLen + len) cap *= 2;
+        if (!_cpathListingGrow((void**)&du->names, sizeof(cpath_char_t),
+                               du->namesLen, cap)) {
+            errno = ENOMEM;
+            return CPATH_DU_NONE;
+        }
+        du->namesCap = cap;
+    }
+
+    cpath_du_node *node = &du->nodes[du->count];
+    node->parent = parent;
+    node->name = du->namesLen;
+    node->nameLen = len;
+    node->depth = depth;
+    node->size = (uint64_t)st->st_size;
+    node->blocks = (uint64_t)st->st_blocks;
+    node->files = 0;
+    node->totalSize = 0;
+    node->totalBlocks = 0;
+    node->totalFiles = 0;
+    memcpy(du->names + du->namesLen, name, sizeof(cpath_char_t) * len);
+    du->namesLen += len;
+    return du->count++;
+}
 
+// Returns false if another link to the file was already counted
 _CPATH_FUNC_
-int cpathOpenCurrentSubDir(cpath_dir *out, cpath_dir *dir) {
-    if (dir == NULL || out == NULL) {
+int _cpathDuFirstLink(_cpath_du_ctx *ctx, const struct stat *st, int *ok) {
+    uint64_t dev = (uint64_t)st->st_dev;
+    uint64_t ino = (uint64_t)st->st_ino;
+    uint64_t hash = (ino ^ (dev * 0x9E3779B97F4A7C15ULL)) * 0xFF51AFD7ED558CCDULL;
+    size_t stripe = (size_t)(hash >> 32) % CPATH_DU_LINK_STRIPES;
+    int added = 1;
+
+    pthread_mutex_lock(&ctx->linkLocks[stripe]);
+    *ok = cpathVisitedAdd(&ctx->links[stripe], dev, ino, &added);
+    pthread_mutex_unlock(&ctx->linkLocks[stripe]);
+    return added;
+}
+
+_CPATH_FUNC_
+void _cpathDuJob(cpath_parallel *pool, int worker, cpath_parallel_job *job) {
+    _cpath_du_ctx *ctx = (_cpath_du_ctx*)pool->data;
+    cpath_du *du = ctx->du;
+    cpath path;
+    cpath_dir dir;
+    memcpy(path.buf, cpathParallelJobPath(job),
+           sizeof(cpath_char_t) * (job->len + 1));
+    path.len = job->len;
+
+    // totalled here and only added to the node once we are done
+    uint64_t size = 0;
+    uint64_t blocks = 0;
+    uint64_t files = 0;
+    size_t hardlinks = 0;
+    size_t errors = 0;
+    if (!cpathOpenDir(&dir, &path)) {
+        pthread_mutex_lock(&ctx->lock);
+        du->errors++;
+        pthread_mutex_unlock(&ctx->lock);
+        return;
+    }
+    if (!cpathLoadAllFilesStat(&dir, &ctx->batches[worker])) errors++;
+
+    for (size_t i = 0; i < dir.size; i++) {
+        cpath_file *file = &dir.files[i];
+        if (cpathFileIsSpecialHardLink(file)) continue;
+        if (!file->statLoaded && !cpathGetFileInfo(file)) {
+            errors++;
+            continue;
+        }
+
+        if (file->isDir) {
+            // its job counts it
+            pthread_mutex_lock(&ctx->lock);
+            size_t node = _cpathDuAdd(du, job->tag, file->name,
+                                      cpath_str_length(file->name),
+                                      job->depth + 1, &file->stat);
+            pthread_mutex_unlock(&ctx->lock);
+            if (node == CPATH_DU_NONE ||
+                    !cpathParallelPush(pool, worker, file->path.buf,
+                                       file->path.len, job->depth + 1, node)) {
+                errors++;
+            }
+            continue;
+        }
+
+        if (file->stat.st_nlink > 1) {
+            int ok;
+            if (!_cpathDuFirstLink(ctx, &file->stat, &ok)) {
+                hardlinks++;
+                continue;
+            }
+            if (!ok) errors++;
+        }
+        size += (uint64_t)file->stat.st_size;
+        blocks += (uint64_t)file->stat.st_blocks;
+        files++;
+    }
+    cpathCloseDir(&dir);
+
+    pthread_mutex_lock(&ctx->lock);
+    cpath_du_node *node = &du->nodes[job->tag];
+    node->size += size;
+    node->blocks += blocks;
+    node->files += files;
+    du->hardlinks += hardlinks;
+    du->errors += errors;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+_CPATH_FUNC_
+int cpathDuScan(cpath_du *du, const cpath *root, int threads) {
+    if (du == NULL || root == NULL) {
         errno = EINVAL;
         return 0;
     }
 
+    du->nodes = NULL;
+    du->count = 0;
+    du->cap = 0;
+    du->names = NULL;
+    du->namesLen = 0;
+    du->namesCap = 0;
+    du->hardlinks = 0;
+    du->errors = 0;
+
     cpath_file file;
-    if (!cpathPeekNextFile(dir, &file) ||
-            !file.isDir || !cpathFileToDir(out, &file)) {
-        if (!file.isDir) errno = EINVAL;
+    if (!cpathOpenFile(&file, root) ||
+            (!file.statLoaded && !cpathGetFileInfo(&file))) {
+        return 0;
+    }
+    if (!file.isDir) {
+        errno = ENOTDIR;
+        return 0;
+    }
+    if (_cpathDuAdd(du, CPATH_DU_NONE, root->buf, root->len, 0,
+                    &file.stat) == CPATH_DU_NONE) {
+        cpathDuFree(du);
         return 0;
     }
-    return 1;
-}
 
-_CPATH_FUNC_
-int cpathOpenNextSubDirEmplace(cpath_dir *dir, int saveDir) {
-    if (dir == NULL) {
-        errno = EINVAL;
+    _cpath_du_ctx ctx;
+    cpath_parallel pool;
+    ctx.du = du;
+    if (!cpathParallelInit(&pool, threads, _cpathDuJob, NULL, &ctx)) {
+        cpathDuFree(du);
+        return 0;
+    }
+    ctx.batches = (cpath_stat_batch*)CPATH_MALLOC(sizeof(cpath_stat_batch) *
+                                                  pool.threads);
+    if (ctx.batches == NULL) {
+        cpathParallelFree(&pool);
+        cpathDuFree(du);
+        errno = ENOMEM;
         return 0;
     }
+    pthread_mutex_init(&ctx.lock, NULL);
+    for (int i = 0; i < CPATH_DU_LINK_STRIPES; i++) {
+        pthread_mutex_init(&ctx.linkLocks[i], NULL);
+        cpathVisitedInit(&ctx.links[i]);
+    }
+    for (int i = 0; i < pool.threads; i++) cpathStatBatchInit(&ctx.batches[i]);
 
-    cpath_file file;
-    if (!cpathGetNextFile(dir, &file) ||
-            !file.isDir || !cpathOpenSubFileEmplace(dir, &file, saveDir)) {
-        if (!file.isDir) errno = EINVAL;
+    int ok = cpathParallelPush(&pool, 0, root->buf, root->len, 0, 0);
+    if (ok) cpathParallelRun(&pool);
+
+    for (int i = 0; i < pool.threads; i++) cpathStatBatchFree(&ctx.batches[i]);
+    for (int i = 0; i < CPATH_DU_LINK_STRIPES; i++) {
+        pthread_mutex_destroy(&ctx.linkLocks[i]);
+        cpathVisitedFree(&ctx.links[i]);
+    }
+    pthread_mutex_destroy(&ctx.lock);
+    CPATH_FREE(ctx.batches);
+    cpathParallelFree(&pool);
+    if (!ok) {
+        cpathDuFree(du);
         return 0;
     }
+
+    for (size_t i = 0; i < du->count; i++) {
+        cpath_du_node *node = &du->nodes[i];
+        node->totalSize += node->size;
+        node->totalBlocks += node->blocks;
+        node->totalFiles += node->files;
+    }
+    // children always come after their parent so going backwards means
+    // every directory is finished by the time it is added to its parent
+    for (size_t i = du->count; i-- > 1;) {
+        cpath_du_node *node = &du->nodes[i];
+        cpath_du_node *parent = &du->nodes[node->parent];
+        parent->totalSize += node->totalSize;
+        parent->totalBlocks += node->totalBlocks;
+        parent->totalFiles += node->totalFiles;
+    }
     return 1;
 }
 
 _CPATH_FUNC_
-int cpathOpenCurrentSubDirEmplace(cpath_dir *dir, int saveDir) {
-    if (dir == NULL) {
+void cpathDuFree(cpath_du *du) {
+    if (du == NULL) return;
+    if (du->nodes != NULL) CPATH_FREE(du->nodes);
+    if (du->names != NULL) CPATH_FREE(du->names);
+    du->nodes = NULL;
+    du->names = NULL;
+    du->count = du->cap = 0;
+    du->namesLen = du->namesCap = 0;
+}
+
+_CPATH_FUNC_
+int cpathDuPath(const cpath_du *du, size_t node, cpath *out) {
+    if (du == NULL || out == NULL || node >= du->count) {
         errno = EINVAL;
         return 0;
     }
 
-    cpath_file file;
-    if (!cpathPeekNextFile(dir, &file) ||
-            !file.isDir || !cpathOpenSubFileEmplace(dir, &file, saveDir)) {
-        if (!file.isDir) errno = EINVAL;
-        return 0;
+    const cpath_du_node *it = &du->nodes[node];
+    if (it->parent == CPATH_DU_NONE) {
+        memcpy(out->buf, du->names + it->name,
+               sizeof(cpath_char_t) * it->nameLen);
+        out->buf[it->nameLen] = CPATH_STR('\0');
+        out->len = it->nameLen;
+        return 1;
     }
-    return 1;
+    return cpathDuPath(du, it->parent, out) &&
+           cpathConcatStrn(out, du->names + it->name, it->nameLen);
 }
+#endif
+
+/* == Duplicates == */
+
+// the nth stripe of every 16 uses keys [n, n + 8) (like XXH3's sliding
+// secret) so moving stripes around changes the hash
+static const uint64_t _cpathContentHashKeys[8 + 15] = {
+    0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL,
+    0x85EBCA77C2B2AE63ULL, 0x27D4EB2F165667C5ULL, 0xFF51AFD7ED558CCDULL,
+    0xC4CEB9FE1A85EC53ULL, 0x94D049BB133111EBULL,
+    0xC0E16B163A85A4DCULL, 0x890ACD8DD443C47CULL, 0xB3889D8A6DC47761ULL,
+    0x6A0398E528F0AE6AULL, 0x048344ECE48A855EULL, 0xF175CFEA21871330ULL,
+    0x391CEEF02702C2FDULL, 0x4BAF8CAC4784CB12ULL, 0x3547744583A3F88EULL,
+    0xD9CF2B15C6B6C90EULL, 0x961FACC76D5FE21CULL, 0x0094AB49D50F11F9ULL,
+    0xE3211E37BDBEB6DCULL, 0x62FE6C274FF3511AULL, 0x5AC30B329FDF0574ULL,
+};
 
 _CPATH_FUNC_
-int cpathRevertEmplace(cpath_dir **dir) {
-    if (dir == NULL || *dir == NULL) return 0;
-    cpath_dir *tmp = (*dir)->parent;
-    (*dir)->parent = NULL;
-    cpathCloseDir(*dir);
-    *dir = tmp;
-    return *dir != NULL;
+uint64_t _cpathMix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
 }
 
 _CPATH_FUNC_
-int cpathRevertEmplaceCopy(cpath_dir *dir) {
-    if (dir == NULL) return 0;
-    cpath_dir *tmp = dir->parent;
-    dir->parent = NULL;
-    cpathCloseDir(dir);
-    if (tmp != NULL) {
-        memcpy(dir, tmp, sizeof(cpath_dir));
-    }
-    return tmp != NULL;
+void _cpathContentHashInit(cpath_content_hash *hash) {
+    memcpy(hash->acc, _cpathContentHashKeys, sizeof(hash->acc));
+    hash->stripes = 0;
 }
 
+// Every 16 stripes so the high bits make it back into the products
 _CPATH_FUNC_
-int cpathOpenFile(cpath_file *file, const cpath *path) {
-    // We want to efficiently open this file so unlike most libraries
-    // we won't use a directory search we will just find the given file
-    // or directly use stuff like dirname/basename!
-    cpath_dir dir;
-    int found = 0;
-
-    if (file == NULL || path == NULL || path->len == 0) {
-        errno = EINVAL;
-        return 0;
+void _cpathContentHashScramble(cpath_content_hash *hash) {
+    for (int i = 0; i < 8; i++) {
+        uint64_t acc = hash->acc[i];
+        acc ^= acc >> 47;
+        acc ^= _cpathContentHashKeys[i];
+        hash->acc[i] = acc * 0x9E3779B1ULL;
     }
-    if (path->len >= CPATH_MAX_PATH_LEN) {
-        errno = ENAMETOOLONG;
-        return 0;
+}
+
+/*
+    Each stripe is 8 lanes of 64 bits, every lane adds the product of the
+    two halves of (lane ^ key) and the lane itself goes to its neighbour
+    (the same as XXH3's accumulate) which maps directly onto
+    _mm_mul_epu32.
+*/
+_CPATH_FUNC_
+void _cpathContentHashStripesScalar(cpath_content_hash *hash,
+                                    const unsigned char *p, size_t stripes) {
+    for (size_t s = 0; s < stripes; s++, p += 64) {
+        const uint64_t *keys = _cpathContentHashKeys + hash->stripes % 16;
+        for (int i = 0; i < 8; i++) {
+            uint64_t data;
+            memcpy(&data, p + i * 8, sizeof(data));
+            uint64_t key = data ^ keys[i];
+            hash->acc[i ^ 1] += data;
+            hash->acc[i] += (key & 0xFFFFFFFFULL) * (key >> 32);
+        }
+        if (++hash->stripes % 16 == 0) _cpathContentHashScramble(hash);
     }
+}
 
-    void *data;
-    void *handle = NULL;
+/*
+    Same as _cpathContentHashStripesScalar (it gives the same hash) but
+    keeps the lanes in vector registers between scrambles
+*/
+_CPATH_FUNC_
+void _cpathContentHashStripes(cpath_content_hash *hash,
+                              const unsigned char *p, size_t stripes) {
+#if defined CPATH_SIMD_AVX2
+    while (stripes > 0) {
+        size_t run = 16 - (size_t)(hash->stripes % 16);
+        if (run > stripes) run = stripes;
+        const uint64_t *keys = _cpathContentHashKeys + hash->stripes % 16;
+        __m256i acc0 = _mm256_loadu_si256((const __m256i*)hash->acc);
+        __m256i acc1 = _mm256_loadu_si256((const __m256i*)(hash->acc + 4));
+        for (size_t s = 0; s < run; s++, p += 64, keys++) {
+            __m256i d0 = _mm256_loadu_si256((const __m256i*)p);
+            __m256i d1 = _mm256_loadu_si256((const __m256i*)(p + 32));
+            __m256i k0 = _mm256_xor_si256(d0, _mm256_loadu_si256((const __m256i*)keys));
+            __m256i k1 = _mm256_xor_si256(d1, _mm256_loadu_si256((const __m256i*)(keys + 4)));
+            acc0 = _mm256_add_epi64(acc0, _mm256_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2)));
+            acc1 = _mm256_add_epi64(acc1, _mm256_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2)));
+            acc0 = _mm256_add_epi64(acc0, _mm256_mul_epu32(k0, _mm256_srli_epi64(k0, 32)));
+            acc1 = _mm256_add_epi64(acc1, _mm256_mul_epu32(k1, _mm256_srli_epi64(k1, 32)));
+        }
+        _mm256_storeu_si256((__m256i*)hash->acc, acc0);
+        _mm256_storeu_si256((__m256i*)(hash->acc + 4), acc1);
+        hash->stripes += run;
+        stripes -= run;
+        if (hash->stripes % 16 == 0) _cpathContentHashScramble(hash);
+    }
+#elif defined CPATH_SIMD_SSE2
+    while (stripes > 0) {
+        size_t run = 16 - (size_t)(hash->stripes % 16);
+        if (run > stripes) run = stripes;
+        const uint64_t *keys = _cpathContentHashKeys + hash->stripes % 16;
+        __m128i acc[4];
+        for (int i = 0; i < 4; i++) {
+            acc[i] = _mm_loadu_si128((const __m128i*)(hash->acc + i * 2));
+        }
+        for (size_t s = 0; s < run; s++, p += 64, keys++) {
+            for (int i = 0; i < 4; i++) {
+                __m128i d = _mm_loadu_si128((const __m128i*)(p + i * 16));
+                __m128i key = _mm_loadu_si128((const __m128i*)(keys + i * 2));
+                __m128i k = _mm_xor_si128(d, key);
+                acc[i] = _mm_add_epi64(acc[i], _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+                acc[i] = _mm_add_epi64(acc[i], _mm_mul_epu32(k, _mm_srli_epi64(k, 32)));
+            }
+        }
+        for (int i = 0; i < 4; i++) {
+            _mm_storeu_si128((__m128i*)(hash->acc + i * 2), acc[i]);
+        }
+        hash->stripes += run;
+        stripes -= run;
+        if (hash->stripes % 16 == 0) _cpathContentHashScramble(hash);
+    }
+#else
+    _cpathContentHashStripesScalar(hash, p, stripes);
+#endif
+}
 
-    cpathCopy(&file->path, path);
+// The tail (less than a stripe) is zero padded, len is the length of
+// everything that was hashed so that padding can't collide
+_CPATH_FUNC_
+uint64_t _cpathContentHashFinal(cpath_content_hash *hash,
+                                const unsigned char *tail, size_t tailLen,
+                                uint64_t len) {
+    if (tailLen > 0) {
+        unsigned char last[64];
+        memset(last, 0, sizeof(last));
+        memcpy(last, tail, tailLen);
+        _cpathContentHashStripesScalar(hash, last, 1);
+    }
+    uint64_t h = len * 0x9E3779B185EBCA87ULL;
+    for (int i = 0; i < 8; i++) {
+        h = (h ^ _cpathMix64(hash->acc[i] ^ _cpathContentHashKeys[i])) *
+            0x9E3779B185EBCA87ULL;
+    }
+    return _cpathMix64(h);
+}
 
-#if defined _MSC_VER
-    WIN32_FIND_DATA findData;
+_CPATH_FUNC_
+uint64_t cpathContentHash(const void *data, size_t len) {
+    cpath_content_hash hash;
+    const unsigned char *p = (const unsigned char*)data;
+    _cpathContentHashInit(&hash);
+    _cpathContentHashStripes(&hash, p, len / 64);
+    return _cpathContentHashFinal(&hash, p + len / 64 * 64, len % 64, len);
+}
 
-#if (defined WINAPI_FAMILY) && (WINAPI_FAMILY != WINAPI_FAMILY_DESKTOP_APP)
-    handle = FindFirstFileEx(path->buf, FindExInfoStandard, &findData,
-                                                                FindExSearchNameMatch, NULL, 0);
-#else
-    handle = FindFirstFile(path->buf, &findData);
-#endif
+_CPATH_FUNC_
+uint64_t cpathContentHashScalar(const void *data, size_t len) {
+    cpath_content_hash hash;
+    const unsigned char *p = (const unsigned char*)data;
+    _cpathContentHashInit(&hash);
+    _cpathContentHashStripesScalar(&hash, p, len / 64);
+    return _cpathContentHashFinal(&hash, p + len / 64 * 64, len % 64, len);
+}
 
-    if (handle == INVALID_HANDLE_VALUE) {
-        errno = ENOENT;
-        return 0;
-    }
+#if defined CPATH_HAS_OPENAT
+_CPATH_FUNC_
+void cpathDupesInit(cpath_dupes *dupes) {
+    dupes->files = NULL;
+    dupes->count = 0;
+    dupes->cap = 0;
+    dupes->paths = NULL;
+    dupes->pathsLen = 0;
+    dupes->pathsCap = 0;
+    cpathVisitedInit(&dupes->links);
+    dupes->groups = NULL;
+    dupes->groupCount = 0;
+    dupes->verify = 1;
+    dupes->partialBytes = 0;
+    dupes->fullBytes = 0;
+    dupes->verifyBytes = 0;
+    dupes->errors = 0;
+    dupes->hardlinks = 0;
+    dupes->failed = 0;
+}
 
-    data = &findData;
-    cpath_str_copy(file->name, findData.cFileName);
-#else
-    // copy the name then strip to just basename
-    // this is very ewwwww, honestly we probably would be better
-    // to just do this ourselves since ugh
-    cpath_strn_copy(file->name, path->buf, path->len);
-    char *tmp = basename(file->name);
-    // some systems allocate it seems.. ugh
-    if (tmp != file->name) {
-        cpath_str_copy(file->name, tmp);
-        CPATH_FREE(tmp);
-    }
-    // @TODO: make sure tmp isn't too long
-#endif
-    dir.dirent = NULL;
-    file->statLoaded = 0;
-    int res = cpathLoadFlags(&dir, file, data);
-#if defined _MSC_VER
-    FindClose((HANDLE)handle);
-#endif
+_CPATH_FUNC_
+void cpathDupesFree(cpath_dupes *dupes) {
+    if (dupes == NULL) return;
+    if (dupes->files != NULL) CPATH_FREE(dupes->files);
+    if (dupes->paths != NULL) CPATH_FREE(dupes->paths);
+    if (dupes->groups != NULL) CPATH_FREE(dupes->groups);
+    cpathVisitedFree(&dupes->links);
+    dupes->files = NULL;
+    dupes->paths = NULL;
+    dupes->groups = NULL;
+    dupes->count = dupes->cap = 0;
+    dupes->pathsLen = dupes->pathsCap = 0;
+    dupes->groupCount = 0;
+}
 
-    return res;
+_CPATH_FUNC_
+int _cpathDupesPush(cpath_dupes *dupes, const cpath_char_t *path, size_t len,
+                    uint64_t size) {
+    if (dupes->count == dupes->cap) {
+        size_t cap = dupes->cap > 0 ? dupes->cap * 2 : 256;
+        if (!_cpathListingGrow((void**)&dupes->files, sizeof(cpath_dupes_file),
+                               dupes->count, cap)) {
+            errno = ENOMEM;
+            return 0;
+        }
+        dupes->cap = cap;
+    }
+    if (dupes->pathsLen + len > dupes->pathsCap) {
+        size_t cap = dupes->pathsCap > 0 ? dupes->pathsCap * 2 : 4096;
+        while (cap < dupes->pathsLen + len) cap *= 2;
+        if (!_cpathListingGrow((void**)&dupes->paths, sizeof(cpath_char_t),
+                               dupes->pathsLen, cap)) {
+            errno = ENOMEM;
+            return 0;
+        }
+        dupes->pathsCap = cap;
+    }
+
+    cpath_dupes_file *file = &dupes->files[dupes->count++];
+    file->path = dupes->pathsLen;
+    file->len = len;
+    file->size = size;
+    file->partial = 0;
+    file->full = 0;
+    file->match = 0;
+    file->unreadable = 0;
+    memcpy(dupes->paths + dupes->pathsLen, path, sizeof(cpath_char_t) * len);
+    dupes->pathsLen += len;
+    return 1;
 }
 
 _CPATH_FUNC_
-int cpathFileToDir(cpath_dir *dir, const cpath_file *file) {
-    if (dir == NULL || file == NULL || !file->isDir) {
+int cpathDupesAdd(cpath_dupes *dupes, cpath_file *file) {
+    if (dupes == NULL || file == NULL) {
         errno = EINVAL;
         return 0;
     }
-    return cpathOpenDir(dir, &file->path);
+    if (!file->isReg) return 1;
+    if (!file->statLoaded && !cpathGetFileInfo(file)) {
+        // it's already gone
+        dupes->errors++;
+        return 1;
+    }
+    if (file->stat.st_size <= 0) return 1;
+
+    if (file->stat.st_nlink > 1) {
+        int added;
+        if (!cpathVisitedAdd(&dupes->links, (uint64_t)file->stat.st_dev,
+                             (uint64_t)file->stat.st_ino, &added)) {
+            return 0;
+        }
+        if (!added) {
+            dupes->hardlinks++;
+            return 1;
+        }
+    }
+    return _cpathDupesPush(dupes, file->path.buf, file->path.len,
+                           (uint64_t)file->stat.st_size);
 }
 
 _CPATH_FUNC_
-cpath_str cpathGetExtension(cpath_file *file) {
-    if (file->extension != NULL) return file->extension;
-
-    cpath_char_t *dot = cpath_str_find_last_char(file->name, CPATH_STR('.'));
-    if (dot != NULL) {
-        // extension
-        file->extension = dot + 1;
-    } else {
-        // no extension so set to CPATH_STR('\0')
-        file->extension = &file->name[cpath_str_length(file->name)];
-    }
-    return file->extension;
+void cpathDupesVisit(cpath_file *file, cpath_dir *parent, int depth,
+                     void *data) {
+    (void)parent;
+    (void)depth;
+    cpath_dupes *dupes = (cpath_dupes*)data;
+    if (!dupes->failed && !cpathDupesAdd(dupes, file)) dupes->failed = 1;
 }
 
 _CPATH_FUNC_
-cpath_time_t cpathGetLastAccess(cpath_file *file) {
-    if (!file->statLoaded) cpathGetFileInfo(file);
+int _cpathDupesCmp(const void *a, const void *b) {
+    const cpath_dupes_file *x = (const cpath_dupes_file*)a;
+    const cpath_dupes_file *y = (const cpath_dupes_file*)b;
+    if (x->size != y->size) return x->size < y->size ? -1 : 1;
+    if (x->partial != y->partial) return x->partial < y->partial ? -1 : 1;
+    if (x->full != y->full) return x->full < y->full ? -1 : 1;
+    if (x->match != y->match) return x->match < y->match ? -1 : 1;
+    return x->path < y->path ? -1 : x->path > y->path;
+}
 
-#if defined _MSC_VER || defined __MINGW32__
-    // Idk todo
-#else
-    return file->stat.st_atime;
-#endif
+_CPATH_FUNC_
+int _cpathDupesSame(const cpath_dupes_file *a, const cpath_dupes_file *b,
+                    int stage) {
+    return a->size == b->size &&
+           (stage < 1 || a->partial == b->partial) &&
+           (stage < 2 || a->full == b->full) &&
+           (stage < 3 || a->match == b->match);
 }
 
+// Sorts the files and drops every file that doesn't have a match (for
+// the given stage) or couldn't be read
 _CPATH_FUNC_
-cpath_time_t cpathGetLastModification(cpath_file *file) {
-    if (!file->statLoaded) cpathGetFileInfo(file);
+void _cpathDupesKeep(cpath_dupes *dupes, int stage) {
+    size_t kept = 0;
+    qsort(dupes->files, dupes->count, sizeof(cpath_dupes_file),
+          _cpathDupesCmp);
+    for (size_t i = 0; i < dupes->count;) {
+        size_t end = i + 1;
+        while (end < dupes->count &&
+               _cpathDupesSame(&dupes->files[i], &dupes->files[end], stage)) {
+            end++;
+        }
+        size_t readable = 0;
+        for (size_t j = i; j < end; j++) readable += !dupes->files[j].unreadable;
+        dupes->errors += end - i - readable;
+        if (readable > 1) {
+            for (size_t j = i; j < end; j++) {
+                if (!dupes->files[j].unreadable) {
+                    dupes->files[kept++] = dupes->files[j];
+                }
+            }
+        }
+        i = end;
+    }
+    dupes->count = kept;
+}
 
-#if defined _MSC_VER || defined __MINGW32__
-    // Idk todo
-#else
-    return file->stat.st_mtime;
-#endif
+// Reads exactly len bytes at offset
+_CPATH_FUNC_
+int _cpathDupesRead(int fd, unsigned char *buf, size_t len, uint64_t offset) {
+    while (len > 0) {
+        CPATH_SYSCALL_HOOK("read");
+        ssize_t n = pread(fd, buf, len, (off_t)offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        buf += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 1;
 }
 
+// Opens the file (marking it unreadable if we can't)
 _CPATH_FUNC_
-cpath_offset_t cpathGetFileSize(cpath_file *file) {
-    if (!file->statLoaded) cpathGetFileInfo(file);
+int _cpathDupesOpen(cpath_dupes *dupes, cpath_dupes_file *file) {
+    cpath path;
+    memcpy(path.buf, dupes->paths + file->path,
+           sizeof(cpath_char_t) * file->len);
+    path.buf[file->len] = CPATH_STR('\0');
+    path.len = file->len;
+
+    CPATH_SYSCALL_HOOK("open");
+    int fd = open(path.buf, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) file->unreadable = 1;
+    return fd;
+}
 
-#if defined _MSC_VER || defined __MINGW32__
-    // Idk todo
-#else
-    return file->stat.st_size;
+_CPATH_FUNC_
+void _cpathDupesHashFile(cpath_dupes *dupes, cpath_dupes_file *file,
+                         unsigned char *buf, int full, uint64_t *bytes) {
+    int fd = _cpathDupesOpen(dupes, file);
+    if (fd < 0) return;
+
+    cpath_content_hash hash;
+    _cpathContentHashInit(&hash);
+    int ok = 1;
+    if (!full && file->size > 2 * CPATH_DUPES_PARTIAL) {
+        ok = _cpathDupesRead(fd, buf, CPATH_DUPES_PARTIAL, 0) &&
+             _cpathDupesRead(fd, buf + CPATH_DUPES_PARTIAL, CPATH_DUPES_PARTIAL,
+                             file->size - CPATH_DUPES_PARTIAL);
+        _cpathContentHashStripes(&hash, buf, 2 * CPATH_DUPES_PARTIAL / 64);
+        file->partial = _cpathContentHashFinal(&hash, NULL, 0, file->size);
+        *bytes += 2 * CPATH_DUPES_PARTIAL;
+    } else {
+        // small files are entirely hashed the first time around
+        const unsigned char *tail = NULL;
+        size_t tailLen = 0;
+#if defined POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 #endif
+        for (uint64_t offset = 0; ok && offset < file->size;) {
+            size_t len = file->size - offset < CPATH_DUPES_BUF_SIZE
+                         ? (size_t)(file->size - offset) : CPATH_DUPES_BUF_SIZE;
+            ok = _cpathDupesRead(fd, buf, len, offset);
+            _cpathContentHashStripes(&hash, buf, len / 64);
+            // only the last read can end part way through a stripe
+            tail = buf + len / 64 * 64;
+            tailLen = len % 64;
+            offset += len;
+            *bytes += len;
+        }
+        file->full = _cpathContentHashFinal(&hash, tail, tailLen, file->size);
+        if (!full) file->partial = file->full;
+    }
+    close(fd);
+    if (!ok) file->unreadable = 1;
+}
+
+/*
+    1 if the files (which are the same size) have the same bytes, 0 if
+    they don't and -1 if one couldn't be read (it's marked unreadable)
+    each file gets half of the buffer.
+*/
+_CPATH_FUNC_
+int _cpathDupesCompare(cpath_dupes *dupes, cpath_dupes_file *a,
+                       cpath_dupes_file *b, unsigned char *buf,
+                       uint64_t *bytes) {
+    int fa = _cpathDupesOpen(dupes, a);
+    if (fa < 0) return -1;
+    int fb = _cpathDupesOpen(dupes, b);
+    if (fb < 0) {
+        close(fa);
+        return -1;
+    }
+
+    const size_t half = CPATH_DUPES_BUF_SIZE / 2;
+    int res = 1;
+    for (uint64_t offset = 0; res == 1 && offset < a->size;) {
+        size_t len = a->size - offset < half ? (size_t)(a->size - offset)
+                                             : half;
+        if (!_cpathDupesRead(fa, buf, len, offset)) {
+            a->unreadable = 1;
+            res = -1;
+        } else if (!_cpathDupesRead(fb, buf + half, len, offset)) {
+            b->unreadable = 1;
+            res = -1;
+        } else if (memcmp(buf, buf + half, len) != 0) {
+            res = 0;
+        }
+        offset += len;
+        *bytes += 2 * len;
+    }
+    close(fa);
+    close(fb);
+    return res;
 }
 
+/*
+    Splits a group (that has the same hashes) by what is actually in the
+    files, every file's match is the first file with the same bytes.
+    Comparing against each distinct file is quadratic but a group only
+    has more than one of those if the hash collided.
+*/
 _CPATH_FUNC_
-void cpathSort(cpath_dir *dir, cpath_cmp cmp) {
-    if (dir->files == NULL) {
-        if (dir->size == -1) {
-            // bad, this means you try to sorted a directory before you preloaded
-            // in this case we'll just preload the files.  This is just to be nice
-            cpathLoadAllFiles(dir);
-        }
-
-        // this is fine just means no files in directory
-        if (dir->size == 0) {
-            return;
+void _cpathDupesVerifyGroup(cpath_dupes *dupes, size_t group,
+                            unsigned char *buf, uint64_t *bytes) {
+    size_t start = dupes->groups[group];
+    size_t end = dupes->groups[group + 1];
+    cpath_dupes_file *files = dupes->files;
+    for (size_t i = start; i < end; i++) files[i].match = i;
+    for (size_t i = start; i < end; i++) {
+        if (files[i].match != i) continue;
+        for (size_t j = i + 1; j < end && !files[i].unreadable; j++) {
+            // already matched or already known to be different
+            if (files[j].match != j || files[j].unreadable) continue;
+            if (_cpathDupesCompare(dupes, &files[i], &files[j], buf,
+                                   bytes) == 1) {
+                files[j].match = i;
+            }
         }
     }
-    qsort(dir->files, dir->size, sizeof(struct cpath_dir_t), cmp);
 }
 
-static const cpath_char_t *prefixTableDecimal[] = {
-    CPATH_STR("kB"), CPATH_STR("MB"), CPATH_STR("GB"), CPATH_STR("TB"),
-    CPATH_STR("PB"), CPATH_STR("EB"), CPATH_STR("ZB"), CPATH_STR("YB"),
-};
-static const cpath_char_t *prefixTableDecimalUpper[] = {
-    CPATH_STR("KB"), CPATH_STR("MB"), CPATH_STR("GB"), CPATH_STR("TB"),
-    CPATH_STR("PB"), CPATH_STR("EB"), CPATH_STR("ZB"), CPATH_STR("YB"),
-};
-static const cpath_char_t *prefixTableDecimalLower[] = {
-    CPATH_STR("kb"), CPATH_STR("mb"), CPATH_STR("gb"), CPATH_STR("tb"),
-    CPATH_STR("pb"), CPATH_STR("eb"), CPATH_STR("zb"), CPATH_STR("yb"),
-};
-static const cpath_char_t *prefixTableIEC[] = {
-    CPATH_STR("KiB"), CPATH_STR("MiB"), CPATH_STR("GiB"), CPATH_STR("TiB"),
-    CPATH_STR("PiB"), CPATH_STR("EiB"), CPATH_STR("ZiB"), CPATH_STR("YiB"),
-};
-// identical to decimal upper but kept separate for the sake of readability
-static const cpath_char_t *prefixTableJEDEC[] = {
-    CPATH_STR("KB"), CPATH_STR("MB"), CPATH_STR("GB"), CPATH_STR("TB"),
-    CPATH_STR("PB"), CPATH_STR("EB"), CPATH_STR("ZB"), CPATH_STR("YB"),
-};
+typedef struct _cpath_dupes_worker_t {
+    unsigned char *buf;
+    uint64_t bytes;
+} _cpath_dupes_worker;
+
+typedef struct _cpath_dupes_ctx_t {
+    cpath_dupes *dupes;
+    _cpath_dupes_worker *workers;
+    // 0 for partial hashes, 1 for full hashes and 2 to verify groups
+    int full;
+} _cpath_dupes_ctx;
 
 _CPATH_FUNC_
-double cpathGetFileSizeDec(cpath_file *file, int intervalSize) {
-    double size = cpathGetFileSize(file);
-    int steps = 0;
-    while (size >= intervalSize / 2 && steps < 8) {
-        size /= intervalSize;
-        steps++;
+void _cpathDupesHashChunk(_cpath_dupes_ctx *ctx, int worker, size_t chunk) {
+    cpath_dupes *dupes = ctx->dupes;
+    if (ctx->full == 2) {
+        // a chunk is a whole group
+        _cpathDupesVerifyGroup(dupes, chunk, ctx->workers[worker].buf,
+                               &ctx->workers[worker].bytes);
+        return;
+    }
+    size_t end = (chunk + 1) * CPATH_DUPES_CHUNK;
+    if (end > dupes->count) end = dupes->count;
+    for (size_t i = chunk * CPATH_DUPES_CHUNK; i < end; i++) {
+        cpath_dupes_file *file = &dupes->files[i];
+        // the partial hash already covered all of it
+        if (ctx->full && file->size <= 2 * CPATH_DUPES_PARTIAL) continue;
+        _cpathDupesHashFile(dupes, file, ctx->workers[worker].buf, ctx->full,
+                            &ctx->workers[worker].bytes);
     }
-    return size;
 }
 
+#if defined CPATH_PARALLEL
 _CPATH_FUNC_
-const cpath_char_t *cpathGetFileSizeSuffix(cpath_file *file, CPathByteRep rep) {
-    cpath_offset_t size = cpathGetFileSize(file);
-    int word = (rep & BYTE_REP_LONG) == BYTE_REP_LONG;
-    int byte_word = (rep & BYTE_REP_BYTE_WORD) == BYTE_REP_BYTE_WORD;
-    // disable both them to make comparing easier
-    rep &= ~BYTE_REP_LONG;
-    rep &= ~BYTE_REP_BYTE_WORD;
-    int interval = rep == BYTE_REP_IEC || rep == BYTE_REP_JEDEC ? 1024 : 1000;
+void _cpathDupesJob(cpath_parallel *pool, int worker, cpath_parallel_job *job) {
+    _cpathDupesHashChunk((_cpath_dupes_ctx*)pool->data, worker, job->tag);
+}
+#endif
 
-    if (size < interval / 2) {
-        // then we just have a byte case
-        if (word || byte_word) {
-            return rep != BYTE_REP_DECIMAL_LOWER ? CPATH_STR("Bytes")
-                                                                                     : CPATH_STR("bytes");
-        } else {
-            return rep != BYTE_REP_DECIMAL_LOWER ? CPATH_STR("B")
-                                                                                     : CPATH_STR("b");
+// Hashes every file (each file is only touched by one worker) or
+// verifies every group (full == 2)
+_CPATH_FUNC_
+int _cpathDupesHashAll(cpath_dupes *dupes, int threads, int full) {
+    size_t chunks = full == 2 ? dupes->groupCount
+                              : (dupes->count + CPATH_DUPES_CHUNK - 1) /
+                                CPATH_DUPES_CHUNK;
+    _cpath_dupes_ctx ctx;
+    ctx.dupes = dupes;
+    ctx.full = full;
+    int workers = 1;
+
+#if defined CPATH_PARALLEL
+    cpath_parallel pool;
+    if (!cpathParallelInit(&pool, threads, _cpathDupesJob, NULL, &ctx)) {
+        return 0;
+    }
+    workers = pool.threads;
+#else
+    (void)threads;
+#endif
+
+    int ok = 1;
+    ctx.workers = (_cpath_dupes_worker*)CPATH_MALLOC(
+        sizeof(_cpath_dupes_worker) * workers);
+    if (ctx.workers != NULL) {
+        for (int i = 0; i < workers; i++) {
+            ctx.workers[i].buf = (unsigned char*)CPATH_MALLOC(CPATH_DUPES_BUF_SIZE);
+            ctx.workers[i].bytes = 0;
+            if (ctx.workers[i].buf == NULL) ok = 0;
         }
+    } else {
+        ok = 0;
     }
 
-    int steps = 0;
-    double size_flt = size;
-    while (size_flt >= interval / 2 && steps < 8) {
-        size_flt /= (double)interval;
-        steps++;
+    if (ok) {
+#if defined CPATH_PARALLEL
+        for (size_t i = 0; i < chunks && ok; i++) {
+            ok = cpathParallelPush(&pool, 0, CPATH_STR(""), 0, 0, i);
+        }
+        cpathParallelRun(&pool);
+#else
+        for (size_t i = 0; i < chunks; i++) _cpathDupesHashChunk(&ctx, 0, i);
+#endif
     }
 
-    switch (rep) {
-        case BYTE_REP_IEC:            return prefixTableIEC[steps - 1];
-        case BYTE_REP_JEDEC:          return prefixTableJEDEC[steps - 1];
-        case BYTE_REP_DECIMAL:        return prefixTableDecimal[steps - 1];
-        case BYTE_REP_DECIMAL_LOWER:  return prefixTableDecimalLower[steps - 1];
-        case BYTE_REP_DECIMAL_UPPER:  return prefixTableDecimalUpper[steps - 1];
-        default: return NULL;
+    if (ctx.workers != NULL) {
+        for (int i = 0; i < workers; i++) {
+            if (ctx.workers[i].buf != NULL) CPATH_FREE(ctx.workers[i].buf);
+            if (full == 2) dupes->verifyBytes += ctx.workers[i].bytes;
+            else if (full) dupes->fullBytes += ctx.workers[i].bytes;
+            else dupes->partialBytes += ctx.workers[i].bytes;
+        }
+        CPATH_FREE(ctx.workers);
     }
+#if defined CPATH_PARALLEL
+    cpathParallelFree(&pool);
+#endif
+    if (!ok) errno = ENOMEM;
+    return ok;
 }
 
+// Fills in the groups (the files have to be sorted)
 _CPATH_FUNC_
-void cpath_traverse(
-    cpath_dir *dir, int depth, int visit_subdirs, cpath_err_handler err,
-    cpath_traverse_it it, void *data
-) {
-    // currently implemented recursively
-    if (dir == NULL) {
-        errno = EINVAL;
-        if (err != NULL) err();
-        return;
+int _cpathDupesGroup(cpath_dupes *dupes, int stage) {
+    // every group has atleast 2 files so this is plenty
+    if (dupes->groups != NULL) CPATH_FREE(dupes->groups);
+    dupes->groups = (size_t*)CPATH_MALLOC(sizeof(size_t) *
+                                          (dupes->count / 2 + 1));
+    dupes->groupCount = 0;
+    if (dupes->groups == NULL) {
+        errno = ENOMEM;
+        return 0;
     }
-    cpath_file file;
-    while (cpathGetNextFile(dir, &file)) {
-        if (it != NULL) {
-            it(&file, dir, depth, data);
-        }
-        if (file.isDir && visit_subdirs && !cpathFileIsSpecialHardLink(&file)) {
-            cpath_dir tmp;
-            if (!cpathFileToDir(&tmp, &file)) {
-                if (err) err();
-                continue;
-            }
-            cpath_traverse(&tmp, depth + 1, visit_subdirs, err, it, data);
-            cpathCloseDir(&tmp);
+    for (size_t i = 0; i < dupes->count; i++) {
+        if (i == 0 || !_cpathDupesSame(&dupes->files[i - 1], &dupes->files[i],
+                                       stage)) {
+            dupes->groups[dupes->groupCount++] = i;
         }
     }
+    dupes->groups[dupes->groupCount] = dupes->count;
+    return 1;
 }
 
 _CPATH_FUNC_
-int cpathMkdir(const cpath *path) {
-#if defined _MSC_VER || __MINGW32__
-    return CreateDirectory(path->buf, NULL);
-#else
-    return mkdir(path->buf, 0700) == 0;
-#endif
+int cpathDupesFind(cpath_dupes *dupes, int threads) {
+    if (dupes == NULL || dupes->failed) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    // only sizes that collide go any further, and their paths are moved
+    // into a new (smaller) arena
+    _cpathDupesKeep(dupes, 0);
+    size_t pathsLen = 0;
+    for (size_t i = 0; i < dupes->count; i++) pathsLen += dupes->files[i].len;
+    cpath_char_t *paths = (cpath_char_t*)CPATH_MALLOC(
+        sizeof(cpath_char_t) * (pathsLen + 1));
+    if (paths == NULL) {
+        errno = ENOMEM;
+        return 0;
+    }
+    pathsLen = 0;
+    for (size_t i = 0; i < dupes->count; i++) {
+        cpath_dupes_file *file = &dupes->files[i];
+        memcpy(paths + pathsLen, dupes->paths + file->path,
+               sizeof(cpath_char_t) * file->len);
+        file->path = pathsLen;
+        pathsLen += file->len;
+    }
+    if (dupes->paths != NULL) CPATH_FREE(dupes->paths);
+    dupes->paths = paths;
+    dupes->pathsLen = dupes->pathsCap = pathsLen;
+
+    if (!_cpathDupesHashAll(dupes, threads, 0)) return 0;
+    _cpathDupesKeep(dupes, 1);
+    if (!_cpathDupesHashAll(dupes, threads, 1)) return 0;
+    _cpathDupesKeep(dupes, 2);
+    if (!_cpathDupesGroup(dupes, 2)) return 0;
+    if (!dupes->verify) return 1;
+
+    if (!_cpathDupesHashAll(dupes, threads, 2)) return 0;
+    _cpathDupesKeep(dupes, 3);
+    return _cpathDupesGroup(dupes, 3);
 }
 
 _CPATH_FUNC_
-FILE *cpathOpen(const cpath *path, const cpath_char_t *mode) {
-    return cpath_fopen(path->buf, mode);
+int cpathDupesPath(const cpath_dupes *dupes, size_t file, cpath *out) {
+    if (dupes == NULL || out == NULL || file >= dupes->count) {
+        errno = EINVAL;
+        return 0;
+    }
+    const cpath_dupes_file *it = &dupes->files[file];
+    memcpy(out->buf, dupes->paths + it->path, sizeof(cpath_char_t) * it->len);
+    out->buf[it->len] = CPATH_STR('\0');
+    out->len = it->len;
+    return 1;
 }
+#endif
 
 #endif
 #ifdef __cplusplus
@@ -2015,6 +10801,11 @@ FILE *cpathOpen(const cpath *path, const cpath_char_t *mode) {
     } }
 
 // cpp bindings
+#include <new>
+#if __cplusplus > 199711L
+#include <utility>
+#endif
+
 namespace cpath {
 // using is a C++11 extension, we want to remain pretty
 // compatible to all versions
@@ -2025,6 +10816,7 @@ typedef internals::cpath            RawPath;
 typedef internals::cpath_dir        RawDir;
 typedef internals::cpath_file       RawFile;
 typedef internals::CPathByteRep     ByteRep;
+typedef internals::cpath_component  RawComponent;
 
 typedef void(*TraversalIt)(
     struct File &file, struct Dir &parent, int depth, void *data
@@ -2055,23 +10847,95 @@ typedef struct stat RawStat;
 template<typename T, typename Err>
 struct Opt {
 private:
-#if __cplusplus <= 199711L
-    struct Data {
-#else
+    // T is constructed in place (only if ok) so we don't require T to be
+    // default constructible and we don't have to copy it in
     union Data {
-#endif
-    T raw;
+        char raw[sizeof(T)];
+        // just for alignment
+        long double alignDouble;
+        long long alignLong;
+        void *alignPtr;
+    } data;
     Err err;
-
-    Data(T raw) : raw(raw) {}
-    Data(Err err) : err(err) {}
-} data;
     bool ok;
 
+    inline T *Ptr() {
+        return reinterpret_cast<T*>(data.raw);
+    }
+
+    inline const T *Ptr() const {
+        return reinterpret_cast<const T*>(data.raw);
+    }
+
+    inline void Reset() {
+        if (ok) Ptr()->~T();
+        ok = false;
+    }
+
 public:
-    Opt(T raw) : data(raw), ok(true) {}
-    Opt(Err err) : data(err), ok(false) {}
-    Opt() : data(Err()), ok(false) {}
+    Opt(const T &raw) : err(), ok(true) {
+        new (data.raw) T(raw);
+    }
+    Opt(Err err) : err(err), ok(false) {}
+    Opt() : err(Err()), ok(false) {}
+
+    Opt(const Opt &other) : err(other.err), ok(other.ok) {
+        if (ok) new (data.raw) T(*other.Ptr());
+    }
+
+    Opt &operator=(const Opt &other) {
+        if (this != &other) {
+            Reset();
+            err = other.err;
+            if (other.ok) {
+                new (data.raw) T(*other.Ptr());
+                ok = true;
+            }
+        }
+        return *this;
+    }
+
+#if __cplusplus > 199711L
+    Opt(T &&raw) : err(), ok(true) {
+        new (data.raw) T(std::move(raw));
+    }
+
+    Opt(Opt &&other) : err(other.err), ok(other.ok) {
+        if (ok) new (data.raw) T(std::move(*other.Ptr()));
+    }
+
+    Opt &operator=(Opt &&other) {
+        if (this != &other) {
+            Reset();
+            err = other.err;
+            if (other.ok) {
+                new (data.raw) T(std::move(*other.Ptr()));
+                ok = true;
+            }
+        }
+        return *this;
+    }
+#endif
+
+    ~Opt() {
+        Reset();
+    }
+
+    /*
+        Default constructs the value in place and returns it
+        so it can be filled in without any copies.
+    */
+    T *Emplace() {
+        Reset();
+        new (data.raw) T();
+        ok = true;
+        return Ptr();
+    }
+
+    void SetErr(Err err) {
+        Reset();
+        this->err = err;
+    }
 
     bool IsOk() const {
         return ok;
@@ -2082,21 +10946,21 @@ public:
     }
 
     Err GetErr() const {
-        return data.err;
+        return err;
     }
 
     T GetRaw() const {
-        return data.raw;
+        return *Ptr();
     }
 
     T *operator*() {
         if (!ok) return NULL;
-        return &data.raw;
+        return Ptr();
     }
 
     T *operator->() {
         if (!ok) return NULL;
-        return &data.raw;
+        return Ptr();
     }
 };
 
@@ -2121,12 +10985,120 @@ struct Error {
 
     static void WriteToErrno(Type type) {
         switch (type) {
-            case INVALID_ARGUMENTS: errno = EINVAL;
-            case NAME_TOO_LONG: errno = ENAMETOOLONG;
-            case NO_SUCH_FILE: errno = ENOENT;
-            case IO_ERROR: errno = IO_ERROR;
-            default: errno = 0;
+            case INVALID_ARGUMENTS: errno = EINVAL; break;
+            case NAME_TOO_LONG: errno = ENAMETOOLONG; break;
+            case NO_SUCH_FILE: errno = ENOENT; break;
+            case IO_ERROR: errno = EIO; break;
+            default: errno = 0; break;
+        }
+    }
+};
+
+struct Component {
+private:
+    RawComponent component;
+
+public:
+    inline Component() {
+        component.str = NULL;
+        component.len = 0;
+    }
+
+    inline Component(RawComponent component) : component(component) {}
+
+    inline const RawChar *Data() const {
+        return component.str;
+    }
+
+    inline unsigned long Size() const {
+        return component.len;
+    }
+
+    inline const RawComponent *GetRawComponent() const {
+        return &component;
+    }
+
+    inline friend bool operator==(const Component &c1, const Component &c2) {
+        return internals::cpathComponentEq(&c1.component, &c2.component);
+    }
+
+    inline friend bool operator!=(const Component &c1, const Component &c2) {
+        return !(c1 == c2);
+    }
+};
+
+/*
+    A read only range over the components of a path, the path has to
+    outlive the range.
+*/
+struct ComponentRange {
+private:
+    const RawChar *buf;
+    size_t len;
+    bool reverse;
+
+public:
+    struct Iterator {
+    private:
+        internals::cpath_component_it it;
+        Component current;
+        bool reverse;
+        bool done;
+
+        inline void Advance() {
+            RawComponent next;
+            done = reverse ? !internals::cpathComponentItPrev(&it, &next)
+                           : !internals::cpathComponentItNext(&it, &next);
+            if (!done) current = Component(next);
+        }
+
+    public:
+        inline Iterator() : reverse(false), done(true) {}
+
+        inline Iterator(const RawChar *buf, size_t len, bool reverse)
+            : reverse(reverse), done(false) {
+            internals::cpathComponentItInitStrn(&it, buf, len);
+            Advance();
+        }
+
+        inline const Component &operator*() const {
+            return current;
+        }
+
+        inline const Component *operator->() const {
+            return &current;
+        }
+
+        inline Iterator &operator++() {
+            Advance();
+            return *this;
+        }
+
+        inline Iterator operator++(int) {
+            Iterator old = *this;
+            Advance();
+            return old;
+        }
+
+        inline friend bool operator==(const Iterator &a, const Iterator &b) {
+            if (a.done || b.done) return a.done == b.done;
+            return a.current.Data() == b.current.Data();
+        }
+
+        inline friend bool operator!=(const Iterator &a, const Iterator &b) {
+            return !(a == b);
         }
+    };
+
+    inline ComponentRange(const RawChar *buf, size_t len, bool reverse)
+        : buf(buf), len(len), reverse(reverse) {}
+
+    inline Iterator begin() const {
+        return Iterator(buf, len, reverse);
+    }
+
+    inline Iterator end() const {
+        return Iterator();
     }
 };
 
@@ -2171,6 +11143,18 @@ public:
         return path.len;
     }
 
+    inline ComponentRange Components() const {
+        return ComponentRange(path.buf, path.len, false);
+    }
+
+    inline ComponentRange ReverseComponents() const {
+        return ComponentRange(path.buf, path.len, true);
+    }
+
+    inline bool StartsWith(const Path &prefix) const {
+        return internals::cpathStartsWith(&path, &prefix.path);
+    }
+
     inline friend bool operator==(const Path &p1, const Path &p2) {
         if (p1.path.len != p2.path.len) return false;
         return !cpath_str_compare_safe(p1.path.buf, p2.path.buf, p1.path.len);
@@ -2220,6 +11204,9 @@ private:
     RawFile file;
     bool hasArg;
 
+    // so directories can fill in files directly
+    friend struct Dir;
+
 public:
     inline bool LoadFileInfo() {
         return internals::cpathGetFileInfo(&file);
@@ -2239,12 +11226,14 @@ public:
     inline File() : hasArg(false) {}
 
     inline static Opt<File, Error::Type> OpenFile(const Path &path) {
-        RawFile file;
-        if (!internals::cpathOpenFile(&file, path.GetRawPath())) {
-            return Error::FromErrno();
+        Opt<File, Error::Type> res;
+        File *file = res.Emplace();
+        if (!internals::cpathOpenFile(&file->file, path.GetRawPath())) {
+            res.SetErr(Error::FromErrno());
         } else {
-            return File(file);
+            file->hasArg = true;
         }
+        return res;
     }
 
     inline Opt<Dir, Error::Type> ToDir() const;
@@ -2309,8 +11298,8 @@ public:
         return internals::cpathGetFileSizeSuffix(&file, rep);
     }
 
-    inline Path Path() const {
-        return cpath::Path(file.path);
+    inline ::cpath::Path Path() const {
+        return ::cpath::Path(file.path);
     }
 
     inline const RawChar *Name() {
@@ -2336,57 +11325,97 @@ struct Dir {
 private:
     RawDir dir;
     bool loadedFiles;
+    // false once closed (or moved from) so we don't close twice
+    bool owns;
+    // the file GetNext() read
+    File current;
 
-public:
-    inline Dir(const Path &path) {
-        loadedFiles = false;
-        internals::cpathOpenDir(&dir, path.GetRawPath());
+    inline explicit Dir(const RawFile *file) : loadedFiles(false) {
+        owns = internals::cpathFileToDir(&dir, file);
     }
-    inline Dir(RawDir dir) : dir(dir) {
-        loadedFiles = false;
+
+#if __cplusplus > 199711L
+    // directories own their handle so can only be moved
+    Dir(const Dir &other) = delete;
+    Dir &operator=(const Dir &other) = delete;
+#endif
+
+public:
+    inline Dir(const Path &path) : loadedFiles(false) {
+        owns = internals::cpathOpenDir(&dir, path.GetRawPath());
+    }
+    inline Dir(RawDir dir) : dir(dir), loadedFiles(false), owns(true) {}
+    inline Dir() : loadedFiles(false) {
+        owns = internals::cpathOpenDir(&dir, Path().GetRawPath());
+    }
+
+#if __cplusplus > 199711L
+    inline Dir(Dir &&other) : dir(other.dir), loadedFiles(other.loadedFiles),
+                              owns(other.owns), current(other.current) {
+        other.owns = false;
+        other.dir.files = NULL;
+        other.dir.parent = NULL;
+        other.dir.pool = NULL;
+    }
+
+    inline Dir &operator=(Dir &&other) {
+        if (this != &other) {
+            Close();
+            dir = other.dir;
+            loadedFiles = other.loadedFiles;
+            owns = other.owns;
+            current = other.current;
+            other.owns = false;
+            other.dir.files = NULL;
+            other.dir.parent = NULL;
+            other.dir.pool = NULL;
+        }
+        return *this;
     }
-    inline Dir() {
-        loadedFiles = false;
-        internals::cpathOpenDir(&dir, Path().GetRawPath());
+
+    inline ~Dir() {
+        Close();
     }
+#endif
 
     inline static Opt<Dir, Error::Type> Open(const File &file) {
-        RawDir dir;
-        internals::cpathFileToDir(&dir, file.GetRawFileConst());
-        return Dir(dir);
+        Dir dir(file.GetRawFileConst());
+        if (!dir.owns) return Error::FromErrno();
+#if __cplusplus > 199711L
+        return std::move(dir);
+#else
+        return dir;
+#endif
     }
 
     inline void Traverse(TraversalIt it, ErrorHandler err, int visitSubDir,
                                              int depth, void *data) {
-        while (Opt<File, Error::Type> file = GetNextFile()) {
-            if (file && it) it(**file, *this, depth, data);
-            if (!file) {
-                Error::WriteToErrno(file.GetErr());
-                if (err) err();
-                continue;
-            }
+        while (Next()) {
+            if (it) it(current, *this, depth, data);
 
-            if (file->IsDir() && !file->IsSpecialHardLink()) {
-                Opt<Dir, Error::Type> dir = file->ToDir();
-                if (!dir) {
-                    Error::WriteToErrno(dir.GetErr());
+            if (visitSubDir && current.file.isDir &&
+                    !internals::cpathFileIsSpecialHardLink(&current.file)) {
+                Dir sub(&current.file);
+                if (!sub.owns) {
                     if (err) err();
                     continue;
                 }
-                dir->Traverse(it, err, visitSubDir, depth + 1, data);
-                dir->Close();
+                sub.Traverse(it, err, visitSubDir, depth + 1, data);
+                sub.Close();
             }
         }
     }
 
     inline bool OpenEmplace(const Path &path) {
-        internals::cpathCloseDir(&dir);
+        Close();
         loadedFiles = false;
-        return internals::cpathOpenDir(&dir, path.GetRawPath());
+        owns = internals::cpathOpenDir(&dir, path.GetRawPath());
+        return owns;
     }
 
     inline void Close() {
-        return internals::cpathCloseDir(&dir);
+        if (owns) internals::cpathCloseDir(&dir);
+        owns = false;
     }
 
     inline void Sort(internals::cpath_cmp cmp) {
@@ -2402,22 +11431,46 @@ public:
         return &dir;
     }
 
+    /*
+        Reads the next file into Current() (no copies are made)
+        Returns false if there are no more files (or it failed)
+    */
+    inline bool Next() {
+        current.hasArg = internals::cpathGetNextFile(&dir, &current.file);
+        return current.hasArg;
+    }
+
+    /*
+        The file read by the last Next(), this is overwritten by the next call
+    */
+    inline File &Current() {
+        return current;
+    }
+
+    inline const File &Current() const {
+        return current;
+    }
+
     inline Opt<File, Error::Type> PeekNextFile() {
-        RawFile file;
-        if (!internals::cpathPeekNextFile(&dir, &file)) {
-            return Error::FromErrno();
+        Opt<File, Error::Type> res;
+        File *file = res.Emplace();
+        if (!internals::cpathPeekNextFile(&dir, &file->file)) {
+            res.SetErr(Error::FromErrno());
         } else {
-            return File(file);
+            file->hasArg = true;
         }
+        return res;
     }
 
     inline Opt<File, Error::Type> GetNextFile() {
-        RawFile file;
-        if (!internals::cpathGetNextFile(&dir, &file)) {
-            return Error::FromErrno();
+        Opt<File, Error::Type> res;
+        File *file = res.Emplace();
+        if (!internals::cpathGetNextFile(&dir, &file->file)) {
+            res.SetErr(Error::FromErrno());
         } else {
-            return File(file);
+            file->hasArg = true;
         }
+        return res;
     }
 
     inline bool LoadFiles() {
@@ -2431,12 +11484,24 @@ public:
     }
 
     inline Opt<File, Error::Type> GetFile(unsigned long n) {
-        RawFile file;
-        if (!internals::cpathGetFile(&dir, &file, n)) {
-            return Error::FromErrno();
+        Opt<File, Error::Type> res;
+        File *file = res.Emplace();
+        if (!internals::cpathGetFile(&dir, &file->file, n)) {
+            res.SetErr(Error::FromErrno());
         } else {
-            return File(file);
+            file->hasArg = true;
         }
+        return res;
+    }
+
+    /*
+        A reference to a loaded file (no copy)
+        Returns NULL if n is out of range
+    */
+    inline const RawFile *GetFileRef(unsigned long n) {
+        const RawFile *file;
+        if (!internals::cpathGetFileConst(&dir, &file, n)) return NULL;
+        return file;
     }
 
     inline bool OpenSubFileEmplace(const File &file, bool saveDir) {
@@ -2460,14 +11525,18 @@ public:
 
     inline Dir OpenNextSubDir() {
         RawDir raw;
-        internals::cpathOpenNextSubDir(&raw, &dir);
-        return Dir(raw);
+        bool ok = internals::cpathOpenNextSubDir(&raw, &dir);
+        Dir res(raw);
+        res.owns = ok;
+        return res;
     }
 
     inline Dir OpenCurrentSubDir() {
         RawDir raw;
-        internals::cpathOpenCurrentSubDir(&raw, &dir);
-        return Dir(raw);
+        bool ok = internals::cpathOpenCurrentSubDir(&raw, &dir);
+        Dir res(raw);
+        res.owns = ok;
+        return res;
     }
 
     inline bool OpenNextSubDirEmplace(bool saveDir) {
@@ -1,10 +1,29 @@
 // This file should be run with -DCPATH_UNICODE on and off
 
 #define CUTE_FILES_IMPLEMENTATION
+#define CPATH_PARALLEL
+#define CPATH_USE_IO_URING
+
+// count every filesystem call cpath makes
+typedef struct syscall_count_t {
+  int open;
+  int read;
+  int rewind;
+  int stat;
+  int link;
+} syscall_count;
+syscall_count syscalls;
+#define CPATH_SYSCALL_HOOK(kind)                                               \
+  (kind[0] == 'o'   ? syscalls.open++                                          \
+   : kind[0] == 'r' ? (kind[1] == 'e' && kind[2] == 'a' ? syscalls.read++      \
+                                                        : syscalls.rewind++)   \
+   : kind[0] == 'l' ? syscalls.link++                                          \
+                    : syscalls.stat++)
 
 #include "../cpath.h"
 #include "others/cute_files.h"
 #include "others/tinydir.h"
+#include <utime.h>
 
 #define OBS_STRCMP cpath_str_compare
 
@@ -27,126 +46,1851 @@ void recursive_visit(cpath_dir *dir, int tab) {
   }
 }
 
-void print_dir(cf_file_t *file, void *udata) { puts(file->name); }
+void print_dir(cf_file_t *file, void *udata) { puts(file->name); }
+
+void recurse(tinydir_dir *dir, int tab) {
+  tinydir_file file;
+  while (dir->has_next) {
+    if (tinydir_readfile(dir, &file) == -1) {
+      perror("Error getting file");
+      tinydir_close(dir);
+      return;
+    }
+
+    puts(file.name);
+    if (file.is_dir && _tinydir_strcmp(file.name, ".") &&
+        _tinydir_strcmp(file.name, "..")) {
+      tinydir_dir tmp;
+      tinydir_open(&tmp, file.path);
+      recurse(&tmp, tab + 1);
+      tinydir_close(&tmp);
+    }
+
+    if (tinydir_next(dir) == -1) {
+      perror("Error getting file");
+      tinydir_close(dir);
+      return;
+    }
+  }
+}
+
+void emplace(cpath_dir *dir) {
+  cpath_file file;
+  int tab = 0;
+
+  while (dir != NULL) {
+    while (cpathGetNextFile(dir, &file)) {
+      for (int i = 0; i < tab; i++)
+        putchar('\t');
+      printf("%s\n", file.name);
+      if (file.isDir && !cpathFileIsSpecialHardLink(&file)) {
+        cpathOpenSubFileEmplace(dir, &file, 1);
+        tab++;
+      }
+    }
+    cpathRevertEmplace(&dir);
+    tab--;
+  }
+}
+
+void dir_stack(cpath_dir_stack *stack) {
+  cpath_file file;
+
+  do {
+    while (cpathDirStackNext(stack, &file)) {
+      for (size_t i = 1; i < stack->depth; i++)
+        putchar('\t');
+      printf("%s\n", file.name);
+      if (file.isDir && !cpathFileIsSpecialHardLink(&file)) {
+        cpathDirStackPush(stack, &file);
+      }
+    }
+  } while (cpathDirStackPop(stack));
+}
+
+void parallel_visit(cpath_file *file, cpath_dir *parent, int depth,
+                    void *data) {
+  puts(file->name);
+}
+
+void stat_visit(cpath_file *file, cpath_dir *parent, int depth, void *data) {
+  cpathGetFileInfo(file);
+  printf("%s %ld\n", file->name, (long)cpathGetFileSize(file));
+}
+
+void stat_loaded_visit(cpath_file *file, cpath_dir *parent, int depth,
+                       void *data) {
+  int *loaded = (int *)data;
+  if (file->statLoaded) (*loaded)++;
+  printf("%s %ld\n", file->name, (long)cpathGetFileSize(file));
+}
+
+void at_visit(cpath_entry *entry, int depth, void *data) {
+  puts(entry->name);
+}
+
+// checks that the on demand path of every regular file is right
+void at_path_visit(cpath_entry *entry, int depth, void *data) {
+  cpath_file file;
+  cpath_file check;
+  if (!entry->isReg) return;
+  if (!cpathEntryToFile(entry, &file)) return;
+  if (!cpathOpenFile(&check, &file.path)) return;
+  if (!cpathEntryGetInfo(entry) || !cpathGetFileInfo(&check)) return;
+  if (entry->stat.st_ino == check.stat.st_ino) (*(int *)data)++;
+}
+
+typedef struct count_visit_t {
+  pthread_mutex_t lock;
+  int files;
+  int dirs;
+} count_visit;
+
+void count_visit_file(cpath_file *file, cpath_dir *parent, int depth,
+                      void *data) {
+  count_visit *count = (count_visit *)data;
+  if (cpathFileIsSpecialHardLink(file)) return;
+  pthread_mutex_lock(&count->lock);
+  if (file->isDir) count->dirs++;
+  else count->files++;
+  pthread_mutex_unlock(&count->lock);
+}
+
+int prune_b(const cpath_char_t *name, size_t len, cpath_dir *parent,
+            int depth, void *data) {
+  return len == 1 && name[0] == 'B';
+}
+
+typedef struct mount_check_t {
+  int calls;
+  int matched;
+} mount_check;
+
+int check_mount(const cpath_file *dir, const cpath_mount *mount, void *data) {
+  mount_check *check = (mount_check *)data;
+  check->calls++;
+  if (mount != NULL && strcmp(dir->path.buf, mount->mountPoint) == 0) {
+    check->matched++;
+  }
+  return 1;
+}
+
+int errors_seen = 0;
+int count_err() { return ++errors_seen; }
+
+int count_seps(const cpath *path) {
+  int n = 0;
+  for (size_t i = 0; i < path->len; i++) n += path->buf[i] == CPATH_SEP;
+  return n;
+}
+
+void write_file(const char *path, const char *contents) {
+  FILE *f = fopen(path, "w");
+  fputs(contents, f);
+  fclose(f);
+}
+
+// a tree whose deepest paths are longer than CPATH_MAX_PATH_LEN (made
+// through chdir since they can't be made by path)
+#define DEEP_TREE_LEVELS (22)
+void deep_tree_name(char *name) {
+  memset(name, 'd', 200);
+  name[200] = '\0';
+}
+
+// every level also has some files (enough that a few are likely to be
+// listed after the sub directory)
+#define DEEP_TREE_FILES (16)
+
+void make_deep_tree() {
+  char name[201];
+  char file[16];
+  deep_tree_name(name);
+  mkdir("deep_tree", 0777);
+  chdir("deep_tree");
+  for (int i = 0; i < DEEP_TREE_LEVELS; i++) {
+    mkdir(name, 0777);
+    chdir(name);
+    for (int j = 0; j < DEEP_TREE_FILES; j++) {
+      sprintf(file, "f%d", j);
+      write_file(file, "");
+    }
+  }
+  for (int i = 0; i <= DEEP_TREE_LEVELS; i++) chdir("..");
+}
+
+void remove_deep_tree() {
+  char name[201];
+  char file[16];
+  deep_tree_name(name);
+  chdir("deep_tree");
+  for (int i = 0; i < DEEP_TREE_LEVELS; i++) chdir(name);
+  for (int i = 0; i < DEEP_TREE_LEVELS; i++) {
+    for (int j = 0; j < DEEP_TREE_FILES; j++) {
+      sprintf(file, "f%d", j);
+      unlink(file);
+    }
+    chdir("..");
+    rmdir(name);
+  }
+  chdir("..");
+  rmdir("deep_tree");
+}
+
+void write_bytes(const char *path, const unsigned char *data, size_t len) {
+  FILE *f = fopen(path, "wb");
+  fwrite(data, 1, len, f);
+  fclose(f);
+}
+
+void make_ignore_tree() {
+  mkdir("ignore_tree", 0777);
+  mkdir("ignore_tree/.git", 0777);
+  mkdir("ignore_tree/build", 0777);
+  mkdir("ignore_tree/docs", 0777);
+  mkdir("ignore_tree/src", 0777);
+  write_file("ignore_tree/.gitignore", "# build output\nbuild/\n*.o\n!keep.o\n"
+                                       "/docs/*.md\n");
+  write_file("ignore_tree/.git/HEAD", "");
+  write_file("ignore_tree/build/x.txt", "");
+  write_file("ignore_tree/a.o", "");
+  write_file("ignore_tree/keep.o", "");
+  write_file("ignore_tree/main.c", "");
+  write_file("ignore_tree/docs/readme.md", "");
+  write_file("ignore_tree/docs/notes.txt", "");
+  write_file("ignore_tree/src/.gitignore", "!*.o\ngen\n");
+  write_file("ignore_tree/src/b.o", "");
+  write_file("ignore_tree/src/gen", "");
+}
+
+void remove_ignore_tree() {
+  const char *files[] = {
+      "ignore_tree/.gitignore", "ignore_tree/.git/HEAD",
+      "ignore_tree/build/x.txt", "ignore_tree/a.o", "ignore_tree/keep.o",
+      "ignore_tree/main.c", "ignore_tree/docs/readme.md",
+      "ignore_tree/docs/notes.txt", "ignore_tree/src/.gitignore",
+      "ignore_tree/src/b.o", "ignore_tree/src/gen"};
+  const char *dirs[] = {"ignore_tree/.git", "ignore_tree/build",
+                        "ignore_tree/docs", "ignore_tree/src", "ignore_tree"};
+  for (size_t i = 0; i < sizeof(files) / sizeof(*files); i++) unlink(files[i]);
+  for (size_t i = 0; i < sizeof(dirs) / sizeof(*dirs); i++) rmdir(dirs[i]);
+}
+
+
+int main(int argc, char *argv[]) {
+  OBS_SETUP("CPath", argc, argv);
+
+  // we have to generate the files
+  if (has_benchmarks) {
+    cpath path = cpathFromUtf8("tmp");
+    cpathMkdir(&path);
+    for (cpath_char_t i = 1; i < 10; i++) {
+      cpathAppendSprintf(&path, "/a%d", i);
+      cpathMkdir(&path);
+      for (cpath_char_t j = 1; j < 100; j++) {
+        cpathAppendSprintf(&path, "/b%d", j);
+        cpathMkdir(&path);
+        for (cpath_char_t k = 1; k < 50; k++) {
+          cpathAppendSprintf(&path, "/%d.tmp", k);
+          FILE *f = cpathOpen(&path, CPATH_STR("w"));
+          fclose(f);
+          cpathUpDir(&path);
+        }
+        cpathUpDir(&path);
+      }
+      cpathUpDir(&path);
+    }
+  }
+
+  OBS_BENCHMARK("Stack CPath", 100, {
+    cpath_dir dir;
+    cpath path;
+    cpathFromStr(&path, "tmp");
+    cpathOpenDir(&dir, &path);
+    emplace(&dir);
+  })
+
+  OBS_BENCHMARK("Stack CPath (dir stack)", 100, {
+    cpath_dir_stack stack;
+    cpath path;
+    cpathFromStr(&path, "tmp");
+    cpathDirStackOpen(&stack, &path);
+    dir_stack(&stack);
+    cpathDirStackClose(&stack);
+  })
+
+  OBS_BENCHMARK("Recursive CPath", 100, {
+    cpath_dir dir;
+    cpath path;
+    cpathFromStr(&path, "tmp");
+    cpathOpenDir(&dir, &path);
+    recursive_visit(&dir, 0);
+  })
+
+  OBS_BENCHMARK("Parallel CPath (2 threads)", 100, {
+    cpath_dir dir;
+    cpath path;
+    cpathFromStr(&path, "tmp");
+    cpathOpenDir(&dir, &path);
+    cpath_traverse_parallel(&dir, 0, 1, NULL, parallel_visit, NULL, 2);
+    cpathCloseDir(&dir);
+  })
+
+  OBS_BENCHMARK("Parallel CPath (4 threads)", 100, {
+    cpath_dir dir;
+    cpath path;
+    cpathFromStr(&path, "tmp");
+    cpathOpenDir(&dir, &path);
+    cpath_traverse_parallel(&dir, 0, 1, NULL, parallel_visit, NULL, 4);
+    cpathCloseDir(&dir);
+  })
+
+  OBS_BENCHMARK("Parallel CPath (8 threads)", 100, {
+    cpath_dir dir;
+    cpath path;
+    cpathFromStr(&path, "tmp");
+    cpathOpenDir(&dir, &path);
+    cpath_traverse_parallel(&dir, 0, 1, NULL, parallel_visit, NULL, 8);
+    cpathCloseDir(&dir);
+  })
+
+  OBS_BENCHMARK("Disk usage CPath (1 thread)", 100, {
+    cpath_du du;
+    cpath path;
+    cpathFromStr(&path, "tmp");
+    cpathDuScan(&du, &path, 1);
+    cpathDuFree(&du);
+  })
+
+  OBS_BENCHMARK("Disk usage CPath (8 threads)", 100, {
+    cpath_du du;
+    cpath path;
+    cpathFromStr(&path, "tmp");
+    cpathDuScan(&du, &path, 8);
+    cpathDuFree(&du);
+  })
+
+  OBS_BENCHMARK("Breadth first CPath", 100, {
+    cpath_bfs bfs;
+    cpath_file file;
+    cpath path;
+    cpathFromStr(&path, "tmp");
+    cpathBfsOpen(&bfs, &path, 0);
+    while (cpathBfsNext(&bfs, &file)) {
+    }
+    cpathBfsClose(&bfs);
+  })
+
+  OBS_BENCHMARK("Breadth first CPath (bounded frontier)", 100, {
+    cpath_bfs bfs;
+    cpath_file file;
+    cpath path;
+    cpathFromStr(&path, "tmp");
+    cpathBfsOpen(&bfs, &path, 16);
+    while (cpathBfsNext(&bfs, &file)) {
+    }
+    cpathBfsClose(&bfs);
+  })
+
+  OBS_BENCHMARK("Snapshot", 100, {
+    cpath_snapshot snapshot;
+    cpath path;
+    cpathFromStr(&path, "tmp");
+    cpathSnapshotScan(&snapshot, &path, NULL, NULL);
+    cpathSnapshotFree(&snapshot);
+  })
+
+  {
+    cpath_index_builder builder;
+    cpath_dir tree;
+    cpath path = cpathFromUtf8("tmp");
+    cpath out = cpathFromUtf8("tmp_index.idx");
+    cpathIndexBuilderInit(&builder, &path);
+    cpathOpenDir(&tree, &path);
+    cpath_traverse(&tree, 0, 1, NULL, cpathIndexBuilderVisit, &builder);
+    cpathCloseDir(&tree);
+    cpathIndexBuilderWrite(&builder, &out);
+    cpathIndexBuilderFree(&builder);
+  }
+
+  OBS_BENCHMARK("Recursive CPath (from an index)", 100, {
+    cpath_index index;
+    cpath out = cpathFromUtf8("tmp_index.idx");
+    cpath path = cpathFromUtf8("tmp");
+    cpath_index_dir stack[64];
+    cpath_file file;
+    int depth = 0;
+    cpathIndexOpen(&index, &out);
+    cpathIndexOpenDir(&stack[0], &index, &path);
+    while (depth >= 0) {
+      if (!cpathIndexGetNextFile(&stack[depth], &file)) {
+        depth--;
+      } else if (file.isDir && depth < 63) {
+        depth++;
+        cpathIndexOpenDir(&stack[depth], &index, &file.path);
+      }
+    }
+    cpathIndexClose(&index);
+  })
+  unlink("tmp_index.idx");
+
+  OBS_BENCHMARK("Recursive CPath (skipping most of it)", 100, {
+    const cpath_char_t *skip[] = {"a2", "a3", "a4", "a5", "a6", "a7", "a8"};
+    cpath_traverse_opts opts;
+    cpathTraverseOptsInit(&opts);
+    opts.skipNames = skip;
+    opts.skipNamesCount = 7;
+    cpath_dir dir;
+    cpath path;
+    cpathFromStr(&path, "tmp");
+    cpathOpenDir(&dir, &path);
+    cpath_traverse_ex(&dir, 0, &opts, NULL, parallel_visit, NULL);
+    cpathCloseDir(&dir);
+  })
+
+  OBS_BENCHMARK("Recursive CPath (following links)", 100, {
+    cpath_traverse_opts opts;
+    cpathTraverseOptsInit(&opts);
+    opts.followLinks = 1;
+    cpath_dir dir;
+    cpath path;
+    cpathFromStr(&path, "tmp");
+    cpathOpenDir(&dir, &path);
+    cpath_traverse_ex(&dir, 0, &opts, NULL, parallel_visit, NULL);
+    cpathCloseDir(&dir);
+  })
+
+  OBS_BENCHMARK("Ignore walk (skipping most of it)", 100, {
+    const char *rules = "a2\na3\na4\na5\na6\na7\na8\n*.log\n";
+    cpath_ignore_walk walk;
+    cpath_file file;
+    cpath path;
+    cpathFromStr(&path, "tmp");
+    cpathIgnoreWalkOpen(&walk, &path);
+    cpathIgnoreWalkAddRules(&walk, rules, strlen(rules));
+    while (cpathIgnoreWalkNext(&walk, &file)) {
+    }
+    cpathIgnoreWalkClose(&walk);
+  })
+
+  OBS_BENCHMARK("Recursive CPath (stat)", 100, {
+    cpath_dir dir;
+    cpath path;
+    cpathFromStr(&path, "tmp");
+    cpathOpenDir(&dir, &path);
+    cpath_traverse(&dir, 0, 1, NULL, stat_visit, NULL);
+    cpathCloseDir(&dir);
+  })
+
+  OBS_BENCHMARK("Batched stat CPath", 100, {
+    cpath_dir dir;
+    cpath path;
+    int loaded = 0;
+    cpathFromStr(&path, "tmp");
+    cpathOpenDir(&dir, &path);
+    cpath_traverse_stat(&dir, 0, 1, NULL, stat_loaded_visit, &loaded);
+    cpathCloseDir(&dir);
+  })
+
+  OBS_BENCHMARK("Recursive CPath (openat)", 100, {
+    cpath_dir dir;
+    cpath path;
+    cpathFromStr(&path, "tmp");
+    cpathOpenDir(&dir, &path);
+    cpath_traverse_at(&dir, 0, 1, NULL, at_visit, NULL);
+    cpathCloseDir(&dir);
+  })
+
+  memset(&syscalls, 0, sizeof(syscalls));
+  OBS_BENCHMARK("Load all files", 100, {
+    cpath_dir dir;
+    cpath path;
+    cpathFromStr(&path, "tmp");
+    cpathOpenDir(&dir, &path);
+    cpathLoadAllFiles(&dir);
+    cpathCloseDir(&dir);
+  })
+  if (syscalls.open > 0) {
+    printf("Load all files per run: %d open, %d read, %d rewind, %d stat\n",
+           syscalls.open / 100, syscalls.read / 100, syscalls.rewind / 100,
+           syscalls.stat / 100);
+  }
+
+  OBS_BENCHMARK("Load listing", 100, {
+    cpath_dir dir;
+    cpath path;
+    cpath_listing listing;
+    cpathListingInit(&listing);
+    cpathFromStr(&path, "tmp");
+    cpathOpenDir(&dir, &path);
+    cpathListingLoad(&listing, &dir, 0);
+    cpathListingSort(&listing, cpathListingCompareName, NULL);
+    cpathListingFree(&listing);
+    cpathCloseDir(&dir);
+  })
+
+  // a path typical of a large monorepo (~200 characters)
+  const cpath_char_t *long_path =
+      "/home/build/src/monorepo/services/payments/internal/processing/"
+      "settlement/reconciliation/adapters/bank_transfer/v2/generated/"
+      "protobuf/messages/settlement_reconciliation_request_builder_test.cc";
+  OBS_BENCHMARK("Separator conversion (scalar)", 100, {
+    cpath_char_t buf[CPATH_MAX_PATH_LEN];
+    size_t len = cpath_str_length(long_path);
+    for (int i = 0; i < 10000; i++) {
+      cpathStrCpyConvScalar(buf, len, long_path);
+    }
+  })
+
+  OBS_BENCHMARK("Separator conversion", 100, {
+    cpath_char_t buf[CPATH_MAX_PATH_LEN];
+    size_t len = cpath_str_length(long_path);
+    for (int i = 0; i < 10000; i++) {
+      cpathStrCpyConv(buf, len, long_path);
+    }
+  })
+
+  static unsigned char hash_buf[4 * 1024 * 1024];
+  for (size_t i = 0; i < sizeof(hash_buf); i++) hash_buf[i] = (unsigned char)i;
+  OBS_BENCHMARK("Content hash 4 MiB (scalar)", 100, {
+    cpathContentHashScalar(hash_buf, sizeof(hash_buf));
+  })
+
+  OBS_BENCHMARK("Content hash 4 MiB", 100, {
+    cpathContentHash(hash_buf, sizeof(hash_buf));
+  })
+
+  OBS_BENCHMARK("Duplicates CPath", 100, {
+    cpath_dupes dupes;
+    cpath_dir dir;
+    cpath path;
+    cpathFromStr(&path, "tmp");
+    cpathDupesInit(&dupes);
+    cpathOpenDir(&dir, &path);
+    cpath_traverse(&dir, 0, 1, NULL, cpathDupesVisit, &dupes);
+    cpathCloseDir(&dir);
+    cpathDupesFind(&dupes, 4);
+    cpathDupesFree(&dupes);
+  })
+
+  const cpath_char_t *dotted_path =
+      "/home/build/src/monorepo/./services/payments/../ledger/internal/"
+      "processing/../../api/./v2/generated/protobuf/../../v3/messages/"
+      "settlement/../reconciliation_request_builder_test.cc";
+  OBS_BENCHMARK("Canonicalise (no syscalls)", 100, {
+    cpath path;
+    for (int i = 0; i < 10000; i++) {
+      cpathFromStr(&path, dotted_path);
+      cpathCanonicaliseNoSysCall(&path, &path);
+    }
+  })
+
+  OBS_BENCHMARK("Canonicalise (no syscalls, batch)", 100, {
+    cpath paths[100];
+    for (int i = 0; i < 100; i++) {
+      for (int j = 0; j < 100; j++) cpathFromStr(&paths[j], dotted_path);
+      cpathCanonicaliseNoSysCallBatch(paths, 100, NULL);
+    }
+  })
+
+  OBS_BENCHMARK("Resolve (realpath)", 100, {
+    cpath path, out;
+    for (int i = 1; i < 10; i++) {
+      for (int j = 1; j < 100; j++) {
+        for (int k = 1; k < 10; k++) {
+          cpathFromStr(&path, "tmp");
+          cpathAppendSprintf(&path, "/a%d/b%d/%d.tmp", i, j, k);
+          cpathCanonicalise(&out, &path);
+        }
+      }
+    }
+  })
+
+  OBS_BENCHMARK("Resolve (resolver)", 100, {
+    cpath path, out;
+    cpath_resolver resolver;
+    cpathResolverInit(&resolver);
+    for (int i = 1; i < 10; i++) {
+      for (int j = 1; j < 100; j++) {
+        for (int k = 1; k < 10; k++) {
+          cpathFromStr(&path, "tmp");
+          cpathAppendSprintf(&path, "/a%d/b%d/%d.tmp", i, j, k);
+          cpathResolve(&resolver, &out, &path);
+        }
+      }
+    }
+    cpathResolverFree(&resolver);
+  })
+
+  OBS_BENCHMARK("Glob tmp/*/b1/*.tmp", 100, {
+    cpath_glob glob;
+    cpath_file file;
+    cpathGlobOpen(&glob, NULL, CPATH_STR("tmp/*/b1/*.tmp"));
+    while (cpathGlobNext(&glob, &file)) {
+    }
+    cpathGlobClose(&glob);
+  })
+
+  OBS_BENCHMARK("Glob tmp/**/1.tmp", 100, {
+    cpath_glob glob;
+    cpath_file file;
+    cpathGlobOpen(&glob, NULL, CPATH_STR("tmp/**/1.tmp"));
+    while (cpathGlobNext(&glob, &file)) {
+    }
+    cpathGlobClose(&glob);
+  })
+
+  OBS_BENCHMARK("Recursive Cute Files", 100,
+                { cf_traverse("tmp", print_dir, NULL); })
+
+  OBS_BENCHMARK("Recursive TinyDir", 100, {
+    tinydir_dir dir;
+    if (tinydir_open(&dir, "tmp") == -1) {
+      perror("Error opening file");
+      tinydir_close(&dir);
+      return 0;
+    }
+    recurse(&dir, 0);
+    tinydir_close(&dir);
+  })
+
+// Presuming you have tree installed
+#if !defined _MSC_VER && !defined __MINGW32__
+  OBS_BENCHMARK_SYS("Tree", 100, "tree tmp");
+  OBS_BENCHMARK_SYS("Find", 100, "find tmp");
+  OBS_BENCHMARK_SYS("Python", 100, "python3 ./benchmark_recursive.py ./tmp")
+#endif
+
+  OBS_TEST_GROUP("Visits", {
+    ;
+    OBS_TEST("Emplace no sort", {
+      cpath base = cpathFromUtf8("A");
+      cpath_dir dir;
+      cpathOpenDir(&dir, &base);
+      cpath_file file;
+
+      obs_test_next_file(dir, file, obs_test_match_dir(file, "A/B", "B"),
+                         obs_test_match_file(file, "A/B/b.txt", "b.txt"),
+                         obs_test_match_file(file, "A/a.txt", "a.txt"));
+      cpathCloseDir(&dir);
+    })
+
+    OBS_TEST("Emplace reuses frames", {
+      cpath base = cpathFromUtf8("A");
+      cpath sub = cpathFromUtf8("A/B");
+      cpath_dir dir;
+      cpath_file file;
+      cpath_dir *frames[2] = { NULL, NULL };
+
+      obs_test_true(cpathOpenDir(&dir, &base));
+      obs_test_true(cpathOpenFile(&file, &sub));
+      for (int i = 0; i < 2; i++) {
+        obs_test_true(cpathOpenSubFileEmplace(&dir, &file, 1));
+        obs_test_str_eq(dir.path.buf, "A/B");
+        frames[i] = dir.parent;
+        obs_test_true(cpathRevertEmplaceCopy(&dir));
+        obs_test_str_eq(dir.path.buf, "A");
+        obs_test_true(dir.pool == frames[i]);
+      }
+      obs_test_true(frames[0] != NULL && frames[0] == frames[1]);
+      obs_test_false(cpathRevertEmplaceCopy(&dir));
+      obs_test_true(dir.pool == NULL);
+    })
+  })
+
+#if defined CPATH_GETDENTS
+  OBS_TEST_GROUP("Getdents", {
+    ;
+    OBS_TEST("Small user buffer and restart", {
+      cpath base = cpathFromUtf8("A");
+      cpath_dir dir;
+      cpath_file file;
+      char buf[512];
+      int count = 0;
+
+      obs_test_true(cpathOpenDirBuf(&dir, &base, buf, sizeof(buf)));
+      while (cpathGetNextFile(&dir, &file)) {
+        obs_test_eq(size_t, file.path.len,
+                    base.len + 1 + cpath_str_length(file.name));
+        count++;
+      }
+      obs_test_eq(int, count, 4);
+
+      obs_test_true(cpathRestartDir(&dir));
+      count = 0;
+      while (cpathGetNextFile(&dir, &file)) count++;
+      obs_test_eq(int, count, 4);
+
+      obs_test_true(cpathRestartDir(&dir));
+      obs_test_true(cpathLoadAllFiles(&dir));
+      obs_test_eq(size_t, dir.size, 4);
+      cpathCloseDir(&dir);
+    })
+
+    OBS_TEST("Dir stack reuses buffers", {
+      cpath base = cpathFromUtf8("A");
+      cpath_dir_stack stack;
+      cpath_file file;
+      char *bufs[2] = { NULL, NULL };
+
+      obs_test_true(cpathDirStackOpen(&stack, &base));
+      for (int i = 0; i < 2; i++) {
+        obs_test_true(cpathRestartDir(cpathDirStackTop(&stack)));
+        // . and .. are directories too
+        while (cpathDirStackNext(&stack, &file) &&
+               (!file.isDir || cpathFileIsSpecialHardLink(&file))) {}
+        obs_test_str_eq(file.name, "B");
+        obs_test_true(cpathDirStackPush(&stack, &file));
+        obs_test_str_eq(stack.path.buf, "A/B");
+        bufs[i] = cpathDirStackTop(&stack)->buf;
+        obs_test_false(cpathDirStackTop(&stack)->ownsBuf);
+        obs_test_true(cpathDirStackPop(&stack));
+      }
+      obs_test_true(bufs[0] != NULL && bufs[0] == bufs[1]);
+      cpathDirStackClose(&stack);
+    })
+  })
+#endif
+
+  OBS_TEST_GROUP("Stat Batch", {
+    ;
+    OBS_TEST("Batch matches sequential stat", {
+      cpath base = cpathFromUtf8("A");
+      cpath_dir dir;
+      cpath_stat_batch batch;
+      cpathStatBatchInit(&batch);
+
+      obs_test_true(cpathOpenDir(&dir, &base));
+      obs_test_true(cpathLoadAllFilesStat(&dir, &batch));
+      obs_test_eq(size_t, dir.size, 4);
+      for (size_t i = 0; i < dir.size; i++) {
+        cpath_file file;
+        obs_test_true(dir.files[i].statLoaded);
+        obs_test_true(cpathOpenFile(&file, &dir.files[i].path));
+        obs_test_true(cpathGetFileInfo(&file));
+        obs_test_eq(long, (long)dir.files[i].stat.st_ino,
+                    (long)file.stat.st_ino);
+        obs_test_eq(long, (long)dir.files[i].stat.st_size,
+                    (long)file.stat.st_size);
+        obs_test_eq(int, dir.files[i].isDir, file.isDir);
+        obs_test_eq(int, dir.files[i].isReg, file.isReg);
+      }
+      cpathCloseDir(&dir);
+      cpathStatBatchFree(&batch);
+    })
+
+    OBS_TEST("Traverse with stat", {
+      cpath base = cpathFromUtf8("A");
+      cpath_dir dir;
+      int loaded = 0;
+      obs_test_true(cpathOpenDir(&dir, &base));
+      cpath_traverse_stat(&dir, 0, 1, NULL, stat_loaded_visit, &loaded);
+      cpathCloseDir(&dir);
+      // a.txt, B and b.txt plus the . and .. in both directories
+      obs_test_eq(int, loaded, 7);
+    })
+  })
+
+  OBS_TEST_GROUP("Listing", {
+    ;
+    OBS_TEST("Load all files reads the directory once", {
+      cpath base = cpathFromUtf8("A");
+      cpath_dir dir;
+      memset(&syscalls, 0, sizeof(syscalls));
+      obs_test_true(cpathOpenDir(&dir, &base));
+      obs_test_true(cpathLoadAllFiles(&dir));
+      obs_test_eq(size_t, dir.size, 4);
+      obs_test_eq(int, syscalls.open, 1);
+      obs_test_eq(int, syscalls.rewind, 0);
+      // just the fstat of the directory for a size hint
+      obs_test_eq(int, syscalls.stat, 1);
+      // one read per entry (and one to find the end) at most
+      obs_test_lte(int, syscalls.read, 5);
+      cpathCloseDir(&dir);
+    })
+
+    OBS_TEST("Load and sort a listing", {
+      cpath base = cpathFromUtf8("A");
+      cpath_dir dir;
+      cpath_listing listing;
+      cpath_file file;
+      size_t len;
+      cpathListingInit(&listing);
+
+      obs_test_true(cpathOpenDir(&dir, &base));
+      obs_test_true(cpathListingLoad(&listing, &dir, 0));
+      obs_test_eq(size_t, listing.size, 4);
+      obs_test_true(listing.sizes == NULL);
+      obs_test_true(listing.modes == NULL);
+      obs_test_true(cpathListingSort(&listing, cpathListingCompareName, NULL));
+
+      obs_test_str_eq(cpathListingName(&listing, 0, &len), ".");
+      obs_test_str_eq(cpathListingName(&listing, 1, &len), "..");
+      obs_test_str_eq(cpathListingName(&listing, 2, &len), "B");
+      obs_test_str_eq(cpathListingName(&listing, 3, &len), "a.txt");
+      obs_test_eq(size_t, len, 5);
+      obs_test_eq(int, listing.types[2], CPATH_LISTING_DIR);
+      obs_test_eq(int, listing.types[3], CPATH_LISTING_REG);
+
+      obs_test_true(cpathListingGetFile(&listing, &file, 3));
+      obs_test_str_eq(file.path.buf, "A/a.txt");
+      obs_test_str_eq(file.name, "a.txt");
+      obs_test_str_eq(file.extension, "txt");
+      obs_test_true(file.isReg);
+      obs_test_false(cpathListingGetFile(&listing, &file, 4));
+
+      cpathCloseDir(&dir);
+      cpathListingFree(&listing);
+    })
+
+    OBS_TEST("Listing with stat", {
+      cpath base = cpathFromUtf8("A");
+      cpath_dir dir;
+      cpath_listing listing;
+      cpathListingInit(&listing);
+
+      obs_test_true(cpathOpenDir(&dir, &base));
+      obs_test_true(cpathListingLoad(&listing, &dir, 1));
+      obs_test_true(listing.sizes != NULL);
+      obs_test_true(listing.modes != NULL);
+      memset(&syscalls, 0, sizeof(syscalls));
+      for (size_t i = 0; i < listing.size; i++) {
+        cpath_file file;
+        struct stat st;
+        obs_test_true(cpathListingGetFile(&listing, &file, i));
+        obs_test_true(file.statLoaded);
+        obs_test_eq(long, (long)listing.sizes[i],
+                    (long)cpathGetFileSize(&file));
+        obs_test_eq(long, (long)listing.inodes[i], (long)file.stat.st_ino);
+
+        // everything we kept matches a real stat
+        obs_test_eq(int, lstat(file.path.buf, &st), 0);
+        obs_test_eq(long, (long)file.stat.st_mode, (long)st.st_mode);
+        obs_test_eq(long, (long)file.stat.st_nlink, (long)st.st_nlink);
+        obs_test_eq(long, (long)file.stat.st_dev, (long)st.st_dev);
+        obs_test_eq(long, (long)file.stat.st_mtime, (long)st.st_mtime);
+      }
+      // the stat from loading is kept
+      obs_test_eq(int, syscalls.stat, 0);
+
+      // and dropped again when it isn't wanted
+      cpathCloseDir(&dir);
+      obs_test_true(cpathOpenDir(&dir, &base));
+      obs_test_true(cpathListingLoad(&listing, &dir, 0));
+      obs_test_true(listing.sizes == NULL);
+      obs_test_true(listing.modes == NULL);
+      cpathCloseDir(&dir);
+      cpathListingFree(&listing);
+    })
+
+    OBS_TEST("An entry that can't be stat'd doesn't lose the listing", {
+      cpath base = cpathFromUtf8("listing_gone");
+      cpath_dir dir;
+      cpath_listing listing;
+      cpath_file file;
+      cpathListingInit(&listing);
+
+      mkdir("listing_gone", 0777);
+      write_file("listing_gone/a", "a");
+      write_file("listing_gone/b", "bb");
+      write_file("listing_gone/c", "ccc");
+
+      // the directory has already been read so b is still listed
+      obs_test_true(cpathOpenDir(&dir, &base));
+      unlink("listing_gone/b");
+      obs_test_true(cpathListingLoad(&listing, &dir, 1));
+      obs_test_eq(size_t, listing.size, 5);
+      obs_test_eq(size_t, listing.errors, 1);
+      obs_test_true(cpathListingSort(&listing, cpathListingCompareName, NULL));
+
+      obs_test_str_eq(cpathListingName(&listing, 3, NULL), "b");
+      obs_test_eq(long, (long)listing.sizes[3], 0);
+      obs_test_true(cpathListingGetFile(&listing, &file, 3));
+      obs_test_false(file.statLoaded);
+      obs_test_true(cpathListingGetFile(&listing, &file, 4));
+      obs_test_true(file.statLoaded);
+      obs_test_eq(long, (long)listing.sizes[4], 3);
+
+      cpathCloseDir(&dir);
+      cpathListingFree(&listing);
+      unlink("listing_gone/a");
+      unlink("listing_gone/c");
+      rmdir("listing_gone");
+    })
+  })
+
+  OBS_TEST_GROUP("Dir Stack", {
+    ;
+    OBS_TEST("Dir stack visits everything", {
+      cpath base = cpathFromUtf8("A");
+      cpath_dir_stack stack;
+      cpath_file file;
+      int files = 0;
+      int dirs = 0;
+      size_t maxDepth = 0;
+
+      obs_test_true(cpathDirStackOpen(&stack, &base));
+      do {
+        while (cpathDirStackNext(&stack, &file)) {
+          if (cpathFileIsSpecialHardLink(&file)) continue;
+          if (stack.depth > maxDepth) maxDepth = stack.depth;
+          if (file.isDir) {
+            dirs++;
+            obs_test_str_eq(file.path.buf, "A/B");
+            obs_test_true(cpathDirStackPush(&stack, &file));
+            obs_test_str_eq(stack.path.buf, "A/B");
+          } else {
+            files++;
+            obs_test_true(cpathGetFileInfo(&file));
+          }
+        }
+      } while (cpathDirStackPop(&stack));
+
+      obs_test_eq(int, files, 2);
+      obs_test_eq(int, dirs, 1);
+      obs_test_eq(size_t, maxDepth, 2);
+      obs_test_str_eq(stack.path.buf, "A");
+      cpathDirStackClose(&stack);
+    })
+  })
+
+  OBS_TEST_GROUP("Breadth First", {
+    ;
+    OBS_TEST("Shallow files come first", {
+      cpath base = cpathFromUtf8("A");
+      cpath_bfs bfs;
+      cpath_file file;
+      int n = 0;
+      int depth = 0;
+
+      memset(&syscalls, 0, sizeof(syscalls));
+      obs_test_true(cpathBfsOpen(&bfs, &base, 0));
+      while (cpathBfsNext(&bfs, &file)) {
+        obs_test_true(bfs.depth >= depth);
+        depth = bfs.depth;
+        if (!strcmp(file.name, "b.txt")) obs_test_eq(int, bfs.depth, 1);
+        n++;
+      }
+      cpathBfsClose(&bfs);
+      obs_test_eq(int, n, 3);
+      obs_test_eq(int, syscalls.open, 2);
+    })
+
+    OBS_TEST("Bounded frontier", {
+      cpath base = cpathFromUtf8(".");
+      cpath_bfs bfs;
+      cpath_file file;
+      count_visit count = {PTHREAD_MUTEX_INITIALIZER, 0, 0};
+      cpath_dir dir;
+      int n = 0;
+      size_t frontier = 0;
+      size_t queueCap = 0;
+      size_t deepest = 0;
+
+      obs_test_true(cpathOpenDir(&dir, &base));
+      cpath_traverse(&dir, 0, 1, NULL, count_visit_file, &count);
+      cpathCloseDir(&dir);
+
+      // the frontier only ever has a single directory waiting, the rest
+      // are open (one per level) rather than pending
+      obs_test_true(cpathBfsOpen(&bfs, &base, 1));
+      while (cpathBfsNext(&bfs, &file)) {
+        if (bfs.queue.count - bfs.queue.head > frontier) {
+          frontier = bfs.queue.count - bfs.queue.head;
+        }
+        if (bfs.queue.cap > queueCap) queueCap = bfs.queue.cap;
+        if (bfs.deep.depth > deepest) deepest = bfs.deep.depth;
+        obs_test_eq(int, bfs.depth, count_seps(&file.path) - 1);
+        n++;
+      }
+      cpathBfsClose(&bfs);
+      obs_test_eq(size_t, frontier, 1);
+      // nothing else was ever held on to
+      obs_test_eq(size_t, queueCap, 64);
+      obs_test_true(deepest > 0);
+      obs_test_eq(int, n, count.files + count.dirs);
+    })
+
+    OBS_TEST("Wide directories stay bounded", {
+      cpath base = cpathFromUtf8("bfs_wide");
+      cpath_bfs bfs;
+      cpath_file file;
+      char name[64];
+      int dirs = 0;
+      int files = 0;
+      size_t pending = 0;
+
+      mkdir("bfs_wide", 0777);
+      for (int i = 0; i < 300; i++) {
+        sprintf(name, "bfs_wide/d%d", i);
+        mkdir(name, 0777);
+        sprintf(name, "bfs_wide/d%d/f", i);
+        write_file(name, "");
+      }
+
+      obs_test_true(cpathBfsOpen(&bfs, &base, 8));
+      while (cpathBfsNext(&bfs, &file)) {
+        size_t now = bfs.queue.count - bfs.queue.head;
+        if (now > pending) pending = now;
+        obs_test_lte(size_t, bfs.deep.depth, 1);
+        if (file.isDir) dirs++;
+        else files++;
+      }
+      cpathBfsClose(&bfs);
+      obs_test_eq(size_t, pending, 8);
+      obs_test_eq(int, dirs, 300);
+      obs_test_eq(int, files, 300);
+
+      for (int i = 0; i < 300; i++) {
+        sprintf(name, "bfs_wide/d%d/f", i);
+        unlink(name);
+        sprintf(name, "bfs_wide/d%d", i);
+        rmdir(name);
+      }
+      rmdir("bfs_wide");
+    })
+  })
+
+  OBS_TEST_GROUP("Checkpoint", {
+    ;
+    OBS_TEST("Resume where we left off", {
+      cpath base = cpathFromUtf8("A");
+      cpath_dir dir;
+      cpath_file file;
+      unsigned char buf[1024];
+      size_t len;
+      int seen = 0;
+
+      // stop as soon as we get into B
+      obs_test_true(cpathOpenDir(&dir, &base));
+      while (cpathGetNextFile(&dir, &file)) {
+        if (cpathFileIsSpecialHardLink(&file)) continue;
+        seen++;
+        if (file.isDir) {
+          obs_test_true(cpathOpenSubFileEmplace(&dir, &file, 1));
+          break;
+        }
+      }
+      obs_test_true(cpathCheckpointSave(&dir, NULL, 0, &len));
+      obs_test_false(cpathCheckpointSave(&dir, buf, 4, &len));
+      obs_test_eq(int, errno, ERANGE);
+      obs_test_true(cpathCheckpointSave(&dir, buf, sizeof(buf), &len));
+      while (cpathRevertEmplaceCopy(&dir)) {
+      }
+
+      obs_test_false(cpathCheckpointResume(&dir, buf, 4));
+      obs_test_true(cpathCheckpointResume(&dir, buf, len));
+      obs_test_str_eq(dir.path.buf, "A/B");
+      do {
+        while (cpathGetNextFile(&dir, &file)) {
+          if (cpathFileIsSpecialHardLink(&file)) continue;
+          seen++;
+          if (file.isDir) cpathOpenSubFileEmplace(&dir, &file, 1);
+        }
+      } while (cpathRevertEmplaceCopy(&dir));
+      // a.txt, B and b.txt each exactly once
+      obs_test_eq(int, seen, 3);
+    })
+  })
+
+  OBS_TEST_GROUP("Snapshot", {
+    ;
+    OBS_TEST("Rescan only reads what changed", {
+      cpath base = cpathFromUtf8("snap_tree");
+      cpath_snapshot first, second, third;
+      cpath_snapshot_changes changes;
+      struct utimbuf old;
+      cpath path;
+
+      mkdir("snap_tree", 0777);
+      mkdir("snap_tree/x", 0777);
+      mkdir("snap_tree/y", 0777);
+      write_file("snap_tree/x/1.txt", "");
+      // otherwise they are too recent to trust
+      old.actime = old.modtime = time(NULL) - 1000;
+      utime("snap_tree", &old);
+      utime("snap_tree/x", &old);
+      utime("snap_tree/y", &old);
+
+      obs_test_true(cpathSnapshotScan(&first, &base, NULL, NULL));
+      obs_test_eq(size_t, first.count, 4);
+      obs_test_eq(size_t, first.dirCount, 3);
+      obs_test_eq(size_t, first.listed, 3);
+
+      // nothing has changed so nothing is read
+      cpathSnapshotChangesInit(&changes);
+      memset(&syscalls, 0, sizeof(syscalls));
+      obs_test_true(cpathSnapshotScan(&second, &base, &first, &changes));
+      obs_test_eq(size_t, second.count, 4);
+      obs_test_eq(size_t, second.listed, 0);
+      obs_test_eq(int, syscalls.open, 0);
+      obs_test_eq(size_t, changes.count, 0);
+
+      write_file("snap_tree/y/new.txt", "");
+      unlink("snap_tree/x/1.txt");
+      obs_test_true(cpathSnapshotScan(&third, &base, &second, &changes));
+      obs_test_eq(size_t, third.count, 4);
+      obs_test_eq(size_t, third.listed, 2);
+      obs_test_eq(size_t, changes.count, 2);
+      for (size_t i = 0; i < changes.count; i++) {
+        cpath_snapshot_change *change = &changes.items[i];
+        if (change->kind == CPATH_SNAPSHOT_ADDED) {
+          obs_test_true(cpathSnapshotPath(&third, change->entry, &path));
+          obs_test_str_eq(path.buf, "snap_tree/y/new.txt");
+        } else {
+          obs_test_true(cpathSnapshotPath(&second, change->entry, &path));
+          obs_test_str_eq(path.buf, "snap_tree/x/1.txt");
+        }
+      }
+
+      cpathSnapshotChangesFree(&changes);
+      cpathSnapshotFree(&first);
+      cpathSnapshotFree(&second);
+      cpathSnapshotFree(&third);
+      unlink("snap_tree/y/new.txt");
+      rmdir("snap_tree/x");
+      rmdir("snap_tree/y");
+      rmdir("snap_tree");
+    })
+  })
+
+  OBS_TEST_GROUP("Index", {
+    ;
+    OBS_TEST("List a tree from its index without touching it", {
+      cpath base = cpathFromUtf8("A");
+      cpath out = cpathFromUtf8("index_test.idx");
+      cpath sub = cpathFromUtf8("A/B");
+      cpath missing = cpathFromUtf8("A/C");
+      cpath_index_builder builder;
+      cpath_index index;
+      cpath_index_dir dir;
+      cpath_dir tree;
+      cpath_file file;
+
+      obs_test_true(cpathIndexBuilderInit(&builder, &base));
+      obs_test_true(cpathOpenDir(&tree, &base));
+      cpath_traverse(&tree, 0, 1, NULL, cpathIndexBuilderVisit, &builder);
+      cpathCloseDir(&tree);
+      obs_test_eq(size_t, builder.count, 4);
+      obs_test_true(cpathIndexBuilderWrite(&builder, &out));
+      cpathIndexBuilderFree(&builder);
+
+      obs_test_true(cpathIndexOpen(&index, &out));
+      obs_test_eq(size_t, (size_t)index.count, 4);
+      memset(&syscalls, 0, sizeof(syscalls));
+
+      // children come back sorted by name
+      obs_test_true(cpathIndexOpenDir(&dir, &index, &base));
+      obs_test_true(cpathIndexGetNextFile(&dir, &file));
+      obs_test_str_eq(file.name, "B");
+      obs_test_str_eq(file.path.buf, "A/B");
+      obs_test_true(file.isDir);
+      obs_test_true(cpathIndexGetNextFile(&dir, &file));
+      obs_test_str_eq(file.name, "a.txt");
+      obs_test_str_eq(file.extension, "txt");
+      obs_test_true(file.isReg);
+      obs_test_true(file.statLoaded);
+      obs_test_false(cpathIndexGetNextFile(&dir, &file));
+
+      obs_test_true(cpathIndexOpenDir(&dir, &index, &sub));
+      obs_test_true(cpathIndexGetNextFile(&dir, &file));
+      obs_test_str_eq(file.path.buf, "A/B/b.txt");
+      obs_test_false(cpathIndexGetNextFile(&dir, &file));
+      obs_test_true(cpathIndexFind(&index, &missing) == CPATH_INDEX_NONE);
+      obs_test_eq(int, syscalls.open, 0);
+      obs_test_eq(int, syscalls.stat, 0);
+
+      cpathIndexClose(&index);
+      unlink("index_test.idx");
+    })
+
+    OBS_TEST("Rewriting an index leaves open ones alone", {
+      cpath base = cpathFromUtf8("A");
+      cpath sub = cpathFromUtf8("A/B");
+      cpath out = cpathFromUtf8("index_rewrite.idx");
+      cpath_index_builder builder;
+      cpath_index before;
+      cpath_index after;
+      cpath_index_dir dir;
+      cpath_dir tree;
+      cpath_file file;
+      char tmp[64];
+
+      obs_test_true(cpathIndexBuilderInit(&builder, &base));
+      obs_test_true(cpathOpenDir(&tree, &base));
+      cpath_traverse(&tree, 0, 1, NULL, cpathIndexBuilderVisit, &builder);
+      cpathCloseDir(&tree);
+      obs_test_true(cpathIndexBuilderWrite(&builder, &out));
+      cpathIndexBuilderFree(&builder);
+      obs_test_true(cpathIndexOpen(&before, &out));
+
+      // a smaller index over the top of the one that's open
+      obs_test_true(cpathIndexBuilderInit(&builder, &sub));
+      obs_test_true(cpathOpenDir(&tree, &sub));
+      cpath_traverse(&tree, 0, 1, NULL, cpathIndexBuilderVisit, &builder);
+      cpathCloseDir(&tree);
+      obs_test_true(cpathIndexBuilderWrite(&builder, &out));
+      cpathIndexBuilderFree(&builder);
+
+      obs_test_eq(size_t, (size_t)before.count, 4);
+      obs_test_true(cpathIndexOpenDir(&dir, &before, &base));
+      obs_test_true(cpathIndexGetNextFile(&dir, &file));
+      obs_test_str_eq(file.name, "B");
+      obs_test_true(cpathIndexGetNextFile(&dir, &file));
+      obs_test_str_eq(file.name, "a.txt");
+      obs_test_false(cpathIndexGetNextFile(&dir, &file));
+
+      obs_test_true(cpathIndexOpen(&after, &out));
+      obs_test_eq(size_t, (size_t)after.count, 2);
+      obs_test_true(cpathIndexOpenDir(&dir, &after, &sub));
+      obs_test_true(cpathIndexGetNextFile(&dir, &file));
+      obs_test_str_eq(file.path.buf, "A/B/b.txt");
+
+      // and nothing is left next to it
+      snprintf(tmp, sizeof(tmp), "index_rewrite.idx.%d.tmp", (int)getpid());
+      obs_test_neq(int, access(tmp, F_OK), 0);
+
+      cpathIndexClose(&before);
+      cpathIndexClose(&after);
+      unlink("index_rewrite.idx");
+    })
+
+    OBS_TEST("Reject a file that isn't an index", {
+      cpath path = cpathFromUtf8("index_bad.idx");
+      cpath_index index;
+      write_file("index_bad.idx", "CPATHIDX but not really an index at all");
+      obs_test_false(cpathIndexOpen(&index, &path));
+      obs_test_eq(int, errno, EINVAL);
+      unlink("index_bad.idx");
+    })
+
+    OBS_TEST("Reject offsets that wrap around", {
+      cpath path = cpathFromUtf8("index_wrap.idx");
+      cpath_index index;
+      unsigned char bytes[sizeof(cpath_index_header) + 64];
+      cpath_index_header header;
+
+      // every column lands in the file once parents + 8 wraps to 0
+      memset(bytes, 0, sizeof(bytes));
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, "CPATHIDX", 8);
+      header.version = _CPATH_INDEX_VERSION;
+      header.charSize = sizeof(cpath_char_t);
+      header.count = 1;
+      header.parents = UINT64_MAX - 7;
+      header.first = 0;
+      header.counts = 8;
+      header.sizes = 16;
+      header.mtimes = 24;
+      header.blocks = 32;
+      header.types = 40;
+      header.names = 41;
+      memcpy(bytes, &header, sizeof(header));
+      write_bytes("index_wrap.idx", bytes, sizeof(bytes));
+
+      obs_test_false(cpathIndexOpen(&index, &path));
+      obs_test_eq(int, errno, EINVAL);
+      unlink("index_wrap.idx");
+    })
+  })
+
+  OBS_TEST_GROUP("Watch", {
+    ;
+    OBS_TEST("Follow creates, deletes, renames and writes", {
+      cpath base = cpathFromUtf8("watch_tree");
+      cpath path;
+      cpath_watch watch;
+      cpath_watch_dir dir;
+      cpath_file file;
+      char name[64];
+      size_t seen = 0;
+
+      mkdir("watch_tree", 0777);
+      mkdir("watch_tree/a", 0777);
+      write_file("watch_tree/a/1.txt", "");
+      obs_test_true(cpathWatchOpen(&watch, &base));
+      obs_test_eq(size_t, watch.count, 3);
+
+      // lots of churn, including a directory filled before we see it
+      for (int i = 0; i < 200; i++) {
+        sprintf(name, "watch_tree/a/f%d.txt", i);
+        write_file(name, "");
+      }
+      for (int i = 0; i < 200; i += 2) {
+        sprintf(name, "watch_tree/a/f%d.txt", i);
+        unlink(name);
+      }
+      mkdir("watch_tree/b", 0777);
+      mkdir("watch_tree/b/c", 0777);
+      write_file("watch_tree/b/c/2.txt", "hello");
+      rename("watch_tree/a/1.txt", "watch_tree/b/1.txt");
+      rename("watch_tree/b", "watch_tree/d");
+      write_file("watch_tree/d/c/2.txt", "hello world");
+      obs_test_true(cpathWatchUpdate(&watch, 0));
+
+      // root, a, 100 files, d, d/1.txt, d/c and d/c/2.txt
+      obs_test_eq(size_t, watch.count, 106);
+      obs_test_eq(size_t, watch.rescans, 0);
+      memset(&syscalls, 0, sizeof(syscalls));
+      path = cpathFromUtf8("watch_tree/d/c/2.txt");
+      obs_test_true(cpathWatchOpenFile(&file, &watch, &path));
+      obs_test_eq(size_t, (size_t)file.stat.st_size, 11);
+      path = cpathFromUtf8("watch_tree/b");
+      obs_test_false(cpathWatchOpenFile(&file, &watch, &path));
+      path = cpathFromUtf8("watch_tree/d");
+      obs_test_true(cpathWatchOpenDir(&dir, &watch, &path));
+      while (cpathWatchGetNextFile(&dir, &file)) {
+        if (file.isDir) obs_test_str_eq(file.path.buf, "watch_tree/d/c");
+        else obs_test_str_eq(file.path.buf, "watch_tree/d/1.txt");
+        seen++;
+      }
+      obs_test_eq(size_t, seen, 2);
+      obs_test_eq(int, syscalls.open, 0);
+      obs_test_eq(int, syscalls.stat, 0);
+
+      // and the watches followed the directory when it was renamed
+      write_file("watch_tree/d/c/3.txt", "");
+      obs_test_true(cpathWatchUpdate(&watch, 0));
+      path = cpathFromUtf8("watch_tree/d/c/3.txt");
+      obs_test_true(cpathWatchOpenFile(&file, &watch, &path));
+
+      cpathWatchClose(&watch);
+      for (int i = 1; i < 200; i += 2) {
+        sprintf(name, "watch_tree/a/f%d.txt", i);
+        unlink(name);
+      }
+      unlink("watch_tree/d/1.txt");
+      unlink("watch_tree/d/c/2.txt");
+      unlink("watch_tree/d/c/3.txt");
+      rmdir("watch_tree/d/c");
+      rmdir("watch_tree/d");
+      rmdir("watch_tree/a");
+      rmdir("watch_tree");
+    })
+
+    OBS_TEST("Rescan after missing events", {
+      cpath base = cpathFromUtf8("watch_tree");
+      cpath sub = cpathFromUtf8("watch_tree/a");
+      cpath path = cpathFromUtf8("watch_tree/a/new.txt");
+      cpath_watch watch;
+      cpath_file file;
+      char buf[4096];
+
+      mkdir("watch_tree", 0777);
+      mkdir("watch_tree/a", 0777);
+      write_file("watch_tree/a/old.txt", "");
+      obs_test_true(cpathWatchOpen(&watch, &base));
+
+      write_file("watch_tree/a/new.txt", "");
+      unlink("watch_tree/a/old.txt");
+      // throw the events away like an overflow would
+      while (read(watch.fd, buf, sizeof(buf)) > 0) {
+      }
+      obs_test_true(cpathWatchUpdate(&watch, 0));
+      obs_test_false(cpathWatchOpenFile(&file, &watch, &path));
+
+      obs_test_true(cpathWatchRescan(&watch, &sub));
+      obs_test_true(cpathWatchOpenFile(&file, &watch, &path));
+      path = cpathFromUtf8("watch_tree/a/old.txt");
+      obs_test_false(cpathWatchOpenFile(&file, &watch, &path));
+      obs_test_eq(size_t, watch.count, 3);
+
+      cpathWatchClose(&watch);
+      unlink("watch_tree/a/new.txt");
+      rmdir("watch_tree/a");
+      rmdir("watch_tree");
+    })
+
+    OBS_TEST("Entries that can't be loaded don't end the scan", {
+      cpath base = cpathFromUtf8("deep_tree");
+      cpath_dir dir;
+      cpath_watch watch;
+      count_visit count = {PTHREAD_MUTEX_INITIALIZER, 0, 0};
+
+      make_deep_tree();
+      obs_test_true(cpathOpenDir(&dir, &base));
+      cpath_traverse_ex(&dir, 0, NULL, NULL, count_visit_file, &count);
+      cpathCloseDir(&dir);
+
+      // every file next to the directory that is too long is still there
+      obs_test_true(cpathWatchOpen(&watch, &base));
+      obs_test_eq(size_t, watch.count, 1 + count.dirs + count.files);
+      obs_test_eq(int, count.files, count.dirs * DEEP_TREE_FILES);
+      obs_test_true(cpathWatchRescan(&watch, &base));
+      obs_test_eq(size_t, watch.count, 1 + count.dirs + count.files);
+      cpathWatchClose(&watch);
+      remove_deep_tree();
+    })
+  })
+
+  OBS_TEST_GROUP("Traverse Options", {
+    ;
+    OBS_TEST("Paths that are too long are skipped", {
+      cpath base = cpathFromUtf8("deep_tree");
+      cpath_dir dir;
+      cpath_traverse_opts opts;
+      count_visit count = {PTHREAD_MUTEX_INITIALIZER, 0, 0};
+
+      make_deep_tree();
+      cpathTraverseOptsInit(&opts);
+      errors_seen = 0;
+      obs_test_true(cpathOpenDir(&dir, &base));
+      obs_test_true(cpath_traverse_ex(&dir, 0, &opts, count_err,
+                                      count_visit_file, &count));
+      cpathCloseDir(&dir);
+      // just the one entry that doesn't fit
+      obs_test_eq(int, errors_seen, 1);
+      obs_test_lt(int, count.dirs, DEEP_TREE_LEVELS);
+      remove_deep_tree();
+    })
+
+    OBS_TEST("Skipped directories are never opened", {
+      cpath base = cpathFromUtf8("A");
+      cpath_dir dir;
+      cpath_traverse_opts opts;
+      const cpath_char_t *skip[] = {CPATH_STR(".git"), CPATH_STR("B")};
+      count_visit count = {PTHREAD_MUTEX_INITIALIZER, 0, 0};
+
+      cpathTraverseOptsInit(&opts);
+      opts.skipNames = skip;
+      opts.skipNamesCount = 2;
+      memset(&syscalls, 0, sizeof(syscalls));
+      obs_test_true(cpathOpenDir(&dir, &base));
+      obs_test_true(cpath_traverse_ex(&dir, 0, &opts, NULL, count_visit_file,
+                                      &count));
+      cpathCloseDir(&dir);
+      obs_test_eq(int, count.files, 1);
+      obs_test_eq(int, count.dirs, 0);
+      obs_test_eq(int, syscalls.open, 1);
 
-void recurse(tinydir_dir *dir, int tab) {
-  tinydir_file file;
-  while (dir->has_next) {
-    if (tinydir_readfile(dir, &file) == -1) {
-      perror("Error getting file");
-      tinydir_close(dir);
-      return;
-    }
+      // the same through a prune
+      cpathTraverseOptsInit(&opts);
+      opts.prune = prune_b;
+      count.files = count.dirs = 0;
+      memset(&syscalls, 0, sizeof(syscalls));
+      obs_test_true(cpathOpenDir(&dir, &base));
+      obs_test_true(cpath_traverse_ex(&dir, 0, &opts, NULL, count_visit_file,
+                                      &count));
+      cpathCloseDir(&dir);
+      obs_test_eq(int, count.files, 1);
+      obs_test_eq(int, count.dirs, 0);
+      obs_test_eq(int, syscalls.open, 1);
 
-    puts(file.name);
-    if (file.is_dir && _tinydir_strcmp(file.name, ".") &&
-        _tinydir_strcmp(file.name, "..")) {
-      tinydir_dir tmp;
-      tinydir_open(&tmp, file.path);
-      recurse(&tmp, tab + 1);
-      tinydir_close(&tmp);
-    }
+      // B is given but not opened
+      cpathTraverseOptsInit(&opts);
+      opts.maxDepth = 0;
+      count.files = count.dirs = 0;
+      memset(&syscalls, 0, sizeof(syscalls));
+      obs_test_true(cpathOpenDir(&dir, &base));
+      obs_test_true(cpath_traverse_ex(&dir, 0, &opts, NULL, count_visit_file,
+                                      &count));
+      cpathCloseDir(&dir);
+      obs_test_eq(int, count.files, 1);
+      obs_test_eq(int, count.dirs, 1);
+      obs_test_eq(int, syscalls.open, 1);
+    })
 
-    if (tinydir_next(dir) == -1) {
-      perror("Error getting file");
-      tinydir_close(dir);
-      return;
-    }
-  }
-}
+    OBS_TEST("Extensions and max entries", {
+      cpath base = cpathFromUtf8("A");
+      cpath_dir dir;
+      cpath_traverse_opts opts;
+      const cpath_char_t *exts[] = {CPATH_STR("c"), CPATH_STR("txt")};
+      count_visit count = {PTHREAD_MUTEX_INITIALIZER, 0, 0};
 
-void emplace(cpath_dir *dir) {
-  cpath_file file;
-  int tab = 0;
+      cpathTraverseOptsInit(&opts);
+      opts.extensions = exts;
+      opts.extensionsCount = 2;
+      obs_test_true(cpathOpenDir(&dir, &base));
+      obs_test_true(cpath_traverse_ex(&dir, 0, &opts, NULL, count_visit_file,
+                                      &count));
+      cpathCloseDir(&dir);
+      obs_test_eq(int, count.files, 2);
+      obs_test_eq(int, count.dirs, 0);
 
-  while (dir != NULL) {
-    while (cpathGetNextFile(dir, &file)) {
-      for (int i = 0; i < tab; i++)
-        putchar('\t');
-      printf("%s\n", file.name);
-      if (file.isDir && !cpathFileIsSpecialHardLink(&file)) {
-        cpathOpenSubFileEmplace(dir, &file, 1);
-        tab++;
-      }
-    }
-    cpathRevertEmplace(&dir);
-    tab--;
-  }
-}
+      opts.maxEntries = 1;
+      count.files = 0;
+      obs_test_true(cpathOpenDir(&dir, &base));
+      obs_test_false(cpath_traverse_ex(&dir, 0, &opts, NULL, count_visit_file,
+                                       &count));
+      cpathCloseDir(&dir);
+      obs_test_eq(int, count.files, 1);
+    })
 
-int main(int argc, char *argv[]) {
-  OBS_SETUP("CPath", argc, argv);
+    OBS_TEST("Following links visits each directory once", {
+      cpath base = cpathFromUtf8("follow_tree");
+      cpath_dir dir;
+      cpath_traverse_opts opts;
+      count_visit count = {PTHREAD_MUTEX_INITIALIZER, 0, 0};
 
-  // we have to generate the files
-  if (has_benchmarks) {
-    cpath path = cpathFromUtf8("tmp");
-    cpathMkdir(&path);
-    for (cpath_char_t i = 1; i < 10; i++) {
-      cpathAppendSprintf(&path, "/a%d", i);
-      cpathMkdir(&path);
-      for (cpath_char_t j = 1; j < 100; j++) {
-        cpathAppendSprintf(&path, "/b%d", j);
-        cpathMkdir(&path);
-        for (cpath_char_t k = 1; k < 50; k++) {
-          cpathAppendSprintf(&path, "/%d.tmp", k);
-          FILE *f = cpathOpen(&path, CPATH_STR("w"));
-          fclose(f);
-          cpathUpDir(&path);
-        }
-        cpathUpDir(&path);
+      mkdir("follow_tree", 0777);
+      mkdir("follow_tree/sub", 0777);
+      obs_test_eq(int, symlink("..", "follow_tree/sub/up"), 0);
+      obs_test_eq(int, symlink("sub", "follow_tree/link"), 0);
+      obs_test_eq(int, symlink("missing", "follow_tree/broken"), 0);
+
+      // links are just files when we don't follow them
+      cpathTraverseOptsInit(&opts);
+      obs_test_true(cpathOpenDir(&dir, &base));
+      obs_test_true(cpath_traverse_ex(&dir, 0, &opts, NULL, count_visit_file,
+                                      &count));
+      cpathCloseDir(&dir);
+      obs_test_eq(int, count.dirs, 1);
+      obs_test_eq(int, count.files, 3);
+
+      // up loops back to the root and link is sub again so neither is opened
+      opts.followLinks = 1;
+      count.files = count.dirs = 0;
+      memset(&syscalls, 0, sizeof(syscalls));
+      obs_test_true(cpathOpenDir(&dir, &base));
+      obs_test_true(cpath_traverse_ex(&dir, 0, &opts, NULL, count_visit_file,
+                                      &count));
+      cpathCloseDir(&dir);
+      obs_test_eq(int, count.dirs, 3);
+      obs_test_eq(int, count.files, 1);
+      obs_test_eq(int, syscalls.open, 2);
+
+      unlink("follow_tree/sub/up");
+      unlink("follow_tree/link");
+      unlink("follow_tree/broken");
+      rmdir("follow_tree/sub");
+      rmdir("follow_tree");
+    })
+
+    OBS_TEST("Visited set", {
+      cpath_visited set;
+      int added;
+      cpathVisitedInit(&set);
+      for (uint64_t i = 0; i < 1000; i++) {
+        obs_test_true(cpathVisitedAdd(&set, i % 3, i, &added));
+        obs_test_true(added);
       }
-      cpathUpDir(&path);
-    }
-  }
+      for (uint64_t i = 0; i < 1000; i++) {
+        obs_test_true(cpathVisitedAdd(&set, i % 3, i, &added));
+        obs_test_false(added);
+      }
+      obs_test_true(cpathVisitedAdd(&set, 1, 0, &added));
+      obs_test_true(added);
+      cpathVisitedFree(&set);
+    })
 
-  OBS_BENCHMARK("Stack CPath", 100, {
-    cpath_dir dir;
-    cpath path;
-    cpathFromStr(&path, "tmp");
-    cpathOpenDir(&dir, &path);
-    emplace(&dir);
+    OBS_TEST("Mount points", {
+      cpath_mounts mounts;
+      cpath_traverse_opts opts;
+      cpath_dir dir;
+      mount_check check = {0, 0};
+      count_visit count = {PTHREAD_MUTEX_INITIALIZER, 0, 0};
+      struct stat st;
+
+      obs_test_true(cpathMountsLoad(&mounts));
+      obs_test_true(mounts.count > 0);
+      obs_test_eq(int, stat("/", &st), 0);
+      const cpath_mount *root = cpathMountsFind(&mounts, st.st_dev);
+      obs_test_true(root != NULL);
+
+      // every mount under /dev (like /dev/pts) is found and skipped
+      cpath base = cpathFromUtf8("/dev");
+      cpathTraverseOptsInit(&opts);
+      opts.mountPolicy = check_mount;
+      opts.mounts = &mounts;
+      obs_test_true(cpathOpenDir(&dir, &base));
+      obs_test_true(cpath_traverse_ex(&dir, 0, &opts, NULL, NULL, &check));
+      cpathCloseDir(&dir);
+      obs_test_eq(int, check.calls, check.matched);
+      cpathMountsFree(&mounts);
+
+      // nothing in the tests crosses a device
+      base = cpathFromUtf8("A");
+      cpathTraverseOptsInit(&opts);
+      opts.sameDevice = 1;
+      obs_test_true(cpathOpenDir(&dir, &base));
+      obs_test_true(cpath_traverse_ex(&dir, 0, &opts, NULL, count_visit_file,
+                                      &count));
+      cpathCloseDir(&dir);
+      obs_test_eq(int, count.files, 2);
+      obs_test_eq(int, count.dirs, 1);
+    })
   })
 
-  OBS_BENCHMARK("Recursive CPath", 100, {
-    cpath_dir dir;
-    cpath path;
-    cpathFromStr(&path, "tmp");
-    cpathOpenDir(&dir, &path);
-    recursive_visit(&dir, 0);
+  OBS_TEST_GROUP("Traverse At", {
+    ;
+    OBS_TEST("Entries match cpath_traverse", {
+      cpath base = cpathFromUtf8("A");
+      cpath_dir dir;
+      count_visit serial = {PTHREAD_MUTEX_INITIALIZER, 0, 0};
+      int found = 0;
+      obs_test_true(cpathOpenDir(&dir, &base));
+      cpath_traverse(&dir, 0, 1, NULL, count_visit_file, &serial);
+      obs_test_true(cpathRestartDir(&dir));
+      cpath_traverse_at(&dir, 0, 1, NULL, at_path_visit, &found);
+      cpathCloseDir(&dir);
+      // a.txt and B/b.txt
+      obs_test_eq(int, found, 2);
+      obs_test_eq(int, serial.files, 2);
+    })
+
+    OBS_TEST("Open dir relative to parent", {
+      cpath base = cpathFromUtf8("A");
+      cpath_dir dir, sub;
+      size_t len = 0;
+      int found = 0;
+      const cpath_char_t *name;
+      obs_test_true(cpathOpenDir(&dir, &base));
+      obs_test_true(cpathOpenDirAt(&sub, &dir, "B"));
+      while ((name = cpathPeekNextName(&sub, &len)) != NULL) {
+        if (len == 5 && strcmp(name, "b.txt") == 0) found++;
+        cpathMoveNextFile(&sub);
+      }
+      obs_test_eq(int, found, 1);
+      obs_test_true(cpathRestartDir(&sub));
+      obs_test_true(cpathLoadAllFiles(&sub));
+      obs_test_eq(size_t, sub.size, 3);
+      cpathCloseDir(&sub);
+      cpathCloseDir(&dir);
+    })
+
+    OBS_TEST("Unknown types are stat'd relative to the parent", {
+      cpath base = cpathFromUtf8("A");
+      cpath_dir dir, sub;
+      cpath_file file;
+      size_t len = 0;
+      const cpath_char_t *name;
+      obs_test_true(cpathOpenDir(&dir, &base));
+      obs_test_true(cpathOpenDirAt(&sub, &dir, "B"));
+      while ((name = cpathPeekNextName(&sub, &len)) != NULL &&
+             strcmp(name, "b.txt") != 0) {
+        cpathMoveNextFile(&sub);
+      }
+      obs_test_true(name != NULL);
+
+      // like a filesystem that doesn't fill in d_type, there is no b.txt
+      // in the CWD so this only works if it is stat'd through B
+      sub.dirent->d_type = DT_UNKNOWN;
+      memset(&syscalls, 0, sizeof(syscalls));
+      obs_test_true(cpathGetNextFile(&sub, &file));
+      obs_test_str_eq(file.name, "b.txt");
+      obs_test_true(file.isReg);
+      obs_test_true(file.statLoaded);
+      obs_test_eq(int, syscalls.stat, 1);
+      cpathCloseDir(&sub);
+      cpathCloseDir(&dir);
+    })
   })
 
-  OBS_BENCHMARK("Recursive Cute Files", 100,
-                { cf_traverse("tmp", print_dir, NULL); })
+  OBS_TEST_GROUP("Parallel", {
+    ;
+    OBS_TEST("Parallel visits everything", {
+      cpath base = cpathFromUtf8("A");
+      cpath_dir dir;
+      count_visit serial = {PTHREAD_MUTEX_INITIALIZER, 0, 0};
+      count_visit parallel = {PTHREAD_MUTEX_INITIALIZER, 0, 0};
 
-  OBS_BENCHMARK("Recursive TinyDir", 100, {
-    tinydir_dir dir;
-    if (tinydir_open(&dir, "tmp") == -1) {
-      perror("Error opening file");
-      tinydir_close(&dir);
-      return 0;
-    }
-    recurse(&dir, 0);
-    tinydir_close(&dir);
+      obs_test_true(cpathOpenDir(&dir, &base));
+      cpath_traverse(&dir, 0, 1, NULL, count_visit_file, &serial);
+      cpathCloseDir(&dir);
+
+      obs_test_true(cpathOpenDir(&dir, &base));
+      cpath_traverse_parallel(&dir, 0, 1, NULL, count_visit_file, &parallel, 4);
+      cpathCloseDir(&dir);
+
+      obs_test_eq(int, serial.files, 2);
+      obs_test_eq(int, serial.dirs, 1);
+      obs_test_eq(int, parallel.files, serial.files);
+      obs_test_eq(int, parallel.dirs, serial.dirs);
+    })
   })
 
-// Presuming you have tree installed
-#if !defined _MSC_VER && !defined __MINGW32__
-  OBS_BENCHMARK_SYS("Tree", 100, "tree tmp");
-  OBS_BENCHMARK_SYS("Find", 100, "find tmp");
-  OBS_BENCHMARK_SYS("Python", 100, "python3 ./benchmark_recursive.py ./tmp")
-#endif
+  OBS_TEST_GROUP("Disk Usage", {
+    ;
+    OBS_TEST("Totals per directory counting hardlinks once", {
+      cpath base = cpathFromUtf8("du_tree");
+      cpath path;
+      cpath_du du;
+      struct stat root, a, b;
+      size_t sub = CPATH_DU_NONE;
 
-  OBS_TEST_GROUP("Visits", {
+      mkdir("du_tree", 0777);
+      mkdir("du_tree/a", 0777);
+      mkdir("du_tree/a/b", 0777);
+      write_file("du_tree/1.txt", "12345");
+      write_file("du_tree/a/2.txt", "1234567890");
+      write_file("du_tree/a/b/3.txt", "123");
+      link("du_tree/a/2.txt", "du_tree/a/b/link.txt");
+
+      obs_test_true(cpathDuScan(&du, &base, 4));
+      obs_test_eq(size_t, du.count, 3);
+      obs_test_eq(size_t, du.hardlinks, 1);
+      obs_test_eq(size_t, du.errors, 0);
+      for (size_t i = 0; i < du.count; i++) {
+        if (du.nodes[i].depth == 1) sub = i;
+      }
+      obs_test_neq(size_t, sub, CPATH_DU_NONE);
+      obs_test_true(cpathDuPath(&du, sub, &path));
+      obs_test_str_eq(path.buf, "du_tree/a");
+
+      // directories count their own size too
+      stat("du_tree", &root);
+      stat("du_tree/a", &a);
+      stat("du_tree/a/b", &b);
+      obs_test_eq(size_t, (size_t)du.nodes[0].files, 1);
+      obs_test_eq(size_t, (size_t)du.nodes[0].totalFiles, 3);
+      obs_test_eq(size_t, (size_t)du.nodes[0].size, (size_t)root.st_size + 5);
+      obs_test_eq(size_t, (size_t)du.nodes[sub].totalSize,
+                  (size_t)(a.st_size + b.st_size) + 13);
+      obs_test_eq(size_t, (size_t)du.nodes[0].totalSize,
+                  (size_t)(root.st_size + a.st_size + b.st_size) + 18);
+      cpathDuFree(&du);
+
+      unlink("du_tree/a/b/link.txt");
+      unlink("du_tree/a/b/3.txt");
+      unlink("du_tree/a/2.txt");
+      unlink("du_tree/1.txt");
+      rmdir("du_tree/a/b");
+      rmdir("du_tree/a");
+      rmdir("du_tree");
+    })
+
+    OBS_TEST("Format totals", {
+      obs_test_str_eq(cpathGetSizeSuffix(2048, BYTE_REP_IEC), "KiB");
+      obs_test_true(cpathGetSizeDec(2048, 1024) == 2.0);
+      obs_test_str_eq(cpathGetSizeSuffix(100, BYTE_REP_DECIMAL), "B");
+    })
+  })
+
+  OBS_TEST_GROUP("Duplicates", {
     ;
-    OBS_TEST("Emplace no sort", {
-      cpath base = cpathFromUtf8("A");
+    OBS_TEST("Vectorised hash matches scalar", {
+      static unsigned char data[5000];
+      srand(7);
+      for (size_t i = 0; i < sizeof(data); i++) data[i] = (unsigned char)rand();
+      for (size_t len = 0; len < sizeof(data); len += 1 + rand() % 97) {
+        obs_test_true(cpathContentHash(data, len) ==
+                      cpathContentHashScalar(data, len));
+      }
+      uint64_t before = cpathContentHash(data, sizeof(data));
+      data[2500] ^= 1;
+      obs_test_true(cpathContentHash(data, sizeof(data)) != before);
+      // zero padding of the tail doesn't collide
+      memset(data, 0, 64);
+      obs_test_true(cpathContentHash(data, 10) != cpathContentHash(data, 11));
+
+      // the same stripes in a different order
+      static unsigned char swapped[16384];
+      static unsigned char block[512];
+      for (size_t i = 0; i < sizeof(swapped); i++) {
+        swapped[i] = (unsigned char)rand();
+      }
+      uint64_t fast = cpathContentHash(swapped, sizeof(swapped));
+      uint64_t slow = cpathContentHashScalar(swapped, sizeof(swapped));
+      memcpy(block, swapped, 512);
+      memcpy(swapped, swapped + 512, 512);
+      memcpy(swapped + 512, block, 512);
+      obs_test_true(cpathContentHash(swapped, sizeof(swapped)) != fast);
+      obs_test_true(cpathContentHashScalar(swapped, sizeof(swapped)) != slow);
+      obs_test_true(cpathContentHash(swapped, sizeof(swapped)) ==
+                    cpathContentHashScalar(swapped, sizeof(swapped)));
+      // and just two neighbouring stripes
+      fast = cpathContentHash(swapped, sizeof(swapped));
+      memcpy(block, swapped + 4096, 64);
+      memcpy(swapped + 4096, swapped + 4160, 64);
+      memcpy(swapped + 4160, block, 64);
+      obs_test_true(cpathContentHash(swapped, sizeof(swapped)) != fast);
+    })
+
+    OBS_TEST("Only hash what could be a duplicate", {
+      cpath base = cpathFromUtf8("dup_tree");
+      cpath path;
+      cpath_dupes dupes;
       cpath_dir dir;
-      cpathOpenDir(&dir, &base);
-      cpath_file file;
+      static unsigned char big[20000];
 
-      obs_test_next_file(dir, file, obs_test_match_dir(file, "A/B", "B"),
-                         obs_test_match_file(file, "A/B/b.txt", "b.txt"),
-                         obs_test_match_file(file, "A/a.txt", "a.txt"));
+      mkdir("dup_tree", 0777);
+      mkdir("dup_tree/sub", 0777);
+      write_file("dup_tree/a.txt", "hello");
+      write_file("dup_tree/sub/b.txt", "hello");
+      write_file("dup_tree/c.txt", "world");
+      write_file("dup_tree/unique.txt", "nothing like it");
+      write_file("dup_tree/empty1.txt", "");
+      write_file("dup_tree/empty2.txt", "");
+      link("dup_tree/a.txt", "dup_tree/sub/a_link.txt");
+      for (size_t i = 0; i < sizeof(big); i++) big[i] = (unsigned char)(i * 7);
+      write_bytes("dup_tree/big1.bin", big, sizeof(big));
+      write_bytes("dup_tree/sub/big2.bin", big, sizeof(big));
+      // same ends, different middle
+      big[10000] ^= 1;
+      write_bytes("dup_tree/big3.bin", big, sizeof(big));
+
+      cpathDupesInit(&dupes);
+      obs_test_true(cpathOpenDir(&dir, &base));
+      cpath_traverse(&dir, 0, 1, NULL, cpathDupesVisit, &dupes);
+      cpathCloseDir(&dir);
+      obs_test_eq(size_t, dupes.hardlinks, 1);
+      obs_test_true(cpathDupesFind(&dupes, 4));
+
+      obs_test_eq(size_t, dupes.groupCount, 2);
+      obs_test_eq(size_t, dupes.count, 4);
+      obs_test_eq(size_t, dupes.errors, 0);
+      // the 3 small files whole and then just the ends of the big ones
+      obs_test_eq(size_t, (size_t)dupes.partialBytes, 15 + 3 * 8192);
+      obs_test_eq(size_t, (size_t)dupes.fullBytes, 3 * sizeof(big));
+      // both of each pair are read again to compare them
+      obs_test_eq(size_t, (size_t)dupes.verifyBytes, 10 + 2 * sizeof(big));
+
+      // groups are in order of size
+      obs_test_eq(size_t, dupes.groups[1] - dupes.groups[0], 2);
+      for (size_t i = dupes.groups[0]; i < dupes.groups[1]; i++) {
+        obs_test_true(cpathDupesPath(&dupes, i, &path));
+        // whichever link to a.txt came first
+        obs_test_true(strcmp(path.buf, "dup_tree/a.txt") == 0 ||
+                      strcmp(path.buf, "dup_tree/sub/a_link.txt") == 0 ||
+                      strcmp(path.buf, "dup_tree/sub/b.txt") == 0);
+      }
+      obs_test_eq(size_t, dupes.groups[2] - dupes.groups[1], 2);
+      obs_test_eq(size_t, (size_t)dupes.files[dupes.groups[1]].size,
+                  sizeof(big));
+      cpathDupesFree(&dupes);
+
+      unlink("dup_tree/sub/a_link.txt");
+      unlink("dup_tree/sub/b.txt");
+      unlink("dup_tree/sub/big2.bin");
+      unlink("dup_tree/a.txt");
+      unlink("dup_tree/c.txt");
+      unlink("dup_tree/unique.txt");
+      unlink("dup_tree/empty1.txt");
+      unlink("dup_tree/empty2.txt");
+      unlink("dup_tree/big1.bin");
+      unlink("dup_tree/big3.bin");
+      rmdir("dup_tree/sub");
+      rmdir("dup_tree");
+    })
+
+    OBS_TEST("Swapped blocks aren't duplicates", {
+      cpath base = cpathFromUtf8("dup_swap");
+      cpath_dupes dupes;
+      cpath_dir dir;
+      static unsigned char data[16384];
+      static unsigned char block[512];
+
+      mkdir("dup_swap", 0777);
+      for (size_t i = 0; i < sizeof(data); i++) data[i] = (unsigned char)rand();
+      write_bytes("dup_swap/a.bin", data, sizeof(data));
+      memcpy(block, data + 8192, 512);
+      memcpy(data + 8192, data + 8704, 512);
+      memcpy(data + 8704, block, 512);
+      write_bytes("dup_swap/b.bin", data, sizeof(data));
+
+      // without verifying so it's down to the hash
+      cpathDupesInit(&dupes);
+      dupes.verify = 0;
+      obs_test_true(cpathOpenDir(&dir, &base));
+      cpath_traverse(&dir, 0, 1, NULL, cpathDupesVisit, &dupes);
+      cpathCloseDir(&dir);
+      obs_test_true(cpathDupesFind(&dupes, 2));
+      obs_test_eq(size_t, dupes.groupCount, 0);
+      cpathDupesFree(&dupes);
+
+      unlink("dup_swap/a.bin");
+      unlink("dup_swap/b.bin");
+      rmdir("dup_swap");
     })
   })
 
@@ -261,6 +2005,38 @@ int main(int argc, char *argv[]) {
       obs_test_path_eq_string(a, "C:/D");
     })
 
+    OBS_TEST("Fake canonicalise keeps dotted names", {
+      cpath a = cpathFromUtf8("a..b/.../x//y/../../..c");
+      obs_test_true(cpathCanonicaliseNoSysCall(&a, &a));
+      obs_test_path_eq_string(a, "a..b/.../..c");
+
+      // deeper than the inline component stack
+      cpath deep = cpathFromUtf8("");
+      for (int i = 0; i < 100; i++) CPATH_CONCAT_LIT(&deep, "d");
+      for (int i = 0; i < 99; i++) CPATH_CONCAT_LIT(&deep, "..");
+      obs_test_true(cpathCanonicaliseNoSysCall(&deep, &deep));
+      obs_test_path_eq_string(deep, "d");
+    })
+
+    OBS_TEST("Fake canonicalise batch", {
+      cpath paths[4];
+      int ok[4];
+      cpathFromStr(&paths[0], CPATH_STR("A/./B/../C"));
+      cpathFromStr(&paths[1], CPATH_STR("/.."));
+      cpathFromStr(&paths[2], CPATH_STR("./"));
+      cpathFromStr(&paths[3], CPATH_STR("/x/y/../z/"));
+      obs_test_eq(size_t, cpathCanonicaliseNoSysCallBatch(paths, 4, ok), 3);
+      obs_test_eq(int, ok[0], 1);
+      obs_test_eq(int, ok[1], 0);
+      obs_test_eq(int, ok[2], 1);
+      obs_test_eq(int, ok[3], 1);
+      obs_test_path_eq_string(paths[0], "A/C");
+      // failures are left as they were
+      obs_test_path_eq_string(paths[1], "/..");
+      obs_test_path_eq_string(paths[2], ".");
+      obs_test_path_eq_string(paths[3], "/x/z");
+    })
+
     OBS_TEST("Canonlicalise", {
       cpath a = cpathFromUtf8(".");
       obs_test_true(cpathCanonicalise(&a, &a));
@@ -379,6 +2155,398 @@ int main(int argc, char *argv[]) {
       obs_test_null(it);
       obs_test_path_eq_string(dir, "/A/B/C/D/E.c");
     })
+
+    OBS_TEST("Component iterator doesn't modify the path", {
+      const cpath dir = cpathFromUtf8(
+          "/A//B/a_component_long_enough_to_need_a_few_blocks/E.c/");
+      const cpath copy = dir;
+      const char *expected[] = {
+        "/", "A", "B", "a_component_long_enough_to_need_a_few_blocks", "E.c"
+      };
+      cpath_component_it it;
+      cpath_component c;
+      int n = 0;
+      cpathComponentItInit(&it, &dir);
+      while (cpathComponentItNext(&it, &c)) {
+        obs_test_eq(size_t, c.len, strlen(expected[n]));
+        obs_test_false(strncmp(c.str, expected[n], c.len));
+        n++;
+      }
+      obs_test_eq(int, n, 5);
+
+      cpathComponentItInit(&it, &dir);
+      while (cpathComponentItPrev(&it, &c)) {
+        n--;
+        obs_test_eq(size_t, c.len, strlen(expected[n]));
+        obs_test_false(strncmp(c.str, expected[n], c.len));
+      }
+      obs_test_eq(int, n, 0);
+
+      // both ends meet in the middle
+      cpathComponentItInit(&it, &dir);
+      obs_test_true(cpathComponentItPrev(&it, &c));
+      obs_test_true(cpathComponentItNext(&it, &c));
+      obs_test_true(cpathComponentItPrev(&it, &c));
+      obs_test_true(cpathComponentItNext(&it, &c));
+      obs_test_true(cpathComponentItNext(&it, &c));
+      obs_test_false(strncmp(c.str, "B", c.len));
+      obs_test_false(cpathComponentItPrev(&it, &c));
+      obs_test_false(cpathComponentItNext(&it, &c));
+      obs_test_path_eq(dir, copy);
+
+      // trailing separators are skipped too
+      const cpath_char_t *str = CPATH_STR("A/B//");
+      cpathComponentItInitStrn(&it, str, 5);
+      obs_test_true(cpathComponentItPrev(&it, &c));
+      obs_test_eq(size_t, c.len, 1);
+      obs_test_true(c.str == str + 2);
+    })
+
+    OBS_TEST("Starts with", {
+      cpath path = cpathFromUtf8("/usr/local//bin/ls");
+      cpath prefix = cpathFromUtf8("/usr/local/");
+      obs_test_true(cpathStartsWith(&path, &prefix));
+      prefix = cpathFromUtf8("/usr/loc");
+      obs_test_false(cpathStartsWith(&path, &prefix));
+      prefix = cpathFromUtf8("usr/local");
+      obs_test_false(cpathStartsWith(&path, &prefix));
+      prefix = cpathFromUtf8("/usr/local/bin/ls/more");
+      obs_test_false(cpathStartsWith(&path, &prefix));
+      obs_test_true(cpathStartsWith(&path, &path));
+    })
+  })
+
+  OBS_TEST_GROUP("Resolver", {
+    ;
+    OBS_TEST("Matches realpath", {
+      const char *paths[] = {
+        ".", "A", "A/B/b.txt", "A/./B/../a.txt", "A//B/", "A/B/../../A/B"
+      };
+      cpath_resolver resolver;
+      cpathResolverInit(&resolver);
+      for (int i = 0; i < 6; i++) {
+        cpath path = cpathFromUtf8(paths[i]);
+        cpath expected, got;
+        obs_test_true(cpathCanonicalise(&expected, &path));
+        obs_test_true(cpathResolve(&resolver, &got, &path));
+        obs_test_path_eq(got, expected);
+      }
+
+      cpath missing = cpathFromUtf8("A/missing/a.txt");
+      obs_test_false(cpathResolve(&resolver, &missing, &missing));
+      obs_test_eq(int, errno, ENOENT);
+      cpathResolverFree(&resolver);
+    })
+
+    OBS_TEST("Siblings only resolve their new component", {
+      cpath_resolver resolver;
+      cpathResolverInit(&resolver);
+      cpath path = cpathFromUtf8("A/B/b.txt");
+      cpath out;
+      obs_test_true(cpathResolve(&resolver, &out, &path));
+
+      syscalls.link = 0;
+      path = cpathFromUtf8("A/B");
+      obs_test_true(cpathResolve(&resolver, &out, &path));
+      obs_test_eq(int, syscalls.link, 0);
+      path = cpathFromUtf8("A/a.txt");
+      obs_test_true(cpathResolve(&resolver, &out, &path));
+      obs_test_eq(int, syscalls.link, 1);
+      cpathResolverFree(&resolver);
+    })
+
+    OBS_TEST("Symlinks", {
+      cpath_resolver resolver;
+      cpathResolverInit(&resolver);
+      unlink("resolver_link");
+      unlink("resolver_loop");
+      obs_test_eq(int, symlink("A/B", "resolver_link"), 0);
+      obs_test_eq(int, symlink("resolver_loop", "resolver_loop"), 0);
+
+      cpath path = cpathFromUtf8("resolver_link/../a.txt");
+      cpath expected = cpathFromUtf8("A/a.txt");
+      cpath out;
+      obs_test_true(cpathCanonicalise(&expected, &expected));
+      obs_test_true(cpathResolve(&resolver, &out, &path));
+      obs_test_path_eq(out, expected);
+
+      path = cpathFromUtf8("resolver_loop/a");
+      obs_test_false(cpathResolve(&resolver, &out, &path));
+      obs_test_eq(int, errno, ELOOP);
+
+      // the cached prefix is stale until we invalidate it
+      unlink("resolver_link");
+      obs_test_eq(int, symlink("A", "resolver_link"), 0);
+      path = cpathFromUtf8("resolver_link/a.txt");
+      obs_test_false(cpathResolve(&resolver, &out, &path));
+      cpath link = cpathFromUtf8("resolver_link");
+      obs_test_eq(size_t, cpathResolverInvalidate(&resolver, &link), 3);
+      obs_test_true(cpathResolve(&resolver, &out, &path));
+      obs_test_path_eq(out, expected);
+
+      unlink("resolver_link");
+      unlink("resolver_loop");
+      cpathResolverFree(&resolver);
+    })
+  })
+
+  OBS_TEST_GROUP("Glob", {
+    ;
+    OBS_TEST("Match", {
+      cpath_glob_pattern pattern;
+      obs_test_true(cpathGlobCompile(&pattern, CPATH_STR("src/**/*.{c,h}")));
+      obs_test_eq(size_t, pattern.count, 3);
+      obs_test_true(cpathGlobMatch(&pattern, CPATH_STR("src/a.c"), 7));
+      obs_test_true(cpathGlobMatch(&pattern, CPATH_STR("src/x/y/z.h"), 11));
+      obs_test_false(cpathGlobMatch(&pattern, CPATH_STR("src/x/y/z.cc"), 12));
+      obs_test_false(cpathGlobMatch(&pattern, CPATH_STR("lib/a.c"), 7));
+      cpathGlobPatternFree(&pattern);
+
+      obs_test_true(cpathGlobCompile(&pattern, CPATH_STR("[a-c]?.t*t")));
+      obs_test_true(cpathGlobMatch(&pattern, CPATH_STR("b1.txt"), 6));
+      obs_test_true(cpathGlobMatch(&pattern, CPATH_STR("c..tt"), 5));
+      obs_test_false(cpathGlobMatch(&pattern, CPATH_STR("d1.txt"), 6));
+      obs_test_false(cpathGlobMatch(&pattern, CPATH_STR("a/1.txt"), 7));
+      cpathGlobPatternFree(&pattern);
+
+      obs_test_true(cpathGlobCompile(&pattern, CPATH_STR("a/**/**/b")));
+      obs_test_eq(size_t, pattern.count, 3);
+      obs_test_true(cpathGlobMatch(&pattern, CPATH_STR("a/b"), 3));
+      obs_test_true(cpathGlobMatch(&pattern, CPATH_STR("a/x/y/b"), 7));
+      cpathGlobPatternFree(&pattern);
+
+      obs_test_true(cpathGlobCompile(&pattern, CPATH_STR("{x,y{1,2}}[!0]")));
+      obs_test_eq(size_t, pattern.alts, 3);
+      obs_test_true(cpathGlobMatch(&pattern, CPATH_STR("y2a"), 3));
+      obs_test_false(cpathGlobMatch(&pattern, CPATH_STR("x0"), 2));
+      cpathGlobPatternFree(&pattern);
+    })
+
+    OBS_TEST("Only opens what it has to", {
+      cpath_glob glob;
+      cpath_file file;
+      int n = 0;
+
+      memset(&syscalls, 0, sizeof(syscalls));
+      obs_test_true(cpathGlobOpen(&glob, NULL, CPATH_STR("A/B/*.txt")));
+      while (cpathGlobNext(&glob, &file)) {
+        obs_test_str_eq(file.name, "b.txt");
+        n++;
+      }
+      cpathGlobClose(&glob);
+      obs_test_eq(int, n, 1);
+      // only A/B is read the rest are looked up directly
+      obs_test_eq(int, syscalls.open, 1);
+
+      memset(&syscalls, 0, sizeof(syscalls));
+      n = 0;
+      obs_test_true(cpathGlobOpen(&glob, NULL, CPATH_STR("{A,Missing}/a.txt")));
+      while (cpathGlobNext(&glob, &file)) {
+        obs_test_str_eq(file.name, "a.txt");
+        n++;
+      }
+      cpathGlobClose(&glob);
+      obs_test_eq(int, n, 1);
+      obs_test_eq(int, syscalls.open, 0);
+
+      n = 0;
+      cpath base = cpathFromUtf8("A");
+      obs_test_true(cpathGlobOpen(&glob, &base, CPATH_STR("**/*.txt")));
+      while (cpathGlobNext(&glob, &file)) n++;
+      cpathGlobClose(&glob);
+      obs_test_eq(int, n, 2);
+    })
+  })
+
+  OBS_TEST_GROUP("Ignore Files", {
+    ;
+    OBS_TEST("Ignored directories are never opened", {
+      cpath base = cpathFromUtf8("ignore_tree");
+      cpath_ignore_walk walk;
+      cpath_file file;
+      int n = 0;
+      int sawB = 0;
+
+      make_ignore_tree();
+      memset(&syscalls, 0, sizeof(syscalls));
+      obs_test_true(cpathIgnoreWalkOpen(&walk, &base));
+      while (cpathIgnoreWalkNext(&walk, &file)) {
+        obs_test_true(cpath_str_compare_safe(file.name, CPATH_STR("a.o"), 4) != 0);
+        obs_test_true(cpath_str_compare_safe(file.name, CPATH_STR("gen"), 4) != 0);
+        obs_test_true(
+            cpath_str_compare_safe(file.name, CPATH_STR("readme.md"), 10) != 0);
+        if (!cpath_str_compare_safe(file.name, CPATH_STR("b.o"), 4)) sawB = 1;
+        n++;
+      }
+      cpathIgnoreWalkClose(&walk);
+      // .gitignore, keep.o, main.c, docs, docs/notes.txt, src,
+      // src/.gitignore and src/b.o (negated in src)
+      obs_test_eq(int, n, 8);
+      obs_test_true(sawB);
+      // root, docs and src each with two ignore files
+      obs_test_eq(int, syscalls.open, 9);
+      remove_ignore_tree();
+    })
+
+    OBS_TEST("Entries that can't be loaded are skipped alone", {
+      cpath base = cpathFromUtf8("deep_tree");
+      cpath_dir dir;
+      cpath_ignore_walk walk;
+      cpath_file file;
+      count_visit count = {PTHREAD_MUTEX_INITIALIZER, 0, 0};
+      int n = 0;
+
+      make_deep_tree();
+      obs_test_true(cpathOpenDir(&dir, &base));
+      cpath_traverse_ex(&dir, 0, NULL, NULL, count_visit_file, &count);
+      cpathCloseDir(&dir);
+
+      // every file next to the directory that is too long is still there
+      obs_test_true(cpathIgnoreWalkOpen(&walk, &base));
+      while (cpathIgnoreWalkNext(&walk, &file)) n++;
+      obs_test_eq(int, n, count.dirs + count.files);
+      obs_test_eq(size_t, walk.errors, 1);
+      cpathIgnoreWalkClose(&walk);
+      remove_deep_tree();
+    })
+
+    OBS_TEST("Extra rules have the lowest precedence", {
+      cpath base = cpathFromUtf8("ignore_tree");
+      cpath_ignore_walk walk;
+      cpath_file file;
+      const char *rules = "main.c\r\n*.txt\n!a.o\n";
+      int n = 0;
+
+      make_ignore_tree();
+      obs_test_true(cpathIgnoreWalkOpen(&walk, &base));
+      obs_test_true(cpathIgnoreWalkAddRules(&walk, rules, strlen(rules)));
+      while (cpathIgnoreWalkNext(&walk, &file)) n++;
+      cpathIgnoreWalkClose(&walk);
+      // main.c and notes.txt go but a.o stays ignored
+      obs_test_eq(int, n, 6);
+      remove_ignore_tree();
+    })
+
+    OBS_TEST("Braces and patterns too big to compile", {
+      cpath base = cpathFromUtf8("ignore_tree");
+      cpath_ignore_walk walk;
+      cpath_file file;
+      const char *rules = "*.{c,txt}\n";
+      char bad[256];
+      int n = 0;
+      int sawIgnore = 0;
+
+      // more segments than a glob can have
+      bad[0] = '\0';
+      for (int i = 0; i < 70; i++) strcat(bad, "a/");
+      strcat(bad, "*\n");
+      make_ignore_tree();
+      write_file("ignore_tree/docs/.ignore", bad);
+      obs_test_true(cpathIgnoreWalkOpen(&walk, &base));
+      obs_test_true(cpathIgnoreWalkAddRules(&walk, rules, strlen(rules)));
+      obs_test_true(cpathIgnoreWalkAddRules(&walk, bad, strlen(bad)));
+      while (cpathIgnoreWalkNext(&walk, &file)) {
+        if (!cpath_str_compare_safe(file.name, CPATH_STR(".ignore"), 8)) {
+          sawIgnore = 1;
+        }
+        n++;
+      }
+      cpathIgnoreWalkClose(&walk);
+      // main.c and notes.txt go, docs is still walked
+      obs_test_true(sawIgnore);
+      obs_test_eq(int, n, 7);
+      unlink("ignore_tree/docs/.ignore");
+      remove_ignore_tree();
+    })
+  })
+
+  OBS_TEST_GROUP("Separators", {
+    ;
+    OBS_TEST("Vectorised conversion matches scalar", {
+      const char alphabet[] = "ab/\\.";
+      cpath_char_t src[400], fast[400], slow[400];
+      srand(42);
+      for (int n = 0; n < 2000; n++) {
+        size_t len = (size_t)(rand() % 300);
+        for (size_t i = 0; i < len; i++) {
+          // mostly names with the odd run of separators
+          src[i] = rand() % 4 ? alphabet[rand() % 2]
+                              : alphabet[2 + rand() % 3];
+        }
+        src[len] = '\0';
+        size_t fastLen = cpathStrCpyConv(fast, len, src);
+        size_t slowLen = cpathStrCpyConvScalar(slow, len, src);
+        obs_test_eq(size_t, fastLen, slowLen);
+        obs_test_str_eq(fast, slow);
+      }
+    })
+
+    OBS_TEST("Convert to a custom separator", {
+      cpath path;
+      cpathFromStr(&path, "/a/b//c/0123456789abcdef0123456789/d");
+      cpathConvertSepCustom(&path, '\\');
+      obs_test_str_eq(path.buf, "\\a\\b\\c\\0123456789abcdef0123456789\\d");
+      obs_test_eq(size_t, path.len, 35);
+      cpathConvertSep(&path);
+      obs_test_path_eq_string(path, "/a/b/c/0123456789abcdef0123456789/d");
+    })
+  })
+
+  OBS_TEST_GROUP("VPath", {
+    ;
+    OBS_TEST("Small paths stay inline and long ones spill", {
+      cpath_vpath path;
+      cpathVPathInit(&path);
+      obs_test_true(cpathVPathFromStr(&path, "/a\\b//c/"));
+      obs_test_str_eq(cpathVPathStr(&path), "/a/b/c");
+      obs_test_null(path.buf);
+
+      for (int i = 0; i < 100; i++) {
+        obs_test_true(cpathVPathConcatStr(&path, "dir"));
+      }
+      obs_test_not_null(path.buf);
+      obs_test_eq(size_t, path.len, 6 + 100 * 4);
+      for (int i = 0; i < 100; i++) {
+        obs_test_true(cpathVPathUpDir(&path));
+      }
+      obs_test_str_eq(cpathVPathStr(&path), "/a/b/c");
+
+      cpath fixed;
+      obs_test_true(cpathVPathToPath(&path, &fixed));
+      obs_test_path_eq_string(fixed, "/a/b/c");
+      cpathVPathFree(&path);
+      obs_test_eq(size_t, path.len, 0);
+    })
+
+    OBS_TEST("Matches cpath", {
+      const char *paths[] = {"a/./b/../c", "/x/y/../../z/.", "./a/b/", "a/..",
+                             "../a"};
+      for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        cpath fixed, fixedOut;
+        cpath_vpath var;
+        cpathVPathInit(&var);
+        cpathFromStr(&fixed, paths[i]);
+        obs_test_true(cpathVPathFromPath(&var, &fixed));
+        int fixedRes = cpathCanonicaliseNoSysCall(&fixedOut, &fixed);
+        int varRes = cpathVPathCanonicaliseNoSysCall(&var, &var);
+        obs_test_eq(int, fixedRes, varRes);
+        if (fixedRes) obs_test_str_eq(cpathVPathStr(&var), fixedOut.buf);
+
+        obs_test_true(CPATH_CONCAT_LIT(&fixed, "e.c"));
+        obs_test_true(cpathVPathFromPath(&var, &fixed));
+        obs_test_true(cpathUpDir(&fixed));
+        obs_test_true(cpathVPathUpDir(&var));
+        obs_test_str_eq(cpathVPathStr(&var), fixed.buf);
+        cpathVPathFree(&var);
+      }
+
+      cpath_vpath up;
+      cpathVPathInit(&up);
+      cpathVPathFromStr(&up, "a");
+      obs_test_true(cpathVPathUpDir(&up));
+      obs_test_str_eq(cpathVPathStr(&up), ".");
+      cpathVPathFree(&up);
+    })
   })
 
   OBS_REPORT